@@ -74,8 +74,11 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "cli.h"
 #include "overlay_address.h"
 #include "overlay_buffer.h"
+#include "overlay_interface.h"
+#include "overlay_packet.h"
 #include "keyring.h"
 #include "dataformats.h"
+#include "crypto.h"
 
 extern struct cli_schema command_line_options[];
 
@@ -1080,6 +1083,7 @@ int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *context)
       || cli_arg(parsed, "SID", &sidhex, str_is_subscriber_id, "broadcast") == -1
       || cli_arg(parsed, "count", &count, cli_uint, "0") == -1)
     return -1;
+  int use_ring = 0 == cli_arg(parsed, "--ring", NULL, NULL, NULL);
 
   /* Get SID that we want to ping.
      TODO - allow lookup of SID prefixes and telephone numbers
@@ -1110,6 +1114,11 @@ int app_mdp_ping(const struct cli_parsed *parsed, struct cli_context *context)
   if ((mdp_sockfd = mdp_socket()) < 0)
     return WHY("Cannot create MDP socket");
 
+  if (use_ring && mdp_ring_open(mdp_sockfd) == -1){
+    mdp_close(mdp_sockfd);
+    return WHY("Cannot exchange packets with the daemon through shared memory");
+  }
+
   set_nonblock(mdp_sockfd);
   struct mdp_header mdp_header;
   bzero(&mdp_header, sizeof(mdp_header));
@@ -2677,6 +2686,31 @@ int app_crypt_test(const struct cli_parsed *parsed, struct cli_context *context)
     end = gettime_ms();
     cli_printf(context, "mean signature verification time = %.2fms\n",
 	   (end-start)*1.0/i);
+
+    // the same signed message heard again should be found in the cache of verified signatures
+    sid_t sid;
+    urandombytes(sid.binary, sizeof sid.binary);
+    struct subscriber *signer = find_subscriber(sid.binary, sizeof sid.binary, 1);
+    if (!signer)
+      return -1;
+    bcopy(sign_pk, signer->sas_public, SAS_SIZE);
+    signer->sas_valid=1;
+    unsigned char message[plainLenIn + SIGNATURE_BYTES];
+    bcopy(plainTextIn, message, plainLenIn);
+    unsigned char hash[crypto_hash_sha512_BYTES];
+    crypto_hash_sha512(hash, message, plainLenIn);
+    int sig_length = SIGNATURE_BYTES;
+    if (crypto_create_signature(sign_sk, hash, sizeof hash, &message[plainLenIn], &sig_length))
+      return -1;
+    start = gettime_ms();
+    for(i=0;i<1000;i++) {
+      int len = sizeof message;
+      if (crypto_verify_message(signer, message, &len))
+	return WHY("crypto_verify_message() failed");
+    }
+    end = gettime_ms();
+    cli_printf(context, "mean repeated message verification time = %.4fms\n",
+	   (end-start)*1.0/i);
   }
 
   /* We can't do public signing with a crypto_box key, but we should be able to
@@ -2986,6 +3020,339 @@ int app_mem_test(const struct cli_parsed *UNUSED(parsed), struct cli_context *UN
   return 0;
 }
 
+static void sched_test_alarm(struct sched_ent *UNUSED(alarm))
+{
+}
+
+int app_sched_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const char *count_ascii;
+  if (cli_arg(parsed, "count", &count_ascii, cli_uint, "100000") == -1)
+    return -1;
+  static struct profile_total sched_test_stats = {.name="sched_test_alarm",};
+  const unsigned count = atoi(count_ascii);
+  if (count == 0)
+    return 0;
+  struct sched_ent *alarms = emalloc_zero(count * sizeof(struct sched_ent));
+  if (!alarms)
+    return -1;
+  unsigned i;
+  // far enough ahead that no alarm falls due, however slow the scheduler is
+  time_ms_t now = gettime_ms() + 3600000;
+  for (i = 0; i < count; i++) {
+    alarms[i].function = sched_test_alarm;
+    alarms[i].stats = &sched_test_stats;
+  }
+
+  cli_printf(context, "Benchmarking alarm scheduler with %u alarms:\n", count);
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < count; i++) {
+    alarms[i].alarm = now + 1000 + (random() % 60000);
+    alarms[i].deadline = alarms[i].alarm + 1000;
+    schedule(&alarms[i]);
+  }
+  time_ms_t end = gettime_ms();
+  cli_printf(context, "schedule - %u alarms took %"PRId64"ms\n", count, (int64_t)(end - start));
+
+  start = gettime_ms();
+  for (i = 0; i < count; i++) {
+    struct sched_ent *alarm = &alarms[random() % count];
+    unschedule(alarm);
+    alarm->alarm = now + 1000 + (random() % 60000);
+    alarm->deadline = alarm->alarm + 1000;
+    schedule(alarm);
+  }
+  end = gettime_ms();
+  cli_printf(context, "reschedule - %u alarms took %"PRId64"ms\n", count, (int64_t)(end - start));
+
+  start = gettime_ms();
+  for (i = 0; i < count; i++)
+    unschedule(&alarms[(i * 7919) % count]);
+  end = gettime_ms();
+  cli_printf(context, "unschedule - %u alarms took %"PRId64"ms\n", count, (int64_t)(end - start));
+
+  for (i = 0; i < count; i++)
+    if (is_scheduled(&alarms[i]))
+      FATALF("alarm %u is still scheduled", i);
+  free(alarms);
+  return 0;
+}
+
+int app_queue_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const unsigned rounds = 1000;
+  const unsigned dest_counts[] = {1, 10, 50};
+  overlay_queue_init();
+  const int capacity = overlay_queue_remaining(OQ_ORDINARY);
+  if (!my_subscriber) {
+    sid_t sid;
+    urandombytes(sid.binary, sizeof sid.binary);
+    if ((my_subscriber = find_subscriber(sid.binary, sizeof sid.binary, 1)) == NULL)
+      return -1;
+    my_subscriber->reachable = REACHABLE_SELF;
+  }
+  // packets are "sent" to /dev/null through a dummy file interface
+  overlay_interface *interface = &overlay_interfaces[0];
+  bzero(interface, sizeof *interface);
+  strncpy(interface->name, "queue_test", sizeof interface->name);
+  interface->socket_type = SOCK_FILE;
+  interface->mtu = 1200;
+  unsigned q;
+  for (q = 0; q < OQ_MAX; q++)
+    interface->queue_weight[q] = interface->mtu;
+  if ((interface->alarm.poll.fd = open("/dev/null", O_WRONLY)) == -1)
+    return WHY_perror("open(\"/dev/null\")");
+  interface->state = INTERFACE_STATE_UP;
+
+  unsigned t;
+  for (t = 0; t < NELS(dest_counts); t++) {
+    const unsigned dest_count = dest_counts[t];
+    struct network_destination *destinations[dest_count];
+    unsigned i;
+    for (i = 0; i < dest_count; i++)
+      destinations[i] = new_destination(interface, ENCAP_OVERLAY);
+    unsigned frames = 0, packets, round;
+    time_ms_t start = gettime_ms();
+    for (round = 0; round < rounds; round++) {
+      // fill the queue, spreading frames across all destinations
+      while (overlay_queue_remaining(OQ_ORDINARY) > 0) {
+	struct overlay_frame *frame = op_new();
+	if (!frame)
+	  return -1;
+	frame->type = OF_TYPE_DATA;
+	frame->queue = OQ_ORDINARY;
+	frame->ttl = 1;
+	frame->source = my_subscriber;
+	frame->packet_version = 1;
+	frame->payload = ob_new();
+	ob_limitsize(frame->payload, 400);
+	ob_append_space(frame->payload, 400);
+	frame->destinations[frame->destination_count++].destination =
+	  add_destination_ref(destinations[frames++ % dest_count]);
+	if (overlay_payload_enqueue(frame) == -1) {
+	  op_free(frame);
+	  return -1;
+	}
+      }
+      // and let the queue's own alarm drain it again
+      while (overlay_queue_remaining(OQ_ORDINARY) < capacity)
+	fd_poll();
+    }
+    packets = interface->tx_count;
+    interface->tx_count = 0;
+    time_ms_t end = gettime_ms();
+    cli_printf(context, "%u destinations - %u frames in %u packets took %"PRId64"ms\n",
+	dest_count, frames, packets, (int64_t)(end - start));
+    for (i = 0; i < dest_count; i++)
+      release_destination_ref(destinations[i]);
+  }
+  close(interface->alarm.poll.fd);
+  bzero(interface, sizeof *interface);
+  return 0;
+}
+
+static void cli_pool_stats(struct cli_context *context, const struct mem_pool *pool)
+{
+  cli_printf(context, "%s pool: %lu allocations, %lu reused, %u in use (peak %u), %u idle\n",
+      pool->name, pool->allocs, pool->reused, pool->in_use, pool->peak_in_use, pool->free_count);
+}
+
+int app_packet_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const unsigned packets = 200000;
+  const unsigned frames_per_packet = 2;
+  const size_t mtu = 1200, payload_size = 400;
+  unsigned char bytes[payload_size];
+  urandombytes(bytes, sizeof bytes);
+  unsigned i, j;
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < packets; i++) {
+    // build a packet from newly queued frames, as overlay_fill_send_packet() does
+    struct overlay_buffer *packet = ob_new();
+    if (!packet)
+      return -1;
+    ob_limitsize(packet, mtu);
+    for (j = 0; j < frames_per_packet; j++) {
+      struct overlay_frame *frame = op_new();
+      if (!frame || (frame->payload = ob_new()) == NULL)
+	return -1;
+      ob_append_bytes(frame->payload, bytes, payload_size);
+      ob_append_ui16(packet, ob_position(frame->payload));
+      ob_append_bytes(packet, ob_ptr(frame->payload), ob_position(frame->payload));
+      op_free(frame);
+    }
+    if (ob_overrun(packet))
+      return WHY("Packet overrun");
+    // then parse it and forward each payload, as packetOkOverlay() does
+    struct overlay_buffer *b = ob_static(ob_ptr(packet), ob_position(packet));
+    ob_limitsize(b, ob_position(packet));
+    while (ob_remaining(b) > 0) {
+      size_t len = ob_get_ui16(b);
+      struct overlay_frame f;
+      bzero(&f, sizeof f);
+      f.payload = ob_slice(b, ob_position(b), len);
+      ob_limitsize(f.payload, len);
+      struct overlay_frame *forward = op_dup(&f);
+      if (!forward)
+	return -1;
+      op_free(forward);
+      ob_free(f.payload);
+      b->position += len;
+    }
+    ob_free(b);
+    ob_free(packet);
+  }
+  time_ms_t elapsed = gettime_ms() - start;
+  cli_printf(context, "%u packets of %u frames took %"PRId64"ms, %.0f packets per second\n",
+      packets, frames_per_packet, (int64_t)elapsed, elapsed ? packets * 1000.0 / elapsed : 0.0);
+  cli_pool_stats(context, &overlay_frame_pool);
+  cli_pool_stats(context, &ob_header_pool);
+  cli_pool_stats(context, &ob_block_pool);
+  return 0;
+}
+
+static void cli_subscriber_stats(struct cli_context *context)
+{
+  struct subscriber_stats stats;
+  subscriber_stats(&stats);
+  cli_printf(context, "%u subscribers using %zu bytes, %u tree nodes using %zu bytes, %lu evicted\n",
+      stats.subscribers, stats.subscriber_bytes, stats.tree_nodes, stats.tree_bytes, stats.evicted);
+}
+
+int app_subscriber_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const unsigned count = 100000;
+  const unsigned rounds = 10;
+  sid_t *sids = emalloc(count * sizeof(sid_t));
+  if (!sids)
+    return -1;
+  urandombytes(sids->binary, count * sizeof(sid_t));
+  unsigned i, r;
+  
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < count; i++)
+    if (!find_subscriber(sids[i].binary, SID_SIZE, 1))
+      return WHY("Failed to add subscriber");
+  time_ms_t elapsed = gettime_ms() - start;
+  cli_printf(context, "Added %u subscribers in %"PRId64"ms\n", count, (int64_t)elapsed);
+  cli_subscriber_stats(context);
+  
+  start = gettime_ms();
+  for (r = 0; r < rounds; r++)
+    for (i = 0; i < count; i++)
+      if (!find_subscriber(sids[i].binary, SID_SIZE, 0))
+	return WHY("Failed to find subscriber");
+  elapsed = gettime_ms() - start;
+  cli_printf(context, "%u full lookups took %"PRId64"ms, %.0f per second\n",
+      rounds * count, (int64_t)elapsed, elapsed ? rounds * count * 1000.0 / elapsed : 0.0);
+  
+  start = gettime_ms();
+  for (r = 0; r < rounds; r++)
+    for (i = 0; i < count; i++) {
+      // look up the shortest abbreviation that we would send to other nodes
+      struct subscriber *subscriber = find_subscriber(sids[i].binary, SID_SIZE, 0);
+      if (find_subscriber(sids[i].binary, (subscriber->abbreviate_len + 2) / 2, 0) != subscriber)
+	return WHY("Failed to find abbreviated subscriber");
+    }
+  elapsed = gettime_ms() - start;
+  cli_printf(context, "%u full and abbreviated lookups took %"PRId64"ms, %.0f per second\n",
+      rounds * count, (int64_t)elapsed, elapsed ? rounds * count * 1000.0 / elapsed : 0.0);
+  
+  start = gettime_ms();
+  unsigned evicted = subscriber_evict_idle(gettime_ms() + 1);
+  elapsed = gettime_ms() - start;
+  cli_printf(context, "Evicted %u idle subscribers in %"PRId64"ms\n", evicted, (int64_t)elapsed);
+  cli_subscriber_stats(context);
+  free(sids);
+  return 0;
+}
+
+static int rhizome_write_test(struct cli_context *context, unsigned char *data, uint64_t size, size_t block_size, int swap_pairs)
+{
+  struct rhizome_write write;
+  bzero(&write, sizeof write);
+  if (rhizome_open_write(&write, NULL, size, RHIZOME_PRIORITY_DEFAULT) != RHIZOME_PAYLOAD_STATUS_NEW)
+    return WHY("Failed to open payload for writing");
+  time_ms_t start = gettime_ms();
+  uint64_t offset;
+  int ret = 0;
+  for (offset = 0; offset < size && ret == 0; offset += 2 * block_size) {
+    size_t len = size - offset < block_size ? size - offset : block_size;
+    size_t len2 = size - offset - len < block_size ? size - offset - len : block_size;
+    // MDP blocks sometimes arrive out of order, so the second block of each pair may come first
+    if (swap_pairs && len2)
+      ret = rhizome_random_write(&write, offset + len, data + offset + len, len2);
+    if (ret == 0)
+      ret = rhizome_random_write(&write, offset, data + offset, len);
+    if (ret == 0 && !swap_pairs && len2)
+      ret = rhizome_random_write(&write, offset + len, data + offset + len, len2);
+  }
+  int external = write.blob_fd != -1;
+  if (ret == -1) {
+    rhizome_fail_write(&write);
+    return WHY("Failed to write payload");
+  }
+  if (rhizome_finish_write(&write) != RHIZOME_PAYLOAD_STATUS_NEW)
+    return WHY("Failed to finish writing payload");
+  time_ms_t elapsed = gettime_ms() - start;
+  // make sure that every block was stored in the right place
+  struct rhizome_read read;
+  bzero(&read, sizeof read);
+  if (rhizome_open_read(&read, &write.id) != RHIZOME_PAYLOAD_STATUS_STORED)
+    ret = WHY("Failed to open payload for reading");
+  for (offset = 0; ret == 0 && offset < size; ) {
+    unsigned char buf[RHIZOME_CRYPT_PAGE_SIZE];
+    ssize_t r = rhizome_read(&read, buf, sizeof buf);
+    if (r <= 0 || memcmp(buf, data + offset, r) != 0)
+      ret = WHYF("Payload read back differs at offset %"PRIu64, offset);
+    offset += r;
+  }
+  rhizome_read_close(&read);
+  rhizome_delete_file(&write.id);
+  if (ret == -1)
+    return -1;
+  cli_printf(context, "Wrote %"PRIu64" bytes in %zu byte blocks%s to %s in %"PRId64"ms, %.2f MB/s\n",
+      size, block_size, swap_pairs ? " (pairs swapped)" : "",
+      external ? "a file" : "a SQLite blob",
+      (int64_t)elapsed, elapsed ? size * 1000.0 / elapsed / (1024 * 1024) : 0.0);
+  return 0;
+}
+
+int app_rhizome_write_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  if (rhizome_opendb() == -1)
+    return -1;
+  // the block size that rhizome fetches request over MDP
+  const size_t block_size = config.rhizome.rhizome_mdp_block_size;
+  // one payload that is stored in a SQLite blob, and one that is stored in a file
+  const uint64_t sizes[] = {config.rhizome.max_blob_size, 8 * 1024 * 1024};
+  unsigned char *data = emalloc(sizes[1]);
+  if (!data)
+    return -1;
+  cli_printf(context, "write_buffer_size=%"PRIu32" write_buffer_ms=%"PRIu32" sync_payloads=%d\n",
+      config.rhizome.write_buffer_size, config.rhizome.write_buffer_ms, config.rhizome.sync_payloads);
+  int ret = 0;
+  unsigned i, swap;
+  for (i = 0; i < NELS(sizes) && ret == 0; i++)
+    for (swap = 0; swap < 2 && ret == 0; swap++) {
+      // fresh random data each time, so that every payload has a new hash
+      urandombytes(data, sizes[i]);
+      ret = rhizome_write_test(context, data, sizes[i], block_size, swap);
+    }
+  free(data);
+  return ret;
+}
+
 int app_network_scan(const struct cli_parsed *parsed, struct cli_context *context)
 {
   int mdp_sockfd;
@@ -3038,7 +3405,7 @@ struct cli_schema command_line_options[]={
    "Stop a running daemon with instance path from SERVALINSTANCE_PATH environment variable."},
   {app_server_status,{"status",NULL},CLIFLAG_PERMISSIVE_CONFIG,
    "Display information about running daemon."},
-  {app_mdp_ping,{"mdp","ping","[--interval=<ms>]","[--timeout=<seconds>]","<SID>|broadcast","[<count>]",NULL}, 0,
+  {app_mdp_ping,{"mdp","ping","[--interval=<ms>]","[--timeout=<seconds>]","[--ring]","<SID>|broadcast","[<count>]",NULL}, 0,
    "Attempts to ping specified node via Mesh Datagram Protocol (MDP)."},
   {app_trace,{"mdp","trace","<SID>",NULL}, 0,
    "Trace through the network to the specified node via MDP."},
@@ -3147,6 +3514,22 @@ struct cli_schema command_line_options[]={
    "Run memory speed test"},
   {app_byteorder_test,{"test","byteorder",NULL}, 0,
    "Run byte order handling test"},
+  {app_sched_test,{"test","scheduler","[<count>]",NULL}, 0,
+   "Run alarm scheduler speed test"},
+  {app_queue_test,{"test","queue",NULL}, 0,
+   "Run overlay queue packet stuffing speed test"},
+  {app_packet_test,{"test","packets",NULL}, 0,
+   "Run overlay packet send and receive allocation speed test"},
+  {app_route_test,{"test","routing",NULL}, 0,
+   "Run incremental route calculation speed test"},
+  {app_filter_test,{"test","filter",NULL}, 0,
+   "Run MDP packet filter rule matching speed test"},
+  {app_mdp_ring_test,{"test","mdpring",NULL}, 0,
+   "Run local MDP client socket and shared memory transport speed test"},
+  {app_subscriber_test,{"test","subscribers",NULL}, 0,
+   "Run subscriber table lookup speed and memory usage test"},
+  {app_rhizome_write_test,{"test","rhizomewrite",NULL}, 0,
+   "Run Rhizome payload write speed test with MDP sized blocks"},
   {app_msp_connection,{"msp", "listen", "[--once]", "[--forward=<local_port>]", "<port>", NULL}, 0,
   "Listen for incoming connections"},
   {app_msp_connection,{"msp", "connect", "[--once]", "[--forward=<local_port>]", "<sid>", "<port>", NULL}, 0,
@@ -694,6 +694,12 @@ int cf_fmt_socket_type(const char **, const short *typep);
 int cf_opt_encapsulation(short *encapp, const char *text);
 int cf_fmt_encapsulation(const char **, const short *encapp);
 
+int cf_opt_route_metric(short *metricp, const char *text);
+int cf_fmt_route_metric(const char **, const short *metricp);
+
+int cf_opt_sqlite_synchronous(short *syncp, const char *text);
+int cf_fmt_sqlite_synchronous(const char **, const short *syncp);
+
 extern int cf_limbo;
 extern struct config_main config;
 
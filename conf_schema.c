@@ -779,6 +779,73 @@ int cf_cmp_encapsulation(const short *a, const short *b)
   return cf_cmp_short(a, b);
 }
 
+int cf_opt_route_metric(short *metricp, const char *text)
+{
+  if (strcasecmp(text, "drop_rate") == 0) {
+    *metricp = ROUTE_METRIC_DROP_RATE;
+    return CFOK;
+  }
+  if (strcasecmp(text, "airtime") == 0) {
+    *metricp = ROUTE_METRIC_AIRTIME;
+    return CFOK;
+  }
+  return CFINVALID;
+}
+
+int cf_fmt_route_metric(const char **textp, const short *metricp)
+{
+  const char *t = NULL;
+  switch (*metricp) {
+    case ROUTE_METRIC_DROP_RATE: t = "drop_rate"; break;
+    case ROUTE_METRIC_AIRTIME:   t = "airtime"; break;
+  }
+  if (!t)
+    return CFINVALID;
+  *textp = str_edup(t);
+  return CFOK;
+}
+
+int cf_cmp_route_metric(const short *a, const short *b)
+{
+  return cf_cmp_short(a, b);
+}
+
+int cf_opt_sqlite_synchronous(short *syncp, const char *text)
+{
+  if (strcasecmp(text, "off") == 0) {
+    *syncp = RHIZOME_SQLITE_SYNC_OFF;
+    return CFOK;
+  }
+  if (strcasecmp(text, "normal") == 0) {
+    *syncp = RHIZOME_SQLITE_SYNC_NORMAL;
+    return CFOK;
+  }
+  if (strcasecmp(text, "full") == 0) {
+    *syncp = RHIZOME_SQLITE_SYNC_FULL;
+    return CFOK;
+  }
+  return CFINVALID;
+}
+
+int cf_fmt_sqlite_synchronous(const char **textp, const short *syncp)
+{
+  const char *t = NULL;
+  switch (*syncp) {
+    case RHIZOME_SQLITE_SYNC_OFF:    t = "off"; break;
+    case RHIZOME_SQLITE_SYNC_NORMAL: t = "normal"; break;
+    case RHIZOME_SQLITE_SYNC_FULL:   t = "full"; break;
+  }
+  if (!t)
+    return CFINVALID;
+  *textp = str_edup(t);
+  return CFOK;
+}
+
+int cf_cmp_sqlite_synchronous(const short *a, const short *b)
+{
+  return cf_cmp_short(a, b);
+}
+
 int cf_opt_pattern_list(struct pattern_list *listp, const char *text)
 {
   struct pattern_list list;
@@ -324,16 +324,27 @@ STRUCT(server)
 STRING(256,                 chdir,      "/", absolute_path,, "Absolute path of chdir(2) for server process")
 STRING(256,                 interface_path, "", str_nonempty,, "Path of directory containing interface files, either absolute or relative to instance directory")
 ATOM(bool_t,                respawn_on_crash, 0, boolean,, "If true, server will exec(2) itself on fatal signals, eg SEGV")
+ATOM(int32_t,               worker_threads, 2, int32_nonneg,, "Number of threads for CPU heavy work like signature verification, zero to do it all on the main thread")
 END_STRUCT
 
 STRUCT(monitor)
 ATOM(uint32_t,              uid,        0, uint32_nonzero,, "Allowed UID for monitor socket client")
 END_STRUCT
 
+STRUCT(mdp_queue_weight)
+ATOM(int32_t,               voice,           -1, int32_nonneg,, "Bytes of voice traffic each destination may send per round")
+ATOM(int32_t,               management,      -1, int32_nonneg,, "Bytes of mesh management traffic each destination may send per round")
+ATOM(int32_t,               video,           -1, int32_nonneg,, "Bytes of video traffic each destination may send per round")
+ATOM(int32_t,               ordinary,        -1, int32_nonneg,, "Bytes of ordinary traffic each destination may send per round")
+ATOM(int32_t,               opportunistic,   -1, int32_nonneg,, "Bytes of opportunistic traffic each destination may send per round")
+END_STRUCT
+
 STRUCT(mdp_iftype)
 ATOM(int32_t,               tick_ms,         -1, int32_nonneg,, "Tick interval")
 ATOM(int32_t,               packet_interval, -1, int32_nonneg,, "Minimum interval between packets in microseconds")
 ATOM(int32_t,               reachable_timeout_ms, -1, int32_nonneg,, "Inactivity timeout after which node considered unreachable")
+ATOM(int32_t,               link_rate,       -1, int32_nonneg,, "Typical bits per second sent over the air, used to estimate airtime when routing")
+SUB_STRUCT(mdp_queue_weight, queue_weight,)
 END_STRUCT
 
 ARRAY(mdp_iftypelist, NO_DUPLICATES)
@@ -341,9 +352,26 @@ KEY_ATOM(short, interface_type)
 VALUE_SUB_STRUCT(mdp_iftype)
 END_ARRAY(5)
 
+STRUCT(mdp_aqm)
+ATOM(bool_t,                enable,      0, boolean,, "If true, drop frames early when the transmit queues stay congested")
+ATOM(int32_t,               target_ms,   -1, int32_nonneg,, "Acceptable time for a frame to wait in a queue, default is 1/20 of the queue's latency target")
+ATOM(int32_t,               interval_ms, -1, int32_nonneg,, "How long the wait may exceed the target before dropping, default is 1/4 of the queue's latency target")
+END_STRUCT
+
+STRUCT(mdp_broadcast)
+ATOM(uint32_t,              slots,       4096, uint32_nonzero,, "Number of recently seen broadcast packet identifiers to remember")
+ATOM(uint32_t,              expiry_ms,   30000, uint32_nonzero,, "How long to remember a broadcast packet identifier, and drop duplicates of the broadcast")
+END_STRUCT
+
 STRUCT(mdp)
 SUB_STRUCT(mdp_iftypelist,  iftype,)
+SUB_STRUCT(mdp_aqm,         aqm,)
+SUB_STRUCT(mdp_broadcast,   broadcast,)
 ATOM(bool_t,                enable_inet, 0, boolean,, "If true, allow mdp clients to connect over loopback UDP")
+ATOM(uint32_t,              nm_cache_size, 512, uint32_nonzero,, "Number of Curve25519 shared secrets to keep for encrypting to other nodes")
+ATOM(uint32_t,              subscriber_timeout_ms, 600000, uint32_nonzero,, "Forget unreachable subscribers that have not been used for this long")
+ATOM(uint32_t,              link_refresh_ms, 30000, uint32_nonzero,, "How often to repeat unchanged routes to neighbours, changed routes are always sent immediately")
+ATOM(short,                 route_metric, ROUTE_METRIC_DROP_RATE, route_metric,, "How to choose between paths, drop_rate for the least packet loss, airtime for the least time spent transmitting")
 END_STRUCT
 
 STRUCT(vomp)
@@ -428,6 +456,13 @@ ATOM(bool_t,                enable,     1, boolean,, "If true, Rhizome advertise
 ATOM(uint32_t,              interval,   500, uint32_nonzero,, "Interval between Rhizome advertisements")
 END_STRUCT
 
+STRUCT(rhizome_sqlite)
+ATOM(bool_t,                wal,                1, boolean,, "If true, use a write-ahead log instead of a rollback journal")
+ATOM(short,                 synchronous,        RHIZOME_SQLITE_SYNC_NORMAL, sqlite_synchronous,, "How often SQLite waits for writes to reach the disk; off, normal or full")
+ATOM(int32_t,               wal_autocheckpoint, 1000, int32_nonneg,, "Copy the write-ahead log into the database once it holds this many pages, 0 to only do so when the database is closed")
+ATOM(int32_t,               statement_cache,    32, int32_nonneg,, "Number of prepared SQL statements to keep for reuse")
+END_STRUCT
+
 STRUCT(rhizome)
 ATOM(bool_t,                enable,         1, boolean,, "If true, server opens Rhizome database when starting")
 ATOM(bool_t,                fetch,          1, boolean,, "If false, no new bundles will be fetched from peers")
@@ -436,11 +471,15 @@ ATOM(bool_t,                clean_on_start, 1, boolean,, "If true, Rhizome datab
 STRING(256,                 datastore_path, "", str_nonempty,, "Path of rhizome storage directory, absolute or relative to instance directory")
 ATOM(uint64_t,              database_size,  1000000, uint64_scaled,, "Size of database in bytes")
 ATOM(uint32_t,              max_blob_size,  128 * 1024, uint32_scaled,, "Store payloads larger than this in files not SQLite blobs")
+ATOM(uint32_t,              write_buffer_size, 128 * 1024, uint32_scaled,, "Buffer received payload data until there is this much to write, or the whole payload has arrived")
+ATOM(uint32_t,              write_buffer_ms, 1000, uint32_nonzero,, "Write buffered payload data once it has waited this long")
+ATOM(bool_t,                sync_payloads,  0, boolean,, "If true, wait for payload data written to files to reach the disk")
 
 ATOM(uint64_t,              rhizome_mdp_block_size, 512, uint64_scaled,, "Rhizome MDP block size.")
 ATOM(uint64_t,              idle_timeout,           RHIZOME_IDLE_TIMEOUT, uint64_scaled,, "Rhizome transfer timeout if no data received.")
 ATOM(uint64_t,              mdp_stall_timeout,      1000, uint64_scaled,, "Timeout to request more data via mdp.")
 ATOM(uint32_t,              fetch_delay_ms,         50, uint32_nonzero,, "Delay from receiving first bundle advert to initiating fetch")
+SUB_STRUCT(rhizome_sqlite,  sqlite,)
 SUB_STRUCT(rhizome_direct,  direct,)
 SUB_STRUCT(rhizome_api,     api,)
 SUB_STRUCT(rhizome_http,    http,)
@@ -485,6 +524,7 @@ ATOM(bool_t,                debug,           0, boolean,, "If true, log details
 ATOM(bool_t,                point_to_point,  0, boolean,, "If true, assume there will only be two devices on this interface")
 ATOM(bool_t,                ctsrts,          0, boolean,, "If true, enable CTS/RTS hardware handshaking")
 ATOM(int32_t,               uartbps,         57600, int32_rs232baudrate,, "Speed of serial UART link speed (which may be different to serial device link speed)")
+ATOM(uint16_t,              rx_batch,        16, uint16_nonzero,, "Maximum number of packets to read from a dgram socket each time it becomes readable")
 END_STRUCT
 
 ARRAY(interface_list, NO_DUPLICATES)
@@ -185,6 +185,13 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define ENCAP_OVERLAY 1
 #define ENCAP_SINGLE 2
 
+#define ROUTE_METRIC_DROP_RATE 1
+#define ROUTE_METRIC_AIRTIME 2
+
+#define RHIZOME_SQLITE_SYNC_OFF 0
+#define RHIZOME_SQLITE_SYNC_NORMAL 1
+#define RHIZOME_SQLITE_SYNC_FULL 2
+
 // numbers chosen to not conflict with KEYTYPE flags
 #define UNLOCK_REQUEST (0xF0)
 #define UNLOCK_CHALLENGE (0xF1)
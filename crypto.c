@@ -23,6 +23,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "overlay_address.h"
 #include "crypto.h"
 #include "keyring.h"
+#include "dataformats.h"
 
 // verify a signature against a public sas key.
 int crypto_verify_signature(unsigned char *sas_key, 
@@ -55,6 +56,26 @@ int crypto_verify_signature(unsigned char *sas_key,
   RETURN(0);
 }
 
+/* Broadcast frames are often heard several times via different neighbours, so remember the
+ * signatures we have verified recently. An entry only matches the same message hash, signature
+ * and signing key, so a cached result can't be reused for a different message or signer.
+ */
+#define VERIFIED_CACHE_SIZE 256
+#define VERIFIED_CACHE_MS 10000
+
+struct verified_signature{
+  unsigned char hash[32];
+  unsigned char signature[SIGNATURE_BYTES];
+  unsigned char sas_key[SAS_SIZE];
+  time_ms_t expires;
+};
+
+static struct verified_signature verified_cache[VERIFIED_CACHE_SIZE];
+
+// verification times, and cache hits, are reported with the other performance statistics
+static struct profile_total verify_stats = {.name="crypto_verify_message"};
+static struct profile_total verify_cached_stats = {.name="crypto_verify_message (cached)"};
+
 // verify the signature at the end of a message, on return message_len will be reduced by the length of the signature.
 int crypto_verify_message(struct subscriber *subscriber, unsigned char *message, int *message_len)
 {
@@ -66,13 +87,36 @@ int crypto_verify_message(struct subscriber *subscriber, unsigned char *message,
   if (*message_len < SIGNATURE_BYTES)
     return WHY("Message is too short to include a signature");
   
+  struct call_stats call={.totals=&verify_stats};
+  fd_func_enter(__HERE__, &call);
+  
   *message_len -= SIGNATURE_BYTES;
+  unsigned char *signature = &message[*message_len];
   
   unsigned char hash[crypto_hash_sha512_BYTES];
   crypto_hash_sha512(hash,message,*message_len);
   
-  return crypto_verify_signature(subscriber->sas_public, hash, 
-				 crypto_hash_sha512_BYTES, &message[*message_len], SIGNATURE_BYTES);
+  time_ms_t now = gettime_ms();
+  struct verified_signature *entry = &verified_cache[read_uint16(hash) % VERIFIED_CACHE_SIZE];
+  if (entry->expires > now
+    && memcmp(entry->hash, hash, sizeof entry->hash)==0
+    && memcmp(entry->signature, signature, SIGNATURE_BYTES)==0
+    && memcmp(entry->sas_key, subscriber->sas_public, SAS_SIZE)==0){
+    call.totals = &verify_cached_stats;
+    fd_func_exit(__HERE__, &call);
+    return 0;
+  }
+  
+  int ret = crypto_verify_signature(subscriber->sas_public, hash, 
+				 crypto_hash_sha512_BYTES, signature, SIGNATURE_BYTES);
+  if (ret == 0){
+    bcopy(hash, entry->hash, sizeof entry->hash);
+    bcopy(signature, entry->signature, SIGNATURE_BYTES);
+    bcopy(subscriber->sas_public, entry->sas_key, SAS_SIZE);
+    entry->expires = now + VERIFIED_CACHE_MS;
+  }
+  fd_func_exit(__HERE__, &call);
+  return ret;
 }
 
 // generate a signature for this raw content, copy the signature to the address requested.
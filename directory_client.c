@@ -90,7 +90,7 @@ static void directory_send_keyring(struct subscriber *directory_service){
 static int load_directory_config()
 {
   if (!directory_service && !is_sid_t_any(config.directory.service)) {
-    directory_service = find_subscriber(config.directory.service.binary, SID_SIZE, 1);
+    directory_service = add_subscriber_ref(find_subscriber(config.directory.service.binary, SID_SIZE, 1));
     if (!directory_service)
       return WHYF("Failed to create subscriber record");
     // used by tests
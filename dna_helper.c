@@ -132,6 +132,7 @@ DECLARE_SCHED_ENT(reply_timeout,    sched_timeout);
 static char request_buffer[SID_STRLEN + DID_MAXSIZE + 4];
 static char *request_bufptr = NULL;
 static char *request_bufend = NULL;
+// holds a reference until the reply is finished
 static struct subscriber *request_source = NULL;
 static mdp_port_t request_port = 0;
 static char request_did[DID_MAXSIZE + 1];
@@ -294,6 +295,7 @@ dna_helper_kill()
   if (awaiting_reply) {
     unschedule(&sched_timeout);
     awaiting_reply = 0;
+    set_subscriber_ref(&request_source, NULL);
   }
   if (dna_helper_pid > 0) {
     if (config.debug.dnahelper)
@@ -322,6 +324,7 @@ dna_helper_harvest(int blocking)
       if (awaiting_reply) {
 	unschedule(&sched_timeout);
 	awaiting_reply = 0;
+	set_subscriber_ref(&request_source, NULL);
       }
       return 1;
     } else if (pid == -1) {
@@ -438,6 +441,7 @@ void handle_reply_line(const char *bufp, size_t len)
 	DEBUG("DNAHELPER reply DONE");
       unschedule(&sched_timeout);
       awaiting_reply = 0;
+      set_subscriber_ref(&request_source, NULL);
     } else {
       char sidhex[SID_STRLEN + 1];
       char did[DID_MAXSIZE + 1];
@@ -641,7 +645,7 @@ dna_helper_enqueue(struct subscriber *source, mdp_port_t source_port, const char
     }
     request_bufptr = request_buffer;
     request_bufend = request_buffer + strbuf_len(b);
-    request_source = source;
+    set_subscriber_ref(&request_source, source);
     request_port = source_port;
     strncpy(request_did, did, sizeof request_did);
     request_did[sizeof request_did - 1] = '\0';
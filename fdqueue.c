@@ -46,67 +46,374 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
   POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <assert.h>
+#include <fcntl.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <signal.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #include "fdqueue.h"
 #include "conf.h"
+#include "mem.h"
+#include "net.h"
 #include "str.h"
 #include "strbuf.h"
 #include "strbuf_helpers.h"
 
-#define MAX_WATCHED_FDS 128
-struct pollfd fds[MAX_WATCHED_FDS];
+#define WATCHED_FDS_INCREMENT 64
+struct pollfd *fds=NULL;
 int fdcount=0;
-struct sched_ent *fd_callbacks[MAX_WATCHED_FDS];
-struct sched_ent *next_alarm=NULL;
-struct sched_ent *next_deadline=NULL;
+int fdsize=0;
+struct sched_ent **fd_callbacks=NULL;
 struct profile_total poll_stats={NULL,0,"Idle (in poll)",0,0,0,0};
 
+/* Watched handles that have activity, collected by poll(2) or epoll_wait(2) before any callbacks
+ * are made.  The index into fds[] is kept so that we can tell if a callback has unwatched the
+ * handle before we get to it, without touching an alarm that may have been freed.
+ */
+struct fd_ready {
+  struct sched_ent *alarm;
+  int index;
+  int fd;
+  short revents;
+};
+static struct fd_ready *fd_ready=NULL;
+
+#ifdef HAVE_SYS_EPOLL_H
+/* With epoll(7) the kernel holds the set of watched handles, so each fd_poll() only has to visit
+ * the handles that are ready, instead of passing and scanning every watched handle.  More than one
+ * alarm may watch the same handle (eg, input and output on one socket), so the alarms for each
+ * file descriptor are chained together and the kernel is given the union of their events.
+ */
+struct fd_watchers {
+  struct sched_ent *head;
+  char registered;
+  // epoll(7) refuses regular files, which poll(2) would always report as ready
+  char unsupported;
+};
+// -1 if not opened yet, -2 if epoll(7) is not available and we must use poll(2)
+static int epoll_fd=-1;
+static struct fd_watchers *fd_watchers=NULL;
+static int fd_watchers_size=0;
+static int epoll_unsupported=0;
+static struct epoll_event *epoll_events=NULL;
+
+static int epoll_open()
+{
+  if (epoll_fd == -1){
+    if ((epoll_fd = epoll_create(WATCHED_FDS_INCREMENT)) == -1){
+      WARN_perror("epoll_create");
+      WARN("Falling back to poll(2)");
+      epoll_fd = -2;
+    }else if (fcntl(epoll_fd, F_SETFD, FD_CLOEXEC) == -1)
+      WARNF_perror("fcntl(%d, F_SETFD, FD_CLOEXEC)", epoll_fd);
+  }
+  return epoll_fd >= 0;
+}
+
+static struct fd_watchers *epoll_watchers(int fd)
+{
+  if (fd < 0)
+    return NULL;
+  if (fd >= fd_watchers_size){
+    int size = fd_watchers_size ? fd_watchers_size : WATCHED_FDS_INCREMENT;
+    while (size <= fd)
+      size *= 2;
+    struct fd_watchers *w = erealloc(fd_watchers, size * sizeof(struct fd_watchers));
+    if (!w)
+      return NULL;
+    bzero(&w[fd_watchers_size], (size - fd_watchers_size) * sizeof(struct fd_watchers));
+    fd_watchers = w;
+    fd_watchers_size = size;
+  }
+  return &fd_watchers[fd];
+}
+
+// tell the kernel about the current set of events we want for this handle
+static int epoll_update(int fd)
+{
+  struct fd_watchers *w = epoll_watchers(fd);
+  if (!w)
+    return -1;
+  if (!w->head){
+    if (w->unsupported){
+      w->unsupported = 0;
+      epoll_unsupported--;
+    }else if (w->registered){
+      // closing the handle has already removed it if there are no other copies of it, so ignore errors
+      epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    w->registered = 0;
+    return 0;
+  }
+  if (w->unsupported)
+    return 0;
+  
+  struct epoll_event ev;
+  bzero(&ev, sizeof ev);
+  struct sched_ent *alarm;
+  // POLLIN, POLLOUT etc have the same values as EPOLLIN, EPOLLOUT etc
+  for (alarm = w->head; alarm; alarm = alarm->_next_watcher)
+    ev.events |= alarm->poll.events;
+  ev.data.fd = fd;
+  
+  int op = w->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  int r = epoll_ctl(epoll_fd, op, fd, &ev);
+  // the handle may have been closed and re-opened without being unwatched
+  if (r == -1 && op == EPOLL_CTL_MOD && errno == ENOENT)
+    r = epoll_ctl(epoll_fd, op = EPOLL_CTL_ADD, fd, &ev);
+  else if (r == -1 && op == EPOLL_CTL_ADD && errno == EEXIST)
+    r = epoll_ctl(epoll_fd, op = EPOLL_CTL_MOD, fd, &ev);
+  if (r == -1){
+    if (errno != EPERM)
+      return WHYF_perror("epoll_ctl(%d, %s, %d)", epoll_fd, op == EPOLL_CTL_ADD ? "EPOLL_CTL_ADD" : "EPOLL_CTL_MOD", fd);
+    if (config.debug.io)
+      DEBUGF("#%d does not support epoll, treating it as always ready", fd);
+    w->registered = 0;
+    w->unsupported = 1;
+    epoll_unsupported++;
+    return 0;
+  }
+  w->registered = 1;
+  return 0;
+}
+
+static int epoll_link(struct sched_ent *alarm, int fd)
+{
+  struct fd_watchers *w = epoll_watchers(fd);
+  if (!w)
+    return -1;
+  alarm->_next_watcher = w->head;
+  w->head = alarm;
+  return epoll_update(fd);
+}
+
+static void epoll_unlink(struct sched_ent *alarm, int fd)
+{
+  if (fd < 0 || fd >= fd_watchers_size)
+    return;
+  struct sched_ent **p;
+  for (p = &fd_watchers[fd].head; *p; p = &(*p)->_next_watcher){
+    if (*p == alarm){
+      *p = alarm->_next_watcher;
+      break;
+    }
+  }
+  alarm->_next_watcher = NULL;
+  epoll_update(fd);
+}
+
+// wait for activity, then collect the alarms that should be called
+static int epoll_collect(int ms)
+{
+  if (epoll_unsupported)
+    ms = 0;
+  int i, count=0;
+  int n = epoll_wait(epoll_fd, epoll_events, fdsize, ms);
+  if (n == -1){
+    if (errno != EINTR)
+      WHY_perror("epoll_wait");
+    n = 0;
+  }
+  for (i = 0; i < n; i++){
+    int fd = epoll_events[i].data.fd;
+    if (fd < 0 || fd >= fd_watchers_size)
+      continue;
+    struct sched_ent *alarm;
+    for (alarm = fd_watchers[fd].head; alarm; alarm = alarm->_next_watcher){
+      short revents = epoll_events[i].events & (alarm->poll.events | POLLERR | POLLHUP | POLLNVAL);
+      if (revents){
+	struct fd_ready *ready = &fd_ready[count++];
+	ready->alarm = alarm;
+	ready->index = alarm->_poll_index;
+	ready->fd = fd;
+	ready->revents = revents;
+      }
+    }
+  }
+  if (epoll_unsupported){
+    for (i = 0; i < fdcount; i++){
+      int fd = fds[i].fd;
+      if (fd >= 0 && fd < fd_watchers_size && fd_watchers[fd].unsupported){
+	short revents = fds[i].events & (POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM);
+	if (revents){
+	  struct fd_ready *ready = &fd_ready[count++];
+	  ready->alarm = fd_callbacks[i];
+	  ready->index = i;
+	  ready->fd = fd;
+	  ready->revents = revents;
+	}
+      }
+    }
+  }
+  return count;
+}
+#endif
+
+// make room to watch more file handles
+static int fd_grow()
+{
+  int size = fdsize ? fdsize * 2 : WATCHED_FDS_INCREMENT;
+  struct pollfd *new_fds = erealloc(fds, size * sizeof(struct pollfd));
+  if (!new_fds)
+    return -1;
+  fds = new_fds;
+  struct sched_ent **new_callbacks = erealloc(fd_callbacks, size * sizeof(struct sched_ent *));
+  if (!new_callbacks)
+    return -1;
+  fd_callbacks = new_callbacks;
+  struct fd_ready *new_ready = erealloc(fd_ready, size * sizeof(struct fd_ready));
+  if (!new_ready)
+    return -1;
+  fd_ready = new_ready;
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event *new_events = erealloc(epoll_events, size * sizeof(struct epoll_event));
+  if (!new_events)
+    return -1;
+  epoll_events = new_events;
+#endif
+  fdsize = size;
+  return 0;
+}
+
 #define alloca_alarm_name(alarm) ((alarm)->stats ? alloca_str_toprint((alarm)->stats->name) : "Unnamed")
 
+/* Scheduled alarms wait in one of two binary heaps.  Until its alarm time has elapsed an alarm is
+ * kept in the alarm heap, ordered by alarm time.  Then it is moved to the deadline heap, ordered by
+ * deadline, where it waits its turn to be called.  Alarms with the same time are called in the
+ * order they were added to the heap.  Each alarm records its own position in its heap, so
+ * scheduling and unscheduling cost O(log n) in the number of scheduled alarms.
+ */
+struct sched_heap {
+  struct sched_ent **ent;
+  unsigned count;
+  unsigned size;
+  int by_deadline;
+};
+static struct sched_heap alarm_heap = {.by_deadline = 0};
+static struct sched_heap deadline_heap = {.by_deadline = 1};
+static uint64_t sched_order = 0;
+
+#define heap_time(H, A) ((H)->by_deadline ? (A)->deadline : (A)->alarm)
+#define heap_first(H) ((H)->count ? (H)->ent[0] : NULL)
+
+static int heap_before(const struct sched_heap *heap, const struct sched_ent *a, const struct sched_ent *b)
+{
+  time_ms_t ta = heap_time(heap, a);
+  time_ms_t tb = heap_time(heap, b);
+  if (ta != tb)
+    return ta < tb;
+  return a->_sched_order < b->_sched_order;
+}
+
+static void heap_set(struct sched_heap *heap, unsigned i, struct sched_ent *alarm)
+{
+  heap->ent[i] = alarm;
+  alarm->_heap_index = i + 1;
+}
+
+static void heap_sift_up(struct sched_heap *heap, unsigned i)
+{
+  struct sched_ent *alarm = heap->ent[i];
+  while (i > 0){
+    unsigned parent = (i - 1) / 2;
+    if (!heap_before(heap, alarm, heap->ent[parent]))
+      break;
+    heap_set(heap, i, heap->ent[parent]);
+    i = parent;
+  }
+  heap_set(heap, i, alarm);
+}
+
+static void heap_sift_down(struct sched_heap *heap, unsigned i)
+{
+  struct sched_ent *alarm = heap->ent[i];
+  while (1){
+    unsigned child = i * 2 + 1;
+    if (child >= heap->count)
+      break;
+    if (child + 1 < heap->count && heap_before(heap, heap->ent[child + 1], heap->ent[child]))
+      child++;
+    if (!heap_before(heap, heap->ent[child], alarm))
+      break;
+    heap_set(heap, i, heap->ent[child]);
+    i = child;
+  }
+  heap_set(heap, i, alarm);
+}
+
+static int heap_insert(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  if (heap->count >= heap->size){
+    unsigned size = heap->size ? heap->size * 2 : 64;
+    struct sched_ent **ent = erealloc(heap->ent, size * sizeof(struct sched_ent *));
+    if (!ent)
+      return WHY("Too many scheduled alarms");
+    heap->ent = ent;
+    heap->size = size;
+  }
+  alarm->_sched_order = sched_order++;
+  alarm->_heap = heap;
+  heap->ent[heap->count] = alarm;
+  heap_sift_up(heap, heap->count++);
+  return 0;
+}
+
+static void heap_remove(struct sched_heap *heap, struct sched_ent *alarm)
+{
+  unsigned i = alarm->_heap_index - 1;
+  assert(i < heap->count && heap->ent[i] == alarm);
+  alarm->_heap_index = 0;
+  alarm->_heap = NULL;
+  if (i == --heap->count)
+    return;
+  // fill the hole with the last alarm, which may need to move either way
+  heap_set(heap, i, heap->ent[heap->count]);
+  if (i > 0 && heap_before(heap, heap->ent[i], heap->ent[(i - 1) / 2]))
+    heap_sift_up(heap, i);
+  else
+    heap_sift_down(heap, i);
+}
+
 void list_alarms()
 {
   DEBUG("Alarms;");
   time_ms_t now = gettime_ms();
   struct sched_ent *alarm;
+  unsigned i;
   
-  for (alarm = next_deadline; alarm; alarm = alarm->_next)
+  for (i = 0; i < deadline_heap.count; i++){
+    alarm = deadline_heap.ent[i];
     DEBUGF("%p %s deadline in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->deadline - now);
+  }
   
-  for (alarm = next_alarm; alarm; alarm = alarm->_next)
+  for (i = 0; i < alarm_heap.count; i++){
+    alarm = alarm_heap.ent[i];
     DEBUGF("%p %s in %"PRId64"ms, deadline in %"PRId64"ms", alarm->function, alloca_alarm_name(alarm), alarm->alarm - now, alarm->deadline - now);
+  }
   
   DEBUG("File handles;");
-  int i;
-  for (i = 0; i < fdcount; ++i)
-    DEBUGF("%s watching #%d", alloca_alarm_name(fd_callbacks[i]), fds[i].fd);
+  int j;
+  for (j = 0; j < fdcount; ++j)
+    DEBUGF("%s watching #%d", alloca_alarm_name(fd_callbacks[j]), fds[j].fd);
 }
 
 int deadline(struct sched_ent *alarm)
 {
-  struct sched_ent *node = next_deadline, *last = NULL;
   if (alarm->deadline < alarm->alarm)
     alarm->deadline = alarm->alarm;
-  
-  while(node!=NULL){
-    if (node->deadline > alarm->deadline)
-      break;
-    last = node;
-    node = node->_next;
-  }
-  if (last == NULL){
-    next_deadline = alarm;
-  }else{
-    last->_next = alarm;
-  }
-  alarm->_prev = last;
-  if(node!=NULL)
-    node->_prev = alarm;
-  alarm->_next = node;
-  return 0;
+  return heap_insert(&deadline_heap, alarm);
 }
 
 int is_scheduled(const struct sched_ent *alarm)
 {
-  return alarm->_next || alarm->_prev || alarm == next_alarm || alarm == next_deadline;
+  return alarm->_heap_index != 0;
 }
 
 // add an alarm to the list of scheduled function calls.
@@ -124,8 +431,6 @@ int _schedule(struct __sourceloc __whence, struct sched_ent *alarm)
   if (!alarm->stats)
     WARN("schedule() called without supplying an alarm name");
 
-  struct sched_ent *node = next_alarm, *last = NULL;
-  
   if (is_scheduled(alarm))
     FATAL("Scheduling an alarm that is already scheduled");
   
@@ -151,23 +456,7 @@ int _schedule(struct __sourceloc __whence, struct sched_ent *alarm)
   if (alarm->alarm <= now)
     return deadline(alarm);
   
-  while(node!=NULL){
-    if (node->alarm > alarm->alarm)
-      break;
-    last = node;
-    node = node->_next;
-  }
-  if (last == NULL){
-    next_alarm = alarm;
-  }else{
-    last->_next=alarm;
-  }
-  alarm->_prev = last;
-  if(node!=NULL)
-    node->_prev = alarm;
-  alarm->_next = node;
-  
-  return 0;
+  return heap_insert(&alarm_heap, alarm);
 }
 
 // remove a function from the schedule before it has fired
@@ -177,21 +466,8 @@ int _unschedule(struct __sourceloc __whence, struct sched_ent *alarm)
   if (config.debug.io)
     DEBUGF("unschedule(alarm=%s)", alloca_alarm_name(alarm));
 
-  struct sched_ent *prev = alarm->_prev;
-  struct sched_ent *next = alarm->_next;
-  
-  if (prev)
-    prev->_next = next;
-  else if(next_alarm==alarm)
-    next_alarm = next;
-  else if(next_deadline==alarm)
-    next_deadline = next;
-  
-  if (next)
-    next->_prev = prev;
-  
-  alarm->_prev = NULL;
-  alarm->_next = NULL;
+  if (is_scheduled(alarm))
+    heap_remove(alarm->_heap, alarm);
   return 0;
 }
 
@@ -208,27 +484,45 @@ int _watch(struct __sourceloc __whence, struct sched_ent *alarm)
   if (!alarm->poll.events)
     FATAL("Can't watch if you haven't set any poll flags");
   
-  if (alarm->_poll_index>=0 && fd_callbacks[alarm->_poll_index]==alarm){
+#ifdef HAVE_SYS_EPOLL_H
+  int old_fd = -1;
+#endif
+  if (alarm->_poll_index>=0 && alarm->_poll_index<fdcount && fd_callbacks[alarm->_poll_index]==alarm){
     // updating event flags
     if (config.debug.io)
       DEBUGF("Updating watch %s, #%d for %s", alloca_alarm_name(alarm), alarm->poll.fd, alloca_poll_events(alarm->poll.events));
+#ifdef HAVE_SYS_EPOLL_H
+    old_fd = fds[alarm->_poll_index].fd;
+#endif
   }else{
     if (config.debug.io)
       DEBUGF("Adding watch %s, #%d for %s", alloca_alarm_name(alarm), alarm->poll.fd, alloca_poll_events(alarm->poll.events));
-    if (fdcount>=MAX_WATCHED_FDS)
+    if (fdcount>=fdsize && fd_grow()==-1)
       return WHY("Too many file handles to watch");
     fd_callbacks[fdcount]=alarm;
     alarm->poll.revents = 0;
     alarm->_poll_index=fdcount;
+    alarm->_next_watcher=NULL;
     fdcount++;
   }
   fds[alarm->_poll_index]=alarm->poll;
+#ifdef HAVE_SYS_EPOLL_H
+  if (epoll_open()){
+    if (old_fd != alarm->poll.fd){
+      epoll_unlink(alarm, old_fd);
+      if (alarm->poll.fd >= 0)
+	return epoll_link(alarm, alarm->poll.fd);
+    }else if (alarm->poll.fd >= 0)
+      return epoll_update(alarm->poll.fd);
+  }
+#endif
   return 0;
 }
 
 int is_watching(struct sched_ent *alarm)
 {
-  if (alarm->_poll_index <0 || fds[alarm->_poll_index].fd!=alarm->poll.fd)
+  int index = alarm->_poll_index;
+  if (index <0 || index>=fdcount || fd_callbacks[index]!=alarm || fds[index].fd!=alarm->poll.fd)
     return 0;
   return 1;
 }
@@ -240,9 +534,13 @@ int _unwatch(struct __sourceloc __whence, struct sched_ent *alarm)
     DEBUGF("unwatch(alarm=%s)", alloca_alarm_name(alarm));
 
   int index = alarm->_poll_index;
-  if (index <0 || fds[index].fd!=alarm->poll.fd)
+  if (index <0 || index>=fdcount || fd_callbacks[index]!=alarm || fds[index].fd!=alarm->poll.fd)
     return WHY("Attempted to unwatch a handle that is not being watched");
   
+#ifdef HAVE_SYS_EPOLL_H
+  if (epoll_fd>=0)
+    epoll_unlink(alarm, alarm->poll.fd);
+#endif
   fdcount--;
   if (index!=fdcount){
     // squash fds
@@ -284,6 +582,43 @@ static void call_alarm(struct sched_ent *alarm, int revents)
   OUT();
 }
 
+// wait for activity using poll(2), then collect the alarms that should be called
+static int poll_collect(int ms)
+{
+  int i, count=0;
+  int r = poll(fds, fdcount, ms);
+  if (config.debug.io) {
+    strbuf b = strbuf_alloca(1024);
+    for (i = 0; i < fdcount; ++i) {
+      if (i)
+	strbuf_puts(b, ", ");
+      strbuf_sprintf(b, "%d:", fds[i].fd);
+      strbuf_append_poll_events(b, fds[i].events);
+      strbuf_puts(b, "->");
+      strbuf_append_poll_events(b, fds[i].revents);
+    }
+    DEBUGF("poll(fds=(%s), fdcount=%d, ms=%d) -> %d", strbuf_str(b), fdcount, ms, r);
+  }
+  for (i = 0; r > 0 && i < fdcount; i++){
+    if (fds[i].revents){
+      struct fd_ready *ready = &fd_ready[count++];
+      ready->alarm = fd_callbacks[i];
+      ready->index = i;
+      ready->fd = fds[i].fd;
+      ready->revents = fds[i].revents;
+    }
+  }
+  return count;
+}
+
+// has this handle been unwatched by a callback since it was collected?
+static int fd_still_ready(const struct fd_ready *ready)
+{
+  return ready->index < fdcount
+      && fd_callbacks[ready->index] == ready->alarm
+      && fds[ready->index].fd == ready->fd;
+}
+
 int fd_poll()
 {
   IN();
@@ -291,15 +626,18 @@ int fd_poll()
   int ms=60000;
   time_ms_t now = gettime_ms();
   
+  struct sched_ent *next_alarm = heap_first(&alarm_heap);
+  struct sched_ent *next_deadline = heap_first(&deadline_heap);
   if (!next_alarm && !next_deadline && fdcount==0)
     RETURN(0);
   
   /* move alarms that have elapsed to the deadline queue */
   while (next_alarm!=NULL&&next_alarm->alarm <=now){
-    struct sched_ent *alarm = next_alarm;
-    unschedule(alarm);
-    deadline(alarm);
+    unschedule(next_alarm);
+    deadline(next_alarm);
+    next_alarm = heap_first(&alarm_heap);
   }
+  next_deadline = heap_first(&deadline_heap);
   
   /* work out how long we can block in poll */
   if (next_deadline)
@@ -319,20 +657,22 @@ int fd_poll()
     if (fdcount==0){
       sleep_ms(ms);
     }else{
-      r = poll(fds, fdcount, ms);
-      if (config.debug.io) {
-	strbuf b = strbuf_alloca(1024);
-	int i;
-	for (i = 0; i < fdcount; ++i) {
-	  if (i)
-	    strbuf_puts(b, ", ");
-	  strbuf_sprintf(b, "%d:", fds[i].fd);
-	  strbuf_append_poll_events(b, fds[i].events);
-	  strbuf_puts(b, "->");
-	  strbuf_append_poll_events(b, fds[i].revents);
+#ifdef HAVE_SYS_EPOLL_H
+      if (epoll_fd>=0){
+	r = epoll_collect(ms);
+	if (config.debug.io) {
+	  strbuf b = strbuf_alloca(1024);
+	  for (i = 0; i < r; ++i) {
+	    if (i)
+	      strbuf_puts(b, ", ");
+	    strbuf_sprintf(b, "%d:", fd_ready[i].fd);
+	    strbuf_append_poll_events(b, fd_ready[i].revents);
+	  }
+	  DEBUGF("epoll_wait(fdcount=%d, ms=%d) -> (%s)", fdcount, ms, strbuf_str(b));
 	}
-	DEBUGF("poll(fds=(%s), fdcount=%d, ms=%d) -> %d", strbuf_str(b), fdcount, ms, r);
-      }
+      }else
+#endif
+	r = poll_collect(ms);
     }
     fd_func_exit(__HERE__, &call_stats);
     now=gettime_ms();
@@ -341,13 +681,12 @@ int fd_poll()
   // Reading new data takes priority over everything else
   // Are any handles marked with POLLIN?
   int in_count=0;
-  if (r>0){
-    for (i=0;i<fdcount;i++)
-      if (fds[i].revents & POLLIN)
-        in_count++;
-  }
+  for (i=0;i<r;i++)
+    if (fd_ready[i].revents & POLLIN)
+      in_count++;
 
   /* call one alarm function, but only if its deadline time has elapsed OR there is no incoming file activity */
+  next_deadline = heap_first(&deadline_heap);
   if (next_deadline && (next_deadline->deadline <=now || (in_count==0))){
     struct sched_ent *alarm = next_deadline;
     unschedule(alarm);
@@ -360,30 +699,196 @@ int fd_poll()
   }
   
   /* If file descriptors are ready, then call the appropriate functions */
-  if (r>0) {
-    for(i=fdcount -1;i>=0;i--){
-      if (fds[i].revents) {
-        // if any handles have POLLIN set, don't process any other handles
-        if (!(fds[i].revents&POLLIN || in_count==0))
-          continue;
-
-	int fd = fds[i].fd;
-	/* Call the alarm callback with the socket in non-blocking mode */
-	errno=0;
-	set_nonblock(fd);
-	// Work around OSX behaviour that doesn't set POLLERR on 
-	// devices that have been deconfigured, e.g., a USB serial adapter
-	// that has been removed.
-	if (errno == ENXIO) fds[i].revents|=POLLERR;
-	call_alarm(fd_callbacks[i], fds[i].revents);
-	/* The alarm may have closed and unwatched the descriptor, make sure this descriptor still matches */
-	if (i<fdcount && fds[i].fd == fd){
-	  if (set_block(fds[i].fd))
-	    FATALF("Alarm %p %s has a bad descriptor that wasn't closed!", fd_callbacks[i], alloca_alarm_name(fd_callbacks[i]));
-	}
-      }
+  for(i=r -1;i>=0;i--){
+    struct fd_ready *ready = &fd_ready[i];
+    // if any handles have POLLIN set, don't process any other handles
+    if (!(ready->revents&POLLIN || in_count==0))
+      continue;
+    /* The alarm may have been unwatched by an earlier callback */
+    if (!fd_still_ready(ready))
+      continue;
+
+    int fd = ready->fd;
+    /* Call the alarm callback with the socket in non-blocking mode */
+    errno=0;
+    set_nonblock(fd);
+    // Work around OSX behaviour that doesn't set POLLERR on 
+    // devices that have been deconfigured, e.g., a USB serial adapter
+    // that has been removed.
+    if (errno == ENXIO) ready->revents|=POLLERR;
+    call_alarm(ready->alarm, ready->revents);
+    /* The alarm may have closed and unwatched the descriptor, make sure this descriptor still matches */
+    if (fd_still_ready(ready)){
+      if (set_block(fd))
+	FATALF("Alarm %p %s has a bad descriptor that wasn't closed!", ready->alarm, alloca_alarm_name(ready->alarm));
     }
   }
   RETURN(1);
   OUT();
 }
+
+/* A small pool of worker threads, for CPU heavy work that would otherwise delay fd_poll().
+ * Work functions run on a worker thread and must not touch anything the main thread may be
+ * using, including logging and config. Completed work is handed back through an eventfd (or a
+ * pipe) that fd_poll() watches, so completion callbacks always run on the main thread.
+ * Without POSIX threads, all work is done on the main thread as it is queued.
+ */
+#ifdef HAVE_PTHREAD
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_finished = PTHREAD_COND_INITIALIZER;
+static struct work_item *work_pending = NULL, **work_pending_tail = &work_pending;
+static struct work_item *work_done = NULL, **work_done_tail = &work_done;
+static unsigned worker_count = 0;
+static int work_started = 0;
+// read end, and write end, of the completion channel
+static int work_signal_fd[2] = {-1, -1};
+
+static void work_completed(struct sched_ent *alarm);
+static struct profile_total work_stats = { .name="work_completed" };
+static struct sched_ent work_alarm = {
+  .function = work_completed,
+  .stats = &work_stats,
+  .poll={.fd = -1},
+  ._poll_index = -1,
+};
+
+static void *worker_main(void *UNUSED(context))
+{
+  // signals are handled by the main thread
+  sigset_t mask;
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+  
+  while(1){
+    pthread_mutex_lock(&work_lock);
+    while (!work_pending)
+      pthread_cond_wait(&work_ready, &work_lock);
+    struct work_item *item = work_pending;
+    work_pending = item->_next;
+    if (!work_pending)
+      work_pending_tail = &work_pending;
+    pthread_mutex_unlock(&work_lock);
+    
+    item->work(item);
+    
+    pthread_mutex_lock(&work_lock);
+    item->_next = NULL;
+    item->_done = 1;
+    int was_empty = work_done == NULL;
+    *work_done_tail = item;
+    work_done_tail = &item->_next;
+    pthread_cond_broadcast(&work_finished);
+    pthread_mutex_unlock(&work_lock);
+    if (was_empty){
+      uint64_t one = 1;
+      while (write(work_signal_fd[1], &one, sizeof one) == -1 && errno == EINTR)
+	;
+    }
+  }
+  return NULL;
+}
+
+static void work_completed(struct sched_ent *alarm)
+{
+  uint64_t count;
+  if (read(alarm->poll.fd, &count, sizeof count) == -1 && errno != EAGAIN)
+    WHY_perror("read");
+  
+  pthread_mutex_lock(&work_lock);
+  struct work_item *item = work_done;
+  work_done = NULL;
+  work_done_tail = &work_done;
+  pthread_mutex_unlock(&work_lock);
+  
+  while (item){
+    struct work_item *next = item->_next;
+    item->completed(item);
+    item = next;
+  }
+}
+
+static int start_workers()
+{
+  work_started = 1;
+  unsigned threads = config.server.worker_threads;
+  if (threads == 0)
+    return 0;
+#ifdef HAVE_SYS_EVENTFD_H
+  if ((work_signal_fd[0] = work_signal_fd[1] = eventfd(0, EFD_CLOEXEC)) == -1)
+    return WHY_perror("eventfd");
+#else
+  if (pipe(work_signal_fd) == -1)
+    return WHY_perror("pipe");
+#endif
+  work_alarm.poll.fd = work_signal_fd[0];
+  work_alarm.poll.events = POLLIN;
+  watch(&work_alarm);
+  
+  for (; worker_count < threads; worker_count++){
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, worker_main, NULL);
+    if (err){
+      errno = err;
+      WHY_perror("pthread_create");
+      break;
+    }
+    pthread_detach(thread);
+  }
+  if (config.debug.io)
+    DEBUGF("Started %u worker threads", worker_count);
+  return 0;
+}
+
+int queue_work(struct work_item *item)
+{
+  if (!work_started)
+    start_workers();
+  if (worker_count == 0){
+    // no threads, so do the work now
+    item->work(item);
+    item->completed(item);
+    return 0;
+  }
+  item->_next = NULL;
+  item->_done = 0;
+  pthread_mutex_lock(&work_lock);
+  *work_pending_tail = item;
+  work_pending_tail = &item->_next;
+  pthread_cond_signal(&work_ready);
+  pthread_mutex_unlock(&work_lock);
+  return 0;
+}
+
+void wait_work(struct work_item *item)
+{
+  if (worker_count == 0)
+    return;
+  pthread_mutex_lock(&work_lock);
+  while (!item->_done)
+    pthread_cond_wait(&work_finished, &work_lock);
+  // take it off the completed list, so work_completed() won't see it
+  struct work_item **ptr = &work_done;
+  while (*ptr != item)
+    ptr = &(*ptr)->_next;
+  *ptr = item->_next;
+  if (!*ptr)
+    work_done_tail = ptr;
+  pthread_mutex_unlock(&work_lock);
+  item->completed(item);
+}
+
+#else // HAVE_PTHREAD
+
+int queue_work(struct work_item *item)
+{
+  item->work(item);
+  item->completed(item);
+  return 0;
+}
+
+void wait_work(struct work_item *UNUSED(item))
+{
+}
+
+#endif // HAVE_PTHREAD
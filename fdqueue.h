@@ -73,13 +73,11 @@ struct call_stats{
 };
 
 struct sched_ent;
+struct sched_heap;
 
 typedef void (*ALARM_FUNCP) (struct sched_ent *alarm);
 
 struct sched_ent{
-  struct sched_ent *_next;
-  struct sched_ent *_prev;
-  
   ALARM_FUNCP function;
   void *context;
   struct pollfd poll;
@@ -88,7 +86,13 @@ struct sched_ent{
   // the order we will prioritise the alarm
   time_ms_t deadline;
   struct profile_total *stats;
+  // position in the alarm or deadline heap, zero if not scheduled
+  unsigned _heap_index;
+  struct sched_heap *_heap;
+  uint64_t _sched_order;
   int _poll_index;
+  // other alarms watching the same file descriptor (epoll only)
+  struct sched_ent *_next_watcher;
 };
 
 #define STRUCT_SCHED_ENT_UNUSED {.poll={.fd=-1}, ._poll_index=-1,}
@@ -111,9 +115,26 @@ int fd_showstats();
 int fd_checkalarms();
 int fd_func_enter(struct __sourceloc, struct call_stats *this_call);
 int fd_func_exit(struct __sourceloc, struct call_stats *this_call);
+// record a call that was timed by something else, eg, a library callback
+void fd_tally_call(struct profile_total *totals, time_ms_t elapsed);
 void dump_stack(int log_level);
 unsigned fd_depth();
 
+struct work_item{
+  // called on a worker thread, must not use logging, config or anything else the main thread may touch
+  void (*work)(struct work_item *item);
+  // called from fd_poll() on the main thread after the work has been done
+  void (*completed)(struct work_item *item);
+  void *context;
+  struct work_item *_next;
+  char _done;
+};
+
+// run CPU heavy work without blocking fd_poll(), or immediately if there are no worker threads
+int queue_work(struct work_item *item);
+// block until queued work is done, then call its completed function now instead of from fd_poll()
+void wait_work(struct work_item *item);
+
 #define IN() static struct profile_total _aggregate_stats={NULL,0,__FUNCTION__,0,0,0,0}; \
     struct call_stats _this_call={.totals=&_aggregate_stats}; \
     fd_func_enter(__HERE__, &_this_call);
@@ -32,6 +32,7 @@ HDRS=	fifo.h \
 	constants.h \
 	monitor-client.h \
 	mdp_client.h \
+	mdp_ring.h \
 	msp_client.h \
 	radio_link.h \
 	sqlite-amalgamation-3070900/sqlite3.h
@@ -20,6 +20,9 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <assert.h>
 #include <inttypes.h>
 #include <time.h>
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #include "serval.h"
 #include "conf.h"
 #include "http_server.h"
@@ -106,6 +109,7 @@ void http_request_init(struct http_request *r, int sockfd)
   r->request_content_remaining = CONTENT_LENGTH_UNKNOWN;
   r->response.header.content_length = CONTENT_LENGTH_UNKNOWN;
   r->response.header.resource_length = CONTENT_LENGTH_UNKNOWN;
+  r->response.content_fd = -1;
   r->alarm.stats = &http_server_stats;
   r->alarm.function = http_server_poll;
   if (r->idle_timeout == 0)
@@ -217,7 +221,7 @@ void *read_pointer(const unsigned char *mem)
   uintptr_t n = 0;
   unsigned i;
   for (i = 0; i != sizeof(void*); ++i)
-    n |= mem[i] << (8 * i);
+    n |= (uintptr_t) mem[i] << (8 * i);
   return (void *) n;
 }
 
@@ -1554,6 +1558,42 @@ static void http_request_receive(struct http_request *r)
   http_request_start_response(r);
 }
 
+/* Send the next part of the content straight from the response's file, without copying it through
+ * the response buffer.  Returns the number of bytes sent, 0 if the socket cannot take any more, or
+ * -1 on error.  Without sendfile(2), reads the next part into the empty response buffer instead,
+ * and returns 0.
+ */
+static ssize_t http_request_send_file(struct http_request *r, http_size_t remaining)
+{
+  assert(remaining != CONTENT_LENGTH_UNKNOWN);
+  assert(r->response_buffer_length == 0);
+#ifdef HAVE_SYS_SENDFILE_H
+  size_t len = remaining < 1024 * 1024 ? (size_t) remaining : 1024 * 1024;
+  off_t offset = (off_t) r->response.content_fd_offset;
+  ssize_t sent = sendfile(r->alarm.poll.fd, r->response.content_fd, &offset, len);
+  if (sent == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    return WHYF_perror("sendfile(%d,%d,%"PRIu64",%zu)", r->alarm.poll.fd, r->response.content_fd, r->response.content_fd_offset, len);
+  }
+  if (sent == 0)
+    return WHYF("HTTP response content ended prematurely at offset %"PRIu64" of fd %d", r->response.content_fd_offset, r->response.content_fd);
+  r->response.content_fd_offset += (size_t) sent;
+  return sent;
+#else
+  size_t len = remaining < r->response_buffer_size ? (size_t) remaining : r->response_buffer_size;
+  ssize_t rd = pread(r->response.content_fd, r->response_buffer, len, (off_t) r->response.content_fd_offset);
+  if (rd == -1)
+    return WHYF_perror("pread(%d,%zu,%"PRIu64")", r->response.content_fd, len, r->response.content_fd_offset);
+  if (rd == 0)
+    return WHYF("HTTP response content ended prematurely at offset %"PRIu64" of fd %d", r->response.content_fd_offset, r->response.content_fd);
+  r->response.content_fd_offset += (size_t) rd;
+  r->response_buffer_length = (size_t) rd;
+  r->response_buffer_sent = 0;
+  return 0;
+#endif
+}
+
 /* Write the current contents of the response buffer to the HTTP socket.  When no more bytes can be
  * written, return so that socket polling can continue.  Once all bytes are sent, if there is a
  * content generator function, invoke it to put more content in the response buffer, and write that
@@ -1635,6 +1675,32 @@ static void http_request_send_response(struct http_request *r)
 	  r->response.content_generator = NULL; // ensure we never invoke again
 	continue;
       }
+    } else if (r->response.content_fd != -1) {
+      // Once the headers have gone, send the content straight from the file.
+      if (unsent == 0) {
+	sigPipeFlag = 0;
+	ssize_t sent = http_request_send_file(r, remaining);
+	if (sent == -1 || sigPipeFlag) {
+	  if (r->debug_flag && *r->debug_flag)
+	    DEBUG("HTTP socket sendfile error, closing connection");
+	  http_request_finalise(r);
+	  return;
+	}
+	if (sent == 0) {
+	  // If nothing was read into the buffer either, then go back to polling.
+	  if (r->response_buffer_length == 0)
+	    return;
+	  continue;
+	}
+	r->response_sent += (size_t) sent;
+	assert(r->response_sent <= r->response_length);
+	if (r->debug_flag && *r->debug_flag)
+	  DEBUGF("Sent %zu bytes from fd %d to HTTP socket, total %"PRIhttp_size_t", remaining=%"PRIhttp_size_t,
+	      (size_t) sent, r->response.content_fd, r->response_sent, r->response_length - r->response_sent);
+	if (r->phase != PAUSE)
+	  http_request_set_idle_timeout(r);
+	continue;
+      }
     } else if (remaining != CONTENT_LENGTH_UNKNOWN && unsent < remaining) {
       WHYF("HTTP response generator finished prematurely at offset %"PRIhttp_size_t"/%"PRIhttp_size_t" (%"PRIhttp_size_t" bytes remaining)",
 	  r->response_sent, r->response_length, remaining);
@@ -1852,11 +1918,11 @@ static int _render_response(struct http_request *r)
   strbuf sb = strbuf_local(r->response_buffer, r->response_buffer_size);
   // Cannot specify both static (pre-rendered) content AND generated content.
   assert(!(hr.content && hr.content_generator));
-  if (hr.content || hr.content_generator) {
+  if (hr.content || hr.content_generator || hr.content_fd != -1) {
     // With static (pre-rendered) content, the content length is mandatory (so we know how much data
     // follows the 'hr.content' pointer.  Generated content will generally not send a Content-Length
     // header, nor send partial content, but they might.
-    if (hr.content)
+    if (hr.content || hr.content_fd != -1)
       assert(hr.header.content_length != CONTENT_LENGTH_UNKNOWN);
     // Ensure that all partial content fields are consistent.  If content length or resource length
     // are unknown, there can be no range field.
@@ -1947,7 +2013,7 @@ static int _render_response(struct http_request *r)
     if (r->response_buffer_need < r->response_length)
       r->response_buffer_need = r->response_length;
   } else
-    assert(hr.content_generator);
+    assert(hr.content_generator || hr.content_fd != -1);
   if (r->response_buffer_size < r->response_buffer_need)
     return 0; // doesn't fit
   assert(!strbuf_overrun(sb));
@@ -1999,7 +2065,7 @@ static void http_request_start_response(struct http_request *r)
 {
   assert(r->phase == RECEIVE);
   _release_reserved(r);
-  if (r->response.content || r->response.content_generator) {
+  if (r->response.content || r->response.content_generator || r->response.content_fd != -1) {
     assert(r->response.header.content_type != NULL);
     assert(r->response.header.content_type[0]);
   }
@@ -2022,6 +2088,7 @@ static void http_request_start_response(struct http_request *r)
     r->response.result_code = 500;
     r->response.content = NULL;
     r->response.content_generator = NULL;
+    r->response.content_fd = -1;
   }
   // If the response cannot be rendered, then render a 500 Server Error instead.  If that fails,
   // then just close the connection.
@@ -2031,6 +2098,7 @@ static void http_request_start_response(struct http_request *r)
     r->response.result_code = 500;
     r->response.content = NULL;
     r->response.content_generator = NULL;
+    r->response.content_fd = -1;
     http_request_render_response(r);
     if (r->response_buffer == NULL) {
       WHY("Cannot render HTTP 500 Server Error response, closing connection");
@@ -2078,6 +2146,7 @@ void http_request_response_static(struct http_request *r, int result, const char
   r->response.header.content_length = r->response.header.resource_length = bytes;
   r->response.content = body;
   r->response.content_generator = NULL;
+  r->response.content_fd = -1;
   http_request_start_response(r);
 }
 
@@ -2090,6 +2159,26 @@ void http_request_response_generated(struct http_request *r, int result, const c
   r->response.header.content_type = mime_type;
   r->response.content = NULL;
   r->response.content_generator = generator;
+  r->response.content_fd = -1;
+  http_request_start_response(r);
+}
+
+/* Start sending a response whose content is sent straight from an open file, starting at 'offset'.
+ * The caller must already have set the content length (and range) in the response header, and
+ * must keep the file open until the request is finalised.
+ */
+void http_request_response_fd(struct http_request *r, int result, const char *mime_type, int fd, uint64_t offset)
+{
+  assert(r->phase == RECEIVE);
+  assert(mime_type != NULL);
+  assert(mime_type[0]);
+  assert(fd != -1);
+  r->response.result_code = result;
+  r->response.header.content_type = mime_type;
+  r->response.content = NULL;
+  r->response.content_generator = NULL;
+  r->response.content_fd = fd;
+  r->response.content_fd_offset = offset;
   http_request_start_response(r);
 }
 
@@ -2114,6 +2203,7 @@ void http_request_simple_response(struct http_request *r, uint16_t result, const
     r->response.content = strbuf_str(h);
   }
   r->response.content_generator = NULL;
+  r->response.content_fd = -1;
   http_request_start_response(r);
 }
 
@@ -115,6 +115,8 @@ struct http_response {
   struct http_response_headers header;
   const char *content;
   HTTP_CONTENT_GENERATOR *content_generator; // callback to produce more content
+  int content_fd; // file to send the content from, or -1
+  uint64_t content_fd_offset; // where the next byte of content lies in content_fd
 };
 
 #define MIME_FILENAME_MAXLEN 127
@@ -157,6 +159,7 @@ void http_request_finalise(struct http_request *r);
 void http_request_pause_response(struct http_request *r, time_ms_t until);
 void http_request_response_static(struct http_request *r, int result, const char *mime_type, const char *body, uint64_t bytes);
 void http_request_response_generated(struct http_request *r, int result, const char *mime_type, HTTP_CONTENT_GENERATOR *);
+void http_request_response_fd(struct http_request *r, int result, const char *mime_type, int fd, uint64_t offset);
 void http_request_simple_response(struct http_request *r, uint16_t result, const char *body);
 
 typedef int (HTTP_CONTENT_GENERATOR_STRBUF_CHUNKER)(struct http_request *, strbuf);
@@ -448,6 +448,10 @@ static int root_page(httpd_request *r, const char *remainder)
   }
   strbuf_puts(b, "Neighbours;<br>");
   link_neighbour_short_status_html(b, "/neighbour");
+  overlay_broadcast_status_html(b);
+  overlay_mdp_bindings_status_html(b);
+  link_traffic_status_html(b);
+  overlay_queue_status_html(b);
   if (is_rhizome_http_enabled()){
     strbuf_puts(b, "<a href=\"/rhizome/status\">Rhizome Status</a><br>");
   }
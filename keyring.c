@@ -227,6 +227,9 @@ void keyring_free(keyring_file *k)
       k->contexts[i]=NULL;
     }
 
+  if (k->sid_index)
+    free(k->sid_index);
+
   /* Wipe everything, just to be sure. */
   bzero(k,sizeof(keyring_file));
   free(k);
@@ -240,10 +243,17 @@ static void wipestr(char *str)
     *str++ = ' ';
 }
 
+// Identities have been added or removed, so the SID index must be rebuilt on next use.
+static void keyring_sid_index_invalidate(keyring_file *k)
+{
+  k->sid_index_size = 0;
+}
+
 void keyring_release_identity(keyring_file *k, unsigned cn, unsigned id)
 {
   if (config.debug.keyring)
     DEBUGF("Releasing k=%p, cn=%u, id=%u", k, cn, id);
+  keyring_sid_index_invalidate(k);
   keyring_context *c=k->contexts[cn];
   assert(c->identity_count > 0);
   c->identity_count--;
@@ -360,21 +370,32 @@ int keyring_enter_keyringpin(keyring_file *k, const char *pin)
   level function, and all we need to know here is that we shouldn't decrypt the
   first 96 bytes of the block.
 */
-static int keyring_munge_block(
-  unsigned char *block, int len /* includes the first 96 bytes */,
-  unsigned char *KeyRingSalt, int KeyRingSaltLen,
-  const char *KeyRingPin, const char *PKRPin)
+struct munge_work{
+  struct work_item item;
+  unsigned char *block;
+  int len;
+  unsigned char *KeyRingSalt;
+  int KeyRingSaltLen;
+  const char *KeyRingPin;
+  const char *PKRPin;
+  int result;
+};
+
+// called on a worker thread, so must not log
+static void munge_block_work(struct work_item *item)
 {
-  if (config.debug.keyring)
-    DEBUGF("KeyRingPin=%s PKRPin=%s", alloca_str_toprint(KeyRingPin), alloca_str_toprint(PKRPin));
+  struct munge_work *mw = item->context;
+  unsigned char *block = mw->block;
+  unsigned char *KeyRingSalt = mw->KeyRingSalt;
+  int KeyRingSaltLen = mw->KeyRingSaltLen;
+  const char *KeyRingPin = mw->KeyRingPin;
+  const char *PKRPin = mw->PKRPin;
   int exit_code=1;
   unsigned char hashKey[crypto_hash_sha512_BYTES];
   unsigned char hashNonce[crypto_hash_sha512_BYTES];
 
   unsigned char work[65536];
 
-  if (len<96) return WHY("block too short");
-
   unsigned char *PKRSalt=&block[0];
   int PKRSaltLen=32;
 
@@ -390,10 +411,8 @@ static int keyring_munge_block(
 #define APPEND(buf, len) { \
     assert(ofs <= sizeof work); \
     unsigned __len = (len); \
-    if (__len > sizeof work - ofs) { \
-      WHY("Input too long"); \
+    if (__len > sizeof work - ofs) \
       goto kmb_safeexit; \
-    } \
     bcopy((buf), &work[ofs], __len); \
     ofs += __len; \
   }
@@ -418,7 +437,7 @@ static int keyring_munge_block(
   /* Now en/de-crypt the remainder of the block.
      We do this in-place for convenience, so you should not pass in a mmap()'d
      lump. */
-  crypto_stream_xsalsa20_xor(&block[96],&block[96],len-96, hashNonce,hashKey);
+  crypto_stream_xsalsa20_xor(&block[96],&block[96],mw->len-96, hashNonce,hashKey);
   exit_code=0;
 
  kmb_safeexit:
@@ -427,10 +446,43 @@ static int keyring_munge_block(
   bzero(&work[0],65536);
   bzero(&hashKey[0],crypto_hash_sha512_BYTES);
   bzero(&hashNonce[0],crypto_hash_sha512_BYTES);
-  return exit_code;
+  mw->result = exit_code;
 #undef APPEND
 }
 
+static void munge_block_completed(struct work_item *UNUSED(item))
+{
+}
+
+/* The hashing and stream cipher are run by the worker pool, like the other CPU heavy crypto, but
+   the caller still waits for the result. */
+static int keyring_munge_block(
+  unsigned char *block, int len /* includes the first 96 bytes */,
+  unsigned char *KeyRingSalt, int KeyRingSaltLen,
+  const char *KeyRingPin, const char *PKRPin)
+{
+  if (config.debug.keyring)
+    DEBUGF("KeyRingPin=%s PKRPin=%s", alloca_str_toprint(KeyRingPin), alloca_str_toprint(PKRPin));
+  if (len<96) return WHY("block too short");
+  struct munge_work mw = {
+    .item.work = munge_block_work,
+    .item.completed = munge_block_completed,
+    .item.context = &mw,
+    .block = block,
+    .len = len,
+    .KeyRingSalt = KeyRingSalt,
+    .KeyRingSaltLen = KeyRingSaltLen,
+    .KeyRingPin = KeyRingPin,
+    .PKRPin = PKRPin,
+    .result = 1
+  };
+  queue_work(&mw.item);
+  wait_work(&mw.item);
+  if (mw.result)
+    return WHY("Input too long");
+  return 0;
+}
+
 static const char *keytype_str(unsigned ktype, const char *unknown)
 {
   switch (ktype) {
@@ -1185,6 +1237,7 @@ static int keyring_decrypt_pkr(keyring_file *k, unsigned cn, const char *pin, in
   }
   /* All fine, so add the id into the context and return. */
   cx->identities[cx->identity_count++] = id;
+  keyring_sid_index_invalidate(k);
   return 0;
 
  kdp_safeexit:
@@ -1311,6 +1364,7 @@ static int keyring_commit_identity(keyring_file *k, keyring_context *cx, keyring
       return 0;
   set_slot(k, id->slot, 1);
   cx->identities[cx->identity_count++] = id;
+  keyring_sid_index_invalidate(k);
   add_subscriber(id, keypair_sid);
   return 1;
 }
@@ -1977,8 +2031,101 @@ int keyring_send_sas_request(struct subscriber *subscriber){
   return ret;
 }
 
+struct keyring_sid_slot {
+  sid_t sid;
+  unsigned cn, in, kp;
+  char used;
+};
+
+static unsigned sid_hash(const sid_t *sidp)
+{
+  // SIDs are public keys, so any of their bytes are as good as a hash
+  return (sidp->binary[0] << 24) | (sidp->binary[1] << 16) | (sidp->binary[2] << 8) | sidp->binary[3];
+}
+
+static int keyring_sid_index_build(keyring_file *k)
+{
+  unsigned cn, in, kp, count = 0;
+  for (cn = in = kp = 0; keyring_next_keytype(k, &cn, &in, &kp, KEYTYPE_CRYPTOBOX); ++kp)
+    count++;
+  // keep the table at most half full
+  unsigned size = 16;
+  while (size < count * 2)
+    size <<= 1;
+  struct keyring_sid_slot *index = emalloc_zero(size * sizeof(struct keyring_sid_slot));
+  if (!index)
+    return -1;
+  for (cn = in = kp = 0; keyring_next_keytype(k, &cn, &in, &kp, KEYTYPE_CRYPTOBOX); ++kp) {
+    const sid_t *sidp = (const sid_t *)k->contexts[cn]->identities[in]->keypairs[kp]->public_key;
+    unsigned i = sid_hash(sidp) & (size - 1);
+    while (index[i].used && cmp_sid_t(&index[i].sid, sidp) != 0)
+      i = (i + 1) & (size - 1);
+    // like a linear search, the first key pair with this SID wins
+    if (index[i].used)
+      continue;
+    index[i].sid = *sidp;
+    index[i].cn = cn;
+    index[i].in = in;
+    index[i].kp = kp;
+    index[i].used = 1;
+  }
+  if (k->sid_index)
+    free(k->sid_index);
+  k->sid_index = index;
+  k->sid_index_size = size;
+  if (config.debug.keyring)
+    DEBUGF("Indexed %u SIDs in %u slots", count, size);
+  return 0;
+}
+
+static struct keyring_sid_slot *keyring_sid_index_find(const keyring_file *k, const sid_t *sidp)
+{
+  unsigned i = sid_hash(sidp) & (k->sid_index_size - 1);
+  for (; k->sid_index[i].used; i = (i + 1) & (k->sid_index_size - 1))
+    if (cmp_sid_t(&k->sid_index[i].sid, sidp) == 0)
+      return &k->sid_index[i];
+  return NULL;
+}
+
+// does the indexed position still hold this SID?
+static int keyring_sid_slot_valid(const keyring_file *k, const struct keyring_sid_slot *slot)
+{
+  if (slot->cn >= k->context_count || slot->in >= k->contexts[slot->cn]->identity_count)
+    return 0;
+  const keyring_identity *id = k->contexts[slot->cn]->identities[slot->in];
+  if (slot->kp >= id->keypair_count)
+    return 0;
+  const keypair *kp = id->keypairs[slot->kp];
+  return kp->type == KEYTYPE_CRYPTOBOX && memcmp(kp->public_key, slot->sid.binary, SID_SIZE) == 0;
+}
+
 int keyring_find_sid(const keyring_file *k, unsigned *cn, unsigned *in, unsigned *kp, const sid_t *sidp)
 {
+  // Searches from the start of the keyring use the SID index.  It is rebuilt when identities are
+  // added or removed, or if an entry no longer points at its key pair.
+  if (*cn == 0 && *in == 0 && *kp == 0) {
+    keyring_file *kw = (keyring_file *)k;
+    int rebuilt = 0;
+    while (1) {
+      if (k->sid_index_size == 0) {
+	if (keyring_sid_index_build(kw) == -1)
+	  break;
+	rebuilt = 1;
+      }
+      struct keyring_sid_slot *slot = keyring_sid_index_find(k, sidp);
+      if (!slot)
+	return 0;
+      if (keyring_sid_slot_valid(k, slot)) {
+	*cn = slot->cn;
+	*in = slot->in;
+	*kp = slot->kp;
+	return 1;
+      }
+      if (rebuilt)
+	break;
+      keyring_sid_index_invalidate(kw);
+    }
+  }
   for(; keyring_next_keytype(k,cn,in,kp,KEYTYPE_CRYPTOBOX); ++(*kp)) {
     if (memcmp(sidp->binary, k->contexts[*cn]->identities[*in]->keypairs[*kp]->public_key, SID_SIZE) == 0)
       return 1;
@@ -2104,60 +2251,311 @@ int keyring_seed(keyring_file *k)
   can indeed be reused.
 */
 
-/* XXX We need a more efficient implementation than a linear list, but it will
-   do for now. */
+/* The cache is a hash table of the most recently used results, in least recently used order so
+   the oldest can be evicted when it is full.  Its size is set by mdp.nm_cache_size.
+*/
 struct nm_record {
-  /* 96 bytes per record */
   sid_t known_key;
   sid_t unknown_key;
   unsigned char nm_bytes[crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES];
+  struct nm_record *hash_next;
+  struct nm_record *lru_prev;
+  struct nm_record *lru_next;
 };
 
-unsigned nm_slots_used=0;
-/* 512 x 96 bytes = 48KB, not too big */
-#define NM_CACHE_SLOTS 512
-struct nm_record nm_cache[NM_CACHE_SLOTS];
+static struct nm_cache {
+  unsigned size;
+  unsigned used;
+  unsigned hash_mask;
+  struct nm_record *records;
+  struct nm_record **buckets;
+  // most recently used first
+  struct nm_record *lru_first;
+  struct nm_record *lru_last;
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+} nm_cache;
+
+static int nm_cache_init(unsigned size)
+{
+  unsigned buckets = 16;
+  while (buckets < size)
+    buckets <<= 1;
+  struct nm_record *records = emalloc_zero(size * sizeof(struct nm_record));
+  struct nm_record **hash = emalloc_zero(buckets * sizeof(struct nm_record *));
+  if (!records || !hash) {
+    if (records)
+      free(records);
+    return -1;
+  }
+  if (nm_cache.records) {
+    bzero(nm_cache.records, nm_cache.size * sizeof(struct nm_record));
+    free(nm_cache.records);
+    free(nm_cache.buckets);
+  }
+  nm_cache.size = size;
+  nm_cache.used = 0;
+  nm_cache.hash_mask = buckets - 1;
+  nm_cache.records = records;
+  nm_cache.buckets = hash;
+  nm_cache.lru_first = nm_cache.lru_last = NULL;
+  return 0;
+}
 
-unsigned char *keyring_get_nm_bytes(const sid_t *known_sidp, const sid_t *unknown_sidp)
+static unsigned nm_hash(const sid_t *known_sidp, const sid_t *unknown_sidp)
 {
-  IN();
-  assert(keyring != NULL);
+  return (sid_hash(known_sidp) * 31 + sid_hash(unknown_sidp)) & nm_cache.hash_mask;
+}
 
-  /* See if we have it cached already */
-  unsigned i;
-  for(i=0;i<nm_slots_used;i++)
-    {
-      if (cmp_sid_t(&nm_cache[i].known_key, known_sidp) != 0) continue;
-      if (cmp_sid_t(&nm_cache[i].unknown_key, unknown_sidp) != 0) continue;
-      RETURN(nm_cache[i].nm_bytes);
+static void nm_lru_unlink(struct nm_record *r)
+{
+  if (r->lru_prev)
+    r->lru_prev->lru_next = r->lru_next;
+  else
+    nm_cache.lru_first = r->lru_next;
+  if (r->lru_next)
+    r->lru_next->lru_prev = r->lru_prev;
+  else
+    nm_cache.lru_last = r->lru_prev;
+}
+
+static void nm_lru_push(struct nm_record *r)
+{
+  r->lru_prev = NULL;
+  r->lru_next = nm_cache.lru_first;
+  if (nm_cache.lru_first)
+    nm_cache.lru_first->lru_prev = r;
+  else
+    nm_cache.lru_last = r;
+  nm_cache.lru_first = r;
+}
+
+static struct nm_record *nm_cache_evict()
+{
+  struct nm_record *r = nm_cache.lru_last;
+  nm_lru_unlink(r);
+  struct nm_record **rp = &nm_cache.buckets[nm_hash(&r->known_key, &r->unknown_key)];
+  while (*rp != r)
+    rp = &(*rp)->hash_next;
+  *rp = r->hash_next;
+  nm_cache.evictions++;
+  return r;
+}
+
+static int nm_cache_check_size()
+{
+  if (nm_cache.size != config.mdp.nm_cache_size && nm_cache_init(config.mdp.nm_cache_size) == -1)
+    return WHY("Could not allocate nm cache");
+  return 0;
+}
+
+static struct nm_record *nm_cache_find(const sid_t *known_sidp, const sid_t *unknown_sidp)
+{
+  struct nm_record *r;
+  for (r = nm_cache.buckets[nm_hash(known_sidp, unknown_sidp)]; r; r = r->hash_next) {
+    if (cmp_sid_t(&r->known_key, known_sidp) == 0 && cmp_sid_t(&r->unknown_key, unknown_sidp) == 0) {
+      if (r != nm_cache.lru_first) {
+	nm_lru_unlink(r);
+	nm_lru_push(r);
+      }
+      return r;
     }
+  }
+  return NULL;
+}
+
+static struct nm_record *nm_cache_store(const sid_t *known_sidp, const sid_t *unknown_sidp, const unsigned char *nm_bytes)
+{
+  // the same value may have been calculated twice, or the cache resized, while we were waiting
+  if (nm_cache_check_size() == -1)
+    return NULL;
+  struct nm_record *r = nm_cache_find(known_sidp, unknown_sidp);
+  if (!r) {
+    /* work out where to store it */
+    if (nm_cache.used < nm_cache.size)
+      r = &nm_cache.records[nm_cache.used++];
+    else
+      r = nm_cache_evict();
+    struct nm_record **bucket = &nm_cache.buckets[nm_hash(known_sidp, unknown_sidp)];
+    r->known_key = *known_sidp;
+    r->unknown_key = *unknown_sidp;
+    r->hash_next = *bucket;
+    *bucket = r;
+    nm_lru_push(r);
+  }
+  bcopy(nm_bytes, r->nm_bytes, sizeof r->nm_bytes);
+  return r;
+}
+
+/* A missing nm value being calculated by the worker pool, with a copy of the private key so the
+   worker never touches the keyring.  Callers of keyring_get_nm_bytes_async() that want the same
+   value wait on the same calculation, in the order they asked.
+*/
+struct nm_waiter {
+  void (*callback)(void *context);
+  void *context;
+  struct nm_waiter *next;
+};
+
+struct nm_work {
+  struct work_item item;
+  sid_t known_key;
+  sid_t unknown_key;
+  unsigned char private_key[crypto_box_curve25519xsalsa20poly1305_SECRETKEYBYTES];
+  unsigned char nm_bytes[crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES];
+  struct nm_record *record;
+  struct nm_waiter *waiters;
+  struct nm_waiter **waiters_tail;
+  struct nm_work *next;
+};
 
-  /* Not in the cache, so prepare to cache it (or return failure if known is not
-     in fact a known key */
+#define NM_MAX_PENDING 4
+static struct nm_work *nm_pending = NULL;
+static unsigned nm_pending_count = 0;
+
+static void nm_work(struct work_item *item)
+{
+  struct nm_work *work = item->context;
+  crypto_box_curve25519xsalsa20poly1305_beforenm(work->nm_bytes, work->unknown_key.binary, work->private_key);
+}
+
+// keyring_get_nm_bytes() is waiting for this one
+static void nm_work_stored(struct work_item *item)
+{
+  struct nm_work *work = item->context;
+  work->record = nm_cache_store(&work->known_key, &work->unknown_key, work->nm_bytes);
+}
+
+static void nm_work_completed(struct work_item *item)
+{
+  struct nm_work *work = item->context;
+  struct nm_work **wp = &nm_pending;
+  while (*wp != work)
+    wp = &(*wp)->next;
+  *wp = work->next;
+  nm_pending_count--;
+  nm_cache_store(&work->known_key, &work->unknown_key, work->nm_bytes);
+  struct nm_waiter *w = work->waiters;
+  while (w) {
+    struct nm_waiter *next = w->next;
+    w->callback(w->context);
+    free(w);
+    w = next;
+  }
+  bzero(work, sizeof *work);
+  free(work);
+}
+
+static struct nm_work *nm_work_new(const sid_t *known_sidp, const sid_t *unknown_sidp)
+{
   unsigned cn=0, in=0, kp=0;
   if (!keyring_find_sid(keyring,&cn,&in,&kp,known_sidp))
-    RETURNNULL(WHYNULL("known key is not in fact known."));
+    return WHYNULL("known key is not in fact known.");
+  struct nm_work *work = emalloc_zero(sizeof(struct nm_work));
+  if (!work)
+    return NULL;
+  nm_cache.misses++;
+  if (config.debug.keyring)
+    DEBUGF("nm cache miss, %lu hits, %lu misses, %lu evictions", nm_cache.hits, nm_cache.misses, nm_cache.evictions);
+  work->known_key = *known_sidp;
+  work->unknown_key = *unknown_sidp;
+  bcopy(keyring->contexts[cn]->identities[in]->keypairs[kp]->private_key, work->private_key, sizeof work->private_key);
+  work->item.work = nm_work;
+  work->item.context = work;
+  work->waiters_tail = &work->waiters;
+  return work;
+}
 
-  /* work out where to store it */
-  if (nm_slots_used<NM_CACHE_SLOTS) {
-    i=nm_slots_used; nm_slots_used++; 
-  } else {
-    i=random()%NM_CACHE_SLOTS;
-  }
-
-  /* calculate and store */
-  nm_cache[i].known_key = *known_sidp;
-  nm_cache[i].unknown_key = *unknown_sidp;
-  crypto_box_curve25519xsalsa20poly1305_beforenm(nm_cache[i].nm_bytes,
-						 unknown_sidp->binary,
-						 keyring
-						 ->contexts[cn]
-						 ->identities[in]
-						 ->keypairs[kp]->private_key);
-  RETURN(nm_cache[i].nm_bytes);
+unsigned char *keyring_get_nm_bytes(const sid_t *known_sidp, const sid_t *unknown_sidp)
+{
+  IN();
+  assert(keyring != NULL);
+
+  if (nm_cache_check_size() == -1)
+    RETURNNULL(NULL);
+
+  /* See if we have it cached already */
+  struct nm_record *r = nm_cache_find(known_sidp, unknown_sidp);
+  if (r) {
+    nm_cache.hits++;
+    RETURN(r->nm_bytes);
+  }
+
+  /* Not in the cache, so calculate it (or return failure if known is not in fact a known key) */
+  struct nm_work *work = nm_work_new(known_sidp, unknown_sidp);
+  if (!work)
+    RETURNNULL(NULL);
+  work->item.completed = nm_work_stored;
+  queue_work(&work->item);
+  wait_work(&work->item);
+  r = work->record;
+  bzero(work, sizeof *work);
+  free(work);
+  if (!r)
+    RETURNNULL(NULL);
+  RETURN(r->nm_bytes);
   OUT();
 }
 
+// will keyring_get_nm_bytes() return this value without calculating it?
+int keyring_has_nm_bytes(const sid_t *known_sidp, const sid_t *unknown_sidp)
+{
+  if (!nm_cache.buckets || nm_cache.size != config.mdp.nm_cache_size)
+    return 0;
+  struct nm_record *r;
+  for (r = nm_cache.buckets[nm_hash(known_sidp, unknown_sidp)]; r; r = r->hash_next)
+    if (cmp_sid_t(&r->known_key, known_sidp) == 0 && cmp_sid_t(&r->unknown_key, unknown_sidp) == 0)
+      return 1;
+  return 0;
+}
+
+/* Make sure that keyring_get_nm_bytes() will not have to calculate the given value.  Returns 1 if
+   it is already cached.  Otherwise returns 0 and calculates it on a worker thread, calling
+   callback(context) from the main loop when it is done, or returns -1 if that isn't possible and
+   the caller should use keyring_get_nm_bytes() instead.
+*/
+int keyring_get_nm_bytes_async(const sid_t *known_sidp, const sid_t *unknown_sidp, void (*callback)(void *context), void *context)
+{
+  assert(keyring != NULL);
+  if (nm_cache_check_size() == -1)
+    return -1;
+  if (nm_cache_find(known_sidp, unknown_sidp))
+    return 1;
+
+  struct nm_work *work;
+  for (work = nm_pending; work; work = work->next)
+    if (cmp_sid_t(&work->known_key, known_sidp) == 0 && cmp_sid_t(&work->unknown_key, unknown_sidp) == 0)
+      break;
+  if (!work && nm_pending_count >= NM_MAX_PENDING)
+    return -1;
+
+  struct nm_waiter *w = emalloc_zero(sizeof(struct nm_waiter));
+  if (!w)
+    return -1;
+  w->callback = callback;
+  w->context = context;
+
+  int start = 0;
+  if (!work) {
+    if (!(work = nm_work_new(known_sidp, unknown_sidp))) {
+      free(w);
+      return -1;
+    }
+    work->item.completed = nm_work_completed;
+    work->next = nm_pending;
+    nm_pending = work;
+    nm_pending_count++;
+    start = 1;
+  }
+  *work->waiters_tail = w;
+  work->waiters_tail = &w->next;
+  // without worker threads, this calls back before returning
+  if (start)
+    queue_work(&work->item);
+  return 0;
+}
+
 static int cmp_identity_ptrs(const keyring_identity *const *a, const keyring_identity *const *b)
 {
   int c;
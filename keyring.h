@@ -70,12 +70,16 @@ typedef struct keyring_bam {
 } keyring_bam;
 
 #define KEYRING_MAX_CONTEXTS 256
+struct keyring_sid_slot;
 typedef struct keyring_file {
   unsigned context_count;
   keyring_bam *bam;
   keyring_context *contexts[KEYRING_MAX_CONTEXTS];
   FILE *file;
   off_t file_size;
+  // hash table from SID to the position of its key pair, rebuilt when sid_index_size is 0
+  struct keyring_sid_slot *sid_index;
+  unsigned sid_index_size;
 } keyring_file;
 
 void keyring_free(keyring_file *k);
@@ -116,6 +120,8 @@ int keyring_load(keyring_file *k, const char *keyring_pin, unsigned entry_pinc,
 int keyring_dump(keyring_file *k, XPRINTF xpf, int include_secret);
 
 unsigned char *keyring_get_nm_bytes(const sid_t *known_sidp, const sid_t *unknown_sidp);
+int keyring_has_nm_bytes(const sid_t *known_sidp, const sid_t *unknown_sidp);
+int keyring_get_nm_bytes_async(const sid_t *known_sidp, const sid_t *unknown_sidp, void (*callback)(void *context), void *context);
 
 int keyring_mapping_request(struct internal_mdp_header *header, struct overlay_buffer *payload);
 int keyring_send_unlock(struct subscriber *subscriber);
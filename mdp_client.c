@@ -18,6 +18,8 @@
  */
 
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include "serval.h"
 #include "conf.h"
 #include "log.h"
@@ -29,30 +31,53 @@
 #include "overlay_interface.h"
 #include "overlay_packet.h"
 #include "mdp_client.h"
+#include "mdp_ring.h"
 #include "socket.h"
 
-int mdp_socket(void)
+// shared memory rings set up by mdp_ring_open()
+struct mdp_client_ring{
+  struct mdp_client_ring *next;
+  int socket;
+  struct mdp_ring_shared *shared;
+  // we signal the daemon's fd, the daemon signals ours
+  int daemon_signal_fd;
+  int signal_fd;
+};
+
+static struct mdp_client_ring *client_rings=NULL;
+
+static struct mdp_client_ring *find_ring(int socket)
 {
-  // for now use the same process for creating sockets
-  return overlay_mdp_client_socket();
+  struct mdp_client_ring *ring = client_rings;
+  while(ring && ring->socket != socket)
+    ring = ring->next;
+  return ring;
 }
 
-int mdp_close(int socket)
+static void free_ring(int socket)
 {
-  // tell the daemon to drop all bindings
-  struct mdp_header header={
-    .flags = MDP_FLAG_CLOSE,
-    .local.port = 0,
-  };
-  
-  mdp_send(socket, &header, NULL, 0);
-  
-  // remove socket
-  socket_unlink_close(socket);
-  return 0;
+  struct mdp_client_ring **ptr = &client_rings;
+  while(*ptr){
+    struct mdp_client_ring *ring = *ptr;
+    if (ring->socket == socket){
+      *ptr = ring->next;
+      munmap(ring->shared, sizeof(struct mdp_ring_shared));
+      close(ring->daemon_signal_fd);
+      close(ring->signal_fd);
+      free(ring);
+      return;
+    }
+    ptr = &ring->next;
+  }
 }
 
-int mdp_send(int socket, const struct mdp_header *header, const uint8_t *payload, size_t len)
+int mdp_socket(void)
+{
+  // for now use the same process for creating sockets
+  return overlay_mdp_client_socket();
+}
+
+static int mdp_send_socket(int socket, const struct mdp_header *header, const uint8_t *payload, size_t len)
 {
   struct socket_address addr;
   if (make_local_sockaddr(&addr, "mdp.2.socket") == -1)
@@ -75,6 +100,38 @@ int mdp_send(int socket, const struct mdp_header *header, const uint8_t *payload
   return send_message(socket, &addr, &data);
 }
 
+int mdp_close(int socket)
+{
+  // tell the daemon to drop all bindings
+  struct mdp_header header={
+    .flags = MDP_FLAG_CLOSE,
+    .local.port = 0,
+  };
+  
+  // if the ring is full, the daemon also closes the ring when this arrives on the socket
+  if (mdp_send(socket, &header, NULL, 0) == -1 && find_ring(socket))
+    mdp_send_socket(socket, &header, NULL, 0);
+  
+  // remove socket
+  free_ring(socket);
+  socket_unlink_close(socket);
+  return 0;
+}
+
+int mdp_send(int socket, const struct mdp_header *header, const uint8_t *payload, size_t len)
+{
+  struct mdp_client_ring *ring = find_ring(socket);
+  if (ring){
+    // falling back to the socket could deliver this packet before those still in the ring
+    if (mdp_ring_write(&ring->shared->to_daemon, ring->daemon_signal_fd, header, payload, len) != 0){
+      errno = EAGAIN;
+      return -1;
+    }
+    return sizeof(struct mdp_header) + len;
+  }
+  return mdp_send_socket(socket, header, payload, len);
+}
+
 ssize_t mdp_recv(int socket, struct mdp_header *header, uint8_t *payload, ssize_t max_len)
 {
   /* Construct name of socket to receive from. */
@@ -102,9 +159,28 @@ ssize_t mdp_recv(int socket, struct mdp_header *header, uint8_t *payload, ssize_
     .msg_iovlen=2,
   };
   
-  ssize_t len = recvmsg(socket, &hdr, 0);
+  int flags = 0;
+  struct mdp_client_ring *ring = find_ring(socket);
+  if (ring){
+    ssize_t len = mdp_ring_read(&ring->shared->to_client, header, payload, max_len);
+    if (len == -1){
+      // about to go to sleep, so the daemon will signal us again
+      mdp_ring_clear_signal(ring->signal_fd);
+      len = mdp_ring_read(&ring->shared->to_client, header, payload, max_len);
+    }
+    if (len == -2)
+      return WHY("Invalid packet in MDP ring");
+    if (len >= 0)
+      return len;
+    // the daemon may have used the socket before the ring was set up, but don't wait for it
+    flags = MSG_DONTWAIT;
+  }
+  
+  ssize_t len = recvmsg(socket, &hdr, flags);
+  if (len == -1 && ring && (errno == EAGAIN || errno == EWOULDBLOCK))
+    return -1;
   if (len == -1)
-    return WHYF_perror("recvmsg(%d,%p,0)", socket, &hdr);
+    return WHYF_perror("recvmsg(%d,%p,%d)", socket, &hdr, flags);
   if ((size_t)len < sizeof(struct mdp_header))
     return WHYF("Received message is too short (%zu)", (size_t)len);
   addr.addrlen=hdr.msg_namelen;
@@ -123,7 +199,129 @@ ssize_t mdp_recv(int socket, struct mdp_header *header, uint8_t *payload, ssize_
 
 int mdp_poll(int socket, time_ms_t timeout_ms)
 {
-  return overlay_mdp_client_poll(socket, timeout_ms);
+  struct mdp_client_ring *ring = find_ring(socket);
+  if (!ring)
+    return overlay_mdp_client_poll(socket, timeout_ms);
+  if (!mdp_ring_empty(&ring->shared->to_client))
+    return 1;
+  // forget any wakeup for packets we have already read
+  mdp_ring_clear_signal(ring->signal_fd);
+  if (!mdp_ring_empty(&ring->shared->to_client))
+    return 1;
+  if (timeout_ms<0) timeout_ms=0;
+  struct pollfd fds[]={
+    {
+      .fd = ring->signal_fd,
+      .events = POLLIN,
+    },
+    {
+      .fd = socket,
+      .events = POLLIN|POLLERR,
+    }
+  };
+  return poll(fds, 2, timeout_ms);
+}
+
+int mdp_ring_open(int socket)
+{
+  if (find_ring(socket))
+    return find_ring(socket)->signal_fd;
+  
+  struct mdp_client_ring *ring = emalloc_zero(sizeof(struct mdp_client_ring));
+  if (!ring)
+    return -1;
+  ring->socket = socket;
+  ring->daemon_signal_fd = ring->signal_fd = -1;
+  ring->shared = MAP_FAILED;
+  int shm_fd = -1;
+  
+  if ((shm_fd = mdp_ring_shared_fd()) == -1)
+    goto error;
+  ring->shared = mmap(NULL, sizeof(struct mdp_ring_shared), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+  if (ring->shared == MAP_FAILED){
+    WHYF_perror("mmap(%d)", shm_fd);
+    goto error;
+  }
+  if ((ring->daemon_signal_fd = mdp_ring_signal_fd()) == -1
+    || (ring->signal_fd = mdp_ring_signal_fd()) == -1)
+    goto error;
+  
+  // pass the ring to the daemon
+  struct socket_address addr;
+  if (make_local_sockaddr(&addr, "mdp.2.socket") == -1)
+    goto error;
+  struct mdp_header header;
+  bzero(&header, sizeof header);
+  header.remote.sid = SID_ANY;
+  header.remote.port = MDP_RING;
+  struct iovec iov[]={
+    {
+      .iov_base = (void*)&header,
+      .iov_len = sizeof header
+    }
+  };
+  int fds[3] = {shm_fd, ring->daemon_signal_fd, ring->signal_fd};
+  union {
+    struct cmsghdr header;
+    uint8_t buff[CMSG_SPACE(sizeof fds)];
+  } control;
+  bzero(&control, sizeof control);
+  struct msghdr hdr={
+    .msg_name=&addr.addr,
+    .msg_namelen=addr.addrlen,
+    .msg_iov=iov,
+    .msg_iovlen=1,
+    .msg_control=control.buff,
+    .msg_controllen=sizeof control.buff,
+  };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+  if (sendmsg(socket, &hdr, 0) == -1){
+    WHYF_perror("sendmsg(%d)", socket);
+    goto error;
+  }
+  close(shm_fd);
+  shm_fd = -1;
+  
+  // wait for the daemon to accept it
+  time_ms_t timeout = gettime_ms() + 1000;
+  while(1){
+    time_ms_t now = gettime_ms();
+    if (now >= timeout || overlay_mdp_client_poll(socket, timeout - now) <= 0){
+      WHY("Timeout waiting for the daemon to accept the MDP ring");
+      goto error;
+    }
+    struct mdp_header reply;
+    uint8_t payload[MDP_MTU];
+    if (mdp_recv(socket, &reply, payload, sizeof payload) == -1)
+      goto error;
+    if (reply.remote.port != MDP_RING || !is_sid_t_any(reply.remote.sid))
+      continue;
+    if (reply.flags & MDP_FLAG_ERROR){
+      WHY("The daemon refused the MDP ring");
+      goto error;
+    }
+    break;
+  }
+  
+  ring->next = client_rings;
+  client_rings = ring;
+  return ring->signal_fd;
+  
+error:
+  if (shm_fd != -1)
+    close(shm_fd);
+  if (ring->shared != MAP_FAILED)
+    munmap(ring->shared, sizeof(struct mdp_ring_shared));
+  if (ring->daemon_signal_fd != -1)
+    close(ring->daemon_signal_fd);
+  if (ring->signal_fd != -1)
+    close(ring->signal_fd);
+  free(ring);
+  return -1;
 }
 
 int overlay_mdp_send(int mdp_sockfd, overlay_mdp_frame *mdp, int flags, int timeout_ms)
@@ -65,6 +65,11 @@ struct mdp_header {
 */
 #define MDP_SEARCH_IDS 2
 
+/* Switch this client to a shared memory transport, see mdp_ring_open()
+ * The request has no payload, and carries a shared memory fd and two eventfds
+*/
+#define MDP_RING 3
+
 // an identity request is sent to port MDP_IDENTITY, sid ANY
 struct mdp_identity_request{
   uint8_t action;
@@ -128,6 +133,13 @@ int mdp_close(int socket);
 int mdp_send(int socket, const struct mdp_header *header, const uint8_t *payload, size_t len);
 ssize_t mdp_recv(int socket, struct mdp_header *header, uint8_t *payload, ssize_t max_len);
 int mdp_poll(int socket, time_ms_t timeout_ms);
+/* Exchange packets with the daemon through shared memory instead of the socket.
+ * Returns a file descriptor to poll instead of the socket, or -1 if the daemon or platform
+ * doesn't support it. Afterwards mdp_recv() returns -1 with errno EAGAIN when there is nothing to read,
+ * and mdp_send() returns -1 with errno EAGAIN when the ring is full, like a full non-blocking socket.
+ * Packets are never sent through the socket instead, so they stay in order.
+ */
+int mdp_ring_open(int socket);
 
 
 
@@ -38,9 +38,31 @@ struct packet_rule{
   mdp_port_t dst_start;
   mdp_port_t dst_end;
   uint8_t flags;
+  // position in the rule list, when several rules match the first one wins
+  unsigned sequence;
   struct packet_rule *next;
+  // next rule in the same index chain
+  struct packet_rule *_next_indexed;
 };
-struct packet_rule *global_rules = NULL;
+
+/* An ordered list of rules, compiled on first use into chains of rules indexed by destination
+ * subscriber or by a single destination port. Rules that fit neither (wildcards and port ranges)
+ * are kept in one more chain, so a packet only needs to be compared with the rules in three short
+ * chains. Each chain stays in rule order, so we can stop looking as soon as we pass a rule that
+ * has already matched.
+ */
+struct packet_rules{
+  struct packet_rule *first;
+  struct packet_rule *last;
+  unsigned count;
+  // number of index buckets, a power of 2, or 0 if the rules have changed since they were compiled
+  unsigned index_size;
+  struct packet_rule **by_destination;
+  struct packet_rule **by_port;
+  struct packet_rule *others;
+};
+
+static struct packet_rules global_rules;
 
 static int match_rule(struct internal_mdp_header *header, struct packet_rule *rule)
 {
@@ -54,6 +76,108 @@ static int match_rule(struct internal_mdp_header *header, struct packet_rule *ru
   if ((rule->flags & RULE_DST_PORT) && 
       (header->destination_port < rule->dst_start||header->destination_port > rule->dst_end))
     return 0;
+  return 1;
+}
+
+static unsigned destination_bucket(struct packet_rules *rules, struct subscriber *destination)
+{
+  return ((unsigned)((uintptr_t)destination >> 4) * 2654435761u) & (rules->index_size - 1);
+}
+
+static unsigned port_bucket(struct packet_rules *rules, mdp_port_t port)
+{
+  return (port * 2654435761u) & (rules->index_size - 1);
+}
+
+static void uncompile_rules(struct packet_rules *rules)
+{
+  if (rules->by_destination)
+    free(rules->by_destination);
+  if (rules->by_port)
+    free(rules->by_port);
+  rules->by_destination = rules->by_port = NULL;
+  rules->others = NULL;
+  rules->index_size = 0;
+}
+
+static int compile_rules(struct packet_rules *rules)
+{
+  unsigned size = 16;
+  while (size < rules->count)
+    size <<= 1;
+  rules->by_destination = emalloc_zero(size * sizeof(struct packet_rule *));
+  rules->by_port = emalloc_zero(size * sizeof(struct packet_rule *));
+  // the tail of every chain, so we can append rules in order
+  struct packet_rule ***tails = emalloc((size * 2 + 1) * sizeof(struct packet_rule **));
+  if (!rules->by_destination || !rules->by_port || !tails){
+    uncompile_rules(rules);
+    if (tails)
+      free(tails);
+    return -1;
+  }
+  rules->index_size = size;
+  unsigned i;
+  for (i = 0; i < size; i++){
+    tails[i] = &rules->by_destination[i];
+    tails[size + i] = &rules->by_port[i];
+  }
+  tails[size * 2] = &rules->others;
+  
+  struct packet_rule *rule;
+  for (rule = rules->first; rule; rule = rule->next){
+    unsigned chain;
+    if (rule->flags & RULE_DESTINATION)
+      chain = destination_bucket(rules, rule->destination);
+    else if ((rule->flags & RULE_DST_PORT) && rule->dst_start == rule->dst_end)
+      chain = size + port_bucket(rules, rule->dst_start);
+    else
+      chain = size * 2;
+    rule->_next_indexed = NULL;
+    *tails[chain] = rule;
+    tails[chain] = &rule->_next_indexed;
+  }
+  free(tails);
+  return 0;
+}
+
+// find the first rule in this chain that matches, if it comes before the best match so far
+static struct packet_rule *first_match(struct packet_rule *rule, struct internal_mdp_header *header, struct packet_rule *best)
+{
+  for (; rule; rule = rule->_next_indexed){
+    if (best && rule->sequence > best->sequence)
+      break;
+    if (match_rule(header, rule))
+      return rule;
+  }
+  return best;
+}
+
+static struct packet_rule *find_rule(struct packet_rules *rules, struct internal_mdp_header *header)
+{
+  if (!rules->count)
+    return NULL;
+  if (!rules->index_size && compile_rules(rules) == -1){
+    // we can still filter packets the slow way
+    struct packet_rule *rule;
+    for (rule = rules->first; rule; rule = rule->next)
+      if (match_rule(header, rule))
+	return rule;
+    return NULL;
+  }
+  struct packet_rule *best = first_match(rules->by_destination[destination_bucket(rules, header->destination)], header, NULL);
+  best = first_match(rules->by_port[port_bucket(rules, header->destination_port)], header, best);
+  return first_match(rules->others, header, best);
+}
+
+int allow_incoming_packet(struct internal_mdp_header *header)
+{
+  struct packet_rule *rule = NULL;
+  if (header->source->source_rules)
+    rule = find_rule(header->source->source_rules, header);
+  if (!rule)
+    rule = find_rule(&global_rules, header);
+  if (!rule)
+    return RULE_ALLOW;
   if (config.debug.mdprequests)
     DEBUGF("Packet matches %s rule, flags:%s%s%s%s", 
       rule->flags & RULE_DROP ? "DROP" : "ALLOW",
@@ -61,47 +185,67 @@ static int match_rule(struct internal_mdp_header *header, struct packet_rule *ru
       rule->flags & RULE_DESTINATION ? " DESTINATION" : "",
       rule->flags & RULE_SRC_PORT? " SOURCE_PORT" : "",
       rule->flags & RULE_DST_PORT ? " DESTINATION_PORT" : "");
-  return 1;
+  return rule->flags & RULE_DROP;
 }
 
-int allow_incoming_packet(struct internal_mdp_header *header)
+// append a rule, rules for a single source are kept with that subscriber and take precedence
+static int add_rule(uint8_t flags, struct subscriber *source, struct subscriber *destination,
+  mdp_port_t src_start, mdp_port_t src_end, mdp_port_t dst_start, mdp_port_t dst_end)
 {
-  struct packet_rule *rule = header->source->source_rules;
-  while(rule){
-    if (match_rule(header, rule))
-      return rule->flags & RULE_DROP;
-    rule = rule->next;
+  struct packet_rules *rules = &global_rules;
+  if (flags & RULE_SOURCE){
+    if (!source->source_rules && !(source->source_rules = emalloc_zero(sizeof(struct packet_rules))))
+      return -1;
+    rules = source->source_rules;
   }
-  rule = global_rules;
-  while(rule){
-    if (match_rule(header, rule))
-      return rule->flags & RULE_DROP;
-    rule = rule->next;
-  }
-  return RULE_ALLOW;
+  struct packet_rule *rule = emalloc_zero(sizeof(struct packet_rule));
+  if (!rule)
+    return -1;
+  rule->flags = flags;
+  rule->source = add_subscriber_ref(source);
+  rule->destination = add_subscriber_ref(destination);
+  rule->src_start = src_start;
+  rule->src_end = src_end;
+  rule->dst_start = dst_start;
+  rule->dst_end = dst_end;
+  rule->sequence = rules->count++;
+  if (rules->last)
+    rules->last->next = rule;
+  else
+    rules->first = rule;
+  rules->last = rule;
+  uncompile_rules(rules);
+  return 0;
 }
 
-static void free_rule_list(struct packet_rule *rule)
+static void free_rules(struct packet_rules *rules)
 {
+  struct packet_rule *rule = rules->first;
   while(rule){
     struct packet_rule *t = rule;
     rule = rule->next;
+    release_subscriber_ref(t->source);
+    release_subscriber_ref(t->destination);
     free(t);
   }
+  uncompile_rules(rules);
+  bzero(rules, sizeof *rules);
 }
 
 static int drop_rule(struct subscriber *subscriber, void *UNUSED(context))
 {
-  free_rule_list(subscriber->source_rules);
-  subscriber->source_rules=NULL;
+  if (subscriber->source_rules){
+    free_rules(subscriber->source_rules);
+    free(subscriber->source_rules);
+    subscriber->source_rules=NULL;
+  }
   return 0;
 }
 
 void load_mdp_packet_rules(const char *UNUSED(filename))
 {
   // drop all existing rules
-  free_rule_list(global_rules);
-  global_rules=NULL;
+  free_rules(&global_rules);
   enum_subscribers(NULL, drop_rule, NULL);
   
   // TODO parse config [file]?
@@ -117,3 +261,108 @@ void load_mdp_packet_rules(const char *UNUSED(filename))
    * 
    * */
 }
+
+// the rules that would apply without compiling them, to check the compiled rules against
+static int linear_allow(struct internal_mdp_header *header)
+{
+  struct packet_rules *lists[2] = {header->source->source_rules, &global_rules};
+  unsigned i;
+  for (i = 0; i < 2; i++){
+    struct packet_rule *rule;
+    for (rule = lists[i] ? lists[i]->first : NULL; rule; rule = rule->next)
+      if (match_rule(header, rule))
+	return rule->flags & RULE_DROP;
+  }
+  return RULE_ALLOW;
+}
+
+int app_filter_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const unsigned node_count = 1000;
+  const unsigned packet_count = 20000;
+  const unsigned rounds = 50;
+  const unsigned rule_counts[] = {10, 100, 1000, 10000};
+  struct subscriber *nodes[node_count];
+  struct internal_mdp_header *headers = NULL;
+  uint8_t *decisions = NULL;
+  int status = -1;
+  unsigned i, j, r;
+  for (i = 0; i < node_count; i++){
+    sid_t sid;
+    urandombytes(sid.binary, sizeof sid.binary);
+    if ((nodes[i] = find_subscriber(sid.binary, sizeof sid.binary, 1)) == NULL)
+      goto end;
+  }
+  headers = emalloc_zero(packet_count * sizeof(struct internal_mdp_header));
+  decisions = emalloc(packet_count);
+  if (!headers || !decisions)
+    goto end;
+  for (i = 0; i < packet_count; i++){
+    headers[i].source = nodes[random() % node_count];
+    // some broadcasts
+    headers[i].destination = random() % 8 ? nodes[random() % node_count] : NULL;
+    headers[i].source_port = random() % 1024;
+    headers[i].destination_port = random() % 1024;
+  }
+  
+  for (j = 0; j < NELS(rule_counts); j++){
+    load_mdp_packet_rules(NULL);
+    for (i = 0; i < rule_counts[j]; i++){
+      mdp_port_t port = random() % 1024;
+      struct subscriber *node = nodes[random() % node_count];
+      int ret;
+      switch (i % 4){
+	case 0:
+	  ret = add_rule(RULE_DROP|RULE_SOURCE|RULE_DST_PORT, node, NULL, 0, 0, port, port);
+	  break;
+	case 1:
+	  ret = add_rule(RULE_DROP|RULE_DESTINATION, NULL, node, 0, 0, 0, 0);
+	  break;
+	case 2:
+	  // mostly single ports, with the occasional range
+	  ret = add_rule(RULE_DROP|RULE_DST_PORT, NULL, NULL, 0, 0, port, i % 100 == 2 ? port + 10 : port);
+	  break;
+	default:
+	  ret = add_rule(RULE_ALLOW|RULE_SOURCE|RULE_SRC_PORT, node, NULL, port, port + 100, 0, 0);
+	  break;
+      }
+      if (ret == -1)
+	goto end;
+    }
+    
+    unsigned dropped = 0;
+    time_ms_t start = gettime_ms();
+    for (r = 0; r < rounds; r++)
+      for (i = 0; i < packet_count; i++)
+	decisions[i] = allow_incoming_packet(&headers[i]);
+    time_ms_t compiled = gettime_ms() - start;
+    
+    unsigned differences = 0;
+    start = gettime_ms();
+    for (i = 0; i < packet_count; i++){
+      int decision = linear_allow(&headers[i]);
+      if (decision != decisions[i])
+	differences++;
+      if (decision == RULE_DROP)
+	dropped++;
+    }
+    time_ms_t linear = gettime_ms() - start;
+    
+    cli_printf(context, "%u rules: %.0f packets per second compiled, %.0f packets per second linear, %u of %u dropped, %u decisions differ\n",
+      rule_counts[j],
+      compiled ? rounds * packet_count * 1000.0 / compiled : 0.0,
+      linear ? packet_count * 1000.0 / linear : 0.0,
+      dropped, packet_count, differences);
+  }
+  status = 0;
+end:
+  // drop the rule chains we compiled
+  load_mdp_packet_rules(NULL);
+  if (headers)
+    free(headers);
+  if (decisions)
+    free(decisions);
+  return status;
+}
@@ -20,7 +20,32 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "conf.h"
 #include "log.h"
 
-ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl, struct socket_address *recvaddr)
+/* Pull the IP TTL out of the ancillary data of a received datagram.
+ */
+static void recv_ttl(struct msghdr *msg, int *ttl)
+{
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (   cmsg->cmsg_level == IPPROTO_IP
+	&& ((cmsg->cmsg_type == IP_RECVTTL) || (cmsg->cmsg_type == IP_TTL))
+	&& cmsg->cmsg_len
+    ) {
+      if (config.debug.packetrx)
+	DEBUGF("  TTL (%p) data location resolves to %p", ttl,CMSG_DATA(cmsg));
+      if (CMSG_DATA(cmsg)) {
+	*ttl = *(unsigned char *) CMSG_DATA(cmsg);
+	if (config.debug.packetrx)
+	  DEBUGF("  TTL of packet is %d", *ttl);
+      } 
+    } else {
+      if (config.debug.packetrx)
+	DEBUGF("I didn't expect to see level=%02x, type=%02x",
+	       cmsg->cmsg_level,cmsg->cmsg_type);
+    }	 
+  }
+}
+
+static ssize_t _recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl, struct socket_address *recvaddr, int flags)
 {
   struct msghdr msg;
   struct iovec iov[1];
@@ -36,9 +61,9 @@ ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl, s
   msg.msg_controllen = sizeof cmsgcmsg;
   msg.msg_flags = 0;
   
-  ssize_t len = recvmsg(sock,&msg,0);
+  ssize_t len = recvmsg(sock,&msg,flags);
   if (len == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
-    return WHYF_perror("recvmsg(%d,%p,0)", sock, &msg);
+    return WHYF_perror("recvmsg(%d,%p,%d)", sock, &msg, flags);
   
 #if 0
   if (config.debug.packetrx) {
@@ -47,28 +72,71 @@ ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl, s
   }
 #endif
   
-  if (len > 0) {
-    struct cmsghdr *cmsg;
-    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
-      if (   cmsg->cmsg_level == IPPROTO_IP
-	  && ((cmsg->cmsg_type == IP_RECVTTL) || (cmsg->cmsg_type == IP_TTL))
-	  && cmsg->cmsg_len
-      ) {
-	if (config.debug.packetrx)
-	  DEBUGF("  TTL (%p) data location resolves to %p", ttl,CMSG_DATA(cmsg));
-	if (CMSG_DATA(cmsg)) {
-	  *ttl = *(unsigned char *) CMSG_DATA(cmsg);
-	  if (config.debug.packetrx)
-	    DEBUGF("  TTL of packet is %d", *ttl);
-	} 
-      } else {
-	if (config.debug.packetrx)
-	  DEBUGF("I didn't expect to see level=%02x, type=%02x",
-		 cmsg->cmsg_level,cmsg->cmsg_type);
-      }	 
-    }
-  }
+  if (len > 0)
+    recv_ttl(&msg, ttl);
   recvaddr->addrlen = msg.msg_namelen;
   
   return len;
 }
+
+ssize_t recvwithttl(int sock,unsigned char *buffer, size_t bufferlen,int *ttl, struct socket_address *recvaddr)
+{
+  return _recvwithttl(sock, buffer, bufferlen, ttl, recvaddr, 0);
+}
+
+/* Read up to count datagrams from a non-blocking read of sock, using a single recvmmsg(2) system
+ * call where the platform has one.  The caller fills in the buffer and bufferlen of each slot; the
+ * length, TTL and source address of each datagram read are filled in here.  Returns the number of
+ * slots filled, which is zero if nothing was waiting, or -1 on error.
+ */
+int recvwithttl_batch(int sock, struct recv_slot *slots, unsigned count)
+{
+  if (count > RECV_BATCH_MAX)
+    count = RECV_BATCH_MAX;
+  unsigned i;
+#ifdef HAVE_RECVMMSG
+  struct mmsghdr msgs[count];
+  struct iovec iov[count];
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int)) * 2];
+  } control[count];
+  for (i = 0; i < count; ++i) {
+    iov[i].iov_base = slots[i].buffer;
+    iov[i].iov_len = slots[i].bufferlen;
+    bzero(&msgs[i], sizeof msgs[i]);
+    msgs[i].msg_hdr.msg_name = &slots[i].recvaddr.store;
+    msgs[i].msg_hdr.msg_namelen = sizeof slots[i].recvaddr.store;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = control[i].buf;
+    msgs[i].msg_hdr.msg_controllen = sizeof control[i].buf;
+  }
+  int n = recvmmsg(sock, msgs, count, MSG_DONTWAIT, NULL);
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      return 0;
+    return WHYF_perror("recvmmsg(%d,%p,%u,MSG_DONTWAIT,NULL)", sock, msgs, count);
+  }
+  for (i = 0; i < (unsigned)n; ++i) {
+    slots[i].len = msgs[i].msg_len;
+    slots[i].ttl = 1;
+    recv_ttl(&msgs[i].msg_hdr, &slots[i].ttl);
+    slots[i].recvaddr.addrlen = msgs[i].msg_hdr.msg_namelen;
+  }
+  return n;
+#else
+  for (i = 0; i < count; ++i) {
+    slots[i].ttl = 1;
+    slots[i].recvaddr.addrlen = sizeof slots[i].recvaddr.store;
+    slots[i].len = _recvwithttl(sock, slots[i].buffer, slots[i].bufferlen, &slots[i].ttl, &slots[i].recvaddr, MSG_DONTWAIT);
+    if (slots[i].len == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	break;
+      // report the datagrams we already have, the error will recur on the next read
+      return i ? (int)i : -1;
+    }
+  }
+  return i;
+#endif
+}
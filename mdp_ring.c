@@ -0,0 +1,160 @@
+/*
+ Copyright (C) 2014 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#include "serval.h"
+#include "mdp_client.h"
+#include "mdp_ring.h"
+
+#define RECORD_HEADER_LEN (sizeof(uint32_t) + sizeof(struct mdp_header))
+
+static void ring_copy_in(struct mdp_ring *ring, uint32_t offset, const void *src, size_t len)
+{
+  offset &= MDP_RING_SIZE - 1;
+  size_t first = MDP_RING_SIZE - offset;
+  if (first > len)
+    first = len;
+  memcpy(&ring->data[offset], src, first);
+  memcpy(&ring->data[0], (const uint8_t *)src + first, len - first);
+}
+
+static void ring_copy_out(struct mdp_ring *ring, uint32_t offset, void *dst, size_t len)
+{
+  offset &= MDP_RING_SIZE - 1;
+  size_t first = MDP_RING_SIZE - offset;
+  if (first > len)
+    first = len;
+  memcpy(dst, &ring->data[offset], first);
+  memcpy((uint8_t *)dst + first, &ring->data[0], len - first);
+}
+
+int mdp_ring_write(struct mdp_ring *ring, int signal_fd, const struct mdp_header *header,
+  const uint8_t *payload, size_t len)
+{
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (len > MDP_MTU || RECORD_HEADER_LEN + len > MDP_RING_SIZE - (head - tail))
+    return 1;
+  uint32_t record_len = len;
+  ring_copy_in(ring, head, &record_len, sizeof record_len);
+  ring_copy_in(ring, head + sizeof record_len, header, sizeof(struct mdp_header));
+  ring_copy_in(ring, head + RECORD_HEADER_LEN, payload, len);
+  __atomic_store_n(&ring->head, head + RECORD_HEADER_LEN + len, __ATOMIC_SEQ_CST);
+  // if the reader has already caught up with us, it may be about to sleep
+  if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head)
+    mdp_ring_signal(signal_fd);
+  return 0;
+}
+
+int mdp_ring_empty(struct mdp_ring *ring)
+{
+  return __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == ring->tail;
+}
+
+ssize_t mdp_ring_read(struct mdp_ring *ring, struct mdp_header *header, uint8_t *payload, size_t max_len)
+{
+  uint32_t tail = ring->tail;
+  uint32_t available = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+  if (available == 0)
+    return -1;
+  // don't trust the other process to have written a sensible record
+  uint32_t record_len;
+  if (available < RECORD_HEADER_LEN || available > MDP_RING_SIZE)
+    return -2;
+  ring_copy_out(ring, tail, &record_len, sizeof record_len);
+  if (record_len > MDP_MTU || RECORD_HEADER_LEN + record_len > available)
+    return -2;
+  ring_copy_out(ring, tail + sizeof record_len, header, sizeof(struct mdp_header));
+  size_t len = record_len < max_len ? record_len : max_len;
+  ring_copy_out(ring, tail + RECORD_HEADER_LEN, payload, len);
+  __atomic_store_n(&ring->tail, tail + RECORD_HEADER_LEN + record_len, __ATOMIC_SEQ_CST);
+  return len;
+}
+
+void mdp_ring_signal(int signal_fd)
+{
+  uint64_t one = 1;
+  if (write(signal_fd, &one, sizeof one) == -1 && errno != EAGAIN)
+    WHYF_perror("write(%d)", signal_fd);
+}
+
+void mdp_ring_clear_signal(int signal_fd)
+{
+  uint64_t count;
+  if (read(signal_fd, &count, sizeof count) == -1 && errno != EAGAIN)
+    WHYF_perror("read(%d)", signal_fd);
+}
+
+int mdp_ring_signal_fd()
+{
+#ifdef HAVE_SYS_EVENTFD_H
+  int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (fd == -1)
+    return WHY_perror("eventfd");
+  return fd;
+#else
+  return WHY("Shared memory MDP transport is not supported on this platform");
+#endif
+}
+
+#if defined(HAVE_MEMFD_CREATE) && defined(F_ADD_SEALS)
+#define MDP_RING_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+#endif
+
+int mdp_ring_shared_fd()
+{
+#ifdef MDP_RING_SEALS
+  int fd = memfd_create("serval-mdp-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+    return WHY_perror("memfd_create");
+  if (ftruncate(fd, sizeof(struct mdp_ring_shared)) == -1){
+    WHYF_perror("ftruncate(%d)", fd);
+    goto error;
+  }
+  if (fcntl(fd, F_ADD_SEALS, MDP_RING_SEALS) == -1){
+    WHYF_perror("fcntl(%d, F_ADD_SEALS)", fd);
+    goto error;
+  }
+  return fd;
+error:
+  close(fd);
+  return -1;
+#else
+  return WHY("Shared memory MDP transport is not supported on this platform");
+#endif
+}
+
+int mdp_ring_is_sealed(int fd)
+{
+#ifdef MDP_RING_SEALS
+  int seals = fcntl(fd, F_GET_SEALS);
+  if (seals == -1)
+    return 0;
+  return (seals & MDP_RING_SEALS) == MDP_RING_SEALS;
+#else
+  return 0;
+#endif
+}
@@ -0,0 +1,67 @@
+/*
+ Copyright (C) 2014 Serval Project Inc.
+
+ This program is free software; you can redistribute it and/or
+ modify it under the terms of the GNU General Public License
+ as published by the Free Software Foundation; either version 2
+ of the License, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program; if not, write to the Free Software
+ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __SERVAL_DNA__MDP_RING_H
+#define __SERVAL_DNA__MDP_RING_H
+
+/* Shared memory transport between the daemon and a local MDP client.
+ *
+ * A client that calls mdp_ring_open() creates a sealed memfd holding one ring in each
+ * direction, and an eventfd for each reader, and passes them to the daemon over its MDP socket.
+ * From then on each packet is copied once into the ring instead of being passed through the
+ * kernel. Each ring has a single writer and a single reader. The writer only signals the reader's
+ * eventfd when the reader may have found the ring empty, so a burst of packets costs one wakeup.
+ * Neither side falls back to the socket when a ring is full, as that could reorder packets. The
+ * daemon drops the packet, as it would for a full socket, and the client's mdp_send() fails with EAGAIN.
+ *
+ * Each record is a 32 bit payload length, a struct mdp_header, then the payload.
+ */
+
+#define MDP_RING_SIZE (256*1024)
+
+struct mdp_ring{
+  // bytes ever written and read, the difference is the number of bytes in the ring
+  uint32_t head;
+  uint8_t _pad_head[60];
+  uint32_t tail;
+  uint8_t _pad_tail[60];
+  uint8_t data[MDP_RING_SIZE];
+};
+
+struct mdp_ring_shared{
+  struct mdp_ring to_daemon;
+  struct mdp_ring to_client;
+};
+
+// returns 0 on success, 1 if there is no room for this packet
+int mdp_ring_write(struct mdp_ring *ring, int signal_fd, const struct mdp_header *header,
+  const uint8_t *payload, size_t len);
+// returns the length of the payload (truncated to max_len), -1 if the ring is empty,
+// or -2 if the ring contents are invalid
+ssize_t mdp_ring_read(struct mdp_ring *ring, struct mdp_header *header, uint8_t *payload, size_t max_len);
+int mdp_ring_empty(struct mdp_ring *ring);
+void mdp_ring_signal(int signal_fd);
+// clear any pending wakeup, the ring must be checked again afterwards
+void mdp_ring_clear_signal(int signal_fd);
+int mdp_ring_signal_fd();
+// create the shared memory for a ring, sealed so that neither process can change its size
+int mdp_ring_shared_fd();
+// the daemon only maps rings that the client can't truncate underneath it
+int mdp_ring_is_sealed(int fd);
+
+#endif
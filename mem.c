@@ -61,6 +61,42 @@ char *_str_edup(struct __sourceloc __whence, const char *str)
   return _strn_edup(__whence, str, strlen(str));
 }
 
+void *_pool_alloc(struct __sourceloc __whence, struct mem_pool *pool)
+{
+  void *new = pool->free_list;
+  if (new) {
+    pool->free_list = *(void **)new;
+    pool->free_count--;
+    pool->reused++;
+  } else if ((new = _emalloc(__whence, pool->size)) == NULL)
+    return NULL;
+  pool->allocs++;
+  if (++pool->in_use > pool->peak_in_use)
+    pool->peak_in_use = pool->in_use;
+  return new;
+}
+
+void *_pool_alloc_zero(struct __sourceloc __whence, struct mem_pool *pool)
+{
+  char *new = _pool_alloc(__whence, pool);
+  if (new)
+    memset(new, 0, pool->size);
+  return new;
+}
+
+void pool_free(struct mem_pool *pool, void *ptr)
+{
+  if (pool->in_use)
+    pool->in_use--;
+  if (pool->free_count >= pool->max_free) {
+    free(ptr);
+    return;
+  }
+  *(void **)ptr = pool->free_list;
+  pool->free_list = ptr;
+  pool->free_count++;
+}
+
 #undef malloc
 #undef calloc
 #undef free
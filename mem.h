@@ -63,10 +63,40 @@ void *_emalloc_zero(struct __sourceloc, size_t bytes);
 char *_str_edup(struct __sourceloc, const char *str);
 char *_strn_edup(struct __sourceloc, const char *str, size_t len);
 
+/* A free list of equally sized blocks, so that objects which are created and destroyed for every
+ * packet don't have to go through malloc(3) and free(3) each time.  Blocks are allocated
+ * individually, so a block from a pool may always be released with free(3) instead, and any
+ * malloc(3) block of the right size may be given to pool_free().  At most max_free idle blocks
+ * are kept.
+ */
+struct mem_pool {
+  const char *name;
+  size_t size;
+  unsigned max_free;
+  void *free_list;
+  unsigned free_count;
+  // statistics
+  unsigned in_use;
+  unsigned peak_in_use;
+  unsigned long allocs;
+  unsigned long reused;
+};
+
+#define MEM_POOL_INIT(NAME, SIZE, MAX_FREE) { .name = (NAME), .size = (SIZE), .max_free = (MAX_FREE) }
+
+/* Equivalent to emalloc() / emalloc_zero() of pool->size bytes, re-using an idle block if there
+ * is one.
+ */
+void *_pool_alloc(struct __sourceloc, struct mem_pool *pool);
+void *_pool_alloc_zero(struct __sourceloc, struct mem_pool *pool);
+void pool_free(struct mem_pool *pool, void *ptr);
+
 #define emalloc(bytes)       _emalloc(__HERE__, (bytes))
 #define erealloc(ptr, bytes) _erealloc(__HERE__, (ptr), (bytes))
 #define emalloc_zero(bytes)  _emalloc_zero(__HERE__, (bytes))
 #define str_edup(str)        _str_edup(__HERE__, (str))
 #define strn_edup(str, len)  _strn_edup(__HERE__, (str), (len))
+#define pool_alloc(pool)     _pool_alloc(__HERE__, (pool))
+#define pool_alloc_zero(pool) _pool_alloc_zero(__HERE__, (pool))
 
 #endif // __SERVAL_DNA__MEM_H
@@ -101,6 +101,16 @@ __SERVAL_DNA__OS_INLINE off64_t lseek64(int fd, off64_t offset, int whence) {
 # endif
 #endif
 
+/* If there is no pread64(2) system call, then seek and read instead.
+ */
+#ifndef HAVE_PREAD64
+__SERVAL_DNA__OS_INLINE ssize_t pread64(int fd, void *buf, size_t count, off64_t offset) {
+    if (lseek64(fd, offset, SEEK_SET) == -1)
+	return -1;
+    return read(fd, buf, count);
+}
+#endif
+
 /* The "e" variants log the error before returning -1.
  */
 typedef void MKDIR_LOG_FUNC(struct __sourceloc, const char *, mode_t);
@@ -154,6 +154,9 @@ schedule(&_sched_##X); }
   /* Calculate (and possibly show) CPU usage stats periodically */
   SCHEDULE(fd_periodicstats, 3000, 500);
 
+  /* Periodically forget idle subscribers */
+  SCHEDULE(subscriber_cleanup, SUBSCRIBER_CLEANUP_INTERVAL_MS, 10000);
+
 #undef SCHEDULE
 
   // log message used by tests to wait for the server to start
@@ -31,14 +31,33 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
+#include "strbuf.h"
 #include "overlay_address.h"
 #include "overlay_buffer.h"
 #include "overlay_interface.h"
 #include "overlay_packet.h"
 
-#define MAX_BPIS 1024
-#define BPI_MASK 0x3ff
-static struct broadcast bpilist[MAX_BPIS];
+// number of neighbouring slots that may hold a BPI
+#define BPI_PROBE 8
+
+struct bpi_slot{
+  struct broadcast id;
+  // when we first saw this BPI, zero for an empty slot
+  time_ms_t seen;
+};
+
+struct broadcast_stats{
+  unsigned new;
+  unsigned duplicates;
+  // BPIs that were replaced before they expired, their floods may be forwarded again
+  unsigned evicted_early;
+};
+
+static struct bpi_table{
+  struct bpi_slot *slots;
+  unsigned size;
+  struct broadcast_stats stats;
+} bpi_table;
 
 #define OA_CODE_SELF 0xff
 #define OA_CODE_PREVIOUS 0xfe
@@ -47,17 +66,25 @@ static struct broadcast bpilist[MAX_BPIS];
 
 // each node has 16 slots based on the next 4 bits of a subscriber id
 // each slot either points to another tree node or a struct subscriber.
+// Only occupied slots are stored, in slot order, so most nodes near the leaves are small.
 struct tree_node{
   // bit flags for the type of object each element points to
   uint16_t is_tree;
+  // bit flags for the slots that are occupied
+  uint16_t present;
+  // number of children we have room for
+  uint8_t capacity;
   
-  union{
-    struct tree_node *tree_nodes[16];
-    struct subscriber *subscribers[16];
-  };
+  void *children[];
 };
 
-static struct tree_node root;
+static struct tree_node *root=NULL;
+
+// memory usage of the subscriber tree
+static unsigned tree_node_count=0;
+static size_t tree_node_bytes=0;
+static unsigned subscriber_count=0;
+static unsigned long subscribers_evicted=0;
 
 struct subscriber *my_subscriber=NULL;
 
@@ -69,6 +96,67 @@ static unsigned char get_nibble(const unsigned char *sidp, int pos)
   return byte&0xF;
 }
 
+// index of the given slot in the list of children
+static unsigned child_index(const struct tree_node *node, unsigned nibble)
+{
+  return __builtin_popcount(node->present & ((1<<nibble) - 1));
+}
+
+static struct tree_node *alloc_node(unsigned capacity)
+{
+  size_t size = sizeof(struct tree_node) + capacity * sizeof(void *);
+  struct tree_node *node = (struct tree_node *) emalloc_zero(size);
+  if (node){
+    node->capacity = capacity;
+    tree_node_count++;
+    tree_node_bytes += size;
+  }
+  return node;
+}
+
+static void free_node(struct tree_node *node)
+{
+  tree_node_count--;
+  tree_node_bytes -= sizeof(struct tree_node) + node->capacity * sizeof(void *);
+  free(node);
+}
+
+// insert a child into the empty slot, growing the node (and updating *nodep) if required
+static int insert_child(struct tree_node **nodep, unsigned nibble, void *child, int is_tree)
+{
+  struct tree_node *node = *nodep;
+  unsigned count = __builtin_popcount(node->present);
+  if (count == node->capacity){
+    unsigned capacity = node->capacity * 2;
+    if (capacity > 16)
+      capacity = 16;
+    size_t old_size = sizeof(struct tree_node) + node->capacity * sizeof(void *);
+    size_t size = sizeof(struct tree_node) + capacity * sizeof(void *);
+    node = (struct tree_node *) erealloc(node, size);
+    if (!node)
+      return -1;
+    node->capacity = capacity;
+    tree_node_bytes += size - old_size;
+    *nodep = node;
+  }
+  unsigned i = child_index(node, nibble);
+  memmove(&node->children[i+1], &node->children[i], (count - i) * sizeof(void *));
+  node->children[i] = child;
+  node->present |= (1<<nibble);
+  if (is_tree)
+    node->is_tree |= (1<<nibble);
+  return 0;
+}
+
+static void remove_child(struct tree_node *node, unsigned nibble)
+{
+  unsigned count = __builtin_popcount(node->present);
+  unsigned i = child_index(node, nibble);
+  memmove(&node->children[i], &node->children[i+1], (count - i - 1) * sizeof(void *));
+  node->present &= ~(1<<nibble);
+  node->is_tree &= ~(1<<nibble);
+}
+
 static void free_subscriber(struct subscriber *subscriber)
 {
   if (subscriber->link_state || subscriber->destination)
@@ -77,22 +165,24 @@ static void free_subscriber(struct subscriber *subscriber)
     FATAL("Can't free a subscriber that is being used by rhizome");
   if (subscriber->identity)
     FATAL("Can't free a subscriber that is unlocked in the keyring");
+  subscriber_count--;
   free(subscriber);
 }
 
 static void free_children(struct tree_node *parent)
 {
-  int i;
+  unsigned i, n=0;
   for (i=0;i<16;i++){
+    if (!(parent->present & (1<<i)))
+      continue;
     if (parent->is_tree & (1<<i)){
-      free_children(parent->tree_nodes[i]);
-      free(parent->tree_nodes[i]);
-      parent->tree_nodes[i]=NULL;
-    }else if(parent->subscribers[i]){
-      free_subscriber(parent->subscribers[i]);
-      parent->subscribers[i]=NULL;
-    }
+      free_children(parent->children[n]);
+      free_node(parent->children[n]);
+    }else
+      free_subscriber(parent->children[n]);
+    n++;
   }
+  parent->present=0;
   parent->is_tree=0;
 }
 
@@ -102,7 +192,8 @@ void free_subscribers()
   // who knows where subscriber ptr's may have leaked to.
   if (serverMode)
     FATAL("Freeing subscribers from a running daemon is not supported");
-  free_children(&root);
+  if (root)
+    free_children(root);
 }
 
 // find a subscriber struct from a whole or abbreviated subscriber id
@@ -111,19 +202,25 @@ struct subscriber *_find_subscriber(struct __sourceloc __whence, const unsigned
   IN();
   if (config.debug.subscriber)
     DEBUGF("find_subscriber(sid=%s, create=%d)", alloca_tohex(sidp, len), create);
-  struct tree_node *ptr = &root;
   int pos=0;
   if (len!=SID_SIZE)
     create =0;
   struct subscriber *ret = NULL;
+  if (!root && (!create || (root = alloc_node(16)) == NULL))
+    goto done;
+  struct tree_node **nodep = &root;
   do {
+    struct tree_node *ptr = *nodep;
     unsigned char nibble = get_nibble(sidp, pos++);
-    if (ptr->is_tree & (1<<nibble)){
-      ptr = ptr->tree_nodes[nibble];
-    }else if(!ptr->subscribers[nibble]){
+    if (!(ptr->present & (1<<nibble))){
       // subscriber is not yet known
       if (create && (ret = (struct subscriber *) emalloc_zero(sizeof(struct subscriber)))) {
-	ptr->subscribers[nibble] = ret;
+	if (insert_child(nodep, nibble, ret, 0) == -1){
+	  free(ret);
+	  ret = NULL;
+	  goto done;
+	}
+	subscriber_count++;
 	ret->sid = *(const sid_t *)sidp;
 	ret->abbreviate_len = pos;
 	if (config.debug.subscriber)
@@ -133,9 +230,13 @@ struct subscriber *_find_subscriber(struct __sourceloc __whence, const unsigned
 	      );
       }
       goto done;
+    }
+    void **slot = &ptr->children[child_index(ptr, nibble)];
+    if (ptr->is_tree & (1<<nibble)){
+      nodep = (struct tree_node **)slot;
     }else{
       // there's a subscriber in this slot, does it match the rest of the sid we've been given?
-      ret = ptr->subscribers[nibble];
+      ret = *slot;
       if (memcmp(ret->sid.binary, sidp, len) == 0)
 	goto done;
       // if we need to insert this subscriber, we have to make a new tree node first
@@ -144,33 +245,88 @@ struct subscriber *_find_subscriber(struct __sourceloc __whence, const unsigned
 	goto done;
       }
       // create a new tree node and move the existing subscriber into it
-      struct tree_node *new = (struct tree_node *) emalloc_zero(sizeof(struct tree_node));
+      struct tree_node *new = alloc_node(2);
       if (new == NULL) {
 	ret = NULL;
 	goto done;
       }
       if (config.debug.subscriber)
 	DEBUGF("create node[%.*s]", pos, alloca_tohex(sidp, len));
-      ptr->tree_nodes[nibble] = new;
+      *slot = new;
       ptr->is_tree |= (1<<nibble);
-      ptr = new;
+      nodep = (struct tree_node **)slot;
       nibble = get_nibble(ret->sid.binary, pos);
-      ptr->subscribers[nibble] = ret;
+      new->children[0] = ret;
+      new->present = (1<<nibble);
       ret->abbreviate_len = pos + 1;
       if (config.debug.subscriber)
 	DEBUGF("set node[%.*s].subscribers[%c]=%p(sid=%s, abbrev_len=%d)",
 	    pos, alloca_tohex(sidp, len), hexdigit_upper[nibble],
 	    ret, alloca_tohex_sid_t(ret->sid), ret->abbreviate_len
 	  );
+      ret = NULL;
       // then go around the loop again to compare the next nibble against the sid until we find an empty slot.
     }
   } while(pos < len*2);
 done:
+  if (ret)
+    ret->last_used = gettime_ms();
   if (config.debug.subscriber)
     DEBUGF("find_subscriber() return %p", ret);
   RETURN(ret);
 }
 
+/* Remove a subscriber from the tree and free it.  Tree nodes left empty are freed, and a node left
+ with a single subscriber is replaced by that subscriber, so its abbreviation gets shorter again.
+ */
+static void remove_subscriber(struct subscriber *subscriber)
+{
+  struct tree_node **path[SID_SIZE*2];
+  unsigned char nibbles[SID_SIZE*2];
+  int depth = 0;
+  struct tree_node **nodep = &root;
+  while (1) {
+    struct tree_node *node = *nodep;
+    unsigned char nibble = get_nibble(subscriber->sid.binary, depth);
+    assert(node->present & (1<<nibble));
+    path[depth] = nodep;
+    nibbles[depth] = nibble;
+    void **slot = &node->children[child_index(node, nibble)];
+    if (!(node->is_tree & (1<<nibble))){
+      assert(*slot == subscriber);
+      break;
+    }
+    nodep = (struct tree_node **)slot;
+    depth++;
+  }
+  remove_child(*path[depth], nibbles[depth]);
+  
+  // tidy up the tree, but always keep the root node
+  for (; depth > 0; depth--){
+    struct tree_node *node = *path[depth];
+    struct tree_node *parent = *path[depth-1];
+    unsigned count = __builtin_popcount(node->present);
+    if (count == 0){
+      remove_child(parent, nibbles[depth-1]);
+      free_node(node);
+      continue;
+    }
+    if (count == 1 && node->is_tree == 0){
+      struct subscriber *only = node->children[0];
+      *path[depth] = (struct tree_node *)only;
+      parent->is_tree &= ~(1<<nibbles[depth-1]);
+      only->abbreviate_len = depth;
+      free_node(node);
+    }
+    break;
+  }
+  
+  if (config.debug.subscriber)
+    DEBUGF("Forgetting subscriber %s", alloca_tohex_sid_t(subscriber->sid));
+  set_subscriber_ref(&subscriber->next_hop, NULL);
+  free_subscriber(subscriber);
+}
+
 /* 
  Walk the subscriber tree, calling the callback function for each subscriber.
  if start is a valid pointer, the first entry returned will be after this subscriber
@@ -191,12 +347,15 @@ static int walk_tree(struct tree_node *node, int pos,
   }
   
   for (;i<e;i++){
-    if (node->is_tree & (1<<i)){
-      if (walk_tree(node->tree_nodes[i], pos+1, start, start_len, end, end_len, callback, context))
-	return 1;
-    }else if(node->subscribers[i]){
-      if (callback(node->subscribers[i], context))
-	return 1;
+    if (node->present & (1<<i)){
+      void *child = node->children[child_index(node, i)];
+      if (node->is_tree & (1<<i)){
+	if (walk_tree(child, pos+1, start, start_len, end, end_len, callback, context))
+	  return 1;
+      }else{
+	if (callback(child, context))
+	  return 1;
+      }
     }
     // stop comparing the start sid after looking at the first branch of the tree
     start=NULL;
@@ -209,7 +368,106 @@ static int walk_tree(struct tree_node *node, int pos,
  */
 void enum_subscribers(struct subscriber *start, int(*callback)(struct subscriber *, void *), void *context)
 {
-  walk_tree(&root, 0, start->sid.binary, SID_SIZE, NULL, 0, callback, context);
+  if (root)
+    walk_tree(root, 0, start ? start->sid.binary : NULL, SID_SIZE, NULL, 0, callback, context);
+}
+
+struct subscriber *add_subscriber_ref(struct subscriber *subscriber)
+{
+  if (subscriber)
+    subscriber->_ref_count++;
+  return subscriber;
+}
+
+void release_subscriber_ref(struct subscriber *subscriber)
+{
+  if (subscriber){
+    assert(subscriber->_ref_count > 0);
+    subscriber->_ref_count--;
+  }
+}
+
+void set_subscriber_ref(struct subscriber **ptr, struct subscriber *subscriber)
+{
+  if (*ptr == subscriber)
+    return;
+  add_subscriber_ref(subscriber);
+  release_subscriber_ref(*ptr);
+  *ptr = subscriber;
+}
+
+struct evict_context{
+  time_ms_t idle_before;
+  struct subscriber **list;
+  unsigned count;
+  unsigned size;
+};
+
+static int is_idle(struct subscriber *subscriber, void *context)
+{
+  struct evict_context *ctx = context;
+  if (subscriber->_ref_count
+    || subscriber == my_subscriber
+    || subscriber->identity
+    || subscriber->sync_state
+    || subscriber->destination
+    || subscriber->source_rules
+    || subscriber->reachable != REACHABLE_NONE
+    || subscriber->last_used >= ctx->idle_before)
+    return 0;
+  // routing may hold on to it for a while yet
+  if (subscriber->link_state && !link_state_forget(subscriber))
+    return 0;
+  if (ctx->count == ctx->size){
+    unsigned size = ctx->size ? ctx->size * 2 : 64;
+    struct subscriber **list = erealloc(ctx->list, size * sizeof(struct subscriber *));
+    if (!list)
+      return 1;
+    ctx->list = list;
+    ctx->size = size;
+  }
+  ctx->list[ctx->count++] = subscriber;
+  return 0;
+}
+
+/* Free every subscriber that hasn't been looked up since idle_before and is not referenced by 
+ * routing, rhizome, the keyring, or anything else that holds a reference to it.
+ */
+unsigned subscriber_evict_idle(time_ms_t idle_before)
+{
+  struct evict_context ctx = {.idle_before = idle_before};
+  enum_subscribers(NULL, is_idle, &ctx);
+  unsigned i;
+  for (i = 0; i < ctx.count; i++)
+    remove_subscriber(ctx.list[i]);
+  if (ctx.list)
+    free(ctx.list);
+  subscribers_evicted += ctx.count;
+  return ctx.count;
+}
+
+void subscriber_stats(struct subscriber_stats *stats)
+{
+  stats->subscribers = subscriber_count;
+  stats->subscriber_bytes = subscriber_count * sizeof(struct subscriber);
+  stats->tree_nodes = tree_node_count;
+  stats->tree_bytes = tree_node_bytes;
+  stats->evicted = subscribers_evicted;
+}
+
+void subscriber_cleanup(struct sched_ent *alarm)
+{
+  time_ms_t now = gettime_ms();
+  unsigned count = subscriber_evict_idle(now - config.mdp.subscriber_timeout_ms);
+  if (config.debug.subscriber){
+    struct subscriber_stats stats;
+    subscriber_stats(&stats);
+    DEBUGF("Forgot %u idle subscribers, %u remain using %zu bytes, tree of %u nodes using %zu bytes",
+      count, stats.subscribers, stats.subscriber_bytes, stats.tree_nodes, stats.tree_bytes);
+  }
+  alarm->alarm = now + SUBSCRIBER_CLEANUP_INTERVAL_MS;
+  alarm->deadline = alarm->alarm + 10000;
+  schedule(alarm);
 }
 
 // generate a new random broadcast address
@@ -220,33 +478,64 @@ int overlay_broadcast_generate_address(struct broadcast *addr)
   return 0;
 }
 
-// test if the broadcast address has been seen
+static int bpi_table_init(unsigned size)
+{
+  struct bpi_slot *slots = emalloc_zero(size * sizeof(struct bpi_slot));
+  if (!slots)
+    return -1;
+  if (bpi_table.slots)
+    free(bpi_table.slots);
+  bpi_table.slots = slots;
+  bpi_table.size = size;
+  return 0;
+}
+
+/* Test if the broadcast address has been seen in the last mdp.broadcast.expiry_ms.
+   If so, drop the frame.
+   Each BPI may be stored in one of BPI_PROBE slots following its hash.  If they are all in use
+   by BPIs that haven't expired, the oldest is forgotten early, which could cause a flood to be
+   forwarded again.  Increase mdp.broadcast.slots if the early eviction count keeps rising. */
 int overlay_broadcast_drop_check(struct broadcast *addr)
 {
-  /* Hash the BPI and see if we have seen it recently.
-     If so, drop the frame.
-     The occassional failure to supress a broadcast frame is not
-     something we are going to worry about just yet.  For byzantine
-     robustness it is however required. */
-  int bpi_index=0;
-  int i;
-  for(i=0;i<BROADCAST_LEN;i++)
-    {
-      bpi_index=((bpi_index<<3)&0xfff8)+((bpi_index>>13)&0x7);
-      bpi_index^=addr->id[i];
-    }
-  bpi_index&=BPI_MASK;
+  if (bpi_table.size != config.mdp.broadcast.slots && bpi_table_init(config.mdp.broadcast.slots) == -1)
+    return 0;
   
-  if (memcmp(bpilist[bpi_index].id, addr->id, BROADCAST_LEN)){
-    if (config.debug.broadcasts)
-      DEBUGF("BPI %s is new", alloca_tohex(addr->id, BROADCAST_LEN));
-    bcopy(addr->id, bpilist[bpi_index].id, BROADCAST_LEN);
-    return 0; /* don't drop */
-  }else{
-    if (config.debug.broadcasts)
-      DEBUGF("BPI %s is a duplicate", alloca_tohex(addr->id, BROADCAST_LEN));
-    return 1; /* drop frame because we have seen this BPI recently */
+  // BPI's are random, so any bits will do for a hash
+  uint64_t hash;
+  memcpy(&hash, addr->id, sizeof hash);
+  unsigned index = hash % bpi_table.size;
+  
+  time_ms_t now = gettime_ms();
+  time_ms_t expired = now - config.mdp.broadcast.expiry_ms;
+  struct bpi_slot *slot = NULL;
+  unsigned i;
+  for (i = 0; i < BPI_PROBE; i++){
+    struct bpi_slot *s = &bpi_table.slots[(index + i) % bpi_table.size];
+    if (s->seen > expired && memcmp(s->id.id, addr->id, BROADCAST_LEN) == 0){
+      bpi_table.stats.duplicates++;
+      if (config.debug.broadcasts)
+	DEBUGF("BPI %s is a duplicate", alloca_tohex(addr->id, BROADCAST_LEN));
+      return 1; /* drop frame because we have seen this BPI recently */
+    }
+    // remember the best slot to replace, preferring empty or expired slots
+    if (!slot || s->seen < slot->seen)
+      slot = s;
   }
+  
+  if (slot->seen > expired)
+    bpi_table.stats.evicted_early++;
+  bpi_table.stats.new++;
+  if (config.debug.broadcasts)
+    DEBUGF("BPI %s is new", alloca_tohex(addr->id, BROADCAST_LEN));
+  slot->id = *addr;
+  slot->seen = now;
+  return 0; /* don't drop */
+}
+
+void overlay_broadcast_status_html(struct strbuf *b)
+{
+  strbuf_sprintf(b, "Broadcasts: %u new, %u duplicates dropped, %u forgotten early from %u slots<br>",
+    bpi_table.stats.new, bpi_table.stats.duplicates, bpi_table.stats.evicted_early, bpi_table.size);
 }
 
 void overlay_broadcast_append(struct overlay_buffer *b, struct broadcast *broadcast)
@@ -298,10 +587,10 @@ static int add_explain_response(struct subscriber *subscriber, void *context)
   subscriber->last_explained = now;
 
   if (!response->please_explain){
-    if ((response->please_explain = emalloc_zero(sizeof(struct overlay_frame))) == NULL)
+    if ((response->please_explain = op_new()) == NULL)
       return 1; // stop walking
     if ((response->please_explain->payload = ob_new()) == NULL) {
-      free(response->please_explain);
+      op_free(response->please_explain);
       response->please_explain = NULL;
       return 1; // stop walking
     }
@@ -361,7 +650,7 @@ static int find_subscr_buffer(struct decode_context *context, struct overlay_buf
     
     // add the abbreviation you told me about
     if (!context->please_explain){
-      context->please_explain = calloc(sizeof(struct overlay_frame),1);
+      context->please_explain = op_new();
       if ((context->please_explain->payload = ob_new()) == NULL)
 	return -1;
       ob_limitsize(context->please_explain->payload, MDP_MTU);
@@ -369,7 +658,8 @@ static int find_subscr_buffer(struct decode_context *context, struct overlay_buf
     
     // And I'll tell you about any subscribers I know that match this abbreviation, 
     // so you don't try to use an abbreviation that's too short in future.
-    walk_tree(&root, 0, id, len, id, len, add_explain_response, context);
+    if (root)
+      walk_tree(root, 0, id, len, id, len, add_explain_response, context);
     
     INFOF("Asking for explanation of %s", alloca_tohex(id, len));
     ob_append_byte(context->please_explain->payload, len);
@@ -413,7 +703,7 @@ int overlay_address_parse(struct decode_context *context, struct overlay_buffer
       }else{
 	// add the abbreviation you told me about
 	if (!context->please_explain){
-	  context->please_explain = calloc(sizeof(struct overlay_frame),1);
+	  context->please_explain = op_new();
 	  if ((context->please_explain->payload = ob_new()) == NULL)
 	    return -1;
 	  ob_limitsize(context->please_explain->payload, MDP_MTU);
@@ -526,7 +816,8 @@ int process_explain(struct overlay_frame *frame)
     }else{
       // reply to the sender with all subscribers that match this abbreviation
       INFOF("Sending explain responses for %s", alloca_tohex(sid, len));
-      walk_tree(&root, 0, sid, len, sid, len, add_explain_response, &context);
+      if (root)
+	walk_tree(root, 0, sid, len, sid, len, add_explain_response, &context);
     }
   }
   if (context.please_explain)
@@ -45,7 +45,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define BROADCAST_LEN 8
 
-struct packet_rule;
+struct packet_rules;
 
 // This structure supports both our own routing protocol which can store calculation details in *node 
 // or IP4 addresses reachable via any other kind of normal layer3 routing protocol, eg olsr
@@ -86,7 +86,12 @@ struct subscriber{
   // private keys for local identities
   struct keyring_identity *identity;
   
-  struct packet_rule *source_rules;
+  struct packet_rules *source_rules;
+  
+  // references from other structures, this subscriber won't be forgotten while any are held
+  unsigned _ref_count;
+  // when this subscriber was last looked up
+  time_ms_t last_used;
 };
 
 struct broadcast{
@@ -118,6 +123,19 @@ struct subscriber *_find_subscriber(struct __sourceloc, const unsigned char *sid
 #define find_subscriber(sid, len, create) _find_subscriber(__WHENCE__, sid, len, create)
 
 void enum_subscribers(struct subscriber *start, int(*callback)(struct subscriber *, void *), void *context);
+struct subscriber *add_subscriber_ref(struct subscriber *subscriber);
+void release_subscriber_ref(struct subscriber *subscriber);
+void set_subscriber_ref(struct subscriber **ptr, struct subscriber *subscriber);
+
+struct subscriber_stats{
+  unsigned subscribers;
+  size_t subscriber_bytes;
+  unsigned tree_nodes;
+  size_t tree_bytes;
+  unsigned long evicted;
+};
+unsigned subscriber_evict_idle(time_ms_t idle_before);
+void subscriber_stats(struct subscriber_stats *stats);
 int set_reachable(struct subscriber *subscriber, struct network_destination *destination, struct subscriber *next_hop);
 int load_subscriber_address(struct subscriber *subscriber);
 
@@ -23,6 +23,20 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "mem.h"
 #include "overlay_buffer.h"
 
+/* Buffer structures, and the bytes of any buffer that fits in a single packet, come from free lists
+ so that building, forwarding and parsing packets doesn't need malloc(3) every time.
+ */
+struct mem_pool ob_header_pool = MEM_POOL_INIT("overlay_buffer", sizeof(struct overlay_buffer), 256);
+struct mem_pool ob_block_pool = MEM_POOL_INIT("overlay_buffer bytes", OB_POOL_BLOCK_SIZE, 256);
+
+static void ob_release_bytes(unsigned char *bytes, size_t allocSize)
+{
+  if (allocSize == OB_POOL_BLOCK_SIZE)
+    pool_free(&ob_block_pool, bytes);
+  else
+    free(bytes);
+}
+
 /*
  When writing to a buffer, sizeLimit may place an upper bound on the amount of space to use
  
@@ -33,7 +47,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = pool_alloc_zero(&ob_header_pool);
   if (config.debug.overlaybuffer)
     DEBUGF("ob_new() return %p", ret);
   if (ret == NULL)
@@ -46,7 +60,7 @@ struct overlay_buffer *_ob_new(struct __sourceloc __whence)
 // and allow other callers to use the ob_ convenience methods for reading and writing up to size bytes.
 struct overlay_buffer *_ob_static(struct __sourceloc __whence, unsigned char *bytes, size_t size)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = pool_alloc_zero(&ob_header_pool);
   if (config.debug.overlaybuffer)
     DEBUGF("ob_static(bytes=%p, size=%zu) return %p", bytes, size, ret);
   if (ret == NULL)
@@ -67,7 +81,7 @@ struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buf
     WHY("Buffer isn't long enough to slice");
     return NULL;
   }
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = pool_alloc_zero(&ob_header_pool);
   if (config.debug.overlaybuffer)
     DEBUGF("ob_slice(b=%p, offset=%zu, length=%zu) return %p", b, offset, length, ret);
   if (ret == NULL)
@@ -81,7 +95,7 @@ struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buf
 
 struct overlay_buffer *_ob_dup(struct __sourceloc __whence, struct overlay_buffer *b)
 {
-  struct overlay_buffer *ret = emalloc_zero(sizeof(struct overlay_buffer));
+  struct overlay_buffer *ret = pool_alloc_zero(&ob_header_pool);
   if (config.debug.overlaybuffer)
     DEBUGF("ob_dup(b=%p) return %p", b, ret);
   if (ret == NULL)
@@ -110,8 +124,8 @@ void _ob_free(struct __sourceloc __whence, struct overlay_buffer *b)
   if (config.debug.overlaybuffer)
     DEBUGF("ob_free(b=%p)", b);
   if (b->allocated)
-    free(b->allocated);
-  free(b);
+    ob_release_bytes(b->allocated, ob_headroom(b) + b->allocSize);
+  pool_free(&ob_header_pool, b);
 }
 
 int _ob_checkpoint(struct __sourceloc __whence, struct overlay_buffer *b)
@@ -196,7 +210,9 @@ ssize_t _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b, siz
       DEBUGF("ob_makespace(): asked for space to %zu, beyond static buffer size of %zu", b->position + bytes, b->allocSize);
     return 0;
   }
-  size_t newSize = b->position + bytes;
+  // keep any headroom in front of the data
+  size_t headroom = ob_headroom(b);
+  size_t newSize = headroom + b->position + bytes;
   if (newSize<64) newSize=64;
   if (newSize&63) newSize+=64-(newSize&63);
   if (newSize>1024 && (newSize&1023))
@@ -230,21 +246,87 @@ ssize_t _ob_makespace(struct __sourceloc __whence, struct overlay_buffer *b, siz
     for(i=0;i<4096;i++) new[newSize+i]=0xbd;
   }
 #else
-  unsigned char *new = emalloc(newSize);
+  unsigned char *new;
+  if (newSize <= OB_POOL_BLOCK_SIZE) {
+    newSize = OB_POOL_BLOCK_SIZE;
+    new = pool_alloc(&ob_block_pool);
+  } else
+    new = emalloc(newSize);
 #endif
   if (!new)
     return 0;
-  bcopy(b->bytes,new,b->position);
-  if (b->allocated) {
-    assert(b->allocated == b->bytes);
-    free(b->allocated);
-  }
-  b->bytes=new;
+  bcopy(b->bytes,new+headroom,b->position);
+  if (b->allocated)
+    ob_release_bytes(b->allocated, headroom + b->allocSize);
+  b->bytes=new+headroom;
   b->allocated=new;
-  b->allocSize=newSize;
+  b->allocSize=newSize-headroom;
+  return 1;
+}
+
+/* Reserve space in front of an empty buffer, so that headers can be added later with ob_push()
+ without moving the contents. Return 1 if successful, 0 if not.
+ */
+int _ob_reserve_headroom(struct __sourceloc __whence, struct overlay_buffer *b, size_t bytes)
+{
+  assert(b != NULL);
+  assert(b->position == 0);
+  if (b->bytes && b->allocated == NULL)
+    return 0;
+  if (!ob_makespace(b, bytes))
+    return 0;
+  b->bytes += bytes;
+  b->allocSize -= bytes;
+  if (b->sizeLimit != SIZE_MAX)
+    b->sizeLimit -= bytes;
+  if (config.debug.overlaybuffer)
+    DEBUGF("ob_reserve_headroom(b=%p, bytes=%zu) headroom=%zu", b, bytes, ob_headroom(b));
   return 1;
 }
 
+size_t ob_headroom(struct overlay_buffer *b)
+{
+  return b->allocated ? (size_t)(b->bytes - b->allocated) : 0;
+}
+
+/* Grow the buffer at the front into its headroom, returning a pointer to the new first byte or
+ NULL if there is not enough headroom. Positions move with the data, so the contents are untouched.
+ */
+unsigned char *_ob_push(struct __sourceloc __whence, struct overlay_buffer *b, size_t bytes)
+{
+  assert(b != NULL);
+  if (ob_headroom(b) < bytes) {
+    if (config.debug.overlaybuffer)
+      DEBUGF("ob_push(b=%p, bytes=%zu) only %zu bytes of headroom", b, bytes, ob_headroom(b));
+    return NULL;
+  }
+  b->bytes -= bytes;
+  b->allocSize += bytes;
+  b->position += bytes;
+  b->checkpointLength += bytes;
+  if (b->sizeLimit != SIZE_MAX)
+    b->sizeLimit += bytes;
+  if (config.debug.overlaybuffer)
+    DEBUGF("ob_push(b=%p, bytes=%zu) position=%zu", b, bytes, b->position);
+  return b->bytes;
+}
+
+// Strip bytes from the front of the buffer, returning them to the headroom.
+void _ob_pull(struct __sourceloc __whence, struct overlay_buffer *b, size_t bytes)
+{
+  assert(b != NULL);
+  assert(b->allocated != NULL);
+  assert(bytes <= b->position);
+  b->bytes += bytes;
+  b->allocSize -= bytes;
+  b->position -= bytes;
+  b->checkpointLength = b->checkpointLength > bytes ? b->checkpointLength - bytes : 0;
+  if (b->sizeLimit != SIZE_MAX)
+    b->sizeLimit -= bytes;
+  if (config.debug.overlaybuffer)
+    DEBUGF("ob_pull(b=%p, bytes=%zu) position=%zu", b, bytes, b->position);
+}
+
 /*
  Functions that append data and increase the size of the buffer if possible / required
  */
@@ -549,11 +631,11 @@ uint64_t ob_get_ui64(struct overlay_buffer *b)
   uint64_t ret = (uint64_t)b->bytes[b->position] << 56
 	| (uint64_t)b->bytes[b->position +1] << 48
 	| (uint64_t)b->bytes[b->position +2] << 40
-	| (uint64_t)b->bytes[b->position +3] << 36
-	| b->bytes[b->position +4] << 24
-	| b->bytes[b->position +5] << 16
-	| b->bytes[b->position +6] << 8
-	| b->bytes[b->position +7];
+	| (uint64_t)b->bytes[b->position +3] << 32
+	| (uint64_t)b->bytes[b->position +4] << 24
+	| (uint64_t)b->bytes[b->position +5] << 16
+	| (uint64_t)b->bytes[b->position +6] << 8
+	| (uint64_t)b->bytes[b->position +7];
   b->position+=8;
   return ret;
 }
@@ -36,9 +36,17 @@ struct overlay_buffer {
   size_t allocSize;
   
   // is this an allocated buffer? can it be resized? Should it be freed?
+  // bytes may start after allocated, leaving headroom to prepend headers
   unsigned char * allocated;
 };
 
+// buffers up to this size share a pool of byte blocks
+#define OB_POOL_BLOCK_SIZE 2048
+
+struct mem_pool;
+extern struct mem_pool ob_header_pool;
+extern struct mem_pool ob_block_pool;
+
 struct overlay_buffer *_ob_new(struct __sourceloc __whence);
 struct overlay_buffer *_ob_static(struct __sourceloc __whence, unsigned char *bytes, size_t size);
 struct overlay_buffer *_ob_slice(struct __sourceloc __whence, struct overlay_buffer *b, size_t offset, size_t length);
@@ -51,6 +59,9 @@ void _ob_flip(struct __sourceloc __whence, struct overlay_buffer *b);
 void _ob_clear(struct __sourceloc __whence, struct overlay_buffer *b);
 void _ob_unlimitsize(struct __sourceloc __whence, struct overlay_buffer *b);
 ssize_t _ob_makespace(struct __sourceloc whence, struct overlay_buffer *b, size_t bytes);
+int _ob_reserve_headroom(struct __sourceloc __whence, struct overlay_buffer *b, size_t bytes);
+unsigned char *_ob_push(struct __sourceloc __whence, struct overlay_buffer *b, size_t bytes);
+void _ob_pull(struct __sourceloc __whence, struct overlay_buffer *b, size_t bytes);
 void _ob_set(struct __sourceloc __whence, struct overlay_buffer *b, size_t ofs, unsigned char byte);
 void _ob_set_ui16(struct __sourceloc __whence, struct overlay_buffer *b, size_t offset, uint16_t v);
 
@@ -79,6 +90,9 @@ void _ob_append_str(struct __sourceloc whence, struct overlay_buffer *b, const c
 #define ob_clear(b) _ob_clear(__WHENCE__, b)
 #define ob_unlimitsize(b) _ob_unlimitsize(__WHENCE__, b)
 #define ob_makespace(b, bytes) _ob_makespace(__WHENCE__, b, bytes)
+#define ob_reserve_headroom(b, bytes) _ob_reserve_headroom(__WHENCE__, b, bytes)
+#define ob_push(b, bytes) _ob_push(__WHENCE__, b, bytes)
+#define ob_pull(b, bytes) _ob_pull(__WHENCE__, b, bytes)
 #define ob_set(b, off, byte) _ob_set(__WHENCE__, b, off, byte)
 #define ob_set_ui16(b, off, v) _ob_set_ui16(__WHENCE__, b, off, v)
 
@@ -95,6 +109,9 @@ void _ob_append_str(struct __sourceloc whence, struct overlay_buffer *b, const c
 #define ob_append_packed_ui64(b, v) _ob_append_packed_ui64(__WHENCE__, b, v)
 #define ob_append_str(b, s) _ob_append_str(__WHENCE__, b, s)
 
+// bytes available in front of the data for ob_push()
+size_t ob_headroom(struct overlay_buffer *b);
+
 // get one byte, -ve number indicates failure
 int ob_peek(struct overlay_buffer *b);
 void ob_skip(struct overlay_buffer *b, unsigned n);
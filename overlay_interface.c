@@ -71,6 +71,7 @@ overlay_interface_close(overlay_interface *interface){
   close(interface->alarm.poll.fd);
   if (interface->radio_link_state)
     radio_link_free(interface);
+  set_subscriber_ref(&interface->other_device, NULL);
   interface->alarm.poll.fd=-1;
   interface->state=INTERFACE_STATE_DOWN;
 }
@@ -126,6 +127,26 @@ void interface_state_html(struct strbuf *b, struct overlay_interface *interface)
   }
   strbuf_sprintf(b, "TX: %d<br>", interface->tx_count);
   strbuf_sprintf(b, "RX: %d<br>", interface->recv_count);
+  if (interface->destination)
+    destination_state_html(b, interface->destination);
+  if (interface->rx_batch_count)
+    strbuf_sprintf(b, "RX batches: %u, average %.1f, largest %u, full %u<br>",
+      interface->rx_batch_count,
+      (double)interface->rx_batch_packets / interface->rx_batch_count,
+      interface->rx_batch_largest,
+      interface->rx_batch_full);
+}
+
+void destination_state_html(struct strbuf *b, struct network_destination *destination)
+{
+  static const char *queue_names[OQ_MAX] = {"voice", "management", "video", "ordinary", "opportunistic"};
+  int i;
+  for (i=0; i<OQ_MAX; i++){
+    if (destination->tx_frames[i])
+      strbuf_sprintf(b, "TX %s: %u frames, %"PRIu64" bytes, weight %d<br>",
+	queue_names[i], destination->tx_frames[i], destination->tx_bytes[i],
+	destination->interface->queue_weight[i]);
+  }
 }
 
 // create a socket with options common to all our UDP sockets
@@ -260,42 +281,66 @@ int overlay_interface_compare(overlay_interface *one, overlay_interface *two)
   return 0;
 }
 
+// How expensive is it to send one packet on this interface?
+int overlay_interface_airtime(overlay_interface *interface)
+{
+  return interface->airtime;
+}
+
+#define RX_PACKET_SIZE 16384
+#define SOCK_ANY_RX_BATCH 16
+
+/* Receive buffers shared by every dgram socket, grown to the largest batch size in use.
+ Packets are always consumed before the next read, so one set is enough.
+ */
+static unsigned char *rx_buffers = NULL;
+static struct recv_slot rx_slot_array[RECV_BATCH_MAX];
+static unsigned rx_slot_count = 0;
+
+static struct recv_slot *rx_slots(unsigned count)
+{
+  if (count > rx_slot_count) {
+    unsigned char *p = erealloc(rx_buffers, (size_t)count * RX_PACKET_SIZE);
+    if (!p)
+      FATAL("Cannot allocate receive buffers");
+    rx_buffers = p;
+    rx_slot_count = count;
+  }
+  unsigned i;
+  for (i = 0; i < count; ++i) {
+    rx_slot_array[i].buffer = rx_buffers + (size_t)i * RX_PACKET_SIZE;
+    rx_slot_array[i].bufferlen = RX_PACKET_SIZE;
+  }
+  return rx_slot_array;
+}
+
 // OSX doesn't recieve broadcast packets on sockets bound to an interface's address
 // So we have to bind a socket to INADDR_ANY to receive these packets.
 static void
 overlay_interface_read_any(struct sched_ent *alarm)
 {
   if (alarm->poll.revents & POLLIN) {
-    int plen=0;
-    int recvttl=1;
-    unsigned char packet[16384];
-    overlay_interface *interface=NULL;
-    struct socket_address recvaddr;
-    recvaddr.addrlen = sizeof recvaddr.store;
-    
-    /* Read only one UDP packet per call to share resources more fairly, and also
-     enable stats to accurately count packets received */
-    plen = recvwithttl(alarm->poll.fd, packet, sizeof(packet), &recvttl, &recvaddr);
-    if (plen == -1) {
-      WHYF_perror("recvwithttl(%d,%p,%zu,&%d,%p(%s))",
-	    alarm->poll.fd, packet, sizeof packet, recvttl,
-	    &recvaddr, alloca_socket_address(&recvaddr)
-	  );
+    struct recv_slot *slots = rx_slots(SOCK_ANY_RX_BATCH);
+    int n = recvwithttl_batch(alarm->poll.fd, slots, SOCK_ANY_RX_BATCH);
+    if (n == -1) {
+      WHYF("Failed to read from broadcast socket %d", alarm->poll.fd);
       unwatch(alarm);
       close(alarm->poll.fd);
       return;
     }
-    
-    /* Try to identify the real interface that the packet arrived on */
-    interface = overlay_interface_find(recvaddr.inet.sin_addr, 0);
-    
-    /* Drop the packet if we don't find a match */
-    if (!interface){
-      if (config.debug.overlayinterfaces)
-	DEBUGF("Could not find matching interface for packet received from %s", inet_ntoa(recvaddr.inet.sin_addr));
-      return;
+    int i;
+    for (i = 0; i < n; ++i) {
+      /* Try to identify the real interface that the packet arrived on */
+      overlay_interface *interface = overlay_interface_find(slots[i].recvaddr.inet.sin_addr, 0);
+      
+      /* Drop the packet if we don't find a match */
+      if (!interface){
+	if (config.debug.overlayinterfaces)
+	  DEBUGF("Could not find matching interface for packet received from %s", inet_ntoa(slots[i].recvaddr.inet.sin_addr));
+	continue;
+      }
+      packetOkOverlay(interface, slots[i].buffer, slots[i].len, &slots[i].recvaddr);
     }
-    packetOkOverlay(interface, packet, plen, &recvaddr);
   }
   if (alarm->poll.revents & (POLLHUP | POLLERR)) {
     INFO("Closing broadcast socket due to error");
@@ -369,6 +414,20 @@ overlay_interface_init_socket(overlay_interface *interface)
   return 0;
 }
 
+static void apply_queue_weights(int weights[OQ_MAX], const struct config_mdp_queue_weight *conf)
+{
+  if (conf->voice >= 0)
+    weights[OQ_ISOCHRONOUS_VOICE] = conf->voice;
+  if (conf->management >= 0)
+    weights[OQ_MESH_MANAGEMENT] = conf->management;
+  if (conf->video >= 0)
+    weights[OQ_ISOCHRONOUS_VIDEO] = conf->video;
+  if (conf->ordinary >= 0)
+    weights[OQ_ORDINARY] = conf->ordinary;
+  if (conf->opportunistic >= 0)
+    weights[OQ_OPPORTUNISTIC] = conf->opportunistic;
+}
+
 /* Returns 0 if interface is successfully added.
  * Returns 1 if interface is not added (eg, dummy file does not exist).
  * Returns -1 in case of error (misconfiguration or system error).
@@ -421,43 +480,66 @@ overlay_interface_init(const char *name, struct socket_address *addr,
   interface->debug = ifconfig->debug;
   interface->tx_count=0;
   interface->recv_count=0;
+  interface->rx_batch = ifconfig->rx_batch > RECV_BATCH_MAX ? RECV_BATCH_MAX : ifconfig->rx_batch;
 
   // How often do we announce ourselves on this interface?
   int tick_ms=-1;
   int packet_interval=-1;
   int reachable_timeout_ms = -1;
+  int link_rate = -1;
 
   // hard coded defaults:
   switch (ifconfig->type) {
     case OVERLAY_INTERFACE_PACKETRADIO:
       tick_ms = 15000;
       packet_interval = 1000;
+      // typical over the air rate of a packet radio modem
+      link_rate = 64000;
       break;
     case OVERLAY_INTERFACE_ETHERNET:
       tick_ms = 500;
       packet_interval = 100;
+      link_rate = 100000000;
       break;
     case OVERLAY_INTERFACE_WIFI:
       tick_ms = 500;
       packet_interval = 800;
+      // broadcast frames are usually sent at the lowest basic rate
+      link_rate = 6000000;
       break;
     case OVERLAY_INTERFACE_UNKNOWN:
       tick_ms = 500;
       packet_interval = 100;
+      link_rate = 6000000;
       break;
   }
   // configurable defaults per interface
-  {
-    int i = config_mdp_iftypelist__get(&config.mdp.iftype, &ifconfig->type);
-    if (i != -1){
-      if (config.mdp.iftype.av[i].value.tick_ms>=0)
-	tick_ms = config.mdp.iftype.av[i].value.tick_ms;
-      if (config.mdp.iftype.av[i].value.packet_interval>=0)
-	packet_interval=config.mdp.iftype.av[i].value.packet_interval;
-      if (config.mdp.iftype.av[i].value.reachable_timeout_ms >= 0)
-	reachable_timeout_ms = config.mdp.iftype.av[i].value.reachable_timeout_ms;
+  int iftype = config_mdp_iftypelist__get(&config.mdp.iftype, &ifconfig->type);
+  if (iftype != -1){
+    if (config.mdp.iftype.av[iftype].value.tick_ms>=0)
+      tick_ms = config.mdp.iftype.av[iftype].value.tick_ms;
+    if (config.mdp.iftype.av[iftype].value.packet_interval>=0)
+      packet_interval=config.mdp.iftype.av[iftype].value.packet_interval;
+    if (config.mdp.iftype.av[iftype].value.reachable_timeout_ms >= 0)
+      reachable_timeout_ms = config.mdp.iftype.av[iftype].value.reachable_timeout_ms;
+    if (config.mdp.iftype.av[iftype].value.link_rate > 0)
+      link_rate = config.mdp.iftype.av[iftype].value.link_rate;
+  }
+  // each destination gets one full packet per round by default
+  for (i=0; i<OQ_MAX; i++)
+    interface->queue_weight[i] = interface->mtu;
+  if (iftype != -1)
+    apply_queue_weights(interface->queue_weight, &config.mdp.iftype.av[iftype].value.queue_weight);
+  apply_queue_weights(interface->queue_weight, &ifconfig->mdp.queue_weight);
+  // a destination must be able to send at least one full frame per round
+  for (i=0; i<OQ_MAX; i++){
+    if (interface->queue_weight[i] < interface->mtu){
+      WARNF("Interface %s queue weight %d is less than the MTU, using %d", 
+	interface->name, interface->queue_weight[i], interface->mtu);
+      interface->queue_weight[i] = interface->mtu;
     }
   }
+
   // specific value for this interface
   if (ifconfig->mdp.tick_ms>=0)
     tick_ms = ifconfig->mdp.tick_ms;
@@ -482,6 +564,9 @@ overlay_interface_init(const char *name, struct socket_address *addr,
   interface->destination->tick_ms = tick_ms;
   interface->destination->reachable_timeout_ms = reachable_timeout_ms >= 0 ? reachable_timeout_ms : tick_ms > 0 ? tick_ms * 5 : 2500;
   
+  interface->airtime = link_rate > 0 ? (int)((int64_t)interface->mtu * 8 * 1000000 / link_rate) : 0;
+  if (interface->airtime < 1)
+    interface->airtime = 1;
   limit_init(&interface->destination->transfer_limit, packet_interval);
 
   if (addr)
@@ -559,25 +644,28 @@ cleanup:
 
 static void interface_read_dgram(struct overlay_interface *interface)
 {
-  int plen=0;
-  unsigned char packet[8096];
-  
-  struct socket_address recvaddr;
-  recvaddr.addrlen = sizeof recvaddr.store;
-
-  /* Read only one UDP packet per call to share resources more fairly, and also
-   enable stats to accurately count packets received */
-  int recvttl=1;
-  plen = recvwithttl(interface->alarm.poll.fd,packet, sizeof(packet), &recvttl, &recvaddr);
-  if (plen == -1) {
-    WHYF_perror("recvwithttl(%d,%p,%zu,&%d,%p(%s))",
-	  interface->alarm.poll.fd, packet, sizeof packet, recvttl,
-	  &recvaddr, alloca_socket_address(&recvaddr)
-	);
+  /* Read at most rx_batch packets per call, so that one busy interface cannot starve the others
+   that are ready in the same pass of fd_poll(); whatever is left will wake us up again */
+  struct recv_slot *slots = rx_slots(interface->rx_batch);
+  int n = recvwithttl_batch(interface->alarm.poll.fd, slots, interface->rx_batch);
+  if (n == -1) {
+    WHYF("Failed to read from interface %s", interface->name);
     overlay_interface_close(interface);
     return;
   }
-  packetOkOverlay(interface, packet, plen, &recvaddr);
+  if (n == 0)
+    return;
+  interface->rx_batch_count++;
+  interface->rx_batch_packets += n;
+  if ((unsigned)n > interface->rx_batch_largest)
+    interface->rx_batch_largest = n;
+  if ((unsigned)n == interface->rx_batch)
+    interface->rx_batch_full++;
+  if (config.debug.packetrx && n > 1)
+    DEBUGF("Read %d packets from %s in one batch", n, interface->name);
+  int i;
+  for (i = 0; i < n; ++i)
+    packetOkOverlay(interface, slots[i].buffer, slots[i].len, &slots[i].recvaddr);
 }
 
 struct file_packet{
@@ -789,7 +877,133 @@ static void overlay_interface_poll(struct sched_ent *alarm)
   }  
 }
 
-static int send_local_broadcast(int fd, const uint8_t *bytes, size_t len, struct socket_address *address)
+/* Outgoing dgram packets are held here while a batch is open, and then sent with as few system
+ calls as possible. Each buffer may be sent to several addresses (eg local broadcasts).
+ */
+#define TX_BATCH_MAX 64
+struct tx_pending{
+  struct overlay_interface *interface;
+  struct overlay_buffer *buffer;
+  struct socket_address address;
+  // should a send failure take the interface down?
+  char close_on_error;
+};
+static struct tx_pending tx_pending[TX_BATCH_MAX];
+static unsigned tx_pending_count = 0;
+static struct overlay_buffer *tx_buffers[TX_BATCH_MAX];
+static unsigned tx_buffer_count = 0;
+static int tx_batching = 0;
+
+static void tx_failed(struct tx_pending *pending)
+{
+  struct overlay_interface *interface = pending->interface;
+  WHYF_perror("sendto(fd=%d,len=%zu,addr=%s) on interface %s",
+      interface->alarm.poll.fd,
+      ob_position(pending->buffer),
+      alloca_socket_address(&pending->address),
+      interface->name
+    );
+  // close the interface if we had any error while sending broadcast packets,
+  // unicast packets should not bring the interface down
+  // a full socket buffer only costs us this packet
+  // TODO mark unicast destination as failed?
+  if (pending->close_on_error && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+    overlay_interface_close(interface);
+}
+
+static void tx_send_interface(struct overlay_interface *interface, struct tx_pending **pending, unsigned count)
+{
+  int fd = interface->alarm.poll.fd;
+  unsigned i = 0;
+#ifdef HAVE_SENDMMSG
+  struct mmsghdr msgs[count];
+  struct iovec iov[count];
+  for (i = 0; i < count; ++i) {
+    iov[i].iov_base = ob_ptr(pending[i]->buffer);
+    iov[i].iov_len = ob_position(pending[i]->buffer);
+    bzero(&msgs[i], sizeof msgs[i]);
+    msgs[i].msg_hdr.msg_name = &pending[i]->address.addr;
+    msgs[i].msg_hdr.msg_namelen = pending[i]->address.addrlen;
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  i = 0;
+  while (i < count && interface->state == INTERFACE_STATE_UP) {
+    // sendmmsg only reports an error for the first message, so skip past each failure and go again
+    int sent = sendmmsg(fd, &msgs[i], count - i, MSG_DONTWAIT);
+    if (sent == -1)
+      tx_failed(pending[i++]);
+    else
+      i += sent;
+  }
+#else
+  for (i = 0; i < count && interface->state == INTERFACE_STATE_UP; ++i) {
+    ssize_t sent = sendto(fd,
+	      ob_ptr(pending[i]->buffer), ob_position(pending[i]->buffer), MSG_DONTWAIT,
+	      &pending[i]->address.addr, pending[i]->address.addrlen);
+    if (sent == -1)
+      tx_failed(pending[i]);
+  }
+#endif
+}
+
+// send everything queued so far, one group per interface
+static void tx_send_pending()
+{
+  char done[TX_BATCH_MAX];
+  bzero(done, sizeof done);
+  unsigned i, j;
+  for (i = 0; i < tx_pending_count; ++i) {
+    if (done[i])
+      continue;
+    struct overlay_interface *interface = tx_pending[i].interface;
+    struct tx_pending *group[TX_BATCH_MAX];
+    unsigned count = 0;
+    for (j = i; j < tx_pending_count; ++j) {
+      if (!done[j] && tx_pending[j].interface == interface) {
+	group[count++] = &tx_pending[j];
+	done[j] = 1;
+      }
+    }
+    if (interface->state == INTERFACE_STATE_UP)
+      tx_send_interface(interface, group, count);
+  }
+  tx_pending_count = 0;
+}
+
+static void tx_flush()
+{
+  tx_send_pending();
+  while (tx_buffer_count > 0)
+    ob_free(tx_buffers[--tx_buffer_count]);
+}
+
+static void tx_queue(struct overlay_interface *interface, struct overlay_buffer *buffer, const struct socket_address *address, char close_on_error)
+{
+  if (tx_pending_count >= TX_BATCH_MAX)
+    tx_send_pending();
+  struct tx_pending *pending = &tx_pending[tx_pending_count++];
+  pending->interface = interface;
+  pending->buffer = buffer;
+  pending->address = *address;
+  pending->close_on_error = close_on_error;
+}
+
+/* Hold outgoing dgram packets until overlay_broadcast_batch_end(), so that all the packets built
+ in one pass of the send queues go out together.
+ */
+void overlay_broadcast_batch_begin()
+{
+  tx_batching = 1;
+}
+
+void overlay_broadcast_batch_end()
+{
+  tx_batching = 0;
+  tx_flush();
+}
+
+static int send_local_broadcast(struct overlay_interface *interface, struct overlay_buffer *buffer, struct socket_address *address)
 {
   DIR *dir;
   struct dirent *dp;
@@ -816,11 +1030,7 @@ static int send_local_broadcast(int fd, const uint8_t *bytes, size_t len, struct
     if (S_ISSOCK(st.st_mode)){
       addr.local.sun_family = AF_UNIX;
       addr.addrlen = sizeof(addr.local.sun_family) + strlen(addr.local.sun_path)+1;
-      
-      ssize_t sent = sendto(fd, bytes, len, 0, 
-		&addr.addr, addr.addrlen);
-      if (sent == -1)
-	WHYF_perror("sendto(%d, %zu, %s)", fd, len, alloca_socket_address(&addr));
+      tx_queue(interface, buffer, &addr, 0);
     }
   }
   closedir(dir);
@@ -910,34 +1120,18 @@ int overlay_broadcast_ensemble(struct network_destination *destination, struct o
 	DEBUGF("Sending %zu byte overlay frame on %s to %s", 
 	  (size_t)len, interface->name, alloca_socket_address(&destination->address));
       
-      set_nonblock(interface->alarm.poll.fd);
+      if (tx_buffer_count >= TX_BATCH_MAX)
+	tx_flush();
+      tx_buffers[tx_buffer_count++] = buffer;
       if (destination->address.addr.sa_family == AF_UNIX
 	&& !destination->unicast){
 	// find all sockets in this folder and send to them
-	send_local_broadcast(interface->alarm.poll.fd, 
-		  bytes, (size_t)len, &destination->address);
+	send_local_broadcast(interface, buffer, &destination->address);
       }else{
-	ssize_t sent = sendto(interface->alarm.poll.fd, 
-		  bytes, (size_t)len, 0, 
-		  &destination->address.addr, destination->address.addrlen);
-	if (sent == -1){
-	  WHYF_perror("sendto(fd=%d,len=%zu,addr=%s) on interface %s",
-	      interface->alarm.poll.fd,
-	      (size_t)len,
-	      alloca_socket_address(&destination->address),
-	      interface->name
-	    );
-	  // close the interface if we had any error while sending broadcast packets,
-	  // unicast packets should not bring the interface down
-	  // TODO mark unicast destination as failed?
-	  if (destination == interface->destination)
-	    overlay_interface_close(interface);
-	  ob_free(buffer);
-	  return -1;
-	}
+	tx_queue(interface, buffer, &destination->address, destination == interface->destination);
       }
-      set_block(interface->alarm.poll.fd);
-      ob_free(buffer);
+      if (!tx_batching)
+	tx_flush();
       return 0;
     }
       
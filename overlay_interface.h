@@ -21,6 +21,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #ifndef __SERVAL_DNA__OVERLAY_INTERFACE_H
 #define __SERVAL_DNA__OVERLAY_INTERFACE_H
 
+#include "constants.h"
 #include "socket.h"
 
 #define INTERFACE_STATE_DOWN 0
@@ -96,6 +97,21 @@ struct network_destination {
 
   // Number of milliseconds of no packets until we assume the link is dead.
   unsigned reachable_timeout_ms;
+  
+  // queued frames that may be sent to this destination, per QOS queue, in queue order
+  struct packet_destination *ready_first[OQ_MAX];
+  struct packet_destination *ready_last[OQ_MAX];
+  // queued frames waiting for an ack or their resend delay, in transmit order
+  struct packet_destination *waiting_first;
+  struct packet_destination *waiting_last;
+  unsigned queued_count;
+  // deficit round-robin state, and what we have sent, per QOS queue
+  int deficit[OQ_MAX];
+  uint64_t tx_bytes[OQ_MAX];
+  unsigned tx_frames[OQ_MAX];
+  // other destinations with queued frames
+  struct network_destination *_next_queued;
+  struct network_destination *_prev_queued;
 };
 
 typedef struct overlay_interface {
@@ -108,6 +124,13 @@ typedef struct overlay_interface {
   int recv_count;
   int tx_count;
   
+  // maximum number of datagrams to read per wakeup, and how those reads went
+  unsigned rx_batch;
+  unsigned rx_batch_count;
+  unsigned rx_batch_packets;
+  unsigned rx_batch_largest;
+  unsigned rx_batch_full;
+  
   struct radio_link_state *radio_link_state;
 
   // copy of ifconfig flags
@@ -123,12 +146,17 @@ typedef struct overlay_interface {
    For radio links the actual maximum and the maximum that is likely to be delivered reliably are
    potentially two quite different values. */
   int mtu;
+  // microseconds to send one full packet at the interface's typical link rate, used when routing by airtime
+  int airtime;
   // can we use this interface for routes to addresses in other subnets?
   int default_route;
   // should we log more debug info on this interace? eg hex dumps of packets
   char debug;
   char local_echo;
 
+  // deficit round-robin quantum, in bytes, that each destination gets per QOS queue
+  int queue_weight[OQ_MAX];
+
   unsigned int uartbps; // set serial port speed (which might be different from link speed)
   int ctsrts; // enabled hardware flow control if non-zero
 
@@ -171,7 +199,11 @@ overlay_interface * overlay_interface_get_default();
 overlay_interface * overlay_interface_find(struct in_addr addr, int return_default);
 overlay_interface * overlay_interface_find_name(const char *name);
 int overlay_interface_compare(overlay_interface *one, overlay_interface *two);
+int overlay_interface_airtime(overlay_interface *interface);
 int overlay_broadcast_ensemble(struct network_destination *destination, struct overlay_buffer *buffer);
+void overlay_broadcast_batch_begin();
+void overlay_broadcast_batch_end();
 void interface_state_html(struct strbuf *b, struct overlay_interface *interface);
+void destination_state_html(struct strbuf *b, struct network_destination *destination);
 
 #endif // __SERVAL_DNA__OVERLAY_INTERFACE_H
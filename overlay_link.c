@@ -97,7 +97,7 @@ int set_reachable(struct subscriber *subscriber,
   int old_value = subscriber->reachable;
   subscriber->reachable = reachable;
   set_destination_ref(&subscriber->destination, destination);
-  subscriber->next_hop = next_hop;
+  set_subscriber_ref(&subscriber->next_hop, next_hop);
   
   // These log messages are for use in tests.  Changing them may break test scripts.
   if (config.debug.overlayrouting || config.debug.linkstate) {
@@ -238,8 +238,7 @@ int overlay_send_probe(struct subscriber *peer, struct network_destination *dest
   
   // TODO enhance overlay_send_frame to support pre-supplied network destinations
   
-  struct overlay_frame *frame=malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   frame->type=OF_TYPE_DATA;
   frame->source = my_subscriber;
   frame->next_hop = frame->destination = peer;
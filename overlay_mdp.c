@@ -50,6 +50,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include "serval.h"
 #include "conf.h"
 #include "str.h"
@@ -60,6 +61,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "overlay_interface.h"
 #include "overlay_packet.h"
 #include "mdp_client.h"
+#include "mdp_ring.h"
 #include "crypto.h"
 #include "keyring.h"
 #include "socket.h"
@@ -87,6 +89,41 @@ static struct sched_ent mdp_sock2_inet = {
   .poll={.fd = -1},
 };
 
+// local clients that have switched to a shared memory transport (see mdp_ring.h)
+struct mdp_ring_client{
+  // watches the eventfd that the client signals
+  struct sched_ent alarm;
+  struct mdp_ring_client *next;
+  struct socket_address client;
+  struct mdp_ring_shared *shared;
+  // the eventfd that we signal
+  int signal_fd;
+  // when the client stopped reading packets, if its ring is full
+  time_ms_t full_since;
+  char closed;
+  // release the client's bindings when the ring is freed
+  char release_bindings;
+};
+
+static struct profile_total mdp_ring_stats = { .name="mdp_ring_poll" };
+static struct mdp_ring_client *ring_clients=NULL;
+
+// give up on a client that hasn't read anything for this long
+#define MDP_RING_STALL_MS 5000
+// the most packets we read from one ring before returning to the event loop
+#define MDP_RING_POLL_PACKETS 64
+
+static struct mdp_ring_client *find_ring_client(const struct socket_address *client)
+{
+  struct mdp_ring_client *ring = ring_clients;
+  for (; ring; ring = ring->next)
+    if (!ring->closed && cmp_sockaddr(&ring->client, client)==0)
+      return ring;
+  return NULL;
+}
+
+static void mdp_ring_close(struct mdp_ring_client *ring, int release_bindings);
+
 static int overlay_saw_mdp_frame(
   struct internal_mdp_header *header, 
   struct overlay_buffer *payload);
@@ -220,22 +257,119 @@ int overlay_mdp_setup_sockets()
   return 0;
 }
 
-#define MDP_MAX_BINDINGS 100
 #define MDP_MAX_SOCKET_NAME_LEN 110
 
 struct mdp_binding{
+  // next binding in the same hash bucket
+  struct mdp_binding *_next;
   struct subscriber *subscriber;
   mdp_port_t port;
   int version;
   int (*internal)(struct internal_mdp_header *header, struct overlay_buffer *payload);
   struct socket_address client;
   time_ms_t binding_time;
+  // packets passed to, or lost on the way to, this binding
+  uint32_t delivered;
+  uint32_t dropped;
 };
 
-struct mdp_binding mdp_bindings[MDP_MAX_BINDINGS];
-int mdp_bindings_initialised=0;
+/* Bindings are keyed by (subscriber, port), but hashed on the port alone so that all bindings
+ * for a port share a bucket, and "ANY" bindings (NULL subscriber) can be found with the exact ones.
+ * The table doubles in size whenever it holds more bindings than buckets.
+ */
+static struct mdp_binding **mdp_bindings=NULL;
+static unsigned mdp_bindings_size=0;
+static unsigned mdp_bindings_count=0;
 mdp_port_t next_port_binding=256;
 
+static struct mdp_binding **binding_bucket(mdp_port_t port)
+{
+  return &mdp_bindings[(port * 2654435761u) & (mdp_bindings_size - 1)];
+}
+
+// find the binding for exactly this subscriber and port
+static struct mdp_binding *find_binding(struct subscriber *subscriber, mdp_port_t port)
+{
+  if (!mdp_bindings)
+    return NULL;
+  struct mdp_binding *binding = *binding_bucket(port);
+  for (; binding; binding = binding->_next)
+    if (binding->port == port && binding->subscriber == subscriber)
+      return binding;
+  return NULL;
+}
+
+// find the binding that should receive packets addressed to this subscriber and port
+static struct mdp_binding *match_binding(struct subscriber *subscriber, mdp_port_t port)
+{
+  if (!mdp_bindings)
+    return NULL;
+  struct mdp_binding *binding = *binding_bucket(port), *any = NULL;
+  for (; binding; binding = binding->_next){
+    if (binding->port != port)
+      continue;
+    /* exact match, so stop searching */
+    if (!subscriber || binding->subscriber == subscriber)
+      return binding;
+    /* If we find an "ANY" binding, remember it. But we will prefer an exact match if we find one */
+    if (!binding->subscriber)
+      any = binding;
+  }
+  return any;
+}
+
+static int grow_bindings()
+{
+  unsigned new_size = mdp_bindings_size ? mdp_bindings_size * 2 : 64;
+  struct mdp_binding **new_table = emalloc_zero(new_size * sizeof(struct mdp_binding *));
+  if (!new_table)
+    return -1;
+  struct mdp_binding **old_table = mdp_bindings;
+  unsigned old_size = mdp_bindings_size, i;
+  mdp_bindings = new_table;
+  mdp_bindings_size = new_size;
+  for (i = 0; i < old_size; i++){
+    while (old_table[i]){
+      struct mdp_binding *binding = old_table[i];
+      old_table[i] = binding->_next;
+      struct mdp_binding **bucket = binding_bucket(binding->port);
+      binding->_next = *bucket;
+      *bucket = binding;
+    }
+  }
+  if (old_table)
+    free(old_table);
+  return 0;
+}
+
+static struct mdp_binding *new_binding(struct subscriber *subscriber, mdp_port_t port)
+{
+  if (mdp_bindings_count >= mdp_bindings_size && grow_bindings() == -1)
+    return NULL;
+  struct mdp_binding *binding = emalloc_zero(sizeof(struct mdp_binding));
+  if (!binding)
+    return NULL;
+  set_subscriber_ref(&binding->subscriber, subscriber);
+  binding->port = port;
+  binding->binding_time = gettime_ms();
+  struct mdp_binding **bucket = binding_bucket(port);
+  binding->_next = *bucket;
+  *bucket = binding;
+  mdp_bindings_count++;
+  return binding;
+}
+
+static void free_binding(struct mdp_binding *binding)
+{
+  struct mdp_binding **ptr = binding_bucket(binding->port);
+  while (*ptr != binding)
+    ptr = &(*ptr)->_next;
+  *ptr = binding->_next;
+  mdp_bindings_count--;
+  set_subscriber_ref(&binding->subscriber, NULL);
+  free(binding);
+}
+
 static int overlay_mdp_reply(int sock, struct socket_address *client,
 			  overlay_mdp_frame *mdpreply)
 {
@@ -288,13 +422,42 @@ static int overlay_mdp_reply_ok(int sock, struct socket_address *client,
 static int overlay_mdp_releasebindings(struct socket_address *client)
 {
   /* Free up any MDP bindings held by this client. */
-  int i;
-  for(i=0;i<MDP_MAX_BINDINGS;i++)
-    if (cmp_sockaddr(&mdp_bindings[i].client, client)==0)
-      mdp_bindings[i].port=0;
-
+  unsigned i;
+  for(i=0;i<mdp_bindings_size;i++){
+    struct mdp_binding **ptr = &mdp_bindings[i];
+    while(*ptr){
+      struct mdp_binding *binding = *ptr;
+      if (binding->internal || cmp_sockaddr(&binding->client, client)!=0){
+	ptr = &binding->_next;
+	continue;
+      }
+      if (config.debug.mdprequests)
+	DEBUGF("Unbind MDP %s:%d from %s", 
+	  binding->subscriber?alloca_tohex_sid_t(binding->subscriber->sid):"All",
+	  binding->port,
+	  alloca_socket_address(client));
+      *ptr = binding->_next;
+      mdp_bindings_count--;
+      set_subscriber_ref(&binding->subscriber, NULL);
+      free(binding);
+    }
+  }
   return 0;
+}
 
+void overlay_mdp_bindings_status_html(struct strbuf *b)
+{
+  unsigned i;
+  uint32_t delivered=0, dropped=0;
+  for(i=0;i<mdp_bindings_size;i++){
+    struct mdp_binding *binding;
+    for (binding = mdp_bindings[i]; binding; binding = binding->_next){
+      delivered += binding->delivered;
+      dropped += binding->dropped;
+    }
+  }
+  strbuf_sprintf(b, "MDP bindings: %u in %u buckets, %u packets delivered, %u dropped<br>",
+    mdp_bindings_count, mdp_bindings_size, delivered, dropped);
 }
 
 static int overlay_mdp_process_bind_request(struct subscriber *subscriber, mdp_port_t port,
@@ -307,112 +470,59 @@ static int overlay_mdp_process_bind_request(struct subscriber *subscriber, mdp_p
     return WHYF("Port %d cannot be bound", port);
   }
   
-  if (!mdp_bindings_initialised) {
-    /* Mark all slots as unused */
-    int i;
-    for(i=0;i<MDP_MAX_BINDINGS;i++)
-      mdp_bindings[i].port=0;
-    mdp_bindings_initialised=1;
-  }
-
   /* See if binding already exists */
-  int free=-1;
-  {
-    int i;
-    for(i=0;i<MDP_MAX_BINDINGS;i++) {
-      /* Look for duplicate bindings */
-      if (mdp_bindings[i].port == port && mdp_bindings[i].subscriber == subscriber) {
-	if (cmp_sockaddr(&mdp_bindings[i].client, client)==0) {
-	  // this client already owns this port binding?
-	  INFO("Identical binding exists");
-	  return 0;
-	}else if(flags&MDP_FORCE){
-	  // steal the port binding
-	  free=i;
-	  break;
-	}else{
-	  return WHY("Port already in use");
-	}
-      }
-      /* Look for free slots in case we need one */
-      if ((free==-1)&&(mdp_bindings[i].port==0)) free=i;
+  struct mdp_binding *binding = find_binding(subscriber, port);
+  if (binding) {
+    if (cmp_sockaddr(&binding->client, client)==0) {
+      // this client already owns this port binding?
+      INFO("Identical binding exists");
+      return 0;
+    }else if(flags&MDP_FORCE){
+      // steal the port binding
+      binding->internal=NULL;
+      binding->delivered=binding->dropped=0;
+      binding->binding_time=gettime_ms();
+    }else{
+      return WHY("Port already in use");
     }
   }
  
   /* Okay, so no binding exists.  Make one, and return success.
-     If we have too many bindings, we should return an error.
      XXX - We don't find out when the socket responsible for a binding has died,
      so stale bindings can hang around.  We really need a solution to this, e.g., 
      probing the sockets periodically (by sending an MDP NOOP frame perhaps?) and
      destroying any socket that reports an error.
   */
-  if (free==-1) {
-    /* XXX Should we probe for stale bindings here and now, since this is when
-       we want the spare slots ?
-
-       Picking one at random is as good a policy as any.
-       Call listeners don't have a port binding, so are unaffected by this.
-    */
-    free=random()%MDP_MAX_BINDINGS;
-  }
+  if (!binding && !(binding = new_binding(subscriber, port)))
+    return WHY("Failed to allocate binding");
   /* Okay, record binding and report success */
-  mdp_bindings[free].port=port;
-  mdp_bindings[free].subscriber=subscriber;
-  mdp_bindings[free].version=0;
-  mdp_bindings[free].client.addrlen = client->addrlen;
-  memcpy(&mdp_bindings[free].client.addr, &client->addr, client->addrlen);
-  mdp_bindings[free].binding_time=gettime_ms();
+  binding->version=0;
+  binding->client.addrlen = client->addrlen;
+  memcpy(&binding->client.addr, &client->addr, client->addrlen);
   return 0;
 }
 
 int mdp_bind_internal(struct subscriber *subscriber, mdp_port_t port,
   int (*internal)(struct internal_mdp_header *header, struct overlay_buffer *payload))
 {
+  if (find_binding(subscriber, port))
+    return WHYF("Internal binding for port %d failed, port already in use", port);
   
-  int i;
-  struct mdp_binding *free_slot=NULL;
-  
-  if (!mdp_bindings_initialised) {
-    /* Mark all slots as unused */
-    int i;
-    for(i=0;i<MDP_MAX_BINDINGS;i++)
-      mdp_bindings[i].port=0;
-    mdp_bindings_initialised=1;
-  }
-  
-  for(i=0;i<MDP_MAX_BINDINGS;i++) {
-    if ((!free_slot) && mdp_bindings[i].port==0)
-      free_slot=&mdp_bindings[i];
-    
-    if (mdp_bindings[i].port == port 
-      && mdp_bindings[i].subscriber == subscriber)
-      return WHYF("Internal binding for port %d failed, port already in use", port);
-  }
-  
-  if (!free_slot)
-    return WHYF("Internal binding for port %d failed, no free slots", port);
+  struct mdp_binding *binding = new_binding(subscriber, port);
+  if (!binding)
+    return WHYF("Internal binding for port %d failed, out of memory", port);
     
-  free_slot->subscriber=subscriber;
-  free_slot->port=port;
-  free_slot->version=1;
-  free_slot->internal=internal;
-  free_slot->binding_time=gettime_ms();
+  binding->version=1;
+  binding->internal=internal;
   return 0;
 }
 
 int mdp_unbind_internal(struct subscriber *subscriber, mdp_port_t port,
   int (*internal)(struct internal_mdp_header *header, struct overlay_buffer *payload))
 {
-  int i;
-  for(i=0;i<MDP_MAX_BINDINGS;i++) {
-    if (mdp_bindings[i].port == port
-      && mdp_bindings[i].subscriber == subscriber
-      && mdp_bindings[i].internal == internal){
-      mdp_bindings[i].port=0;
-      mdp_bindings[i].subscriber=NULL;
-      mdp_bindings[i].internal=NULL;
-    }
-  }
+  struct mdp_binding *binding = find_binding(subscriber, port);
+  if (binding && binding->internal == internal)
+    free_binding(binding);
   return 0;
 }
 
@@ -472,44 +582,31 @@ static struct overlay_buffer *overlay_mdp_decrypt(struct internal_mdp_header *he
 	break;
       }
       
-      unsigned char *nonce=ob_get_bytes_ptr(payload, nb);
-      if (!nonce){
+      unsigned char nonce[nb];
+      if (ob_get_bytes(payload, nonce, nb)){
 	WHYF("Expected %d bytes of nonce", nb);
 	break;
       }
       
+      // decrypt in place, re-using the end of the nonce for crypto_box's leading zero bytes
       int cipher_len=ob_remaining(payload);
-      unsigned char *cipher_text=ob_get_bytes_ptr(payload, cipher_len);
-      if (!cipher_text){
-	WHYF("Expected %d bytes of cipher text", cipher_len);
-	break;
-      }
-      
-      struct overlay_buffer *plaintext = ob_new();
-      if (!ob_makespace(plaintext, cipher_len+cz)){
-	ob_free(plaintext);
-	break;
-      }
-      ob_limitsize(plaintext, cipher_len+cz);
-      
-      unsigned char *plain_block = ob_ptr(plaintext);
-      
-      bzero(plain_block, cz);
-      bcopy(cipher_text, &plain_block[cz], cipher_len);
+      unsigned char *cipher_block=ob_current_ptr(payload) - cz;
+      bzero(cipher_block, cz);
       cipher_len+=cz;
       
       if (crypto_box_curve25519xsalsa20poly1305_open_afternm
-	  (plain_block,plain_block,cipher_len,nonce,k)) {
-	ob_free(plaintext);
+	  (cipher_block,cipher_block,cipher_len,nonce,k)) {
 	WHYF("crypto_box_open_afternm() failed (from %s, to %s, len %d)",
 		    alloca_tohex_sid_t(header->source->sid), alloca_tohex_sid_t(header->destination->sid), cipher_len);
 	break;
       }
       
-      // consume leading zero bytes
-      ob_get_bytes_ptr(plaintext, zb);
-      overlay_mdp_decode_header(header, plaintext);
-      ret=plaintext;
+      // skip leading zero bytes
+      ret = ob_slice(payload, ob_position(payload) - cz + zb, cipher_len - zb);
+      if (!ret)
+	break;
+      ob_limitsize(ret, cipher_len - zb);
+      overlay_mdp_decode_header(header, ret);
       break;
     }
   }
@@ -518,7 +615,7 @@ static struct overlay_buffer *overlay_mdp_decrypt(struct internal_mdp_header *he
   OUT();
 }
 
-int overlay_saw_mdp_containing_frame(struct overlay_frame *f)
+static int saw_mdp_containing_frame(struct overlay_frame *f)
 {
   IN();
   /* Take frame source and destination and use them to populate mdp->in->{src,dst}
@@ -558,6 +655,77 @@ int overlay_saw_mdp_containing_frame(struct overlay_frame *f)
   OUT();
 }
 
+// incoming frames waiting for a worker thread to calculate the nm bytes needed to decrypt them
+#define MAX_PENDING_DECRYPT 16
+static unsigned pending_decrypt_count = 0;
+
+struct pending_decrypt{
+  struct overlay_frame *frame;
+  sid_t source_sid;
+  sid_t destination_sid;
+};
+
+static void pending_decrypt_ready(void *context)
+{
+  struct pending_decrypt *pending = context;
+  struct overlay_frame *f = pending->frame;
+  pending_decrypt_count--;
+  // either end may have been forgotten while we were waiting
+  f->source = find_subscriber(pending->source_sid.binary, SID_SIZE, 0);
+  f->destination = find_subscriber(pending->destination_sid.binary, SID_SIZE, 0);
+  if (f->source && f->destination)
+    saw_mdp_containing_frame(f);
+  op_free(f);
+  free(pending);
+}
+
+/* If decrypting this frame needs a new nm value, calculate it on a worker thread and process a copy
+ * of the frame afterwards, instead of stalling the main loop.  Frames waiting for the same value are
+ * processed in the order they arrived.  Once MAX_PENDING_DECRYPT frames are waiting, or if the
+ * value can't be calculated in the background, the frame is decrypted now as before.
+ */
+static int defer_decrypt(struct overlay_frame *f)
+{
+  if (pending_decrypt_count >= MAX_PENDING_DECRYPT || !keyring
+    || keyring_has_nm_bytes(&f->destination->sid, &f->source->sid))
+    return -1;
+  struct pending_decrypt *pending = emalloc_zero(sizeof(struct pending_decrypt));
+  if (!pending)
+    return -1;
+  // the callback may run before keyring_get_nm_bytes_async() returns, so copy the frame first,
+  // keeping only the payload bytes we haven't read yet
+  if ((pending->frame = op_new()) == NULL) {
+    free(pending);
+    return -1;
+  }
+  *pending->frame = *f;
+  pending->frame->prev = pending->frame->next = NULL;
+  if ((pending->frame->payload = ob_new()) != NULL)
+    ob_append_bytes(pending->frame->payload, ob_current_ptr(f->payload), ob_remaining(f->payload));
+  if (!pending->frame->payload || ob_overrun(pending->frame->payload)) {
+    op_free(pending->frame);
+    free(pending);
+    return -1;
+  }
+  ob_flip(pending->frame->payload);
+  pending->source_sid = f->source->sid;
+  pending->destination_sid = f->destination->sid;
+  pending_decrypt_count++;
+  if (keyring_get_nm_bytes_async(&pending->destination_sid, &pending->source_sid, pending_decrypt_ready, pending) == 0)
+    return 0;
+  pending_decrypt_count--;
+  op_free(pending->frame);
+  free(pending);
+  return -1;
+}
+
+int overlay_saw_mdp_containing_frame(struct overlay_frame *f)
+{
+  if ((f->modifiers & OF_CRYPTO_CIPHERED) && f->destination && defer_decrypt(f) == 0)
+    return 0;
+  return saw_mdp_containing_frame(f);
+}
+
 void mdp_init_response(const struct internal_mdp_header *in, struct internal_mdp_header *out)
 {
   out->source = in->destination ? in->destination : my_subscriber;
@@ -573,8 +741,6 @@ static int overlay_saw_mdp_frame(
   struct overlay_buffer *payload)
 {
   IN();
-  int i;
-  int match=-1;
 
   /* Regular MDP frame addressed to us.  Look for matching port binding,
      and if available, push to client.  Else do nothing, or if we feel nice
@@ -590,23 +756,10 @@ static int overlay_saw_mdp_frame(
   if (allow_incoming_packet(header) == RULE_DROP)
     RETURN(0);
   
-  for(i=0;i<MDP_MAX_BINDINGS;i++)
-    {
-      if (mdp_bindings[i].port!=header->destination_port)
-	continue;
-      
-      if ((!header->destination) || mdp_bindings[i].subscriber == header->destination){
-	/* exact match, so stop searching */
-	match=i;
-	break;
-      }else if (!mdp_bindings[i].subscriber){
-	/* If we find an "ANY" binding, remember it. But we will prefer an exact match if we find one */
-	match=i;
-      }
-    }
+  struct mdp_binding *binding = match_binding(header->destination, header->destination_port);
   
-  if (match>-1) {
-    switch(mdp_bindings[match].version){
+  if (binding) {
+    switch(binding->version){
       case 0:
 	{
 	  overlay_mdp_frame mdp;
@@ -616,31 +769,40 @@ static int overlay_saw_mdp_frame(
 	  ob_rewind(payload);
 	  
 	  ssize_t len = overlay_mdp_relevant_bytes(&mdp);
-	  if (len < 0)
+	  if (len < 0){
+	    binding->dropped++;
 	    RETURN(WHY("unsupported MDP packet type"));
-	  struct socket_address *client = &mdp_bindings[match].client;
+	  }
+	  // copy the address, the binding may be released
+	  struct socket_address client = binding->client;
 	  if (config.debug.mdprequests) 
-	    DEBUGF("Forwarding packet to client %s", alloca_socket_address(client));
-	  ssize_t r = sendto(mdp_sock.poll.fd, &mdp, len, 0, &client->addr, client->addrlen);
+	    DEBUGF("Forwarding packet to client %s", alloca_socket_address(&client));
+	  ssize_t r = sendto(mdp_sock.poll.fd, &mdp, len, 0, &client.addr, client.addrlen);
 	  if (r == -1){
-	    WHYF_perror("sendto(fd=%d,len=%zu,addr=%s)", mdp_sock.poll.fd, (size_t)len, alloca_socket_address(client));
+	    binding->dropped++;
+	    WHYF_perror("sendto(fd=%d,len=%zu,addr=%s)", mdp_sock.poll.fd, (size_t)len, alloca_socket_address(&client));
 	    if (errno == ENOENT){
 	      /* far-end of socket has died, so drop binding */
-	      INFOF("Closing dead MDP client '%s'", alloca_socket_address(client));
-	      overlay_mdp_releasebindings(client);
+	      INFOF("Closing dead MDP client '%s'", alloca_socket_address(&client));
+	      overlay_mdp_releasebindings(&client);
 	    }
 	    RETURN(-1);
 	  }
-	  if (r != len)
-	    RETURN(WHYF("sendto() sent %zu bytes of MDP reply (%zu) to %s", (size_t)r, (size_t)len, alloca_socket_address(client)));
+	  if (r != len){
+	    binding->dropped++;
+	    RETURN(WHYF("sendto() sent %zu bytes of MDP reply (%zu) to %s", (size_t)r, (size_t)len, alloca_socket_address(&client)));
+	  }
+	  binding->delivered++;
 	  RETURN(0);
 	}
       case 1:
 	{
-	  if (mdp_bindings[match].internal)
-	    RETURN(mdp_bindings[match].internal(header, payload));
+	  if (binding->internal){
+	    binding->delivered++;
+	    RETURN(binding->internal(header, payload));
+	  }
 	    
-	  struct socket_address *client = &mdp_bindings[match].client;
+	  struct socket_address *client = &binding->client;
 	  struct mdp_header client_header;
 	  client_header.local.sid=header->destination?header->destination->sid:SID_BROADCAST;
 	  client_header.local.port=header->destination_port;
@@ -656,7 +818,12 @@ static int overlay_saw_mdp_frame(
 	  size_t len = ob_remaining(payload);
 	  const uint8_t *ptr = ob_get_bytes_ptr(payload, len);
 	  
-	  RETURN(mdp_send2(client, &client_header, ptr, len));
+	  if (mdp_send2(client, &client_header, ptr, len)){
+	    binding->dropped++;
+	    RETURN(-1);
+	  }
+	  binding->delivered++;
+	  RETURN(0);
 	}
     }
   } else {
@@ -713,13 +880,13 @@ static int overlay_mdp_check_binding(struct subscriber *subscriber, mdp_port_t p
   /* Check if the address is in the list of bound addresses,
      and that the recvaddr matches. */
   
-  int i;
-  for(i = 0; i < MDP_MAX_BINDINGS; ++i) {
-    if (mdp_bindings[i].port != port)
+  struct mdp_binding *binding = mdp_bindings ? *binding_bucket(port) : NULL;
+  for(; binding; binding = binding->_next) {
+    if (binding->port != port)
       continue;
-    if ((!mdp_bindings[i].subscriber) || mdp_bindings[i].subscriber == subscriber) {
+    if ((!binding->subscriber) || binding->subscriber == subscriber) {
       /* Binding matches, now make sure the sockets match */
-      if (cmp_sockaddr(&mdp_bindings[i].client, client)==0) {
+      if (cmp_sockaddr(&binding->client, client)==0) {
 	/* Everything matches, so this unix socket and MDP address combination is valid */
 	return 0;
       }
@@ -742,42 +909,24 @@ void overlay_mdp_encode_ports(struct overlay_buffer *plaintext, mdp_port_t dst_p
     ob_append_packed_ui32(plaintext, src_port);
 }
 
-static struct overlay_buffer * encrypt_payload(
+// headroom needed in front of the plain text to encrypt it in place and prepend the nonce
+#define MDP_CRYPT_HEADROOM (crypto_box_curve25519xsalsa20poly1305_NONCEBYTES \
+  + crypto_box_curve25519xsalsa20poly1305_ZEROBYTES \
+  - crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES)
+
+// replace the plain text in payload with the nonce and cipher text
+static int encrypt_payload(
   struct subscriber *source, 
   struct subscriber *dest, 
-  const unsigned char *buffer,
-  int cipher_len)
+  struct overlay_buffer *payload)
 {
   int zb=crypto_box_curve25519xsalsa20poly1305_ZEROBYTES;
   int nb=crypto_box_curve25519xsalsa20poly1305_NONCEBYTES;
   int cz=crypto_box_curve25519xsalsa20poly1305_BOXZEROBYTES;
   
-  // generate plain message with leading zero bytes and get ready to cipher it
-  // TODO, add support for leading zero's in overlay_buffer's, so we don't need to copy the plain text
-  unsigned char plain[zb+cipher_len];
-  
-  /* zero bytes */
-  bzero(&plain[0],zb);
-  bcopy(buffer,&plain[zb],cipher_len);
-  
-  cipher_len+=zb;
-  
-  struct overlay_buffer *ret = ob_new();
-  if (ret == NULL)
-    return NULL;
-  
-  unsigned char *nonce = ob_append_space(ret, nb+cipher_len);
-  if (!nonce){
-    ob_free(ret);
-    return NULL;
-  }
-  unsigned char *cipher_text = nonce + nb;
-
-  if (generate_nonce(nonce,nb)){
-    ob_free(ret);
-    WHY("generate_nonce() failed to generate nonce");
-    return NULL;
-  }
+  unsigned char nonce[nb];
+  if (generate_nonce(nonce,nb))
+    return WHY("generate_nonce() failed to generate nonce");
   
   // reserve the high bit of the nonce as a flag for transmitting a shorter nonce.
   nonce[0]&=0x7f;
@@ -785,40 +934,25 @@ static struct overlay_buffer * encrypt_payload(
   /* get pre-computed PKxSK bytes (the slow part of auth-cryption that can be
      retained and reused, and use that to do the encryption quickly. */
   unsigned char *k=keyring_get_nm_bytes(&source->sid, &dest->sid);
-  if (!k) {
-    ob_free(ret);
-    WHY("could not compute Curve25519(NxM)");
-    return NULL;
-  }
+  if (!k)
+    return WHY("could not compute Curve25519(NxM)");
+  
+  // crypto_box needs leading zero bytes in front of the plain text, which it replaces with 
+  // leading zero bytes in front of the cipher text
+  size_t cipher_len = ob_position(payload);
+  unsigned char *plain = ob_push(payload, zb);
+  if (!plain)
+    return WHY("Not enough headroom to encrypt payload");
+  bzero(plain, zb);
+  cipher_len+=zb;
   
   /* Actually authcrypt the payload */
-  if (crypto_box_curve25519xsalsa20poly1305_afternm(cipher_text, plain,cipher_len, nonce, k)) {
-    ob_free(ret);
-    WHY("crypto_box_afternm() failed");
-    return NULL;
-  }
-  
-#if 0
-  if (config.debug.crypto) {
-    DEBUG("authcrypted mdp frame");
-    dump("nm",k,crypto_box_curve25519xsalsa20poly1305_BEFORENMBYTES);
-    dump("plain text",plain,sizeof(plain));
-    dump("nonce",nonce,nb);
-    dump("cipher text",cipher_text,cipher_len);
-  }
-#endif
-  
-  /* now shuffle down to get rid of the temporary space that crypto_box uses. 
-   TODO extend overlay buffer so we don't need this.
-   */
-  bcopy(&cipher_text[cz],&cipher_text[0],cipher_len-cz);
-  ret->position-=cz;
-#if 0
-  if (config.debug.crypto)
-    dump("frame", &ret->bytes[0], ret->position);
-#endif
+  if (crypto_box_curve25519xsalsa20poly1305_afternm(plain, plain, cipher_len, nonce, k))
+    return WHY("crypto_box_afternm() failed");
   
-  return ret;
+  ob_pull(payload, cz);
+  bcopy(nonce, ob_push(payload, nb), nb);
+  return 0;
 }
 
 // encrypt or sign the plaintext, then queue the frame for transmission.
@@ -855,7 +989,7 @@ int overlay_send_frame(struct internal_mdp_header *header,
       header->destination?alloca_tohex_sid_t(header->destination->sid):"broadcast", header->destination_port);
       
   /* Prepare the overlay frame for dispatch */
-  struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   if (!frame)
     return -1;
   
@@ -870,8 +1004,12 @@ int overlay_send_frame(struct internal_mdp_header *header,
     frame->modifiers |= OF_CRYPTO_SIGNED;
   
   // copy the plain text message into a new buffer, with the wire encoded port numbers
+  // leaving room to encrypt it in place
   struct overlay_buffer *plaintext=ob_new();
-  if (!plaintext){
+  if (!plaintext 
+    || (header->crypt_flags == 0 && !ob_reserve_headroom(plaintext, MDP_CRYPT_HEADROOM))){
+    if (plaintext)
+      ob_free(plaintext);
     op_free(frame);
     return -1;
   }
@@ -908,9 +1046,8 @@ int overlay_send_frame(struct internal_mdp_header *header,
     }
   
     /* crypted and signed (using CryptoBox authcryption primitive) */
-    frame->payload = encrypt_payload(frame->source, frame->destination, ob_ptr(plaintext), ob_position(plaintext));
-    if (!frame->payload){
-      ob_free(plaintext);
+    frame->payload = plaintext;
+    if (encrypt_payload(frame->source, frame->destination, frame->payload) == -1){
       op_free(frame);
       return -1;
     }
@@ -1315,18 +1452,11 @@ static void mdp_process_packet(struct socket_address *client, struct mdp_header
   bzero(&internal_header, sizeof(internal_header));
   
   if ((header->flags & MDP_FLAG_CLOSE) && header->local.port==0){
-    int i;
-    for(i=0;i<MDP_MAX_BINDINGS;i++) {
-      if (mdp_bindings[i].port!=0 
-	&& cmp_sockaddr(&mdp_bindings[i].client, client)==0){
-	if (config.debug.mdprequests)
-	  DEBUGF("Unbind MDP %s:%d from %s", 
-	    mdp_bindings[i].subscriber?alloca_tohex_sid_t(mdp_bindings[i].subscriber->sid):"All",
-	    mdp_bindings[i].port,
-	    alloca_socket_address(client));
-	mdp_bindings[i].port=0;
-      }
-    }
+    overlay_mdp_releasebindings(client);
+    // a ring client whose ring was full says goodbye through the socket
+    struct mdp_ring_client *ring = find_ring_client(client);
+    if (ring)
+      mdp_ring_close(ring, 0);
     // should we expect clients to wait?
     return;
   }
@@ -1348,7 +1478,7 @@ static void mdp_process_packet(struct socket_address *client, struct mdp_header
     }
   }
   
-  struct mdp_binding *binding=NULL, *free_slot=NULL;
+  struct mdp_binding *binding=NULL;
   
   // assign the next available port number
   if (header->local.port==0 && header->flags & MDP_FLAG_BIND){
@@ -1365,20 +1495,7 @@ static void mdp_process_packet(struct socket_address *client, struct mdp_header
   internal_header.qos = header->qos;
   
   // find matching binding
-  {
-    int i;
-    for(i=0;i<MDP_MAX_BINDINGS;i++) {
-      if ((!free_slot) && mdp_bindings[i].port==0)
-	free_slot=&mdp_bindings[i];
-      
-      if (mdp_bindings[i].port == header->local.port 
-	&& mdp_bindings[i].subscriber == internal_header.source){
-	
-	binding = &mdp_bindings[i];
-	break;
-      }
-    }
-  }
+  binding = find_binding(internal_header.source, header->local.port);
   
   if (header->flags & MDP_FLAG_BIND){
     if (binding){
@@ -1387,9 +1504,9 @@ static void mdp_process_packet(struct socket_address *client, struct mdp_header
       return;
     }
     
-    if (!free_slot){
+    if (!(binding = new_binding(internal_header.source, header->local.port))){
       mdp_reply_error(client, header);
-      WHY("Max supported bindings reached");
+      WHY("Failed to allocate binding");
       return;
     }
     
@@ -1400,12 +1517,8 @@ static void mdp_process_packet(struct socket_address *client, struct mdp_header
 	alloca_socket_address(client));
     
     // claim binding
-    binding = free_slot;
-    binding->port = header->local.port;
-    binding->subscriber = internal_header.source;
     bcopy(&client->addr, &binding->client.addr, client->addrlen);
     binding->client.addrlen = client->addrlen;
-    binding->binding_time=gettime_ms();
     binding->version=1;
     
     // tell the client what we actually bound (with flags & MDP_FLAG_BIND still set)
@@ -1480,14 +1593,44 @@ static void mdp_process_packet(struct socket_address *client, struct mdp_header
 	binding->subscriber?alloca_tohex_sid_t(binding->subscriber->sid):"All",
 	binding->port,
 	alloca_socket_address(client));
-    binding->port=0;
+    free_binding(binding);
     binding=NULL;
   }
 }
 
+static void mdp_ring_close(struct mdp_ring_client *ring, int release_bindings)
+{
+  // the ring and the client's bindings may be in use further up the stack, 
+  // so release them from the ring's own alarm
+  ring->closed = 1;
+  if (release_bindings)
+    ring->release_bindings = 1;
+  unschedule(&ring->alarm);
+  ring->alarm.alarm = gettime_ms();
+  ring->alarm.deadline = ring->alarm.alarm;
+  schedule(&ring->alarm);
+}
+
 static int mdp_send2(const struct socket_address *client, const struct mdp_header *header, 
   const uint8_t *payload, size_t payload_len)
 {
+  struct mdp_ring_client *ring = find_ring_client(client);
+  if (ring){
+    if (mdp_ring_write(&ring->shared->to_client, ring->signal_fd, header, payload, payload_len) == 0){
+      ring->full_since = 0;
+      return 0;
+    }
+    // we can't tell when the client process dies, but it will stop reading
+    time_ms_t now = gettime_ms();
+    if (!ring->full_since)
+      ring->full_since = now;
+    else if (now - ring->full_since > MDP_RING_STALL_MS){
+      INFOF("Closing stalled MDP client '%s'", alloca_socket_address(client));
+      mdp_ring_close(ring, 1);
+    }
+    return WHYF("MDP ring for %s is full", alloca_socket_address(client));
+  }
+  
   struct iovec iov[]={
     {
       .iov_base = (void *)header,
@@ -1524,6 +1667,126 @@ static int mdp_send2(const struct socket_address *client, const struct mdp_heade
   return 0;
 }
 
+static void mdp_ring_free(struct mdp_ring_client *ring)
+{
+  struct mdp_ring_client **ptr = &ring_clients;
+  while (*ptr != ring)
+    ptr = &(*ptr)->next;
+  *ptr = ring->next;
+  if (config.debug.mdprequests)
+    DEBUGF("Closed shared memory ring for %s", alloca_socket_address(&ring->client));
+  if (is_watching(&ring->alarm))
+    unwatch(&ring->alarm);
+  if (is_scheduled(&ring->alarm))
+    unschedule(&ring->alarm);
+  close(ring->alarm.poll.fd);
+  close(ring->signal_fd);
+  munmap(ring->shared, sizeof(struct mdp_ring_shared));
+  free(ring);
+}
+
+static void mdp_ring_poll(struct sched_ent *alarm)
+{
+  struct mdp_ring_client *ring = (struct mdp_ring_client *)alarm;
+  if (!ring->closed && (alarm->poll.revents & POLLIN)) {
+    mdp_ring_clear_signal(alarm->poll.fd);
+    unsigned count;
+    for (count = 0; !ring->closed; count++){
+      // let everything else have a turn, we'll wake up again for the rest
+      if (count >= MDP_RING_POLL_PACKETS){
+	if (!mdp_ring_empty(&ring->shared->to_daemon))
+	  mdp_ring_signal(alarm->poll.fd);
+	break;
+      }
+      uint8_t payload[1200];
+      struct mdp_header header;
+      ssize_t len = mdp_ring_read(&ring->shared->to_daemon, &header, payload, sizeof payload);
+      if (len == -1)
+	break;
+      if (len == -2){
+	WHYF("Invalid packet in MDP ring from %s", alloca_socket_address(&ring->client));
+	ring->closed = 1;
+	ring->release_bindings = 1;
+	break;
+      }
+      struct overlay_buffer *buff = ob_static(payload, len);
+      ob_limitsize(buff, len);
+      mdp_process_packet(&ring->client, &header, buff);
+      ob_free(buff);
+      // the client is going away
+      if ((header.flags & MDP_FLAG_CLOSE) && header.local.port==0)
+	ring->closed = 1;
+    }
+  }
+  if (ring->closed){
+    if (ring->release_bindings)
+      overlay_mdp_releasebindings(&ring->client);
+    mdp_ring_free(ring);
+  }
+}
+
+static void mdp_ring_attach(struct socket_address *client, struct mdp_header *header, int *fds, size_t fd_count)
+{
+  struct mdp_ring_shared *shared = MAP_FAILED;
+  struct stat st;
+  if (fd_count != 3){
+    WHYF("Expected 3 file descriptors for an MDP ring, got %zu", fd_count);
+    goto error;
+  }
+  // a client could otherwise truncate the file and crash us with SIGBUS
+  if (!mdp_ring_is_sealed(fds[0])){
+    WHYF("MDP ring from %s is not sealed", alloca_socket_address(client));
+    goto error;
+  }
+  if (fstat(fds[0], &st) == -1){
+    WHYF_perror("fstat(%d)", fds[0]);
+    goto error;
+  }
+  if (st.st_size < (off_t)sizeof(struct mdp_ring_shared)){
+    WHYF("MDP ring from %s is too small", alloca_socket_address(client));
+    goto error;
+  }
+  shared = mmap(NULL, sizeof(struct mdp_ring_shared), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  if (shared == MAP_FAILED){
+    WHYF_perror("mmap(%d)", fds[0]);
+    goto error;
+  }
+  struct mdp_ring_client *ring = emalloc_zero(sizeof(struct mdp_ring_client));
+  if (!ring)
+    goto error;
+  
+  // replace any ring this client set up before
+  struct mdp_ring_client *old = find_ring_client(client);
+  if (old)
+    mdp_ring_close(old, 0);
+  
+  // tell the client through the socket, before we start using the ring
+  mdp_reply2(client, header, 0, NULL, 0);
+  
+  close(fds[0]);
+  ring->client = *client;
+  ring->shared = shared;
+  ring->signal_fd = fds[2];
+  ring->alarm.function = mdp_ring_poll;
+  ring->alarm.stats = &mdp_ring_stats;
+  ring->alarm.poll.fd = fds[1];
+  ring->alarm.poll.events = POLLIN;
+  ring->next = ring_clients;
+  ring_clients = ring;
+  watch(&ring->alarm);
+  if (config.debug.mdprequests)
+    DEBUGF("Using shared memory ring for %s", alloca_socket_address(client));
+  return;
+  
+error:
+  if (shared != MAP_FAILED)
+    munmap(shared, sizeof(struct mdp_ring_shared));
+  size_t i;
+  for (i = 0; i < fd_count; i++)
+    close(fds[i]);
+  mdp_reply_error(client, header);
+}
+
 static void mdp_poll2(struct sched_ent *alarm)
 {
   if (alarm->poll.revents & POLLIN) {
@@ -1531,6 +1794,11 @@ static void mdp_poll2(struct sched_ent *alarm)
     struct mdp_header header;
     struct socket_address client;
     client.addrlen=sizeof(client.addr);
+    // clients may pass us file descriptors to set up a shared memory ring
+    union {
+      struct cmsghdr header;
+      uint8_t buff[CMSG_SPACE(sizeof(int) * 3)];
+    } control;
     
     struct iovec iov[]={
       {
@@ -1548,6 +1816,8 @@ static void mdp_poll2(struct sched_ent *alarm)
       .msg_namelen=sizeof(client.store),
       .msg_iov=iov,
       .msg_iovlen=2,
+      .msg_control=control.buff,
+      .msg_controllen=sizeof control.buff,
     };
     
     ssize_t len = recvmsg(alarm->poll.fd, &hdr, 0);
@@ -1555,14 +1825,41 @@ static void mdp_poll2(struct sched_ent *alarm)
       WHYF_perror("recvmsg(%d,%p,0)", alarm->poll.fd, &hdr);
       return;
     }
+    
+    int fds[3];
+    size_t fd_count = 0;
+    struct cmsghdr *cmsg;
+    for (cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)){
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+	continue;
+      size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      int *received = (int *)CMSG_DATA(cmsg);
+      size_t i;
+      for (i = 0; i < n; i++){
+	if (fd_count < NELS(fds))
+	  fds[fd_count++] = received[i];
+	else
+	  close(received[i]);
+      }
+    }
+    
     if ((size_t)len < sizeof header) {
       WHYF("Expected length %zu, got %zu from %s", sizeof header, (size_t)len, alloca_socket_address(&client));
+      while (fd_count)
+	close(fds[--fd_count]);
       return;
     }
     
     client.addrlen = hdr.msg_namelen;
     size_t payload_len = (size_t)(len - sizeof header);
     
+    if (is_sid_t_any(header.remote.sid) && header.remote.port == MDP_RING){
+      mdp_ring_attach(&client, &header, fds, fd_count);
+      return;
+    }
+    while (fd_count)
+      close(fds[--fd_count]);
+    
     struct overlay_buffer *buff = ob_static(payload, payload_len);
     ob_limitsize(buff, payload_len);
     
@@ -1741,3 +2038,92 @@ static void overlay_mdp_poll(struct sched_ent *alarm)
   }
   return;
 }
+
+/* Compare the cost of passing packets between two processes through a datagram socket, and
+ * through a shared memory ring, in batches as a busy client would.
+ */
+int app_mdp_ring_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const unsigned packet_count = 200000;
+  const unsigned batch = 16;
+  const size_t payload_len = 1024;
+  uint8_t payload[MDP_MTU];
+  struct mdp_header header;
+  unsigned i, j;
+  bzero(&header, sizeof header);
+  memset(payload, 0x55, sizeof payload);
+  
+  int sv[2];
+  if (socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == -1)
+    return WHY_perror("socketpair");
+  struct iovec iov[]={
+    {
+      .iov_base = (void *)&header,
+      .iov_len = sizeof header
+    },
+    {
+      .iov_base = (void *)payload,
+      .iov_len = payload_len
+    }
+  };
+  struct msghdr hdr={
+    .msg_iov=iov,
+    .msg_iovlen=2,
+  };
+  time_ms_t start = gettime_ms();
+  for (i = 0; i < packet_count; i += batch){
+    for (j = 0; j < batch; j++)
+      if (sendmsg(sv[0], &hdr, 0) == -1)
+	return WHY_perror("sendmsg");
+    for (j = 0; j < batch; j++){
+      struct pollfd fds = {.fd = sv[1], .events = POLLIN};
+      if (poll(&fds, 1, 1000) != 1)
+	return WHY("poll");
+      if (recvmsg(sv[1], &hdr, 0) == -1)
+	return WHY_perror("recvmsg");
+    }
+  }
+  time_ms_t socket_elapsed = gettime_ms() - start;
+  close(sv[0]);
+  close(sv[1]);
+  
+  struct mdp_ring_shared *shared = mmap(NULL, sizeof(struct mdp_ring_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED)
+    return WHY_perror("mmap");
+  int signal_fd = mdp_ring_signal_fd();
+  if (signal_fd == -1)
+    return -1;
+  struct mdp_ring *ring = &shared->to_client;
+  start = gettime_ms();
+  for (i = 0; i < packet_count; i += batch){
+    for (j = 0; j < batch; j++)
+      if (mdp_ring_write(ring, signal_fd, &header, payload, payload_len))
+	return WHY("Ring is full");
+    // the reader sleeps until signalled, then reads until the ring is empty
+    struct pollfd fds = {.fd = signal_fd, .events = POLLIN};
+    if (poll(&fds, 1, 1000) != 1)
+      return WHY("poll");
+    mdp_ring_clear_signal(signal_fd);
+    unsigned count = 0;
+    while (mdp_ring_read(ring, &header, payload, sizeof payload) >= 0)
+      count++;
+    if (count != batch)
+      return WHYF("Read %u packets from the ring, expected %u", count, batch);
+  }
+  time_ms_t ring_elapsed = gettime_ms() - start;
+  close(signal_fd);
+  munmap(shared, sizeof(struct mdp_ring_shared));
+  
+  double bytes = (double)packet_count * (sizeof header + payload_len);
+  cli_printf(context, "Socket: %u packets of %zu bytes in %"PRId64"ms, %.0f packets per second, %.1f MB/s\n",
+    packet_count, payload_len, (int64_t)socket_elapsed,
+    socket_elapsed ? packet_count * 1000.0 / socket_elapsed : 0.0,
+    socket_elapsed ? bytes / socket_elapsed / 1000.0 : 0.0);
+  cli_printf(context, "Ring: %u packets of %zu bytes in %"PRId64"ms, %.0f packets per second, %.1f MB/s\n",
+    packet_count, payload_len, (int64_t)ring_elapsed,
+    ring_elapsed ? packet_count * 1000.0 / ring_elapsed : 0.0,
+    ring_elapsed ? bytes / ring_elapsed / 1000.0 : 0.0);
+  return 0;
+}
@@ -35,6 +35,13 @@ struct packet_destination{
   time_ms_t transmit_time;
   // the actual out going stream for this packet
   struct network_destination *destination;
+  
+  // links in one of the destination's lists of queued frames
+  struct overlay_frame *frame;
+  struct packet_destination *_next;
+  struct packet_destination *_prev;
+  // are we waiting to see if the last transmission was acknowledged?
+  char waiting;
 };
 
 struct overlay_frame {
@@ -43,6 +50,8 @@ struct overlay_frame {
   struct overlay_frame *next;
   // when did we insert into the queue?
   time_ms_t enqueued_at;
+  // position in the queue, to keep per destination lists in the same order
+  uint64_t _queue_order;
   
   // deprecated, all future "types" should just be assigned port numbers
   unsigned int type;
@@ -111,6 +120,10 @@ struct internal_mdp_header{
 };
 
 
+struct mem_pool;
+extern struct mem_pool overlay_frame_pool;
+
+struct overlay_frame *op_new();
 int op_free(struct overlay_frame *p);
 struct overlay_frame *op_dup(struct overlay_frame *f);
 
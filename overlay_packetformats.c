@@ -307,7 +307,8 @@ int parseEnvelopeHeader(struct decode_context *context, struct overlay_interface
     
     if (interface->point_to_point && interface->other_device!=context->sender){
       INFOF("Established point to point link with %s on %s", alloca_tohex_sid_t(context->sender->sid), interface->name);
-      context->point_to_point_device = context->interface->other_device = context->sender;
+      set_subscriber_ref(&context->interface->other_device, context->sender);
+      context->point_to_point_device = context->sender;
     }
     
     if (config.debug.overlayframes)
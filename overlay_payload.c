@@ -123,6 +123,14 @@ cleanup:
   return -1;
 }
 
+struct mem_pool overlay_frame_pool = MEM_POOL_INIT("overlay_frame", sizeof(struct overlay_frame), 256);
+
+// allocate a new, zeroed frame
+struct overlay_frame *op_new()
+{
+  return pool_alloc_zero(&overlay_frame_pool);
+}
+
 int op_free(struct overlay_frame *p)
 {
   if (!p) return WHY("Asked to free NULL");
@@ -132,7 +140,7 @@ int op_free(struct overlay_frame *p)
   p->next=NULL;
   if (p->payload) ob_free(p->payload);
   p->payload=NULL;
-  free(p);
+  pool_free(&overlay_frame_pool, p);
   return 0;
 }
 
@@ -141,7 +149,7 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
   if (!in) return NULL;
 
   /* clone the frame */
-  struct overlay_frame *out = emalloc(sizeof(struct overlay_frame));
+  struct overlay_frame *out = pool_alloc(&overlay_frame_pool);
   if (out == NULL)
     return NULL;
 
@@ -150,7 +158,7 @@ struct overlay_frame *op_dup(struct overlay_frame *in)
 
   if (in->payload) {
     if ((out->payload = ob_dup(in->payload)) == NULL) {
-      free(out);
+      pool_free(&overlay_frame_pool, out);
       return NULL;
     }
   }
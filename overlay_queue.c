@@ -18,6 +18,7 @@
 
 
 #include <assert.h>
+#include <math.h>
 #include "serval.h"
 #include "conf.h"
 #include "overlay_buffer.h"
@@ -36,6 +37,15 @@ typedef struct overlay_txqueue {
   /* Latency target in ms for this traffic class.
    Frames older than the latency target will get dropped. */
   int latencyTarget;
+  
+  /* CoDel active queue management state.
+   Once frames have been waiting longer than the target for a whole interval, we start dropping 
+   them, more often the longer the congestion lasts. */
+  time_ms_t aqm_first_above;
+  time_ms_t aqm_drop_next;
+  unsigned aqm_count;
+  char aqm_dropping;
+  unsigned aqm_drops;
 } overlay_txqueue;
 
 overlay_txqueue overlay_tx[OQ_MAX];
@@ -51,6 +61,8 @@ struct outgoing_packet{
 };
 
 #define SMALL_PACKET_SIZE (400)
+// maximum number of packets to assemble in one pass of the queues
+#define OVERLAY_SEND_BATCH (16)
 
 int32_t mdp_sequence=0;
 struct sched_ent next_packet;
@@ -77,6 +89,122 @@ int overlay_queue_init(){
   return 0;
 }
 
+/* Every queued frame is also linked into a list for each of its destinations, so that filling a
+ packet only has to look at frames that can go to that packet's destination.
+ */
+
+// destinations that have frames queued
+static struct network_destination *queued_destinations=NULL;
+// whose turn is it next in each queue?
+static struct network_destination *drr_next[OQ_MAX];
+static uint64_t queue_order=0;
+
+static void destination_list(struct packet_destination *pd, 
+			     struct packet_destination ***first, struct packet_destination ***last)
+{
+  if (pd->waiting){
+    *first = &pd->destination->waiting_first;
+    *last = &pd->destination->waiting_last;
+  }else{
+    *first = &pd->destination->ready_first[pd->frame->queue];
+    *last = &pd->destination->ready_last[pd->frame->queue];
+  }
+}
+
+static void destination_list_unlink(struct packet_destination *pd)
+{
+  struct packet_destination **first, **last;
+  destination_list(pd, &first, &last);
+  if (pd->_prev)
+    pd->_prev->_next = pd->_next;
+  else
+    *first = pd->_next;
+  if (pd->_next)
+    pd->_next->_prev = pd->_prev;
+  else
+    *last = pd->_prev;
+  pd->_next = pd->_prev = NULL;
+}
+
+// insert before the given entry, or at the end of the list
+static void destination_list_insert(struct packet_destination *pd, struct packet_destination *before)
+{
+  struct packet_destination **first, **last;
+  destination_list(pd, &first, &last);
+  pd->_next = before;
+  pd->_prev = before ? before->_prev : *last;
+  if (pd->_prev)
+    pd->_prev->_next = pd;
+  else
+    *first = pd;
+  if (before)
+    before->_prev = pd;
+  else
+    *last = pd;
+}
+
+static void index_destination(struct overlay_frame *frame, int i)
+{
+  struct packet_destination *pd = &frame->destinations[i];
+  struct network_destination *destination = pd->destination;
+  pd->frame = frame;
+  pd->waiting = 0;
+  // new frames are always the last in their queue
+  destination_list_insert(pd, NULL);
+  if (destination->queued_count++ == 0){
+    destination->_prev_queued = NULL;
+    destination->_next_queued = queued_destinations;
+    if (queued_destinations)
+      queued_destinations->_prev_queued = destination;
+    queued_destinations = destination;
+  }
+}
+
+static void unindex_destination(struct packet_destination *pd)
+{
+  struct network_destination *destination = pd->destination;
+  destination_list_unlink(pd);
+  if (--destination->queued_count == 0){
+    int q;
+    for (q=0;q<OQ_MAX;q++){
+      if (drr_next[q]==destination)
+	drr_next[q]=destination->_next_queued;
+      destination->deficit[q]=0;
+    }
+    if (destination->_prev_queued)
+      destination->_prev_queued->_next_queued = destination->_next_queued;
+    else
+      queued_destinations = destination->_next_queued;
+    if (destination->_next_queued)
+      destination->_next_queued->_prev_queued = destination->_prev_queued;
+    destination->_next_queued = destination->_prev_queued = NULL;
+  }
+}
+
+// we have just sent this frame, don't look at it again until the resend delay has passed
+static void destination_wait(struct packet_destination *pd, time_ms_t now)
+{
+  pd->transmit_time = now;
+  destination_list_unlink(pd);
+  pd->waiting = 1;
+  destination_list_insert(pd, NULL);
+}
+
+// move frames whose resend delay has passed back into the ready lists
+static void destination_promote(struct network_destination *destination, time_ms_t now)
+{
+  struct packet_destination *pd;
+  while ((pd = destination->waiting_first) 
+    && pd->transmit_time + destination->resend_delay <= now){
+    destination_list_unlink(pd);
+    pd->waiting = 0;
+    struct packet_destination *before = destination->ready_first[pd->frame->queue];
+    while (before && before->frame->_queue_order < pd->frame->_queue_order)
+      before = before->_next;
+    destination_list_insert(pd, before);
+  }
+}
+
 /* remove and free a payload from the queue */
 static struct overlay_frame *
 overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
@@ -94,8 +222,11 @@ overlay_queue_remove(overlay_txqueue *queue, struct overlay_frame *frame){
   
   queue->length--;
   
-  while(frame->destination_count>0)
-    release_destination_ref(frame->destinations[--frame->destination_count].destination);
+  while(frame->destination_count>0){
+    struct packet_destination *pd = &frame->destinations[--frame->destination_count];
+    unindex_destination(pd);
+    release_destination_ref(pd->destination);
+  }
     
   op_free(frame);
   
@@ -183,17 +314,21 @@ int overlay_payload_enqueue(struct overlay_frame *p)
     if (!p->destination){
       // hook to allow for flooding via olsr
       olsr_send(p);
-      
-      link_add_destinations(p);
-
-      // just drop it now
-      if (p->destination_count == 0){
-        if (config.debug.mdprequests)
-	  DEBUGF("Not transmitting, as we have nowhere to send it");
-	// free the packet and return success.
-	op_free(p);
-	return 0;
-      }
+    }
+    
+    link_add_destinations(p);
+    
+    // degrade packet version if required to reach the destination
+    if (p->destination && p->packet_version > p->next_hop->max_packet_version)
+      p->packet_version = p->next_hop->max_packet_version;
+
+    // just drop it now
+    if (p->destination_count == 0){
+      if (config.debug.mdprequests)
+	DEBUGF("Not transmitting, as we have nowhere to send it");
+      // free the packet and return success.
+      op_free(p);
+      return 0;
     }
     
     // allow the packet to be resent
@@ -201,9 +336,19 @@ int overlay_payload_enqueue(struct overlay_frame *p)
       p->resend = 1;
   }
   
-  int i=0;
+  int i=0, j;
   for (i=0;i<p->destination_count;i++){
+    // each destination may only appear once
+    for (j=0;j<i;j++)
+      if (p->destinations[j].destination == p->destinations[i].destination)
+	break;
+    if (j<i){
+      release_destination_ref(p->destinations[i].destination);
+      p->destinations[i--] = p->destinations[--p->destination_count];
+      continue;
+    }
     p->destinations[i].sent_sequence=-1;
+    p->destinations[i].transmit_time=0;
     if (config.debug.verbose && config.debug.overlayframes)
       DEBUGF("Sending %s on interface %s", 
 	  p->destinations[i].destination->unicast?"unicast":"broadcast",
@@ -215,10 +360,13 @@ int overlay_payload_enqueue(struct overlay_frame *p)
   p->prev=l;
   p->next=NULL;
   p->enqueued_at=gettime_ms();
+  p->_queue_order=++queue_order;
   p->mdp_sequence = -1;
   queue->last=p;
   if (!queue->first) queue->first=p;
   queue->length++;
+  for (i=0;i<p->destination_count;i++)
+    index_destination(p, i);
   if (p->queue==OQ_ISOCHRONOUS_VOICE)
     rhizome_saw_voice_traffic();
   
@@ -278,10 +426,24 @@ int overlay_queue_schedule_next(time_ms_t next_allowed_packet){
 }
 
 static void remove_destination(struct overlay_frame *frame, int i){
+  unindex_destination(&frame->destinations[i]);
   release_destination_ref(frame->destinations[i].destination);
   frame->destination_count --;
-  if (i<frame->destination_count)
-    frame->destinations[i]=frame->destinations[frame->destination_count];
+  if (i<frame->destination_count){
+    // move the last entry into this slot, and fix up the list pointers that referred to it
+    struct packet_destination *pd = &frame->destinations[i];
+    *pd = frame->destinations[frame->destination_count];
+    struct packet_destination **first, **last;
+    destination_list(pd, &first, &last);
+    if (pd->_prev)
+      pd->_prev->_next = pd;
+    else
+      *first = pd;
+    if (pd->_next)
+      pd->_next->_prev = pd;
+    else
+      *last = pd;
+  }
 }
 
 // update the alarm time and return 1 if changed
@@ -330,174 +492,335 @@ overlay_calc_queue_time(struct overlay_frame *frame)
   return 0;
 }
 
+// frames are appended in time order, so the next frame to expire is always at the head of the queue
 static void
-overlay_stuff_packet(struct outgoing_packet *packet, overlay_txqueue *queue, time_ms_t now){
-  struct overlay_frame *frame = queue->first;
-  
-  // TODO stop when the packet is nearly full?
-  while(frame){
-    if (frame->enqueued_at + queue->latencyTarget < now){
-      if (config.debug.overlayframes)
-	DEBUGF("Dropping frame type %x (length %zu) for %s due to expiry timeout", 
-	       frame->type, frame->payload->checkpointLength,
-	       frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All");
-      frame = overlay_queue_remove(queue, frame);
+overlay_queue_expire(overlay_txqueue *queue, time_ms_t now){
+  struct overlay_frame *frame;
+  while((frame = queue->first) && frame->enqueued_at + queue->latencyTarget < now){
+    if (config.debug.overlayframes)
+      DEBUGF("Dropping frame type %x (length %zu) for %s due to expiry timeout", 
+	     frame->type, frame->payload->checkpointLength,
+	     frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All");
+    overlay_queue_remove(queue, frame);
+  }
+}
+
+// drop every destination on interfaces that have gone down
+static void
+overlay_queue_purge(){
+  struct network_destination *destination;
+restart:
+  for (destination = queued_destinations; destination; destination = destination->_next_queued){
+    if (destination->interface->state==INTERFACE_STATE_UP)
       continue;
+    // the destination may be freed along with its last frame
+    unsigned remaining = destination->queued_count;
+    while(remaining--){
+      struct packet_destination *pd = destination->waiting_first;
+      int q;
+      for (q=0;!pd && q<OQ_MAX;q++)
+	pd = destination->ready_first[q];
+      struct overlay_frame *frame = pd->frame;
+      remove_destination(frame, pd - frame->destinations);
+      if (frame->destination_count==0)
+	overlay_queue_remove(&overlay_tx[frame->queue], frame);
     }
-    
-    /* Note, once we queue a broadcast packet we are currently 
-     * committed to sending it to every destination, 
-     * even if we hear it from somewhere else in the mean time
-     */
-    
-    // ignore payloads that are waiting for ack / nack resends
-    if (frame->delay_until > now)
-      goto skip;
+    goto restart;
+  }
+}
 
-    if (packet->buffer && packet->destination->encapsulation==ENCAP_SINGLE)
-      goto skip;
-      
-    // quickly skip payloads that have no chance of fitting
-    if (packet->buffer && ob_limit(frame->payload) > ob_remaining(packet->buffer))
-      goto skip;
-    
-    if (frame->destination_count==0 && frame->destination){
-      link_add_destinations(frame);
-      
-      int i=0;
-      for (i=0;i<frame->destination_count;i++){
-	frame->destinations[i].sent_sequence=-1;
-	if (config.debug.verbose && config.debug.overlayframes)
-	  DEBUGF("Sending %s on interface %s", 
-	      frame->destinations[i].destination->unicast?"unicast":"broadcast",
-	      frame->destinations[i].destination->interface->name);
+static time_ms_t aqm_control_law(time_ms_t t, int interval, unsigned count)
+{
+  return t + (time_ms_t)(interval / sqrt(count));
+}
+
+/* Called as each frame leaves the queue for the first time. Returns 1 if CoDel decided to drop
+ the frame instead, in which case it has been removed.
+ */
+static int
+overlay_queue_aqm_drop(overlay_txqueue *queue, struct overlay_frame *frame, time_ms_t now){
+  if (!config.mdp.aqm.enable || frame->transmit_count)
+    return 0;
+  int target = config.mdp.aqm.target_ms >= 0 ? config.mdp.aqm.target_ms : queue->latencyTarget / 20;
+  int interval = config.mdp.aqm.interval_ms >= 0 ? config.mdp.aqm.interval_ms : queue->latencyTarget / 4;
+  time_ms_t sojourn = now - frame->enqueued_at;
+  
+  int ok_to_drop = 0;
+  // never drop the last frame, there is no standing queue
+  if (sojourn < target || queue->length <= 1){
+    queue->aqm_first_above = 0;
+  }else if (queue->aqm_first_above == 0){
+    queue->aqm_first_above = now + interval;
+  }else if (now >= queue->aqm_first_above){
+    ok_to_drop = 1;
+  }
+  
+  if (queue->aqm_dropping){
+    if (!ok_to_drop){
+      queue->aqm_dropping = 0;
+      return 0;
+    }
+    if (now < queue->aqm_drop_next)
+      return 0;
+    queue->aqm_count++;
+    queue->aqm_drop_next = aqm_control_law(queue->aqm_drop_next, interval, queue->aqm_count);
+  }else{
+    if (!ok_to_drop)
+      return 0;
+    queue->aqm_dropping = 1;
+    // if we were dropping recently, carry on at about the same rate
+    if (queue->aqm_count > 2 && now - queue->aqm_drop_next < 16 * interval)
+      queue->aqm_count -= 2;
+    else
+      queue->aqm_count = 1;
+    queue->aqm_drop_next = aqm_control_law(now, interval, queue->aqm_count);
+  }
+  
+  queue->aqm_drops++;
+  if (config.debug.overlayframes)
+    DEBUGF("Dropping frame type %x (length %zu) for %s after waiting %"PRId64"ms in queue %d (%u drops)", 
+	   frame->type, ob_position(frame->payload),
+	   frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All",
+	   (int64_t)sojourn, frame->queue, queue->aqm_drops);
+  overlay_queue_remove(queue, frame);
+  return 1;
+}
+
+void overlay_queue_status_html(struct strbuf *b)
+{
+  static const char *queue_names[OQ_MAX] = {"voice", "management", "video", "ordinary", "opportunistic"};
+  int i;
+  for (i=0; i<OQ_MAX; i++){
+    if (overlay_tx[i].length || overlay_tx[i].aqm_drops)
+      strbuf_sprintf(b, "Queue %s: %d frames, %u dropped early%s<br>",
+	queue_names[i], overlay_tx[i].length, overlay_tx[i].aqm_drops,
+	overlay_tx[i].aqm_dropping ? ", dropping" : "");
+  }
+}
+
+// when could this frame next be sent to this destination?
+static time_ms_t
+destination_next_time(struct packet_destination *pd){
+  struct overlay_frame *frame = pd->frame;
+  time_ms_t next = frame->delay_until;
+  if (next < frame->enqueued_at)
+    next = frame->enqueued_at;
+  if (ob_position(frame->payload)<SMALL_PACKET_SIZE &&
+      next < frame->enqueued_at + overlay_tx[frame->queue].small_packet_grace_interval)
+    next = frame->enqueued_at + overlay_tx[frame->queue].small_packet_grace_interval;
+  if (pd->waiting && next < pd->transmit_time + pd->destination->resend_delay)
+    next = pd->transmit_time + pd->destination->resend_delay;
+  return next;
+}
+
+// work out when the next packet could be sent, from the frames queued for each destination
+static void
+overlay_queue_schedule(){
+  time_ms_t next_allowed_packet=0;
+  struct network_destination *destination;
+  for (destination = queued_destinations; destination; destination = destination->_next_queued){
+    if (radio_link_is_busy(destination->interface))
+      continue;
+    time_ms_t limit = limit_next_allowed(&destination->transfer_limit);
+    time_ms_t next = 0;
+    struct packet_destination *pd;
+    int q;
+    for (q=0;q<OQ_MAX && (next==0 || next > limit);q++){
+      for (pd = destination->ready_first[q]; pd; pd = pd->_next){
+	time_ms_t t = destination_next_time(pd);
+	if (next==0 || t < next)
+	  next = t;
+	// nothing can be sent before the rate limit allows it anyway
+	if (next <= limit)
+	  break;
       }
-      
-      // degrade packet version if required to reach the destination
-      if (frame->packet_version > frame->next_hop->max_packet_version)
-	frame->packet_version = frame->next_hop->max_packet_version;
     }
-    
-    int destination_index=-1;
-    {
-      int i;
-      for (i=frame->destination_count -1;i>=0;i--){
-	struct network_destination *dest = frame->destinations[i].destination;
-	if (!dest)
-	  FATALF("Destination %d is NULL", i);
-	if (!dest->interface)
-	  FATALF("Destination interface %d is NULL", i);
-	if (dest->interface->state!=INTERFACE_STATE_UP){
-	  // remove this destination
-	  remove_destination(frame, i);
-	  continue;
+    // the waiting list is in resend order, so stop once no later entry can be any sooner
+    for (pd = destination->waiting_first; pd && (next==0 || next > limit); pd = pd->_next){
+      if (next && pd->transmit_time + destination->resend_delay >= next)
+	break;
+      time_ms_t t = destination_next_time(pd);
+      if (next==0 || t < next)
+	next = t;
+    }
+    if (next==0)
+      continue;
+    if (next < limit)
+      next = limit;
+    if (next_allowed_packet==0 || next < next_allowed_packet)
+      next_allowed_packet = next;
+  }
+  if (next_allowed_packet)
+    overlay_queue_schedule_next(next_allowed_packet);
+}
+
+// the oldest frame we could send to this destination from this queue right now
+static struct packet_destination *
+destination_first_ready(struct network_destination *destination, int queue, time_ms_t now){
+  // skip this interface if the stream tx buffer has data
+  if (radio_link_is_busy(destination->interface))
+    return NULL;
+  // can we send a packet on this interface now?
+  if (limit_next_allowed(&destination->transfer_limit) > now)
+    return NULL;
+  struct packet_destination *pd;
+  for (pd = destination->ready_first[queue]; pd; pd = pd->_next){
+    // ignore payloads that are waiting for ack / nack resends
+    if (pd->frame->delay_until <= now)
+      return pd;
+  }
+  return NULL;
+}
+
+static int destination_quantum(struct network_destination *destination, int queue)
+{
+  int quantum = destination->interface->queue_weight[queue];
+  return quantum > 0 ? quantum : 1;
+}
+
+/* Pick the next frame to send from the highest priority queue that has one. Within each queue,
+ destinations take turns by deficit round-robin, so each may send about queue_weight bytes per
+ round, and one busy neighbour cannot starve the others.
+ */
+static struct packet_destination *
+overlay_queue_pick(time_ms_t now){
+  int q;
+  for (q=0;q<OQ_MAX;q++){
+    if (!drr_next[q])
+      drr_next[q]=queued_destinations;
+    struct network_destination *start = drr_next[q];
+    if (!start)
+      return NULL;
+    // work out how many rounds it would take until some destination can send its next frame,
+    // the first in turn that needs the fewest rounds will win
+    int rounds=0;
+    struct network_destination *destination = start, *winner=NULL;
+    struct packet_destination *picked=NULL;
+    do{
+      struct packet_destination *pd = destination_first_ready(destination, q, now);
+      if (!destination->ready_first[q])
+	destination->deficit[q] = 0;
+      if (pd){
+	int needed = (int)ob_position(pd->frame->payload) - destination->deficit[q];
+	if (needed <= 0){
+	  drr_next[q] = destination;
+	  return pd;
 	}
-	
-	if (frame->destinations[i].transmit_time && 
-	  frame->destinations[i].transmit_time + frame->destinations[i].destination->resend_delay > now)
-	  continue;
-	
-	if (packet->buffer){
-	  if (frame->packet_version!=packet->packet_version)
-	    continue;
-	  
-	  // is this packet going our way?
-	  if (dest==packet->destination){
-	    destination_index=i;
-	    break;
-	  }
-	}else{
-	  // skip this interface if the stream tx buffer has data
-	  if (radio_link_is_busy(dest->interface))
-	    continue;
-	    
-	  // can we send a packet on this interface now?
-	  if (limit_is_allowed(&dest->transfer_limit))
-	    continue;
-      
-	  // send a packet to this destination
-	  if (frame->source_full)
-	    my_subscriber->send_full=1;
-	  if (overlay_init_packet(packet, frame->packet_version, dest) != -1) {
-	    destination_index=i;
-	    frame->destinations[i].sent_sequence = dest->sequence_number;
-	    break;
-	  }
+	int quantum = destination_quantum(destination, q);
+	int r = (needed + quantum - 1) / quantum;
+	if (!picked || r < rounds){
+	  rounds = r;
+	  winner = destination;
+	  picked = pd;
 	}
       }
-    }
-    
-    if (frame->destination_count==0){
-      frame = overlay_queue_remove(queue, frame);
+      destination = destination->_next_queued ? destination->_next_queued : queued_destinations;
+    }while(destination != start);
+    if (!picked)
       continue;
-    }
-    
-    if (destination_index==-1)
-      goto skip;
-    
-    if (frame->send_hook){
-      // last minute check if we really want to send this frame, or track when we sent it
-      if (frame->send_hook(frame, packet->seq, frame->send_context)){
-        // drop packet
-        frame = overlay_queue_remove(queue, frame);
-        continue;
-      }
-    }
+    // play those rounds all at once, destinations after the winner don't get their quantum for the last one
+    int after=0;
+    do{
+      if (destination_first_ready(destination, q, now))
+	destination->deficit[q] += (after ? rounds - 1 : rounds) * destination_quantum(destination, q);
+      if (destination == winner)
+	after=1;
+      destination = destination->_next_queued ? destination->_next_queued : queued_destinations;
+    }while(destination != start);
+    drr_next[q] = winner;
+    return picked;
+  }
+  return NULL;
+}
 
-    if (frame->mdp_sequence == -1){
-      frame->mdp_sequence = mdp_sequence = (mdp_sequence+1)&0xFFFF;
-    }else if(((mdp_sequence - frame->mdp_sequence)&0xFFFF) >= 64){
-      // too late, we've sent too many packets for the next hop to correctly de-duplicate
-      if (config.debug.overlayframes)
-        DEBUGF("Retransmition of frame %p mdp seq %d, is too late to be de-duplicated", 
-	  frame, frame->mdp_sequence);
-      frame = overlay_queue_remove(queue, frame);
-      continue;
-    }
-    
-    char will_retransmit=1;
-    if (frame->packet_version<1 || frame->resend<=0 || packet->seq==-1)
-      will_retransmit=0;
-    
-    if (overlay_frame_append_payload(&packet->context, packet->destination->encapsulation, frame, packet->buffer, will_retransmit)){
-      // payload was not queued, delay the next attempt slightly
-      frame->delay_until = now + 5;
-      goto skip;
-    }
-    
-    {
-      struct packet_destination *dest = &frame->destinations[destination_index];
-      dest->sent_sequence = dest->destination->sequence_number;
-      dest->transmit_time = now;
-    }
-    
-    frame->transmit_count++;
-    
-    if (config.debug.overlayframes){
-      DEBUGF("Appended payload %p, %d type %x len %zd for %s via %s", 
-	     frame, frame->mdp_sequence,
-	     frame->type, ob_position(frame->payload),
-	     frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All",
-	     frame->next_hop?alloca_tohex_sid_t(frame->next_hop->sid):alloca_tohex(frame->broadcast_id.id, BROADCAST_LEN));
+// append a frame to the packet, then either forget about it or wait for an ack
+static void
+overlay_queue_append(struct outgoing_packet *packet, struct packet_destination *pd, time_ms_t now){
+  struct overlay_frame *frame = pd->frame;
+  overlay_txqueue *queue = &overlay_tx[frame->queue];
+  
+  if (frame->send_hook){
+    // last minute check if we really want to send this frame, or track when we sent it
+    if (frame->send_hook(frame, packet->seq, frame->send_context)){
+      // drop packet
+      overlay_queue_remove(queue, frame);
+      return;
     }
+  }
+
+  if (frame->mdp_sequence == -1){
+    frame->mdp_sequence = mdp_sequence = (mdp_sequence+1)&0xFFFF;
+  }else if(((mdp_sequence - frame->mdp_sequence)&0xFFFF) >= 64){
+    // too late, we've sent too many packets for the next hop to correctly de-duplicate
+    if (config.debug.overlayframes)
+      DEBUGF("Retransmition of frame %p mdp seq %d, is too late to be de-duplicated", 
+	frame, frame->mdp_sequence);
+    overlay_queue_remove(queue, frame);
+    return;
+  }
+  
+  char will_retransmit=1;
+  if (frame->packet_version<1 || frame->resend<=0 || packet->seq==-1)
+    will_retransmit=0;
+  
+  if (overlay_frame_append_payload(&packet->context, packet->destination->encapsulation, frame, packet->buffer, will_retransmit)){
+    // payload was not queued, delay the next attempt slightly
+    frame->delay_until = now + 5;
+    return;
+  }
+  
+  pd->sent_sequence = pd->destination->sequence_number;
+  frame->transmit_count++;
+  pd->destination->deficit[frame->queue] -= ob_position(frame->payload);
+  pd->destination->tx_bytes[frame->queue] += ob_position(frame->payload);
+  pd->destination->tx_frames[frame->queue]++;
+  
+  if (config.debug.overlayframes){
+    DEBUGF("Appended payload %p, %d type %x len %zd for %s via %s", 
+	   frame, frame->mdp_sequence,
+	   frame->type, ob_position(frame->payload),
+	   frame->destination?alloca_tohex_sid_t(frame->destination->sid):"All",
+	   frame->next_hop?alloca_tohex_sid_t(frame->next_hop->sid):alloca_tohex(frame->broadcast_id.id, BROADCAST_LEN));
+  }
+  
+  // dont retransmit if we aren't sending sequence numbers, or we've been asked not to
+  if (!will_retransmit){
+    if (config.debug.overlayframes)
+      DEBUGF("Not waiting for retransmission (%d, %d, %d)", frame->packet_version, frame->resend, packet->seq);
+    remove_destination(frame, pd - frame->destinations);
+    if (frame->destination_count==0)
+      overlay_queue_remove(queue, frame);
+    return;
+  }
+  
+  // TODO recalc route on retransmittion??
+  destination_wait(pd, now);
+}
+
+// add every frame from this queue that can go to the packet's destination
+static void
+overlay_stuff_packet(struct outgoing_packet *packet, int queue, time_ms_t now){
+  struct packet_destination *pd = packet->destination->ready_first[queue];
+  
+  // TODO stop when the packet is nearly full?
+  while(pd){
+    struct packet_destination *next = pd->_next;
+    struct overlay_frame *frame = pd->frame;
     
-    // dont retransmit if we aren't sending sequence numbers, or we've been asked not to
-    if (!will_retransmit){
-      if (config.debug.overlayframes)
-	DEBUGF("Not waiting for retransmission (%d, %d, %d)", frame->packet_version, frame->resend, packet->seq);
-      remove_destination(frame, destination_index);
-      if (frame->destination_count==0){
-	frame = overlay_queue_remove(queue, frame);
-	continue;
-      }
-    }
+    /* Note, once we queue a broadcast packet we are currently 
+     * committed to sending it to every destination, 
+     * even if we hear it from somewhere else in the mean time
+     */
     
-    // TODO recalc route on retransmittion??
+    // ignore payloads that are waiting for ack / nack resends, 
+    // and quickly skip payloads that have no chance of fitting
+    if (frame->delay_until <= now
+      && frame->packet_version==packet->packet_version
+      && ob_limit(frame->payload) <= ob_remaining(packet->buffer)
+      && !overlay_queue_aqm_drop(&overlay_tx[queue], frame, now))
+      overlay_queue_append(packet, pd, now);
     
-  skip:
-    // if we can't send the payload now, check when we should try next
-    overlay_calc_queue_time(frame);
-    frame = frame->next;
+    pd = next;
   }
 }
 
@@ -512,10 +835,34 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
   next_packet.alarm=0;
   next_packet.deadline=0;
   
-  for (i=0;i<OQ_MAX;i++){
-    overlay_txqueue *queue=&overlay_tx[i];
-    
-    overlay_stuff_packet(packet, queue, now);
+  for (i=0;i<OQ_MAX;i++)
+    overlay_queue_expire(&overlay_tx[i], now);
+  overlay_queue_purge();
+  struct network_destination *destination;
+  for (destination = queued_destinations; destination; destination = destination->_next_queued)
+    destination_promote(destination, now);
+  
+  if (!packet->buffer){
+    // the first frame we can send decides where this packet is going
+    struct packet_destination *pd;
+    while((pd = overlay_queue_pick(now)) 
+      && overlay_queue_aqm_drop(&overlay_tx[pd->frame->queue], pd->frame, now))
+      ;
+    if (pd){
+      struct overlay_frame *frame = pd->frame;
+      limit_is_allowed(&pd->destination->transfer_limit);
+      if (frame->source_full)
+	my_subscriber->send_full=1;
+      if (overlay_init_packet(packet, frame->packet_version, pd->destination) != -1) {
+	pd->sent_sequence = pd->destination->sequence_number;
+	overlay_queue_append(packet, pd, now);
+      }
+    }
+  }
+  
+  if (packet->buffer && packet->destination->encapsulation!=ENCAP_SINGLE){
+    for (i=0;i<OQ_MAX;i++)
+      overlay_stuff_packet(packet, i, now);
   }
   
   if(packet->buffer){
@@ -527,17 +874,28 @@ overlay_fill_send_packet(struct outgoing_packet *packet, time_ms_t now) {
   }
   if (packet->destination)
     release_destination_ref(packet->destination);
+  overlay_queue_schedule();
   RETURN(ret);
   OUT();
 }
 
-// when the queue timer elapses, send a packet
+// when the queue timer elapses, send as many packets as our queues and rate limits allow
 static void overlay_send_packet(struct sched_ent *UNUSED(alarm))
 {
-  struct outgoing_packet packet;
-  bzero(&packet, sizeof(struct outgoing_packet));
-  packet.seq=-1;
-  overlay_fill_send_packet(&packet, gettime_ms());
+  time_ms_t now = gettime_ms();
+  int i;
+  overlay_broadcast_batch_begin();
+  for (i=0;i<OVERLAY_SEND_BATCH;i++){
+    struct outgoing_packet packet;
+    bzero(&packet, sizeof(struct outgoing_packet));
+    packet.seq=-1;
+    if (!overlay_fill_send_packet(&packet, now))
+      break;
+    // stop when nothing else can be sent yet
+    if (!is_scheduled(&next_packet) || next_packet.alarm > now)
+      break;
+  }
+  overlay_broadcast_batch_end();
 }
 
 int overlay_send_tick_packet(struct network_destination *destination)
@@ -549,65 +907,67 @@ int overlay_send_tick_packet(struct network_destination *destination)
   return 0;
 }
 
+static void overlay_queue_ack_frame(struct subscriber *neighbour, struct network_destination *destination,
+				    struct packet_destination *pd, uint32_t ack_mask, int ack_seq, time_ms_t now)
+{
+  struct overlay_frame *frame = pd->frame;
+  int frame_seq = pd->sent_sequence;
+  if (frame_seq <0 || (frame->next_hop != neighbour && frame->destination))
+    return;
+  int seq_delta = (ack_seq - frame_seq)&0xFF;
+  char acked = (seq_delta==0 || (seq_delta <= 32 && ack_mask&(1<<(seq_delta-1))))?1:0;
+
+  if (acked){
+    int rtt = now - pd->transmit_time;
+    // if we're on a fake network, the actual rtt can be unrealistic
+    if (rtt <5)
+      rtt=5;
+    if (!destination->min_rtt || rtt < destination->min_rtt){
+      destination->min_rtt = rtt;
+      int delay = rtt * 2 + 40;
+      if (delay < destination->resend_delay){
+	destination->resend_delay = delay;
+	if (config.debug.linkstate)
+	  DEBUGF("Adjusting resend delay to %d", destination->resend_delay);
+      }
+    }
+    if (!destination->max_rtt || rtt > destination->max_rtt)
+      destination->max_rtt = rtt;
+    
+    if (config.debug.ack)
+      DEBUGF("DROPPED DUE TO ACK: Packet %p to %s sent by seq %d, acked with seq %d", 
+	frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
+	
+    // drop packets that don't need to be retransmitted
+    if (frame->destination || frame->destination_count<=1)
+      overlay_queue_remove(&overlay_tx[frame->queue], frame);
+    else
+      remove_destination(frame, pd - frame->destinations);
+    
+  }else if (seq_delta < 128 && frame->destination && frame->delay_until>now){
+    // retransmit asap
+    if (config.debug.ack)
+      DEBUGF("RE-TX DUE TO NACK: Requeue packet %p to %s sent by seq %d due to ack of seq %d", frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
+    frame->delay_until = now;
+    overlay_calc_queue_time(frame);
+  }
+}
+
 // de-queue all packets that have been sent to this subscriber & have arrived.
 int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *destination, uint32_t ack_mask, int ack_seq)
 {
-  int i, j;
   time_ms_t now = gettime_ms();
+  // each frame appears at most once in this destination's lists, so the next entry survives removing this one
+  struct packet_destination *pd, *next;
+  for (pd = destination->waiting_first; pd; pd = next){
+    next = pd->_next;
+    overlay_queue_ack_frame(neighbour, destination, pd, ack_mask, ack_seq, now);
+  }
+  int i;
   for (i=0;i<OQ_MAX;i++){
-    struct overlay_frame *frame = overlay_tx[i].first;
-
-    while(frame){
-      
-      for (j=frame->destination_count -1;j>=0;j--)
-	if (frame->destinations[j].destination==destination)
-	  break;
-	  
-      if (j>=0){
-	int frame_seq = frame->destinations[j].sent_sequence;
-	if (frame_seq >=0 && (frame->next_hop == neighbour || !frame->destination)){
-	  int seq_delta = (ack_seq - frame_seq)&0xFF;
-	  char acked = (seq_delta==0 || (seq_delta <= 32 && ack_mask&(1<<(seq_delta-1))))?1:0;
-
-	  if (acked){
-	    int rtt = now - frame->destinations[j].transmit_time;
-	    // if we're on a fake network, the actual rtt can be unrealistic
-	    if (rtt <5)
-	      rtt=5;
-	    if (!destination->min_rtt || rtt < destination->min_rtt){
-	      destination->min_rtt = rtt;
-	      int delay = rtt * 2 + 40;
-	      if (delay < destination->resend_delay){
-		destination->resend_delay = delay;
-		if (config.debug.linkstate)
-		  DEBUGF("Adjusting resend delay to %d", destination->resend_delay);
-	      }
-	    }
-	    if (!destination->max_rtt || rtt > destination->max_rtt)
-	      destination->max_rtt = rtt;
-	    
-	    if (config.debug.ack)
-	      DEBUGF("DROPPED DUE TO ACK: Packet %p to %s sent by seq %d, acked with seq %d", 
-		frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
-		
-	    // drop packets that don't need to be retransmitted
-	    if (frame->destination || frame->destination_count<=1){
-	      frame = overlay_queue_remove(&overlay_tx[i], frame);
-	      continue;
-	    }
-	    remove_destination(frame, j);
-	    
-	  }else if (seq_delta < 128 && frame->destination && frame->delay_until>now){
-	    // retransmit asap
-	    if (config.debug.ack)
-	      DEBUGF("RE-TX DUE TO NACK: Requeue packet %p to %s sent by seq %d due to ack of seq %d", frame, alloca_tohex_sid_t(neighbour->sid), frame_seq, ack_seq);
-	    frame->delay_until = now;
-	    overlay_calc_queue_time(frame);
-	  }
-	}
-      }
-      
-      frame = frame->next;
+    for (pd = destination->ready_first[i]; pd; pd = next){
+      next = pd->_next;
+      overlay_queue_ack_frame(neighbour, destination, pd, ack_mask, ack_seq, now);
     }
   }
   return 0;
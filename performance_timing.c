@@ -247,6 +247,27 @@ int fd_func_enter(struct __sourceloc __whence, struct call_stats *this_call)
   return 0;
 }
 
+static void fd_register_stats(struct profile_total *totals)
+{
+  if (!totals->_initialised){
+    totals->_initialised=1;
+    totals->_next = stats_head;
+    fd_clearstat(totals);
+    stats_head = totals;
+  }
+}
+
+void fd_tally_call(struct profile_total *totals, time_ms_t elapsed)
+{
+  fd_register_stats(totals);
+  totals->total_time+=elapsed;
+  totals->calls++;
+  if (elapsed>totals->max_time) totals->max_time=elapsed;
+  // the time is already included in the caller's own time, don't count it twice
+  if (current_call)
+    current_call->child_time+=elapsed;
+}
+
 int fd_func_exit(struct __sourceloc __whence, struct call_stats *this_call)
 {
   // If current_call does not match this_call, then all bets are off as to where it points.  It
@@ -264,12 +285,8 @@ int fd_func_exit(struct __sourceloc __whence, struct call_stats *this_call)
   time_ms_t elapsed = now - this_call->enter_time;
   current_call = this_call->prev;
   
-  if (this_call->totals && !this_call->totals->_initialised){
-    this_call->totals->_initialised=1;
-    this_call->totals->_next = stats_head;
-    fd_clearstat(this_call->totals);
-    stats_head = this_call->totals;
-  }
+  if (this_call->totals)
+    fd_register_stats(this_call->totals);
   
   if (current_call)
     current_call->child_time+=elapsed;
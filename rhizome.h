@@ -465,6 +465,27 @@ int rhizome_read_manifest_from_file(rhizome_manifest *m, const char *filename);
 int rhizome_manifest_validate(rhizome_manifest *m);
 int rhizome_manifest_parse(rhizome_manifest *m);
 int rhizome_manifest_verify(rhizome_manifest *m);
+int rhizome_manifest_verify_async(rhizome_manifest *m, void (*completed)(rhizome_manifest *m, void *context), void *context);
+
+/* The SHA-512 hash of a payload, computed on a worker thread in batches of RHIZOME_HASH_BATCH_SIZE
+ * bytes, while the main thread reads or writes the next batch.
+ */
+#define RHIZOME_HASH_BATCH_SIZE (64*1024)
+struct rhizome_hash_stream{
+  SHA512_CTX context;
+  // data waiting to be hashed
+  unsigned char *buffer;
+  size_t size;
+  // data being hashed by a worker thread
+  struct work_item work;
+  unsigned char *work_buffer;
+  size_t work_size;
+  char busy;
+};
+void rhizome_hash_init(struct rhizome_hash_stream *stream);
+void rhizome_hash_update(struct rhizome_hash_stream *stream, const unsigned char *data, size_t len);
+void rhizome_hash_final(struct rhizome_hash_stream *stream, rhizome_filehash_t *hash_out);
+void rhizome_hash_cancel(struct rhizome_hash_stream *stream);
 
 int rhizome_hash_file(rhizome_manifest *m, const char *path, rhizome_filehash_t *hash_out, uint64_t *size_out);
 
@@ -540,6 +561,7 @@ sqlite3_stmt *_sqlite_prepare(struct __sourceloc, int log_level, sqlite_retry_st
 int _sqlite_bind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, ...);
 int _sqlite_vbind(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement, va_list ap);
 sqlite3_stmt *_sqlite_prepare_bind(struct __sourceloc, int log_level, sqlite_retry_state *retry, const char *sqltext, ...);
+void sqlite_release(sqlite3_stmt *statement);
 int _sqlite_retry(struct __sourceloc, sqlite_retry_state *retry, const char *action);
 void _sqlite_retry_done(struct __sourceloc, sqlite_retry_state *retry, const char *action);
 int _sqlite_step(struct __sourceloc, int log_level, sqlite_retry_state *retry, sqlite3_stmt *statement);
@@ -610,6 +632,18 @@ int rhizome_manifest_to_bar(rhizome_manifest *m,unsigned char *bar);
 uint64_t rhizome_bar_version(const unsigned char *bar);
 uint64_t rhizome_bar_bidprefix_ll(const unsigned char *bar);
 int rhizome_is_bar_interesting(const unsigned char *bar);
+
+/* In-memory index of stored bundles, see rhizome_index.c */
+int rhizome_index_check();
+void rhizome_index_stored(const unsigned char *bar, uint64_t rowid, const rhizome_filehash_t *filehash);
+void rhizome_index_deleted(const rhizome_bid_t *bidp);
+void rhizome_index_invalidate();
+void rhizome_index_payload_stored(const rhizome_filehash_t *hashp);
+void rhizome_index_payload_deleted(const rhizome_filehash_t *hashp);
+int rhizome_index_is_interesting(const unsigned char *prefix, uint64_t version);
+unsigned rhizome_index_generation();
+unsigned rhizome_index_count();
+int rhizome_index_enum(int (*callback)(const unsigned char *bar, void *context), void *context);
 int rhizome_is_manifest_interesting(rhizome_manifest *m);
 int rhizome_retrieve_manifest(const rhizome_bid_t *bid, rhizome_manifest *m);
 int rhizome_retrieve_manifest_by_prefix(const unsigned char *prefix, unsigned prefix_len, rhizome_manifest *m);
@@ -685,13 +719,15 @@ int rhizome_list_next(struct rhizome_list_cursor *);
 void rhizome_list_commit(struct rhizome_list_cursor *);
 void rhizome_list_release(struct rhizome_list_cursor *);
 
-/* one manifest is required per candidate, plus a few spare.
-   so MAX_RHIZOME_MANIFESTS must be > MAX_CANDIDATES. 
+/* one manifest is required per candidate, plus one per manifest whose signatures are being checked,
+   plus a few spare.
+   so MAX_RHIZOME_MANIFESTS must be > MAX_CANDIDATES + MAX_VERIFYING. 
 */
 #define MAX_RHIZOME_MANIFESTS 40
 #define MAX_CANDIDATES 32
+#define MAX_VERIFYING 4
 
-int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct socket_address *addr, const struct subscriber *peer);
+int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct socket_address *addr, struct subscriber *peer);
 rhizome_manifest * rhizome_fetch_search(const unsigned char *id, int prefix_length);
 
 /* Rhizome file storage api */
@@ -716,14 +752,18 @@ struct rhizome_write
   uint64_t file_length;
   struct rhizome_write_buffer *buffer_list;
   size_t buffer_size;
+  // writes out buffered data once it has waited rhizome.write_buffer_ms
+  struct sched_ent buffer_alarm;
   
   int crypt;
   unsigned char key[RHIZOME_CRYPT_KEY_BYTES];
   unsigned char nonce[crypto_stream_xsalsa20_NONCEBYTES];
   
-  SHA512_CTX sha512_context;
+  struct rhizome_hash_stream hash_stream;
   uint64_t blob_rowid;
   int blob_fd;
+  // written to blob_fd since the last fsync()
+  char sync_pending;
   sqlite3_blob *sql_blob;
 };
 
@@ -875,7 +915,7 @@ enum rhizome_start_fetch_result {
 
 enum rhizome_start_fetch_result
 rhizome_fetch_request_manifest_by_prefix(const struct socket_address *addr, 
-					 const struct subscriber *peer,
+					 struct subscriber *peer,
 					 const unsigned char *prefix, size_t prefix_length);
 int rhizome_any_fetch_active();
 int rhizome_any_fetch_queued();
@@ -884,6 +924,9 @@ int rhizome_fetch_has_queue_space(unsigned char log2_size);
 
 /* rhizome storage methods */
 
+int formf_rhizome_payload_path(char *buf, size_t bufsiz, const char *id);
+#define FORMF_RHIZOME_PAYLOAD_PATH(buf,id) formf_rhizome_payload_path((buf), sizeof(buf), (id))
+int rhizome_shard_payload_files();
 int rhizome_exists(const rhizome_filehash_t *hashp);
 enum rhizome_payload_status rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length, int priority);
 int rhizome_write_buffer(struct rhizome_write *write_state, unsigned char *buffer, size_t data_size);
@@ -908,6 +951,7 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
 ssize_t rhizome_read(struct rhizome_read *read, unsigned char *buffer, size_t buffer_length);
 ssize_t rhizome_read_buffered(struct rhizome_read *read, struct rhizome_read_buffer *buffer, unsigned char *data, size_t len);
 void rhizome_read_close(struct rhizome_read *read);
+int rhizome_read_verified(struct rhizome_read *read);
 enum rhizome_payload_status rhizome_open_decrypt_read(rhizome_manifest *m, struct rhizome_read *read_state);
 enum rhizome_payload_status rhizome_extract_file(rhizome_manifest *m, const char *filepath);
 enum rhizome_payload_status rhizome_dump_file(const rhizome_filehash_t *hashp, const char *filepath, uint64_t *lengthp);
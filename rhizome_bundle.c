@@ -869,8 +869,8 @@ int rhizome_hash_file(rhizome_manifest *m, const char *path, rhizome_filehash_t
     return WHY("Encryption of payloads not implemented");
 
   uint64_t filesize = 0;
-  SHA512_CTX context;
-  SHA512_Init(&context);
+  struct rhizome_hash_stream stream;
+  rhizome_hash_init(&stream);
   if (path[0]) {
     int fd = open(path, O_RDONLY);
     if (fd == -1)
@@ -881,9 +881,11 @@ int rhizome_hash_file(rhizome_manifest *m, const char *path, rhizome_filehash_t
       if (r == -1) {
 	WHYF_perror("read(%s,%zu)", alloca_str_toprint(path), sizeof buffer);
 	close(fd);
+	rhizome_hash_cancel(&stream);
 	return -1;
       }
-      SHA512_Update(&context, buffer, (size_t) r);
+      // hashed on a worker thread while we read the next batch
+      rhizome_hash_update(&stream, buffer, (size_t) r);
       filesize += (size_t) r;
     }
     close(fd);
@@ -891,13 +893,13 @@ int rhizome_hash_file(rhizome_manifest *m, const char *path, rhizome_filehash_t
   // Empty files (including empty path) have no hash.
   if (hash_out) {
     if (filesize > 0)
-      SHA512_Final(hash_out->binary, &context);
+      rhizome_hash_final(&stream, hash_out);
     else
       *hash_out = RHIZOME_FILEHASH_NONE;
   }
   if (size_out)
     *size_out = filesize;
-  SHA512_End(&context, NULL);
+  rhizome_hash_cancel(&stream);
   return 0;
 }
 
@@ -450,9 +450,8 @@ typedef struct manifest_signature_block_cache {
 #define SIG_CACHE_SIZE 1024
 manifest_signature_block_cache sig_cache[SIG_CACHE_SIZE];
 
-static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash, const unsigned char *sig, int sig_len)
+static manifest_signature_block_cache *signature_cache_slot(const unsigned char *hash, const unsigned char *sig, int sig_len)
 {
-  IN();
   unsigned int slot=0;
   int i;
 
@@ -464,37 +463,214 @@ static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash,
     slot=(slot<<1)+(slot&0x80000000?1:0);
     slot+=sig[i];
   }
-  slot%=SIG_CACHE_SIZE;
-
-  if (sig_cache[slot].signature_length!=sig_len || 
-      memcmp(hash, sig_cache[slot].manifest_hash, crypto_hash_sha512_BYTES) ||
-      memcmp(sig, sig_cache[slot].signature_bytes, sig_len)){
-    bcopy(hash, sig_cache[slot].manifest_hash, crypto_hash_sha512_BYTES);
-    bcopy(sig, sig_cache[slot].signature_bytes, sig_len);
-    sig_cache[slot].signature_length=sig_len;
-
-    unsigned char sigBuf[256];
-    unsigned char verifyBuf[256];
-    unsigned char publicKey[256];
-
-    /* Reconstitute signature by putting manifest hash between the two
-       32-byte halves */
-    bcopy(&sig[0],&sigBuf[0],64);
-    bcopy(hash,&sigBuf[64],crypto_hash_sha512_BYTES);
-
-    /* Get public key of signatory */
-    bcopy(&sig[64],&publicKey[0],crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
-
-    unsigned long long mlen=0;
-    sig_cache[slot].signature_valid=
-      crypto_sign_edwards25519sha512batch_open(verifyBuf,&mlen,&sigBuf[0],128,
+  return &sig_cache[slot % SIG_CACHE_SIZE];
+}
+
+static int signature_cache_match(const manifest_signature_block_cache *entry, const unsigned char *hash, const unsigned char *sig, int sig_len)
+{
+  return entry->signature_length==sig_len
+    && memcmp(hash, entry->manifest_hash, crypto_hash_sha512_BYTES)==0
+    && memcmp(sig, entry->signature_bytes, sig_len)==0;
+}
+
+static void signature_cache_store(manifest_signature_block_cache *entry, const unsigned char *hash, const unsigned char *sig, int sig_len, int valid)
+{
+  bcopy(hash, entry->manifest_hash, crypto_hash_sha512_BYTES);
+  bcopy(sig, entry->signature_bytes, sig_len);
+  entry->signature_length=sig_len;
+  entry->signature_valid=valid;
+}
+
+// Safe to call from a worker thread
+static int rhizome_manifest_check_signature(const unsigned char *hash, const unsigned char *sig)
+{
+  unsigned char sigBuf[256];
+  unsigned char verifyBuf[256];
+  unsigned char publicKey[256];
+
+  /* Reconstitute signature by putting manifest hash between the two
+     32-byte halves */
+  bcopy(&sig[0],&sigBuf[0],64);
+  bcopy(hash,&sigBuf[64],crypto_hash_sha512_BYTES);
+
+  /* Get public key of signatory */
+  bcopy(&sig[64],&publicKey[0],crypto_sign_edwards25519sha512batch_PUBLICKEYBYTES);
+
+  unsigned long long mlen=0;
+  return crypto_sign_edwards25519sha512batch_open(verifyBuf,&mlen,&sigBuf[0],128,
 					       publicKey)
-      ? -1 : 0;
-  }
-  RETURN(sig_cache[slot].signature_valid);
+    ? -1 : 0;
+}
+
+static int rhizome_manifest_lookup_signature_validity(const unsigned char *hash, const unsigned char *sig, int sig_len)
+{
+  IN();
+  manifest_signature_block_cache *entry = signature_cache_slot(hash, sig, sig_len);
+  if (!signature_cache_match(entry, hash, sig, sig_len))
+    signature_cache_store(entry, hash, sig, sig_len, rhizome_manifest_check_signature(hash, sig));
+  RETURN(entry->signature_valid);
   OUT();
 }
 
+struct manifest_verify_work{
+  struct work_item item;
+  rhizome_manifest *m;
+  void (*completed)(rhizome_manifest *m, void *context);
+  void *context;
+  unsigned char hash[crypto_hash_sha512_BYTES];
+  unsigned sig_count;
+  struct{
+    unsigned offset;
+    int valid;
+  } sigs[MAX_MANIFEST_VARS];
+};
+
+static void manifest_verify_work(struct work_item *item)
+{
+  struct manifest_verify_work *work = item->context;
+  rhizome_manifest *m = work->m;
+  crypto_hash_sha512(work->hash, m->manifestdata, m->manifest_body_bytes);
+  // only check the signature blocks that rhizome_manifest_extract_signature() would accept,
+  // it will report any problems with the rest when the manifest is verified
+  unsigned ofs = m->manifest_body_bytes;
+  while (ofs < m->manifest_all_bytes && work->sig_count < NELS(work->sigs)) {
+    uint8_t sigType = m->manifestdata[ofs];
+    unsigned len = (sigType << 2) + 4 + 1;
+    if (sigType != 0x17 || ofs + len > m->manifest_all_bytes)
+      break;
+    work->sigs[work->sig_count].offset = ofs + 1;
+    work->sigs[work->sig_count].valid = rhizome_manifest_check_signature(work->hash, m->manifestdata + ofs + 1);
+    work->sig_count++;
+    ofs += len;
+  }
+}
+
+static void manifest_verify_completed(struct work_item *item)
+{
+  struct manifest_verify_work *work = item->context;
+  unsigned i;
+  for (i = 0; i < work->sig_count; i++){
+    const unsigned char *sig = work->m->manifestdata + work->sigs[i].offset;
+    manifest_signature_block_cache *entry = signature_cache_slot(work->hash, sig, 96);
+    if (!signature_cache_match(entry, work->hash, sig, 96))
+      signature_cache_store(entry, work->hash, sig, 96, work->sigs[i].valid);
+  }
+  work->completed(work->m, work->context);
+  free(work);
+}
+
+/* Check the signatures of a manifest on a worker thread, so that the following call to
+ * rhizome_manifest_verify() finds them in the signature cache. The manifest must not be changed or
+ * freed until the completed function has been called.
+ */
+int rhizome_manifest_verify_async(rhizome_manifest *m, void (*completed)(rhizome_manifest *m, void *context), void *context)
+{
+  assert(m->finalised);
+  assert(m->manifest_body_bytes > 0);
+  assert(m->manifest_body_bytes <= m->manifest_all_bytes);
+  struct manifest_verify_work *work = emalloc_zero(sizeof(struct manifest_verify_work));
+  if (!work)
+    return -1;
+  work->m = m;
+  work->completed = completed;
+  work->context = context;
+  work->item.work = manifest_verify_work;
+  work->item.completed = manifest_verify_completed;
+  work->item.context = work;
+  return queue_work(&work->item);
+}
+
+static void hash_stream_work(struct work_item *item)
+{
+  struct rhizome_hash_stream *stream = item->context;
+  SHA512_Update(&stream->context, stream->work_buffer, stream->work_size);
+}
+
+static void hash_stream_completed(struct work_item *item)
+{
+  struct rhizome_hash_stream *stream = item->context;
+  stream->busy = 0;
+}
+
+// wait until a worker thread has finished hashing the previous batch
+static void hash_stream_wait(struct rhizome_hash_stream *stream)
+{
+  if (stream->busy)
+    wait_work(&stream->work);
+  assert(!stream->busy);
+}
+
+// hand the waiting data to a worker thread, and start filling the buffer it had before
+static void hash_stream_flush(struct rhizome_hash_stream *stream)
+{
+  hash_stream_wait(stream);
+  unsigned char *buffer = stream->work_buffer;
+  stream->work_buffer = stream->buffer;
+  stream->work_size = stream->size;
+  stream->buffer = buffer;
+  stream->size = 0;
+  stream->busy = 1;
+  stream->work.work = hash_stream_work;
+  stream->work.completed = hash_stream_completed;
+  stream->work.context = stream;
+  queue_work(&stream->work);
+}
+
+void rhizome_hash_init(struct rhizome_hash_stream *stream)
+{
+  SHA512_Init(&stream->context);
+  stream->buffer = stream->work_buffer = NULL;
+  stream->size = stream->work_size = 0;
+  stream->busy = 0;
+}
+
+/* Add data to the hash, data must be passed in order. The data is copied, so the caller's buffer
+ * may be reused as soon as this returns.
+ */
+void rhizome_hash_update(struct rhizome_hash_stream *stream, const unsigned char *data, size_t len)
+{
+  while (len){
+    if (!stream->buffer && (stream->buffer = emalloc(RHIZOME_HASH_BATCH_SIZE)) == NULL){
+      // hash the rest here instead
+      hash_stream_wait(stream);
+      SHA512_Update(&stream->context, data, len);
+      return;
+    }
+    size_t size = RHIZOME_HASH_BATCH_SIZE - stream->size;
+    if (size > len)
+      size = len;
+    bcopy(data, stream->buffer + stream->size, size);
+    stream->size += size;
+    data += size;
+    len -= size;
+    if (stream->size == RHIZOME_HASH_BATCH_SIZE)
+      hash_stream_flush(stream);
+  }
+}
+
+void rhizome_hash_final(struct rhizome_hash_stream *stream, rhizome_filehash_t *hash_out)
+{
+  // the last partial batch is hashed here, rather than waiting for a worker thread to do it
+  hash_stream_wait(stream);
+  if (stream->size)
+    SHA512_Update(&stream->context, stream->buffer, stream->size);
+  SHA512_Final(hash_out->binary, &stream->context);
+  rhizome_hash_cancel(stream);
+}
+
+// release the buffers, safe to call more than once
+void rhizome_hash_cancel(struct rhizome_hash_stream *stream)
+{
+  hash_stream_wait(stream);
+  if (stream->buffer)
+    free(stream->buffer);
+  if (stream->work_buffer)
+    free(stream->work_buffer);
+  stream->buffer = stream->work_buffer = NULL;
+  stream->size = stream->work_size = 0;
+  SHA512_End(&stream->context, NULL);
+}
+
 int rhizome_manifest_extract_signature(rhizome_manifest *m, unsigned *ofs)
 {
   IN();
@@ -33,6 +33,7 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 static int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const rhizome_bid_t *bidp);
 static int rhizome_delete_file_retry(sqlite_retry_state *retry, const rhizome_filehash_t *hashp);
 static int rhizome_delete_payload_retry(sqlite_retry_state *retry, const rhizome_bid_t *bidp);
+static void statement_cache_flush();
 
 static int create_rhizome_store_dir()
 {
@@ -99,10 +100,18 @@ static void sqlite_trace_callback(void *UNUSED(context), const char *rendered_sq
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
-static void sqlite_profile_callback(void *context, const char *rendered_sql, sqlite_uint64 UNUSED(nanosec))
+static void sqlite_profile_callback(void *context, const char *rendered_sql, sqlite_uint64 nanosec)
 {
+  static struct profile_total step_stats = {.name="sqlite3_step"};
+  // carry part milliseconds over to the next statement, so that many quick statements add up
+  static sqlite_uint64 step_nanosec = 0;
   if (!sqlite_trace_done)
     sqlite_trace_callback(context, rendered_sql);
+  if (sqlite_trace_func())
+    logMessage(LOG_LEVEL_DEBUG, sqlite_trace_whence ? *sqlite_trace_whence : __HERE__, "took %"PRIu64"us", (uint64_t)(nanosec / 1000));
+  step_nanosec += nanosec;
+  fd_tally_call(&step_stats, step_nanosec / 1000000);
+  step_nanosec %= 1000000;
 }
 
 /* This function allows code like:
@@ -162,6 +171,7 @@ void verify_bundles()
 	if (config.debug.rhizome)
 	  DEBUGF("Removing invalid manifest entry @%lld", rowid);
 	sqlite_exec_void_retry(&retry, "DELETE FROM MANIFESTS WHERE ROWID = ?;", INT64, rowid, END);
+	rhizome_index_invalidate();
       }
       rhizome_manifest_free(m);
     }
@@ -238,6 +248,29 @@ int rhizome_opendb()
   
   sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
 
+  /* With a write-ahead log, readers in other processes don't block the daemon's writes, and each
+   * transaction costs one sync of the log instead of syncing both the journal and the database.
+   * The journal mode is stored in the database, so switch back if the log has been turned off.
+   */
+  char journal_mode[16];
+  const char *wanted_mode = config.rhizome.sqlite.wal ? "wal" : "delete";
+  if (sqlite_exec_strbuf_retry(&retry, strbuf_local(journal_mode, sizeof journal_mode),
+	config.rhizome.sqlite.wal ? "PRAGMA journal_mode=WAL;" : "PRAGMA journal_mode=DELETE;", END) != -1
+    && strcasecmp(journal_mode, wanted_mode) != 0)
+    WARNF("Rhizome database journal_mode is %s, not %s", alloca_str_toprint(journal_mode), wanted_mode);
+  switch (config.rhizome.sqlite.synchronous) {
+    case RHIZOME_SQLITE_SYNC_OFF:
+      sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA synchronous=OFF;", END);
+      break;
+    case RHIZOME_SQLITE_SYNC_NORMAL:
+      sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA synchronous=NORMAL;", END);
+      break;
+    case RHIZOME_SQLITE_SYNC_FULL:
+      sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA synchronous=FULL;", END);
+      break;
+  }
+  sqlite3_wal_autocheckpoint(rhizome_db, config.rhizome.sqlite.wal_autocheckpoint);
+
   uint64_t version;
   if (sqlite_exec_uint64_retry(&retry, &version, "PRAGMA user_version;", END) == -1)
     RETURN(-1);
@@ -281,6 +314,11 @@ int rhizome_opendb()
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "CREATE TABLE IF NOT EXISTS IDENTITY(uuid text not null); ", END);
     sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=5;", END);
   }
+  if (version<6){
+    if (rhizome_shard_payload_files() == -1)
+      WARN("Failed to move some payload files into subdirectories");
+    sqlite_exec_void_loglevel(LOG_LEVEL_WARN, "PRAGMA user_version=6;", END);
+  }
 
   char buf[UUID_STRLEN + 1];
   int r = sqlite_exec_strbuf_retry(&retry, strbuf_local(buf, sizeof buf), "SELECT uuid from IDENTITY LIMIT 1;", END);
@@ -329,6 +367,7 @@ int rhizome_close_db()
       WHY("Uncommitted transaction!");
       sqlite_exec_void("ROLLBACK;", END);
     }
+    statement_cache_flush();
     sqlite3_stmt *stmt = NULL;
     while ((stmt = sqlite3_next_stmt(rhizome_db, stmt))) {
       const char *sql = sqlite3_sql(stmt);
@@ -440,8 +479,81 @@ void _sqlite_retry_done(struct __sourceloc __whence, sqlite_retry_state *retry,
     retry->start = -1;
 }
 
+/* Prepared statements are kept for reuse, keyed by their SQL text, so that frequent queries are
+ * only compiled once.  A statement is taken out of the cache while it is in use, so only one caller
+ * can use it at a time, and a caller that finalises it instead of releasing it does no harm.  When
+ * the cache is full, the least recently released statement is finalised.
+ */
+
+struct statement_cache_entry {
+  sqlite3_stmt *statement;
+  unsigned last_used;
+};
+
+static struct statement_cache_entry *statement_cache = NULL;
+static unsigned statement_cache_size = 0;
+static unsigned statement_cache_clock = 0;
+
+static void statement_cache_flush()
+{
+  unsigned i;
+  for (i = 0; i < statement_cache_size; ++i)
+    if (statement_cache[i].statement)
+      sqlite3_finalize(statement_cache[i].statement);
+  if (statement_cache)
+    free(statement_cache);
+  statement_cache = NULL;
+  statement_cache_size = 0;
+}
+
+static sqlite3_stmt *statement_cache_take(const char *sqltext)
+{
+  static struct profile_total cached_stats = {.name="sqlite3_prepare_v2 (cached)"};
+  unsigned i;
+  for (i = 0; i < statement_cache_size; ++i) {
+    sqlite3_stmt *statement = statement_cache[i].statement;
+    if (statement && strcmp(sqlite3_sql(statement), sqltext) == 0) {
+      statement_cache[i].statement = NULL;
+      fd_tally_call(&cached_stats, 0);
+      return statement;
+    }
+  }
+  return NULL;
+}
+
+/* Reset a statement and put it in the cache for the next caller that prepares the same SQL text,
+ * or finalise it if the cache is disabled.
+ */
+void sqlite_release(sqlite3_stmt *statement)
+{
+  if (!statement)
+    return;
+  sqlite3_reset(statement);
+  sqlite3_clear_bindings(statement);
+  unsigned size = config.rhizome.sqlite.statement_cache;
+  if (size != statement_cache_size) {
+    statement_cache_flush();
+    if (size && (statement_cache = emalloc_zero(size * sizeof(struct statement_cache_entry))))
+      statement_cache_size = size;
+  }
+  if (!statement_cache_size) {
+    sqlite3_finalize(statement);
+    return;
+  }
+  struct statement_cache_entry *slot = &statement_cache[0];
+  unsigned i;
+  for (i = 0; i < statement_cache_size && slot->statement; ++i)
+    if (!statement_cache[i].statement || statement_cache[i].last_used < slot->last_used)
+      slot = &statement_cache[i];
+  if (slot->statement)
+    sqlite3_finalize(slot->statement);
+  slot->statement = statement;
+  slot->last_used = ++statement_cache_clock;
+}
+
 /* Prepare an SQL command from a simple string.  Returns NULL if an error occurs (logged as an
- * error), otherwise returns a pointer to the prepared SQLite statement.
+ * error), otherwise returns a pointer to the prepared SQLite statement, which the caller must pass
+ * to sqlite_release() or sqlite3_finalize() when it is done.
  *
  * IMPORTANT!  Do not form statement strings using sprintf(3) or strbuf_sprintf() or similar
  * methods, because those are susceptible to SQL injection attacks.  Instead, use bound parameters
@@ -459,11 +571,20 @@ void _sqlite_retry_done(struct __sourceloc __whence, sqlite_retry_state *retry,
 sqlite3_stmt *_sqlite_prepare(struct __sourceloc __whence, int log_level, sqlite_retry_state *retry, const char *sqltext)
 {
   IN();
+  static struct profile_total prepare_stats = {.name="sqlite3_prepare_v2"};
   sqlite3_stmt *statement = NULL;
   if (!rhizome_db && rhizome_opendb() == -1)
     RETURN(NULL);
+  if ((statement = statement_cache_take(sqltext))) {
+    sqlite_trace_done = 0;
+    RETURN(statement);
+  }
   while (1) {
-    switch (sqlite3_prepare_v2(rhizome_db, sqltext, -1, &statement, NULL)) {
+    struct call_stats call = {.totals=&prepare_stats};
+    fd_func_enter(__HERE__, &call);
+    int r = sqlite3_prepare_v2(rhizome_db, sqltext, -1, &statement, NULL);
+    fd_func_exit(__HERE__, &call);
+    switch (r) {
       case SQLITE_OK:
 	sqlite_trace_done = 0;
 	RETURN(statement);
@@ -853,7 +974,7 @@ int _sqlite_step(struct __sourceloc __whence, int log_level, sqlite_retry_state
 
 /*
  * Convenience wrapper for executing a prepared SQL statement where the row outputs are not wanted.
- * Always finalises the statement before returning.
+ * Always releases the statement before returning.
  *
  * If an error occurs then logs it at the given level and returns -1.
  *
@@ -874,9 +995,10 @@ static int _sqlite_exec(struct __sourceloc __whence, int log_level, sqlite_retry
   int stepcode;
   while ((stepcode = _sqlite_step(__whence, log_level, retry, statement)) == SQLITE_ROW)
     ++rowcount;
-  sqlite3_finalize(statement);
+  int changes = sqlite3_changes(rhizome_db);
+  sqlite_release(statement);
   if (sqlite_trace_func())
-    DEBUGF("rowcount=%d changes=%d", rowcount, sqlite3_changes(rhizome_db));
+    DEBUGF("rowcount=%d changes=%d", rowcount, changes);
   return sqlite_code_ok(stepcode) ? rowcount : -1;
 }
 
@@ -951,7 +1073,7 @@ static int _sqlite_vexec_uint64(struct __sourceloc __whence, sqlite_retry_state
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   if (!sqlite_code_ok(stepcode) || ret == -1)
     return -1;
   if (sqlite_trace_func())
@@ -1041,7 +1163,7 @@ int _sqlite_vexec_strbuf_retry(struct __sourceloc __whence, sqlite_retry_state *
   }
   if (rowcount > 1)
     WARNF("query unexpectedly returned %d rows, ignored all but first", rowcount);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   return sqlite_code_ok(stepcode) && ret != -1 ? rowcount : -1;
 }
 
@@ -1159,7 +1281,7 @@ static int rhizome_delete_external(const char *id)
 {
   // attempt to remove any external blob
   char blob_path[1024];
-  if (!FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%s", RHIZOME_BLOB_SUBDIR, id))
+  if (!FORMF_RHIZOME_PAYLOAD_PATH(blob_path, id))
     return -1;
   if (unlink(blob_path) == -1) {
     if (errno != ENOENT)
@@ -1372,6 +1494,7 @@ int rhizome_drop_stored_file(const rhizome_filehash_t *hashp, int maximum_priori
       if (config.debug.rhizome)
 	DEBUGF("removing stale manifests, groupmemberships");
       sqlite_exec_void_retry(&retry, "DELETE FROM MANIFESTS WHERE id = ?;", RHIZOME_BID_T, &bid, END);
+      rhizome_index_deleted(&bid);
       sqlite_exec_void_retry(&retry, "DELETE FROM KEYPAIRS WHERE public = ?;", RHIZOME_BID_T, &bid, END);
       sqlite_exec_void_retry(&retry, "DELETE FROM GROUPMEMBERSHIPS WHERE manifestid = ?;", RHIZOME_BID_T, &bid, END);
     }
@@ -1469,7 +1592,7 @@ int rhizome_store_manifest(rhizome_manifest *m)
     goto rollback;
   if (sqlite_step_retry(&retry, stmt) == -1)
     goto rollback;
-  sqlite3_finalize(stmt);
+  sqlite_release(stmt);
   stmt = NULL;
   rhizome_manifest_set_rowid(m, sqlite3_last_insert_rowid(rhizome_db));
   rhizome_manifest_set_inserttime(m, now);
@@ -1527,6 +1650,7 @@ int rhizome_store_manifest(rhizome_manifest *m)
 	  alloca_tohex_rhizome_bid_t(m->cryptoSignPublic),
 	  m->version
 	);
+    rhizome_index_stored(bar, m->rowid, m->filesize > 0 ? &m->filehash : NULL);
     monitor_announce_bundle(m);
     if (serverMode)
       rhizome_sync_announce();
@@ -1893,7 +2017,7 @@ int rhizome_retrieve_manifest(const rhizome_bid_t *bidp, rhizome_manifest *m)
     ret = unpack_manifest_row(m, statement);
   else
     INFOF("Manifest id=%s not found", alloca_tohex_rhizome_bid_t(*bidp));
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   return ret;
 }
 
@@ -1923,7 +2047,7 @@ int rhizome_retrieve_manifest_by_prefix(const unsigned char *prefix, unsigned pr
     ret = unpack_manifest_row(m, statement);
   else
     INFOF("Manifest with id prefix=`%s` not found", like);
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
   return ret;
 }
 
@@ -1937,13 +2061,17 @@ static int rhizome_delete_manifest_retry(sqlite_retry_state *retry, const rhizom
     return -1;
   if (_sqlite_exec(__WHENCE__, LOG_LEVEL_ERROR, retry, statement) == -1)
     return -1;
-  return sqlite3_changes(rhizome_db) ? 0 : 1;
+  if (sqlite3_changes(rhizome_db) == 0)
+    return 1;
+  rhizome_index_deleted(bidp);
+  return 0;
 }
 
 static int rhizome_delete_file_retry(sqlite_retry_state *retry, const rhizome_filehash_t *hashp)
 {
   int ret = 0;
   rhizome_delete_external(alloca_tohex_rhizome_filehash_t(*hashp));
+  rhizome_index_payload_deleted(hashp);
   sqlite3_stmt *statement = sqlite_prepare_bind(retry, "DELETE FROM files WHERE id = ?", RHIZOME_FILEHASH_T, hashp, END);
   if (!statement || sqlite_exec_retry(retry, statement) == -1)
     ret = -1;
@@ -2029,47 +2157,12 @@ int rhizome_delete_file(const rhizome_filehash_t *hashp)
   return rhizome_delete_file_retry(&retry, hashp);
 }
 
-static int is_interesting(const char *id_hex, uint64_t version)
-{
-  IN();
-  int ret=1;
-
-  // do we have this bundle [or later]?
-  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
-  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
-    "SELECT filehash FROM MANIFESTS WHERE id LIKE ? AND version >= ?",
-    TEXT_TOUPPER, id_hex,
-    INT64, version,
-    END);
-  if (!statement)
-    RETURN(-1);
-  if (sqlite_step_retry(&retry, statement) == SQLITE_ROW){
-    const char *q_filehash = (const char *) sqlite3_column_text(statement, 0);
-    ret=0;
-    if (q_filehash && *q_filehash) {
-      rhizome_filehash_t hash;
-      if (str_to_rhizome_filehash_t(&hash, q_filehash) == -1) {
-	WARNF("invalid field MANIFESTS.filehash=%s -- ignored", alloca_str_toprint(q_filehash));
-	ret = 1;
-      } else if (!rhizome_exists(&hash))
-	ret = 1;
-    }
-  }
-  sqlite3_finalize(statement);
-  RETURN(ret);
-  OUT();
-}
-
 int rhizome_is_bar_interesting(const unsigned char *bar)
 {
-  uint64_t version = rhizome_bar_version(bar);
-  char id_hex[RHIZOME_BAR_PREFIX_BYTES *2 + 2];
-  tohex(id_hex, RHIZOME_BAR_PREFIX_BYTES * 2, &bar[RHIZOME_BAR_PREFIX_OFFSET]);
-  strcat(id_hex, "%");
-  return is_interesting(id_hex, version);
+  return rhizome_index_is_interesting(&bar[RHIZOME_BAR_PREFIX_OFFSET], rhizome_bar_version(bar));
 }
 
 int rhizome_is_manifest_interesting(rhizome_manifest *m)
 {
-  return is_interesting(alloca_tohex_rhizome_bid_t(m->cryptoSignPublic), m->version);
+  return rhizome_index_is_interesting(m->cryptoSignPublic.binary, m->version);
 }
@@ -41,7 +41,8 @@ struct rhizome_fetch_candidate {
      Can be either IP+port for HTTP or it can be a SID 
      for MDP. */
   struct socket_address addr;
-  const struct subscriber *peer;
+  // holds a reference, so the subscriber can't be forgotten while the candidate is queued
+  struct subscriber *peer;
 
   int priority;
 };
@@ -54,7 +55,8 @@ struct rhizome_fetch_slot {
   rhizome_manifest *manifest;
 
   struct socket_address addr;
-  const struct subscriber *peer;
+  // holds a reference while the slot is in use
+  struct subscriber *peer;
 
   int state;
 #define RHIZOME_FETCH_FREE 0
@@ -327,15 +329,17 @@ static struct rhizome_fetch_candidate *rhizome_fetch_insert(struct rhizome_fetch
     DEBUGF("insert queue[%d] candidate[%u]", (int)(q - rhizome_fetch_queues), i);
   assert(i < q->candidate_queue_size);
   assert(i == 0 || c[-1].manifest);
-  if (e->manifest) // queue is full
+  if (e->manifest){ // queue is full
     rhizome_manifest_free(e->manifest);
-  else
+    set_subscriber_ref(&e->peer, NULL);
+  }else
     while (e > c && !e[-1].manifest)
       --e;
   for (; e > c; --e)
     e[0] = e[-1];
   assert(e == c);
   c->manifest = NULL;
+  c->peer = NULL;
   return c;
 }
 
@@ -355,10 +359,12 @@ static void rhizome_fetch_unqueue(struct rhizome_fetch_queue *q, unsigned i)
     rhizome_manifest_free(c->manifest);
     c->manifest = NULL;
   }
+  set_subscriber_ref(&c->peer, NULL);
   struct rhizome_fetch_candidate *e = &q->candidate_queue[q->candidate_queue_size - 1];
   for (; c < e && c[1].manifest; ++c)
     c[0] = c[1];
   c->manifest = NULL;
+  c->peer = NULL;
 }
 
 static void candidate_unqueue(struct rhizome_fetch_candidate *c)
@@ -672,7 +678,7 @@ schedule_fetch(struct rhizome_fetch_slot *slot)
  */
 static enum rhizome_start_fetch_result
 rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m, 
-  const struct socket_address *addr, const struct subscriber *peer)
+  const struct socket_address *addr, struct subscriber *peer)
 {
   IN();
   if (slot->state != RHIZOME_FETCH_FREE)
@@ -756,10 +762,12 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m,
 
   /* Prepare for fetching */
   slot->addr = *addr;
-  slot->peer = peer;
+  set_subscriber_ref(&slot->peer, peer);
   slot->manifest = m;
 
   enum rhizome_start_fetch_result result = schedule_fetch(slot);
+  if (slot->state == RHIZOME_FETCH_FREE)
+    set_subscriber_ref(&slot->peer, NULL);
   // If the payload is already available, no need to fetch, so import now.
   if (result == IMPORTED) {
     if (config.debug.rhizome_rx)
@@ -776,7 +784,7 @@ rhizome_fetch(struct rhizome_fetch_slot *slot, rhizome_manifest *m,
  */
 enum rhizome_start_fetch_result
 rhizome_fetch_request_manifest_by_prefix(const struct socket_address *addr, 
-					 const struct subscriber *peer,
+					 struct subscriber *peer,
 					 const unsigned char *prefix, size_t prefix_length)
 {
   assert(addr);
@@ -787,7 +795,7 @@ rhizome_fetch_request_manifest_by_prefix(const struct socket_address *addr,
   /* Prepare for fetching via HTTP */
   slot->addr = *addr;
   slot->manifest = NULL;
-  slot->peer = peer;
+  set_subscriber_ref(&slot->peer, peer);
   bcopy(prefix, slot->bid.binary, prefix_length);
   slot->prefix_length=prefix_length;
 
@@ -796,7 +804,10 @@ rhizome_fetch_request_manifest_by_prefix(const struct socket_address *addr,
      for inserting into the database, but we can avoid the temporary file in
      the process. */
   
-  return schedule_fetch(slot);
+  enum rhizome_start_fetch_result result = schedule_fetch(slot);
+  if (slot->state == RHIZOME_FETCH_FREE)
+    set_subscriber_ref(&slot->peer, NULL);
+  return result;
 }
 
 /* Activate the next fetch for the given slot.  This takes the next job from the head of the slot's
@@ -885,7 +896,7 @@ int rhizome_fetch_has_queue_space(unsigned char log2_size){
  *
  * @author Andrew Bettison <andrew@servalproject.com>
  */
-int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct socket_address *addr, const struct subscriber *peer)
+static int suggest_queue_manifest_import(rhizome_manifest *m, const struct socket_address *addr, struct subscriber *peer)
 {
   IN();
   
@@ -989,7 +1000,7 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
   c->manifest = m;
   c->priority = priority;
   c->addr = *addr;
-  c->peer = peer;
+  c->peer = add_subscriber_ref(peer);
 
   if (config.debug.rhizome_rx) {
     DEBUG("Rhizome fetch queues:");
@@ -1022,6 +1033,57 @@ int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct sock
   OUT();
 }
 
+struct queue_import_context{
+  struct socket_address addr;
+  bool_t has_addr;
+  bool_t has_peer;
+  sid_t peer_sid;
+};
+
+// manifests whose signatures are being checked on a worker thread
+static unsigned verifying_count = 0;
+
+static void queue_import_verified(rhizome_manifest *m, void *context)
+{
+  struct queue_import_context *ctx = context;
+  verifying_count--;
+  // the peer may have been forgotten while the signatures were being checked
+  struct subscriber *peer = ctx->has_peer ? find_subscriber(ctx->peer_sid.binary, SID_SIZE, 0) : NULL;
+  suggest_queue_manifest_import(m, ctx->has_addr ? &ctx->addr : NULL, peer);
+  free(ctx);
+}
+
+/* Check the manifest signatures on a worker thread before considering it for import, so a burst
+ * of adverts doesn't stall the main loop. The manifest is freed or queued as described above,
+ * but possibly after this function has returned.
+ * Each manifest being checked holds a slot in the manifest pool, so once MAX_VERIFYING of them
+ * are waiting for a worker, further manifests are checked on the main thread as they arrive.
+ */
+int rhizome_suggest_queue_manifest_import(rhizome_manifest *m, const struct socket_address *addr, struct subscriber *peer)
+{
+  if (!config.rhizome.fetch || m->selfSigned || !rhizome_is_manifest_interesting(m)
+    || verifying_count >= MAX_VERIFYING)
+    return suggest_queue_manifest_import(m, addr, peer);
+  struct queue_import_context *ctx = emalloc_zero(sizeof(struct queue_import_context));
+  if (!ctx)
+    return suggest_queue_manifest_import(m, addr, peer);
+  if (addr){
+    ctx->addr = *addr;
+    ctx->has_addr = 1;
+  }
+  if (peer){
+    ctx->peer_sid = peer->sid;
+    ctx->has_peer = 1;
+  }
+  verifying_count++;
+  if (rhizome_manifest_verify_async(m, queue_import_verified, ctx) == -1){
+    verifying_count--;
+    free(ctx);
+    return suggest_queue_manifest_import(m, addr, peer);
+  }
+  return 0;
+}
+
 static void rhizome_fetch_close(struct rhizome_fetch_slot *slot)
 {
   if (config.debug.rhizome_rx)
@@ -1044,6 +1106,7 @@ static void rhizome_fetch_close(struct rhizome_fetch_slot *slot)
   if (slot->previous)
     rhizome_manifest_free(slot->previous);
   slot->previous = NULL;
+  set_subscriber_ref(&slot->peer, NULL);
   
   if (slot->write_state.blob_fd != -1 || slot->write_state.blob_rowid != 0)
     rhizome_fail_write(&slot->write_state);
@@ -1109,7 +1172,7 @@ static int rhizome_fetch_mdp_requestblocks(struct rhizome_fetch_slot *slot)
   
   header.source = my_subscriber;
   header.source_port = MDP_PORT_RHIZOME_RESPONSE;
-  header.destination = (struct subscriber *)slot->peer;
+  header.destination = slot->peer;
   header.destination_port = MDP_PORT_RHIZOME_REQUEST;
   header.ttl = 1;
   header.qos = OQ_ORDINARY;
@@ -42,7 +42,7 @@ int rhizome_file_page(httpd_request *r, const char *remainder)
   int ret = rhizome_response_content_init_filehash(r, &filehash);
   if (ret)
     return ret;
-  http_request_response_generated(&r->http, 200, CONTENT_TYPE_BLOB, rhizome_payload_content);
+  rhizome_payload_response(r);
   return 1;
 }
 
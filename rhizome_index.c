@@ -0,0 +1,385 @@
+/*
+Serval DNA Rhizome bundle index
+Copyright (C) 2014 Serval Project Inc.
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#include <sys/stat.h>
+#include "serval.h"
+#include "conf.h"
+#include "rhizome.h"
+
+/* An in-memory index of every stored bundle, keyed by bundle id prefix, so that the daemon can
+ * decide whether each BAR it hears about is interesting without asking SQLite.
+ *
+ * Each entry holds the BAR of the stored manifest (which includes its version) and whether its
+ * payload is present. The daemon updates the index as it stores and deletes bundles, and
+ * rhizome_index_check() picks up any changes that other processes have made to the database.
+ * Entries are chained in hash buckets by bundle id, and again by payload hash so that storing or
+ * deleting a payload can find the bundles that use it. Both tables double in size whenever the
+ * index holds more entries than buckets.
+ */
+
+// how often to count the rows in the database, in case another process has deleted bundles
+#define INDEX_RECOUNT_INTERVAL 60000
+
+struct index_entry{
+  struct index_entry *_next;
+  // next entry in the same payload hash bucket
+  struct index_entry *_next_payload;
+  unsigned char bar[RHIZOME_BAR_BYTES];
+  uint64_t rowid;
+  rhizome_filehash_t filehash;
+  bool_t has_payload;
+  bool_t payload_present;
+};
+
+static struct index_entry **index_table=NULL;
+static struct index_entry **payload_table=NULL;
+static unsigned index_size=0;
+static unsigned index_count=0;
+// number of database rows that could not be indexed
+static unsigned index_skipped=0;
+static time_ms_t index_recount_time=0;
+// number of entries that have a payload which isn't present
+static unsigned index_missing=0;
+static uint64_t index_max_rowid=0;
+static unsigned index_generation=0;
+static int index_loaded=0;
+
+static struct index_entry **index_bucket(const unsigned char *prefix)
+{
+  // bundle ids are public keys, so any bytes will do for a hash
+  uint32_t hash;
+  memcpy(&hash, prefix, sizeof hash);
+  return &index_table[hash & (index_size - 1)];
+}
+
+static struct index_entry **payload_bucket(const rhizome_filehash_t *hashp)
+{
+  uint32_t hash;
+  memcpy(&hash, hashp->binary, sizeof hash);
+  return &payload_table[hash & (index_size - 1)];
+}
+
+static void payload_link(struct index_entry *entry)
+{
+  struct index_entry **bucket = payload_bucket(&entry->filehash);
+  entry->_next_payload = *bucket;
+  *bucket = entry;
+}
+
+static void payload_unlink(struct index_entry *entry)
+{
+  struct index_entry **ptr = payload_bucket(&entry->filehash);
+  while (*ptr != entry)
+    ptr = &(*ptr)->_next_payload;
+  *ptr = entry->_next_payload;
+}
+
+static struct index_entry *index_find(const unsigned char *prefix)
+{
+  if (!index_table)
+    return NULL;
+  struct index_entry *entry = *index_bucket(prefix);
+  for (; entry; entry = entry->_next)
+    if (memcmp(entry->bar + RHIZOME_BAR_PREFIX_OFFSET, prefix, RHIZOME_BAR_PREFIX_BYTES) == 0)
+      return entry;
+  return NULL;
+}
+
+static int index_grow()
+{
+  unsigned new_size = index_size ? index_size * 2 : 1024;
+  struct index_entry **new_table = emalloc_zero(new_size * sizeof(struct index_entry *));
+  if (!new_table)
+    return -1;
+  struct index_entry **new_payload_table = emalloc_zero(new_size * sizeof(struct index_entry *));
+  if (!new_payload_table){
+    free(new_table);
+    return -1;
+  }
+  struct index_entry **old_table = index_table;
+  unsigned old_size = index_size, i;
+  index_table = new_table;
+  if (payload_table)
+    free(payload_table);
+  payload_table = new_payload_table;
+  index_size = new_size;
+  for (i = 0; i < old_size; i++){
+    while (old_table[i]){
+      struct index_entry *entry = old_table[i];
+      old_table[i] = entry->_next;
+      struct index_entry **bucket = index_bucket(entry->bar + RHIZOME_BAR_PREFIX_OFFSET);
+      entry->_next = *bucket;
+      *bucket = entry;
+      if (entry->has_payload)
+	payload_link(entry);
+    }
+  }
+  if (old_table)
+    free(old_table);
+  return 0;
+}
+
+static void index_set_present(struct index_entry *entry, bool_t present)
+{
+  if (!entry->has_payload || entry->payload_present == present)
+    return;
+  entry->payload_present = present;
+  if (present)
+    index_missing--;
+  else
+    index_missing++;
+}
+
+static void index_remove(struct index_entry *entry)
+{
+  struct index_entry **ptr = index_bucket(entry->bar + RHIZOME_BAR_PREFIX_OFFSET);
+  while (*ptr != entry)
+    ptr = &(*ptr)->_next;
+  *ptr = entry->_next;
+  if (entry->has_payload)
+    payload_unlink(entry);
+  index_set_present(entry, 1);
+  index_count--;
+  index_generation++;
+  free(entry);
+}
+
+static void index_clear()
+{
+  unsigned i;
+  for (i = 0; i < index_size; i++){
+    while (index_table[i]){
+      struct index_entry *entry = index_table[i];
+      index_table[i] = entry->_next;
+      free(entry);
+    }
+    payload_table[i] = NULL;
+  }
+  index_count = 0;
+  index_skipped = 0;
+  index_missing = 0;
+  index_max_rowid = 0;
+  index_generation++;
+}
+
+static void index_add(const unsigned char *bar, uint64_t rowid, const rhizome_filehash_t *filehash, bool_t present)
+{
+  struct index_entry *entry = index_find(bar + RHIZOME_BAR_PREFIX_OFFSET);
+  if (!entry){
+    if (index_count >= index_size && index_grow() == -1)
+      return;
+    if ((entry = emalloc_zero(sizeof(struct index_entry))) == NULL)
+      return;
+    struct index_entry **bucket = index_bucket(bar + RHIZOME_BAR_PREFIX_OFFSET);
+    entry->_next = *bucket;
+    *bucket = entry;
+    entry->payload_present = 1;
+    index_count++;
+  }
+  bcopy(bar, entry->bar, RHIZOME_BAR_BYTES);
+  entry->rowid = rowid;
+  index_set_present(entry, 1);
+  if (entry->has_payload)
+    payload_unlink(entry);
+  entry->has_payload = filehash != NULL;
+  if (filehash){
+    entry->filehash = *filehash;
+    payload_link(entry);
+  }
+  index_set_present(entry, present);
+  if (rowid > index_max_rowid)
+    index_max_rowid = rowid;
+  index_generation++;
+}
+
+// the same test as rhizome_exists(), given the FILES and FILEBLOBS columns from the query below
+static bool_t payload_present(const rhizome_filehash_t *filehash, int datavalid, int has_blob)
+{
+  if (datavalid != 1)
+    return 0;
+  if (has_blob)
+    return 1;
+  char blob_path[1024];
+  if (!FORMF_RHIZOME_PAYLOAD_PATH(blob_path, alloca_tohex_rhizome_filehash_t(*filehash)))
+    return 0;
+  struct stat st;
+  return stat(blob_path, &st) != -1;
+}
+
+// add every manifest with a rowid after the given one
+static int index_load(uint64_t after_rowid)
+{
+  sqlite_retry_state retry = SQLITE_RETRY_STATE_DEFAULT;
+  sqlite3_stmt *statement = sqlite_prepare_bind(&retry,
+    "SELECT MANIFESTS.rowid, MANIFESTS.bar, MANIFESTS.filehash, FILES.datavalid, "
+      "EXISTS(SELECT 1 FROM FILEBLOBS WHERE FILEBLOBS.id = MANIFESTS.filehash) "
+    "FROM MANIFESTS LEFT JOIN FILES ON FILES.id = MANIFESTS.filehash "
+    "WHERE MANIFESTS.rowid > ?",
+    INT64, after_rowid,
+    END);
+  if (!statement)
+    return -1;
+  unsigned added = 0;
+  while (sqlite_step_retry(&retry, statement) == SQLITE_ROW){
+    uint64_t rowid = sqlite3_column_int64(statement, 0);
+    // remember the rows we skip, so they don't look like rows that another process has added
+    if (rowid > index_max_rowid)
+      index_max_rowid = rowid;
+    const unsigned char *bar = sqlite3_column_blob(statement, 1);
+    if (sqlite3_column_bytes(statement, 1) != RHIZOME_BAR_BYTES){
+      index_skipped++;
+      continue;
+    }
+    const char *q_filehash = (const char *) sqlite3_column_text(statement, 2);
+    if (q_filehash && *q_filehash){
+      rhizome_filehash_t filehash;
+      if (str_to_rhizome_filehash_t(&filehash, q_filehash) == -1){
+	WARNF("invalid field MANIFESTS.filehash=%s -- ignored", alloca_str_toprint(q_filehash));
+	index_skipped++;
+	continue;
+      }
+      index_add(bar, rowid, &filehash,
+	payload_present(&filehash, sqlite3_column_int(statement, 3), sqlite3_column_int(statement, 4)));
+    }else
+      index_add(bar, rowid, NULL, 1);
+    added++;
+  }
+  sqlite3_finalize(statement);
+  if (config.debug.rhizome)
+    DEBUGF("Added %u manifests to the bundle index, which now holds %u", added, index_count);
+  return 0;
+}
+
+/* Make sure the index matches the database. Every insert allocates a new rowid, so new rows are
+ * added as they appear. Our own deletes update the index as they happen, but another process may
+ * have deleted bundles too, so every INDEX_RECOUNT_INTERVAL we count the rows, and load the whole
+ * index again if the count differs.
+ */
+int rhizome_index_check()
+{
+  uint64_t max_rowid = 0, rows = 0;
+  if (sqlite_exec_uint64(&max_rowid, "SELECT max(rowid) FROM MANIFESTS", END) == -1)
+    return -1;
+  time_ms_t now = gettime_ms();
+  if (!index_loaded || max_rowid < index_max_rowid){
+    index_clear();
+    index_loaded = 1;
+    index_recount_time = now + INDEX_RECOUNT_INTERVAL;
+    return index_load(0);
+  }
+  if (max_rowid > index_max_rowid && index_load(index_max_rowid) == -1)
+    return -1;
+  if (now < index_recount_time)
+    return 0;
+  index_recount_time = now + INDEX_RECOUNT_INTERVAL;
+  if (sqlite_exec_uint64(&rows, "SELECT count(*) FROM MANIFESTS", END) == -1)
+    return -1;
+  if (rows != index_count + index_skipped){
+    if (config.debug.rhizome)
+      DEBUGF("Bundle index holds %u manifests and skipped %u, database has %"PRIu64", reloading",
+	index_count, index_skipped, rows);
+    index_clear();
+    return index_load(0);
+  }
+  return 0;
+}
+
+void rhizome_index_stored(const unsigned char *bar, uint64_t rowid, const rhizome_filehash_t *filehash)
+{
+  if (index_loaded)
+    index_add(bar, rowid, filehash, 1);
+}
+
+void rhizome_index_deleted(const rhizome_bid_t *bidp)
+{
+  if (!index_loaded)
+    return;
+  struct index_entry *entry = index_find(bidp->binary);
+  if (entry)
+    index_remove(entry);
+}
+
+// forget everything, and load the whole index again when it is next used
+void rhizome_index_invalidate()
+{
+  if (index_loaded){
+    index_clear();
+    index_loaded = 0;
+  }
+}
+
+static void index_payload_changed(const rhizome_filehash_t *hashp, bool_t present)
+{
+  if (!index_loaded || !payload_table || (present && index_missing == 0))
+    return;
+  struct index_entry *entry = *payload_bucket(hashp);
+  for (; entry; entry = entry->_next_payload)
+    if (cmp_rhizome_filehash_t(&entry->filehash, hashp) == 0)
+      index_set_present(entry, present);
+}
+
+void rhizome_index_payload_stored(const rhizome_filehash_t *hashp)
+{
+  index_payload_changed(hashp, 1);
+}
+
+void rhizome_index_payload_deleted(const rhizome_filehash_t *hashp)
+{
+  index_payload_changed(hashp, 0);
+}
+
+/* Returns 1 if we don't have this version (or later) of the bundle with this id prefix, or don't
+ * have its payload, 0 if we do, or -1 on error.
+ */
+int rhizome_index_is_interesting(const unsigned char *prefix, uint64_t version)
+{
+  if (!index_loaded && rhizome_index_check() == -1)
+    return -1;
+  struct index_entry *entry = index_find(prefix);
+  if (!entry || rhizome_bar_version(entry->bar) < version)
+    return 1;
+  return entry->payload_present ? 0 : 1;
+}
+
+// changes whenever the set of indexed BARs changes
+unsigned rhizome_index_generation()
+{
+  return index_generation;
+}
+
+unsigned rhizome_index_count()
+{
+  return index_count;
+}
+
+int rhizome_index_enum(int (*callback)(const unsigned char *bar, void *context), void *context)
+{
+  if (!index_loaded && rhizome_index_check() == -1)
+    return -1;
+  unsigned i;
+  for (i = 0; i < index_size; i++){
+    struct index_entry *entry = index_table[i];
+    for (; entry; entry = entry->_next){
+      int r = callback(entry->bar, context);
+      if (r)
+	return r;
+    }
+  }
+  return 0;
+}
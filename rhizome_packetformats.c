@@ -210,8 +210,7 @@ void overlay_rhizome_advertise(struct sched_ent *alarm)
   if (bundles_available<1)
     goto end;
   
-  struct overlay_frame *frame = malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   frame->type = OF_TYPE_RHIZOME_ADVERT;
   frame->source = my_subscriber;
   frame->ttl = 1;
@@ -250,8 +249,7 @@ end:
 
 /* Queue an advertisment for a single manifest */
 int rhizome_advertise_manifest(struct subscriber *dest, rhizome_manifest *m){
-  struct overlay_frame *frame = malloc(sizeof(struct overlay_frame));
-  bzero(frame,sizeof(struct overlay_frame));
+  struct overlay_frame *frame = op_new();
   frame->type = OF_TYPE_RHIZOME_ADVERT;
   frame->source = my_subscriber;
   if (dest && dest->reachable&REACHABLE)
@@ -32,7 +32,8 @@ static void finalise_union_read_state(httpd_request *r)
 static void finalise_union_rhizome_insert(httpd_request *r)
 {
   form_buf_malloc_release(&r->u.insert.manifest);
-  if (r->u.insert.write.blob_fd != -1)
+  // a payload kept in a SQLite blob has no file descriptor, but may still have buffered data
+  if (r->u.insert.write.blob_fd != -1 || r->u.insert.write.blob_rowid != 0)
     rhizome_fail_write(&r->u.insert.write);
 }
 
@@ -623,7 +624,7 @@ static int restful_rhizome_bid_raw_bin(httpd_request *r, const char *remainder)
   int ret = rhizome_response_content_init_filehash(r, &r->manifest->filehash);
   if (ret)
     return ret;
-  http_request_response_generated(&r->http, 200, CONTENT_TYPE_BLOB, rhizome_payload_content);
+  rhizome_payload_response(r);
   return 1;
 }
 
@@ -640,7 +641,7 @@ static int restful_rhizome_bid_decrypted_bin(httpd_request *r, const char *remai
   if (ret)
     return ret;
   // TODO use Content Type from manifest (once it is implemented)
-  http_request_response_generated(&r->http, 200, CONTENT_TYPE_BLOB, rhizome_payload_content);
+  rhizome_payload_response(r);
   return 1;
 }
 
@@ -745,6 +746,19 @@ int rhizome_payload_content(struct http_request *hr, unsigned char *buf, size_t
   return remain ? 1 : 0;
 }
 
+/* Send the payload opened by rhizome_response_content_init_filehash() or
+ * rhizome_response_content_init_payload().  A payload that is kept in its own file, does not need
+ * decrypting, and whose hash we have already checked, is sent straight from that file.  Otherwise
+ * it is read, hashed and decrypted as it is sent.
+ */
+void rhizome_payload_response(httpd_request *r)
+{
+  if (!r->u.read_state.crypt && rhizome_read_verified(&r->u.read_state))
+    http_request_response_fd(&r->http, 200, CONTENT_TYPE_BLOB, r->u.read_state.blob_fd, r->u.read_state.offset);
+  else
+    http_request_response_generated(&r->http, 200, CONTENT_TYPE_BLOB, rhizome_payload_content);
+}
+
 static void render_manifest_headers(struct http_request *hr, strbuf sb)
 {
   httpd_request *r = (httpd_request *) hr;
@@ -18,15 +18,83 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
 #include <assert.h>
+#include <dirent.h>
 #include "serval.h"
 #include "rhizome.h"
 #include "conf.h"
 #include "strlcpy.h"
+#include "dataformats.h"
 
 #define RHIZOME_BUFFER_MAXIMUM_SIZE (1024*1024)
+#define RHIZOME_BUFFER_CHUNK_SIZE (64*1024)
 
 uint64_t rhizome_copy_file_to_blob(int fd, uint64_t id, size_t size);
 
+/* Stored payload files are named by their hash, so identical payloads share one file.  They are
+ * spread over 256 subdirectories of the blob directory, named by the first two hex digits of the
+ * hash, so that no single directory grows too large.  Payloads that are still being written are
+ * named by their temporary id, directly in the blob directory.
+ */
+int formf_rhizome_payload_path(char *buf, size_t bufsiz, const char *id)
+{
+  if (strlen(id) == RHIZOME_FILEHASH_STRLEN)
+    return formf_rhizome_store_path(buf, bufsiz, "%s/%.2s/%s", RHIZOME_BLOB_SUBDIR, id, id);
+  return formf_rhizome_store_path(buf, bufsiz, "%s/%s", RHIZOME_BLOB_SUBDIR, id);
+}
+
+// move a finished payload file into place, creating its subdirectory if this is the first
+static int rename_payload_file(const char *from, const char *to)
+{
+  if (rename(from, to) == 0)
+    return 0;
+  if (errno != ENOENT)
+    return WHYF_perror("rename(%s, %s)", alloca_str_toprint(from), alloca_str_toprint(to));
+  char dir[1024];
+  if (strlcpy(dir, to, sizeof dir) >= sizeof dir || !strrchr(dir, '/'))
+    return WHYF("invalid payload path %s", alloca_str_toprint(to));
+  *strrchr(dir, '/') = '\0';
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+    return WHYF_perror("mkdir(%s)", alloca_str_toprint(dir));
+  if (rename(from, to) == -1)
+    return WHYF_perror("rename(%s, %s)", alloca_str_toprint(from), alloca_str_toprint(to));
+  return 0;
+}
+
+/* Older versions kept every payload file directly in the blob directory, move them into their
+ * subdirectories.
+ */
+int rhizome_shard_payload_files()
+{
+  char dir_path[1024];
+  if (!FORMF_RHIZOME_STORE_PATH(dir_path, "%s", RHIZOME_BLOB_SUBDIR))
+    return -1;
+  DIR *dir = opendir(dir_path);
+  if (!dir)
+    return WHYF_perror("opendir(%s)", alloca_str_toprint(dir_path));
+  int ret = 0;
+  unsigned moved = 0;
+  struct dirent *de;
+  while ((de = readdir(dir)) != NULL) {
+    rhizome_filehash_t hash;
+    if (strlen(de->d_name) != RHIZOME_FILEHASH_STRLEN || str_to_rhizome_filehash_t(&hash, de->d_name) == -1)
+      continue;
+    char old_path[1024];
+    char new_path[1024];
+    if (   !FORMF_RHIZOME_STORE_PATH(old_path, "%s/%s", RHIZOME_BLOB_SUBDIR, de->d_name)
+	|| !FORMF_RHIZOME_PAYLOAD_PATH(new_path, de->d_name)
+	|| rename_payload_file(old_path, new_path) == -1
+    ) {
+      ret = -1;
+      continue;
+    }
+    moved++;
+  }
+  closedir(dir);
+  if (config.debug.rhizome_store)
+    DEBUGF("Moved %u payload files into subdirectories", moved);
+  return ret;
+}
+
 int rhizome_exists(const rhizome_filehash_t *hashp)
 {
   uint64_t gotfile = 0;
@@ -45,7 +113,7 @@ int rhizome_exists(const rhizome_filehash_t *hashp)
   
   // No row in FILEBLOBS, look for an external blob file.
   char blob_path[1024];
-  if (!FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%s", RHIZOME_BLOB_SUBDIR, alloca_tohex_rhizome_filehash_t(*hashp)))
+  if (!FORMF_RHIZOME_PAYLOAD_PATH(blob_path, alloca_tohex_rhizome_filehash_t(*hashp)))
     return 0;
   
   struct stat st;
@@ -72,12 +140,30 @@ static int rhizome_create_fileblob(sqlite_retry_state *retry, uint64_t id, size_
   return sqlite3_last_insert_rowid(rhizome_db);
 }
 
+static struct profile_total write_buffer_alarm_stats = {
+  .name="rhizome_write_buffer_alarm",
+};
+
+// write out whatever buffered data we can, as it has waited long enough
+static void rhizome_write_buffer_alarm(struct sched_ent *alarm)
+{
+  struct rhizome_write *write_state = alarm->context;
+  if (rhizome_random_write(write_state, 0, NULL, 0))
+    WHY("Failed to write buffered payload data");
+}
+
 enum rhizome_payload_status rhizome_open_write(struct rhizome_write *write, const rhizome_filehash_t *expectedHashp, uint64_t file_length, int priority)
 {
   if (file_length == 0)
     return RHIZOME_PAYLOAD_STATUS_EMPTY;
 
   write->blob_fd=-1;
+  write->sync_pending=0;
+  write->buffer_alarm = (struct sched_ent)STRUCT_SCHED_ENT_UNUSED;
+  write->buffer_alarm.function = rhizome_write_buffer_alarm;
+  write->buffer_alarm.context = write;
+  write->buffer_alarm.stats = &write_buffer_alarm_stats;
+  rhizome_hash_init(&write->hash_stream);
   
   if (expectedHashp){
     if (rhizome_exists(expectedHashp))
@@ -90,7 +176,7 @@ enum rhizome_payload_status rhizome_open_write(struct rhizome_write *write, cons
   time_ms_t now = gettime_ms();
   static uint64_t last_id=0;
   write->temp_id = now;
-  if (write->temp_id < last_id)
+  if (write->temp_id <= last_id)
     write->temp_id = last_id + 1;
   last_id = write->temp_id;
   
@@ -155,7 +241,6 @@ enum rhizome_payload_status rhizome_open_write(struct rhizome_write *write, cons
   write->file_length = file_length;
   write->file_offset = 0;
   write->written_offset = 0;
-  SHA512_Init(&write->sha512_context);
   return RHIZOME_PAYLOAD_STATUS_NEW;
 }
 
@@ -184,7 +269,7 @@ static int prepare_data(struct rhizome_write *write_state, unsigned char *buffer
       return -1;
   }
   
-  SHA512_Update(&write_state->sha512_context, buffer, data_size);
+  rhizome_hash_update(&write_state->hash_stream, buffer, data_size);
   write_state->file_offset+=data_size;
   
   if (config.debug.rhizome_store)
@@ -221,16 +306,15 @@ static int write_data(struct rhizome_write *write_state, uint64_t file_offset, c
   if (write_state->blob_fd != -1) {
     size_t ofs = 0;
     // keep trying until all of the data is written.
-    if (lseek64(write_state->blob_fd, (off64_t) file_offset, SEEK_SET) == -1)
-      return WHYF_perror("lseek64(%d,%"PRIu64",SEEK_SET)", write_state->blob_fd, file_offset);
     while (ofs < data_size){
-      ssize_t r = write(write_state->blob_fd, buffer + ofs, (size_t)(data_size - ofs));
+      ssize_t r = pwrite64(write_state->blob_fd, buffer + ofs, (size_t)(data_size - ofs), (off64_t)(file_offset + ofs));
       if (r == -1)
-	return WHY_perror("write");
+	return WHYF_perror("pwrite64(%d,%"PRIu64")", write_state->blob_fd, file_offset + ofs);
       if (config.debug.rhizome_store)
         DEBUGF("Wrote %zd bytes to fd %d", (size_t)r, write_state->blob_fd);
       ofs += (size_t)r;
     }
+    write_state->sync_pending = 1;
   }else{
     if (!write_state->sql_blob)
       return WHY("Must call write_get_lock() before write_data()");
@@ -250,8 +334,14 @@ static int write_data(struct rhizome_write *write_state, uint64_t file_offset, c
 static int write_release_lock(struct rhizome_write *write_state)
 {
   int ret=0;
-  if (write_state->blob_fd != -1)
+  if (write_state->blob_fd != -1){
+    if (config.rhizome.sync_payloads && write_state->sync_pending){
+      if (fsync(write_state->blob_fd) == -1)
+	return WHYF_perror("fsync(%d)", write_state->blob_fd);
+      write_state->sync_pending = 0;
+    }
     return 0;
+  }
     
   if (write_state->sql_blob){
     ret = sqlite_blob_close(write_state->sql_blob);
@@ -263,8 +353,32 @@ static int write_release_lock(struct rhizome_write *write_state)
   return ret;
 }
 
+// don't mix data that has been encrypted and hashed with data that hasn't
+static int same_state(struct rhizome_write *write_state, uint64_t offset_a, uint64_t offset_b)
+{
+  return (offset_a < write_state->file_offset) == (offset_b < write_state->file_offset);
+}
+
+// if a buffer now reaches the next one, and has room for it, join them
+static void merge_next_buffer(struct rhizome_write *write_state, struct rhizome_write_buffer *b)
+{
+  struct rhizome_write_buffer *n = b->_next;
+  if (   n
+      && b->offset + b->data_size == n->offset
+      && b->data_size + n->data_size <= b->buffer_size
+      && same_state(write_state, b->offset, n->offset)
+  ){
+    bcopy(n->data, b->data + b->data_size, n->data_size);
+    b->data_size += n->data_size;
+    b->_next = n->_next;
+    free(n);
+  }
+}
+
 // Write data buffers in any order, the data will be cached and streamed into the database in file order. 
 // Though there is an upper bound on the amount of cached data
+// Contiguous blocks are gathered into larger buffers, so that small blocks received over MDP are
+// written together in one transaction, or one system call for an external file.
 int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, unsigned char *buffer, size_t data_size)
 {
   if (config.debug.rhizome_store)
@@ -275,18 +389,21 @@ int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uns
     data_size = write_state->file_length - offset;
   
   struct rhizome_write_buffer **ptr = &write_state->buffer_list;
+  // the buffer before *ptr
+  struct rhizome_write_buffer *prev = NULL;
   int ret=0;
   int should_write = 0;
-  // if we are writing to a file, or already have the sql blob open, or are finishing, write as much
-  // as we can.
-  if (write_state->blob_fd != -1 || write_state->sql_blob || buffer == NULL)
+  // if we already have the sql blob open, or are finishing, write as much as we can.
+  if (write_state->sql_blob || buffer == NULL)
     should_write = 1;
   else {
-    // cache up to RHIZOME_BUFFER_MAXIMUM_SIZE or file length before attempting to write everything in one go.
+    // cache up to rhizome.write_buffer_size or file length before attempting to write everything in
+    // one go, and rhizome_write_buffer_alarm() writes anything that has waited longer than
+    // rhizome.write_buffer_ms.
     // (Not perfect if the range overlaps)
     uint64_t new_size = write_state->written_offset + write_state->buffer_size + data_size;
     if (   (write_state->file_length != RHIZOME_SIZE_UNSET && new_size >= write_state->file_length)
-	|| new_size >= RHIZOME_BUFFER_MAXIMUM_SIZE
+	|| write_state->buffer_size + data_size >= config.rhizome.write_buffer_size
     )
       should_write = 1;
   }
@@ -335,8 +452,14 @@ int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uns
       break;
     
     // can we process the incoming data block now?
-    if (data_size>0 && offset == write_state->file_offset){
-      if (prepare_data(write_state, buffer, data_size)){
+    // A cached buffer that starts here is processed instead, as it may hold more than this block.
+    if (   offset == write_state->file_offset
+	&& (!*ptr || offset < (*ptr)->offset)
+    ){
+      size_t size = data_size;
+      if (*ptr && offset + size > (*ptr)->offset)
+	size = (*ptr)->offset - offset;
+      if (prepare_data(write_state, buffer, size)){
 	ret=-1;
 	break;
       }
@@ -368,21 +491,49 @@ int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uns
 	if (size<=0)
 	  break;
 	  
-	if (config.debug.rhizome_store)
-	  DEBUGF("Caching block @%"PRId64", %zu", offset, size);
-	struct rhizome_write_buffer *i = emalloc(size + sizeof(struct rhizome_write_buffer));
-	if (!i){
-	  ret=-1;
-	  break;
+	if (   prev
+	    && prev->offset + prev->data_size == offset
+	    && prev->data_size + size <= prev->buffer_size
+	    && same_state(write_state, prev->offset, offset)
+	){
+	  if (config.debug.rhizome_store)
+	    DEBUGF("Appending block @%"PRId64", %zu to buffer @%"PRId64, offset, size, prev->offset);
+	  bcopy(buffer, prev->data + prev->data_size, size);
+	  prev->data_size += size;
+	  write_state->buffer_size += size;
+	  merge_next_buffer(write_state, prev);
+	  last_offset = prev->offset + prev->data_size;
+	}else{
+	  if (config.debug.rhizome_store)
+	    DEBUGF("Caching block @%"PRId64", %zu", offset, size);
+	  size_t buffer_size = size;
+	  // if this block follows on from the data before it, leave room for the blocks that will
+	  // probably follow it
+	  if (offset == last_offset){
+	    buffer_size = RHIZOME_BUFFER_CHUNK_SIZE;
+	    if (write_state->file_length != RHIZOME_SIZE_UNSET && write_state->file_length - offset < buffer_size)
+	      buffer_size = write_state->file_length - offset;
+	    if (buffer_size < size)
+	      buffer_size = size;
+	  }
+	  struct rhizome_write_buffer *i = emalloc(buffer_size + sizeof(struct rhizome_write_buffer));
+	  if (!i){
+	    ret=-1;
+	    break;
+	  }
+	  i->offset = offset;
+	  i->buffer_size = buffer_size;
+	  i->data_size = size;
+	  bcopy(buffer, i->data, size);
+	  i->_next = *ptr;
+	  write_state->buffer_size += size;
+	  *ptr = i;
+	  merge_next_buffer(write_state, i);
+	  last_offset = i->offset + i->data_size;
+	  // if there's any overlap of this buffer and the current one, we may need to add another buffer.
+	  prev = *ptr;
+	  ptr = &((*ptr)->_next);
 	}
-	i->offset = offset;
-	i->buffer_size = i->data_size = size;
-	bcopy(buffer, i->data, size);
-	i->_next = *ptr;
-	write_state->buffer_size += size;
-	*ptr = i;
-	// if there's any overlap of this buffer and the current one, we may need to add another buffer.
-	ptr = &((*ptr)->_next);
       }
       data_size -= size;
       offset+=size;
@@ -391,10 +542,19 @@ int rhizome_random_write(struct rhizome_write *write_state, uint64_t offset, uns
     }
     
     last_offset = (*ptr)->offset + (*ptr)->data_size;
+    prev = *ptr;
     ptr = &((*ptr)->_next);
   }
   if (write_release_lock(write_state))
     ret=-1;
+  // start the clock when data is first buffered, stop it once all buffered data is written
+  if (write_state->buffer_size == 0)
+    unschedule(&write_state->buffer_alarm);
+  else if (!is_scheduled(&write_state->buffer_alarm)) {
+    write_state->buffer_alarm.alarm = gettime_ms() + config.rhizome.write_buffer_ms;
+    write_state->buffer_alarm.deadline = write_state->buffer_alarm.alarm + 1000;
+    schedule(&write_state->buffer_alarm);
+  }
   return ret;
 }
 
@@ -449,13 +609,18 @@ void rhizome_fail_write(struct rhizome_write *write)
     close(write->blob_fd);
     write->blob_fd=-1;
   }
+  unschedule(&write->buffer_alarm);
   write_release_lock(write);
   while(write->buffer_list){
     struct rhizome_write_buffer *n=write->buffer_list;
     write->buffer_list=n->_next;
     free(n);
   }
+  write->buffer_size=0;
+  rhizome_hash_cancel(&write->hash_stream);
   rhizome_delete_file(&write->id);
+  // so callers that check for an open blob don't fail the write again
+  write->blob_rowid=0;
 }
 
 enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
@@ -488,8 +653,7 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
     }
   }
   rhizome_filehash_t hash_out;
-  SHA512_Final(hash_out.binary, &write->sha512_context);
-  SHA512_End(&write->sha512_context, NULL);
+  rhizome_hash_final(&write->hash_stream, &hash_out);
 
   char blob_path[1024];
   if (!FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%"PRIu64, RHIZOME_BLOB_SUBDIR, write->temp_id)) {
@@ -544,6 +708,8 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
     // we've already got that payload, delete the new copy
     sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM FILEBLOBS WHERE id = ?;", UINT64_TOSTR, write->temp_id, END);
     sqlite_exec_void_retry_loglevel(LOG_LEVEL_WARN, &retry, "DELETE FROM FILES WHERE id = ?;", UINT64_TOSTR, write->temp_id, END);
+    if (external && unlink(blob_path) == -1)
+      WARNF_perror("unlink(%s)", alloca_str_toprint(blob_path));
     if (config.debug.rhizome_store)
       DEBUGF("Payload id=%s already present, removed id='%"PRIu64"'", alloca_tohex_rhizome_filehash_t(write->id), write->temp_id);
   } else {
@@ -568,12 +734,10 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
 
     if (external) {
       char dest_path[1024];
-      if (!FORMF_RHIZOME_STORE_PATH(dest_path, "%s/%s", RHIZOME_BLOB_SUBDIR, alloca_tohex_rhizome_filehash_t(write->id)))
+      if (!FORMF_RHIZOME_PAYLOAD_PATH(dest_path, alloca_tohex_rhizome_filehash_t(write->id)))
 	goto dbfailure;
-      if (rename(blob_path, dest_path) == -1) {
-	WHYF_perror("rename(%s, %s)", blob_path, dest_path);
+      if (rename_payload_file(blob_path, dest_path) == -1)
 	goto dbfailure;
-      }
       if (config.debug.rhizome_store)
 	DEBUGF("Renamed %s to %s", blob_path, dest_path);
     }else{
@@ -591,6 +755,7 @@ enum rhizome_payload_status rhizome_finish_write(struct rhizome_write *write)
       goto dbfailure;
     if (config.debug.rhizome_store)
       DEBUGF("Stored file %s", alloca_tohex_rhizome_filehash_t(write->id));
+    rhizome_index_payload_stored(&write->id);
   }
   write->blob_rowid = 0;
   return status;
@@ -795,7 +960,7 @@ enum rhizome_payload_status rhizome_open_read(struct rhizome_read *read, const r
   } else {
     // No row in FILEBLOBS, look for an external blob file.
     char blob_path[1024];
-    if (!FORMF_RHIZOME_STORE_PATH(blob_path, "%s/%s", RHIZOME_BLOB_SUBDIR, alloca_tohex_rhizome_filehash_t(read->id)))
+    if (!FORMF_RHIZOME_PAYLOAD_PATH(blob_path, alloca_tohex_rhizome_filehash_t(read->id)))
       return RHIZOME_PAYLOAD_STATUS_ERROR;
     read->blob_fd = open(blob_path, O_RDONLY);
     if (read->blob_fd == -1) {
@@ -828,13 +993,11 @@ static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read
 {
   IN();
   if (read_state->blob_fd != -1) {
-    if (lseek64(read_state->blob_fd, (off64_t) read_state->offset, SEEK_SET) == -1)
-      RETURN(WHYF_perror("lseek64(%d,%"PRIu64",SEEK_SET)", read_state->blob_fd, read_state->offset));
     if (bufsz == 0)
       RETURN(0);
-    ssize_t rd = read(read_state->blob_fd, buffer, bufsz);
+    ssize_t rd = pread64(read_state->blob_fd, buffer, bufsz, (off64_t) read_state->offset);
     if (rd == -1)
-      RETURN(WHYF_perror("read(%d,%p,%zu)", read_state->blob_fd, buffer, bufsz));
+      RETURN(WHYF_perror("pread64(%d,%p,%zu,%"PRIu64")", read_state->blob_fd, buffer, bufsz, read_state->offset));
     if (config.debug.rhizome_store)
       DEBUGF("Read %zu bytes from fd=%d @%"PRIx64, (size_t) rd, read_state->blob_fd, read_state->offset);
     RETURN(rd);
@@ -870,6 +1033,64 @@ static ssize_t rhizome_read_retry(sqlite_retry_state *retry, struct rhizome_read
   OUT();
 }
 
+/* Payload files can be sent without hashing them again, once we have read the whole file and
+ * checked its hash.  Remember which files we have checked, and what they looked like at the time,
+ * so that a file that has since been changed or replaced is checked again.
+ */
+#define VERIFIED_PAYLOAD_CACHE_SIZE 256
+
+struct verified_payload{
+  rhizome_filehash_t id;
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  time_t ctime;
+};
+
+static struct verified_payload verified_payloads[VERIFIED_PAYLOAD_CACHE_SIZE];
+
+static struct verified_payload *verified_payload_entry(const rhizome_filehash_t *id)
+{
+  return &verified_payloads[read_uint16(id->binary) % VERIFIED_PAYLOAD_CACHE_SIZE];
+}
+
+static void payload_verified(struct rhizome_read *read)
+{
+  struct stat st;
+  if (read->blob_fd == -1 || fstat(read->blob_fd, &st) == -1)
+    return;
+  struct verified_payload *entry = verified_payload_entry(&read->id);
+  entry->id = read->id;
+  entry->dev = st.st_dev;
+  entry->ino = st.st_ino;
+  entry->size = st.st_size;
+  entry->mtime = st.st_mtime;
+  entry->ctime = st.st_ctime;
+}
+
+/* Returns true if this payload is stored in a file, whose hash we have already checked, and which
+ * hasn't changed since.
+ */
+int rhizome_read_verified(struct rhizome_read *read)
+{
+  struct stat st;
+  if (read->blob_fd == -1 || read->invalid)
+    return 0;
+  struct verified_payload *entry = verified_payload_entry(&read->id);
+  if (cmp_rhizome_filehash_t(&entry->id, &read->id) != 0)
+    return 0;
+  if (fstat(read->blob_fd, &st) == -1){
+    WHYF_perror("fstat(%d)", read->blob_fd);
+    return 0;
+  }
+  return entry->dev == st.st_dev
+    && entry->ino == st.st_ino
+    && entry->size == st.st_size
+    && entry->mtime == st.st_mtime
+    && entry->ctime == st.st_ctime;
+}
+
 /* Read content from the store, hashing and decrypting as we go. 
  Random access is supported, but hashing requires all payload contents to be read sequentially. */
 // returns the number of bytes read
@@ -900,6 +1121,7 @@ ssize_t rhizome_read(struct rhizome_read *read_state, unsigned char *buffer, siz
 	read_state->invalid = 1;
 	RETURN(WHYF("Expected hash=%s, got %s", alloca_tohex_rhizome_filehash_t(read_state->id), alloca_tohex_rhizome_filehash_t(hash_out)));
       }
+      payload_verified(read_state);
     }
   }
   
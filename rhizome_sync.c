@@ -27,11 +27,27 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define MSG_TYPE_BARS 0
 #define MSG_TYPE_REQ 1
+#define MSG_TYPE_TREE 2
+#define MSG_TYPE_TREE_BARS 3
 
 #define CACHE_BARS 60
 #define MAX_OLD_BARS 40
 #define BARS_PER_RESPONSE ((int)400/RHIZOME_BAR_BYTES)
 
+// BAR tree reconciliation, see sync_process_tree()
+#define TREE_FANOUT 16
+#define TREE_NIBBLES (RHIZOME_BAR_PREFIX_BYTES*2)
+#define TREE_LEAF_BARS 8
+#define TREE_MAX_BAR_PACKETS 8
+#define TREE_BARS_PER_PACKET ((MDP_MTU - 3 - RHIZOME_BAR_PREFIX_BYTES) / RHIZOME_BAR_BYTES)
+// how many packets of BARs we will send in reply to one tree message
+#define TREE_MAX_REPLY_PACKETS 4
+#define TREE_MAX_QUEUED_BARS 1024
+// depth, prefix, and a packed count and digest for each child
+#define TREE_NODE_MAX_BYTES (1 + RHIZOME_BAR_PREFIX_BYTES + TREE_FANOUT*(5+8))
+#define TREE_ANNOUNCE_INTERVAL 5000
+#define TREE_FLAG_REPLY 1
+
 #define HEAD_FLAG INT64_MAX
 
 struct bar_entry
@@ -58,6 +74,15 @@ struct rhizome_sync
   struct bar_entry bars[CACHE_BARS];
   // how many bars are we interested in?
   int bar_count;
+  // interesting BARs from the tree that didn't fit in bars[] yet
+  unsigned char (*queued_bars)[RHIZOME_BAR_BYTES];
+  unsigned queued_count;
+  unsigned queued_size;
+  // has this peer sent us any BAR tree messages?
+  unsigned char tree_capable;
+  time_ms_t last_tree_root;
+  uint64_t tree_messages;
+  uint64_t tree_bars;
 };
 
 void rhizome_sync_status_html(struct strbuf *b, struct subscriber *subscriber)
@@ -65,6 +90,14 @@ void rhizome_sync_status_html(struct strbuf *b, struct subscriber *subscriber)
   if (!subscriber->sync_state)
     return;
   struct rhizome_sync *state=subscriber->sync_state;
+  if (state->tree_capable){
+    strbuf_sprintf(b, "BAR tree sync, %"PRId64" messages, %"PRId64" BARs, %d interesting, %u queued<br>",
+      state->tree_messages,
+      state->tree_bars,
+      state->bar_count,
+      state->queued_count);
+    return;
+  }
   strbuf_sprintf(b, "Seen %"PRId64" BARs [%"PRId64" to %"PRId64" of %"PRId64"], %d interesting<br>",
     state->bars_seen,
     state->sync_start,
@@ -103,6 +136,16 @@ static void rhizome_sync_send_requests(struct subscriber *subscriber, struct rhi
   time_ms_t now = gettime_ms();
 
   // send requests for manifests that we have room to fetch
+  // refill the cache from BARs the tree has told us about
+  while(state->bar_count < CACHE_BARS && state->queued_count > 0){
+    state->queued_count--;
+    if (rhizome_is_bar_interesting(state->queued_bars[state->queued_count])==0)
+      continue;
+    bcopy(state->queued_bars[state->queued_count], state->bars[state->bar_count].bar, RHIZOME_BAR_BYTES);
+    state->bars[state->bar_count].next_request = now;
+    state->bar_count++;
+  }
+
   struct internal_mdp_header header;
   bzero(&header, sizeof header);
   struct overlay_buffer *payload = NULL;
@@ -157,8 +200,9 @@ static void rhizome_sync_send_requests(struct subscriber *subscriber, struct rhi
     ob_free(payload);
   }
 
-  // send request for more bars if we have room to cache them
-  if (state->bar_count >= CACHE_BARS)
+  // send request for more bars if we have room to cache them,
+  // peers that understand BAR trees will tell us about missing bundles without being asked
+  if (state->bar_count >= CACHE_BARS || state->tree_capable)
     return;
 
   if (state->next_request<=now){
@@ -202,6 +246,15 @@ static int sync_bundle_inserted(struct subscriber *subscriber, void *context)
       }
     }
   }
+  unsigned j;
+  for (j=state->queued_count;j>0;j--){
+    unsigned char *this_bar = state->queued_bars[j-1];
+    if (memcmp(&this_bar[RHIZOME_BAR_PREFIX_OFFSET], id, RHIZOME_BAR_PREFIX_BYTES)==0 && version >= rhizome_bar_version(this_bar)){
+      state->queued_count--;
+      if (j-1<state->queued_count)
+        bcopy(state->queued_bars[state->queued_count], this_bar, RHIZOME_BAR_BYTES);
+    }
+  }
 
   return 0;
 }
@@ -212,18 +265,63 @@ int rhizome_sync_bundle_inserted(const unsigned char *bar)
   return 0;
 }
 
+static int sync_cache_interesting_bar(struct rhizome_sync *state, const unsigned char *bar)
+{
+  if (state->bar_count>=CACHE_BARS)
+    return 0;
+  // check the database before adding the BAR to the list
+  if (rhizome_is_bar_interesting(bar)==0)
+    return 0;
+  bcopy(bar, state->bars[state->bar_count].bar, RHIZOME_BAR_BYTES);
+  state->bars[state->bar_count].next_request = gettime_ms();
+  state->bar_count++;
+  return 1;
+}
+
+static int sync_bar_matches(const unsigned char *a, const unsigned char *b)
+{
+  return memcmp(&a[RHIZOME_BAR_PREFIX_OFFSET], &b[RHIZOME_BAR_PREFIX_OFFSET], RHIZOME_BAR_PREFIX_BYTES)==0
+    && rhizome_bar_version(a) >= rhizome_bar_version(b);
+}
+
+// each walk of the tree reports the same differences until we have fetched them,
+// so remember interesting BARs once, and queue them when the cache is full
+static int sync_queue_tree_bar(struct rhizome_sync *state, const unsigned char *bar)
+{
+  int i;
+  unsigned j;
+  for (i=0;i<state->bar_count;i++)
+    if (sync_bar_matches(state->bars[i].bar, bar))
+      return 0;
+  for (j=0;j<state->queued_count;j++)
+    if (sync_bar_matches(state->queued_bars[j], bar))
+      return 0;
+  if (state->bar_count<CACHE_BARS)
+    return sync_cache_interesting_bar(state, bar);
+  // we'll hear about anything we forget here again on the next walk
+  if (state->queued_count>=TREE_MAX_QUEUED_BARS)
+    return 0;
+  if (rhizome_is_bar_interesting(bar)==0)
+    return 0;
+  if (state->queued_count >= state->queued_size){
+    unsigned size = state->queued_size ? state->queued_size*2 : 64;
+    unsigned char (*queued)[RHIZOME_BAR_BYTES] = erealloc(state->queued_bars, size * RHIZOME_BAR_BYTES);
+    if (!queued)
+      return 0;
+    state->queued_bars = queued;
+    state->queued_size = size;
+  }
+  bcopy(bar, state->queued_bars[state->queued_count++], RHIZOME_BAR_BYTES);
+  return 0;
+}
+
 static int sync_cache_bar(struct rhizome_sync *state, unsigned char *bar, uint64_t token)
 {
   int ret=0;
   if (state->bar_count>=CACHE_BARS)
     return 0;
-  // check the database before adding the BAR to the list
-  if (token!=0 && rhizome_is_bar_interesting(bar)!=0){
-    bcopy(bar, state->bars[state->bar_count].bar, RHIZOME_BAR_BYTES);
-    state->bars[state->bar_count].next_request = gettime_ms();
-    state->bar_count++;
+  if (token!=0 && sync_cache_interesting_bar(state, bar))
     ret=1;
-  }
   if (state->sync_end < token){
     state->sync_end = token;
     state->last_extended = gettime_ms();
@@ -252,12 +350,32 @@ static void sync_process_bar_list(struct subscriber *subscriber, struct rhizome_
   int mid_point = -1;
   time_ms_t now = gettime_ms();
   
+  state->last_response = now;
+
+  if (state->tree_capable){
+    // the BAR tree finds everything we are missing, so just look for new bundles in announcements
+    int added=0;
+    while(ob_remaining(b)>0){
+      ob_get_packed_ui64(b);
+      unsigned char *bar = ob_get_bytes_ptr(b, RHIZOME_BAR_BYTES);
+      if (!bar)
+	break;
+      if (!is_all_matching(bar, RHIZOME_BAR_BYTES, 0) && sync_queue_tree_bar(state, bar))
+	added=1;
+    }
+    if (added)
+      state->next_request = now;
+    return;
+  }
+
   if (now - state->start_time > (60*60*1000)){
     // restart rhizome sync every hour, no matter what state it is in
+    if (state->queued_bars)
+      free(state->queued_bars);
     bzero(state, sizeof(struct rhizome_sync));
     state->start_time = now;
+    state->last_response = now;
   }
-  state->last_response = now;
   
   while(ob_remaining(b)>0 && bar_count < BARS_PER_RESPONSE){
     bar_tokens[bar_count]=ob_get_packed_ui64(b);
@@ -329,6 +447,358 @@ static void sync_process_bar_list(struct subscriber *subscriber, struct rhizome_
 
 }
 
+/* Set reconciliation over a prefix tree of BARs.
+ *
+ * Every BAR we store is a leaf of a 16 way tree, indexed by the nibbles of its bundle id prefix.
+ * Each tree node is summarised by the number of BARs below it, and the XOR of a hash of each of
+ * their id prefix and version. A MSG_TYPE_TREE message carries the summaries of the children of
+ * one or more nodes. The receiver compares them with its own, and for every child that differs,
+ * either replies with the summaries of that child's children, or if either side has only a few
+ * BARs below it, sends its BARs and asks for the peer's. So finding d differences between two sets
+ * of n bundles takes O(d log n) messages, instead of paging through every BAR.
+ *
+ * Interesting BARs that don't fit in the request cache are queued, up to TREE_MAX_QUEUED_BARS.
+ * Anything beyond that is found again by the next walk.
+ *
+ * The root of the tree is broadcast with announcements, at most every TREE_ANNOUNCE_INTERVAL.
+ * Only the peer with the higher SID responds, so each pair of peers only walks the tree once.
+ * Peers that don't understand these messages ignore them, and we keep using the rowid paging
+ * protocol with them.
+ */
+
+struct tree_entry{
+  unsigned char bar[RHIZOME_BAR_BYTES];
+  uint64_t hash;
+};
+
+struct tree_summary{
+  uint32_t count[TREE_FANOUT];
+  uint64_t digest[TREE_FANOUT];
+};
+
+// all of our BARs, sorted by bundle id prefix
+static struct tree_entry *tree_entries=NULL;
+static unsigned tree_count=0;
+static unsigned tree_size=0;
+static unsigned tree_generation=0;
+static int tree_loaded=0;
+static time_ms_t next_tree_announce=0;
+
+static inline unsigned bar_nibble(const unsigned char *prefix, unsigned n)
+{
+  return n&1 ? prefix[n>>1] & 0xF : prefix[n>>1] >> 4;
+}
+
+// FNV-1a of the bundle id prefix and version, so any change of version changes the digest
+static uint64_t tree_bar_hash(const unsigned char *bar)
+{
+  uint64_t hash = 0xcbf29ce484222325ull;
+  unsigned i;
+  for (i=0;i<RHIZOME_BAR_PREFIX_BYTES;i++)
+    hash = (hash ^ bar[RHIZOME_BAR_PREFIX_OFFSET + i]) * 0x100000001b3ull;
+  for (i=0;i<7;i++)
+    hash = (hash ^ bar[RHIZOME_BAR_VERSION_OFFSET + i]) * 0x100000001b3ull;
+  return hash;
+}
+
+static int cmp_tree_entry(const void *a, const void *b)
+{
+  return memcmp(((const struct tree_entry *)a)->bar, ((const struct tree_entry *)b)->bar, RHIZOME_BAR_PREFIX_BYTES);
+}
+
+// compare the first depth nibbles of a BAR with a node prefix
+static int cmp_tree_prefix(const unsigned char *bar, unsigned depth, const unsigned char *prefix)
+{
+  int r = memcmp(bar, prefix, depth>>1);
+  if (r || !(depth&1))
+    return r;
+  return (int)bar_nibble(bar, depth -1) - (int)bar_nibble(prefix, depth -1);
+}
+
+static int tree_add_bar(const unsigned char *bar, void *UNUSED(context))
+{
+  if (tree_count >= tree_size){
+    unsigned size = tree_size ? tree_size*2 : 1024;
+    struct tree_entry *entries = erealloc(tree_entries, size * sizeof(struct tree_entry));
+    if (!entries)
+      return -1;
+    tree_entries = entries;
+    tree_size = size;
+  }
+  bcopy(bar, tree_entries[tree_count].bar, RHIZOME_BAR_BYTES);
+  tree_entries[tree_count].hash = tree_bar_hash(bar);
+  tree_count++;
+  return 0;
+}
+
+// rebuild the tree from the bundle index whenever it changes
+static int sync_tree_check()
+{
+  if (tree_loaded && tree_generation == rhizome_index_generation())
+    return 0;
+  tree_count=0;
+  if (rhizome_index_enum(tree_add_bar, NULL) != 0)
+    return -1;
+  qsort(tree_entries, tree_count, sizeof(struct tree_entry), cmp_tree_entry);
+  tree_generation = rhizome_index_generation();
+  tree_loaded = 1;
+  if (config.debug.rhizome)
+    DEBUGF("Loaded %u BARs into sync tree", tree_count);
+  return 0;
+}
+
+// find the range [*first, *last) of BARs below a tree node
+static void sync_tree_range(unsigned depth, const unsigned char *prefix, unsigned *first, unsigned *last)
+{
+  unsigned lo=0, hi=tree_count;
+  while(lo<hi){
+    unsigned mid = (lo+hi)/2;
+    if (cmp_tree_prefix(tree_entries[mid].bar, depth, prefix) < 0)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  *first = lo;
+  hi=tree_count;
+  while(lo<hi){
+    unsigned mid = (lo+hi)/2;
+    if (cmp_tree_prefix(tree_entries[mid].bar, depth, prefix) <= 0)
+      lo = mid+1;
+    else
+      hi = mid;
+  }
+  *last = lo;
+}
+
+static void sync_tree_summarise(unsigned depth, const unsigned char *prefix, struct tree_summary *summary)
+{
+  bzero(summary, sizeof(struct tree_summary));
+  unsigned i, first, last;
+  sync_tree_range(depth, prefix, &first, &last);
+  for (i=first;i<last;i++){
+    unsigned child = bar_nibble(tree_entries[i].bar, depth);
+    summary->count[child]++;
+    summary->digest[child] ^= tree_entries[i].hash;
+  }
+}
+
+static void sync_tree_header(struct internal_mdp_header *header, struct subscriber *dest)
+{
+  bzero(header, sizeof(struct internal_mdp_header));
+  header->source = my_subscriber;
+  header->source_port = MDP_PORT_RHIZOME_SYNC;
+  header->destination = dest;
+  header->destination_port = MDP_PORT_RHIZOME_SYNC;
+  header->qos = OQ_OPPORTUNISTIC;
+  if (!dest){
+    header->crypt_flags = (MDP_FLAG_NO_CRYPT|MDP_FLAG_NO_SIGN);
+    header->ttl = 1;
+  }
+}
+
+static void append_tree_node(struct overlay_buffer *b, unsigned depth, const unsigned char *prefix)
+{
+  ob_append_byte(b, depth);
+  if (depth)
+    ob_append_bytes(b, prefix, (depth+1)/2);
+}
+
+static int get_tree_node(struct overlay_buffer *b, unsigned *depth, unsigned char *prefix)
+{
+  int d = ob_get(b);
+  if (d<0 || d>TREE_NIBBLES)
+    return -1;
+  unsigned len = (d+1)/2;
+  bzero(prefix, RHIZOME_BAR_PREFIX_BYTES);
+  if (len){
+    const unsigned char *bytes = ob_get_bytes_ptr(b, len);
+    if (!bytes)
+      return -1;
+    bcopy(bytes, prefix, len);
+    if (d&1)
+      prefix[len-1]&=0xF0;
+  }
+  *depth = d;
+  return 0;
+}
+
+static unsigned sync_tree_bar_packets(unsigned count)
+{
+  return count ? (count + TREE_BARS_PER_PACKET - 1) / TREE_BARS_PER_PACKET : 1;
+}
+
+static void append_tree_summary(struct overlay_buffer *b, unsigned depth, const unsigned char *prefix)
+{
+  struct tree_summary summary;
+  sync_tree_summarise(depth, prefix, &summary);
+  append_tree_node(b, depth, prefix);
+  unsigned i;
+  for (i=0;i<TREE_FANOUT;i++){
+    ob_append_packed_ui32(b, summary.count[i]);
+    if (summary.count[i])
+      ob_append_ui64(b, summary.digest[i]);
+  }
+}
+
+static void sync_send_tree_message(struct subscriber *dest, struct overlay_buffer *b)
+{
+  struct internal_mdp_header header;
+  sync_tree_header(&header, dest);
+  ob_flip(b);
+  overlay_send_frame(&header, b);
+  ob_free(b);
+}
+
+// add a node to a MSG_TYPE_TREE message, sending the message first if the node won't fit
+static struct overlay_buffer *sync_append_tree(struct subscriber *dest, struct overlay_buffer *b, unsigned depth, const unsigned char *prefix)
+{
+  assert(depth < TREE_NIBBLES);
+  if (b && ob_remaining(b) < TREE_NODE_MAX_BYTES){
+    sync_send_tree_message(dest, b);
+    b = NULL;
+  }
+  if (!b){
+    b = ob_new();
+    ob_limitsize(b, MDP_MTU);
+    ob_append_byte(b, MSG_TYPE_TREE);
+  }
+  if (config.debug.rhizome_ads)
+    DEBUGF("Sending BAR tree node %s/%u to %s", alloca_tohex(prefix, (depth+1)/2), depth,
+      dest?alloca_tohex_sid_t(dest->sid):"broadcast");
+  append_tree_summary(b, depth, prefix);
+  return b;
+}
+
+static void sync_send_tree(struct subscriber *dest, unsigned depth, const unsigned char *prefix)
+{
+  sync_send_tree_message(dest, sync_append_tree(dest, NULL, depth, prefix));
+}
+
+// send all of our BARs below a tree node, and optionally ask for theirs in return
+static void sync_send_tree_bars(struct subscriber *dest, unsigned depth, const unsigned char *prefix, int reply)
+{
+  unsigned i, first, last, packets=0;
+  sync_tree_range(depth, prefix, &first, &last);
+  if (first == last && !reply)
+    return;
+
+  if (config.debug.rhizome)
+    DEBUGF("Sending %u BARs from tree node %s/%u to %s", last - first, alloca_tohex(prefix, (depth+1)/2), depth,
+      alloca_tohex_sid_t(dest->sid));
+
+  i = first;
+  do{
+    struct internal_mdp_header header;
+    sync_tree_header(&header, dest);
+    struct overlay_buffer *b = ob_new();
+    ob_limitsize(b, MDP_MTU);
+    ob_append_byte(b, MSG_TYPE_TREE_BARS);
+    ob_append_byte(b, reply && packets==0 ? TREE_FLAG_REPLY : 0);
+    append_tree_node(b, depth, prefix);
+    while(i<last && ob_remaining(b)>=RHIZOME_BAR_BYTES)
+      ob_append_bytes(b, tree_entries[i++].bar, RHIZOME_BAR_BYTES);
+    ob_flip(b);
+    overlay_send_frame(&header, b);
+    ob_free(b);
+    packets++;
+  }while(i<last && packets < TREE_MAX_BAR_PACKETS);
+}
+
+/* A MSG_TYPE_TREE message carries one or more nodes. For each child that differs we either send
+ * our BARs, or descend by adding the child to our reply. Sending BARs is limited to
+ * TREE_MAX_REPLY_PACKETS per message, children that would need more are descended into instead,
+ * so the number of packets we send back is bounded by the size of the message we received.
+ */
+static void sync_process_tree(struct subscriber *peer, struct rhizome_sync *state, struct overlay_buffer *b, int broadcast)
+{
+  // when two peers hear each other's root, only one of them needs to walk the tree,
+  // and we hear our own broadcasts too
+  if (broadcast && cmp_sid_t(&my_subscriber->sid, &peer->sid) <= 0)
+    return;
+
+  struct overlay_buffer *reply = NULL;
+  unsigned budget = TREE_MAX_REPLY_PACKETS;
+  time_ms_t now = gettime_ms();
+
+  while(ob_remaining(b)>0){
+    unsigned depth;
+    unsigned char prefix[RHIZOME_BAR_PREFIX_BYTES];
+    if (get_tree_node(b, &depth, prefix)==-1 || depth>=TREE_NIBBLES)
+      break;
+
+    struct tree_summary theirs;
+    unsigned i;
+    for (i=0;i<TREE_FANOUT;i++){
+      theirs.count[i] = ob_get_packed_ui32(b);
+      theirs.digest[i] = theirs.count[i] ? ob_get_ui64(b) : 0;
+    }
+    if (ob_overrun(b))
+      break;
+
+    if (depth==0){
+      // one hop broadcasts may arrive more than once
+      if (now - state->last_tree_root < TREE_ANNOUNCE_INTERVAL/2)
+        continue;
+      state->last_tree_root = now;
+      // reload at the start of each walk, not part way through
+      if (sync_tree_check()==-1)
+        break;
+    }
+
+    struct tree_summary mine;
+    sync_tree_summarise(depth, prefix, &mine);
+    for (i=0;i<TREE_FANOUT;i++){
+      if (theirs.count[i] == mine.count[i] && theirs.digest[i] == mine.digest[i])
+        continue;
+      unsigned char child[RHIZOME_BAR_PREFIX_BYTES];
+      bcopy(prefix, child, sizeof child);
+      child[depth>>1] |= depth&1 ? i : i<<4;
+      unsigned packets = sync_tree_bar_packets(mine.count[i]);
+      if (depth+1 >= TREE_NIBBLES){
+        // we can't descend any further, these should only ever hold a couple of BARs
+        sync_send_tree_bars(peer, depth+1, child, theirs.count[i]>0);
+      }else if ((theirs.count[i] <= TREE_LEAF_BARS || mine.count[i] <= TREE_LEAF_BARS)
+          && theirs.count[i] <= TREE_MAX_REPLY_PACKETS * TREE_BARS_PER_PACKET
+          && packets <= budget){
+        sync_send_tree_bars(peer, depth+1, child, theirs.count[i]>0);
+        budget -= packets;
+      }else
+        reply = sync_append_tree(peer, reply, depth+1, child);
+    }
+  }
+  if (reply)
+    sync_send_tree_message(peer, reply);
+}
+
+static void sync_process_tree_bars(struct subscriber *peer, struct rhizome_sync *state, struct overlay_buffer *b)
+{
+  int flags = ob_get(b);
+  unsigned depth;
+  unsigned char prefix[RHIZOME_BAR_PREFIX_BYTES];
+  if (flags<0 || get_tree_node(b, &depth, prefix)==-1)
+    return;
+  int added=0;
+  while(ob_remaining(b)>=RHIZOME_BAR_BYTES){
+    const unsigned char *bar = ob_get_bytes_ptr(b, RHIZOME_BAR_BYTES);
+    if (cmp_tree_prefix(bar, depth, prefix)!=0)
+      continue;
+    state->tree_bars++;
+    if (sync_queue_tree_bar(state, bar))
+      added=1;
+  }
+  if (added)
+    state->next_request = gettime_ms();
+  if (flags & TREE_FLAG_REPLY){
+    // too many to send in reply? tell them how they are spread over the next level instead
+    unsigned first, last;
+    sync_tree_range(depth, prefix, &first, &last);
+    if (sync_tree_bar_packets(last - first) > TREE_MAX_REPLY_PACKETS && depth < TREE_NIBBLES)
+      sync_send_tree(peer, depth, prefix);
+    else
+      sync_send_tree_bars(peer, depth, prefix, 0);
+  }
+}
+
 static void append_response(struct overlay_buffer *b, uint64_t token, const unsigned char *bar)
 {
   ob_append_packed_ui64(b, token);
@@ -438,7 +908,7 @@ static void sync_send_response(struct subscriber *dest, int forwards, uint64_t t
     }
   }
 
-  sqlite3_finalize(statement);
+  sqlite_release(statement);
 
   if (count){
     if (config.debug.rhizome_ads)
@@ -453,6 +923,15 @@ static void sync_send_response(struct subscriber *dest, int forwards, uint64_t t
 int rhizome_sync_announce()
 {
   int (*oldfunc)() = sqlite_set_tracefunc(is_debug_rhizome_ads);
+  // notice any bundles that other processes have added or removed
+  rhizome_index_check();
+  time_ms_t now = gettime_ms();
+  if (now >= next_tree_announce && sync_tree_check()!=-1){
+    unsigned char root[RHIZOME_BAR_PREFIX_BYTES];
+    bzero(root, sizeof root);
+    sync_send_tree(NULL, 0, root);
+    next_tree_announce = now + TREE_ANNOUNCE_INTERVAL;
+  }
   sync_send_response(NULL, 0, HEAD_FLAG, 5);
   sqlite_set_tracefunc(oldfunc);
   return 0;
@@ -477,6 +956,16 @@ int overlay_mdp_service_rhizome_sync(struct internal_mdp_header *header, struct
         sync_send_response(header->source, forwards, token, 0);
       }
       break;
+    case MSG_TYPE_TREE:
+      state->tree_capable = 1;
+      state->tree_messages++;
+      sync_process_tree(header->source, state, payload, header->destination == NULL);
+      break;
+    case MSG_TYPE_TREE_BARS:
+      state->tree_capable = 1;
+      state->tree_messages++;
+      sync_process_tree_bars(header->source, state, payload);
+      break;
   }
   rhizome_sync_send_requests(header->source, state);
   return 0;
@@ -26,6 +26,8 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "conf.h"
 #include "keyring.h"
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
 
 /*
 Link state routing;
@@ -54,27 +56,26 @@ struct link{
   struct link *_left;
   struct link *_right;
 
+  // which neighbour's routing table is this link from?
+  struct neighbour *neighbour;
   struct subscriber *transmitter;
-  struct link *parent;
   struct network_destination *destination;
   struct subscriber *receiver;
 
+  // list of links with the same transmitter, from the transmitter's link_state
+  struct link *_next_from;
+  struct link **_prev_from;
+
   // What's the last ack we've heard so we don't process nacks twice.
   int last_ack_seq;
 
-  // neighbour path version when path scores were last updated
-  char path_version;
-
   // link quality stats;
   char link_version;
   char drop_rate;
 
   // calculated path score;
   int hop_count;
-  int path_drop_rate;
-
-  // loop prevention;
-  char calculating;
+  int path_cost;
 };
 
 // statistics of incoming half of network links
@@ -110,9 +111,6 @@ struct neighbour{
 
   struct subscriber *subscriber;
 
-  // whenever we hear about a link change, update the version to mark all link path scores as dirty
-  char path_version;
-
   // when do we assume the link is dead because they stopped hearing us or vice versa?
   time_ms_t link_in_timeout;
 
@@ -153,17 +151,43 @@ struct link_state{
   struct subscriber *next_hop;
   struct subscriber *transmitter;
   int hop_count;
-  int route_version;
-  // if a neighbour is free'd this link will point to invalid memory.
+  int path_cost;
+  // estimated airtime of each hop in microseconds, from the interface we use to reach our neighbour
+  int hop_airtime;
   // don't use this pointer directly, call find_best_link instead
   struct link *link;
-  char calculating;
+
+  // all links in our neighbours routing tables where this subscriber is the transmitter
+  struct link *links_from;
+
+  // our own routing tree, where each subscriber's parent is its transmitter
+  struct subscriber *first_child;
+  struct subscriber *next_sibling;
+  struct subscriber **prev_sibling;
+
+  // the best route found so far while routes are being recalculated
+  struct link *candidate;
+  int candidate_hop_count;
+  int candidate_cost;
+  int candidate_airtime;
+  // position in route_heap + 1, or 0 if not queued
+  unsigned heap_pos;
+  // the previous route can no longer be used
+  char invalid;
+  // in the list of subscribers that need their routes recalculated
+  char dirty;
+  // routes have been recalculated, but not yet applied to the subscriber
+  char stale;
+  char changed;
+  // the route has changed since we last told our neighbours about it
+  char announce;
 
   // when do we need to send a new link state message.
   time_ms_t next_update;
 };
 
 static void link_send(struct sched_ent *alarm);
+static void update_alarm(struct __sourceloc __whence, time_ms_t limit);
 
 static struct profile_total link_send_stats={
   .name="link_send",
@@ -175,7 +199,70 @@ static struct sched_ent link_send_alarm={
 };
 
 struct neighbour *neighbours=NULL;
-int route_version=0;
+
+// path scores that we will never route through
+#define UNREACHABLE_HOP_COUNT 99
+#define UNREACHABLE_DROP_RATE 99
+#define UNREACHABLE_AIRTIME INT_MAX
+#define UNREACHABLE_COST (route_metric == ROUTE_METRIC_AIRTIME ? UNREACHABLE_AIRTIME : UNREACHABLE_DROP_RATE)
+// assumed airtime of a hop when we don't know which interface it uses, a full wifi packet at 6Mbit/s
+#define DEFAULT_HOP_AIRTIME 1600
+
+// the path metric our current routes were calculated with
+static short route_metric = ROUTE_METRIC_DROP_RATE;
+
+// subscribers whose incoming links have changed since routes were last calculated
+static struct subscriber **route_dirty=NULL;
+static unsigned route_dirty_count=0, route_dirty_size=0;
+// subscribers whose routes are being recalculated
+static struct subscriber **route_touched=NULL;
+static unsigned route_touched_count=0, route_touched_size=0;
+// priority queue of subscribers, ordered by their candidate path score
+static struct subscriber **route_heap=NULL;
+static unsigned route_heap_count=0, route_heap_size=0;
+static time_ms_t route_now;
+
+// how much routing information are we sending and receiving?
+#define LINK_TRAFFIC_WINDOW_MS 10000
+static struct link_traffic{
+  uint64_t tx_bytes;
+  uint64_t rx_bytes;
+  // records sent because the route changed, or to repeat unchanged routes
+  unsigned changed_records;
+  unsigned refresh_records;
+  // bytes per second over the last complete window
+  time_ms_t window_start;
+  unsigned window_tx_bytes;
+  unsigned window_rx_bytes;
+  unsigned tx_rate;
+  unsigned rx_rate;
+} link_traffic;
+
+static void link_traffic_add(size_t tx_bytes, size_t rx_bytes)
+{
+  time_ms_t now = gettime_ms();
+  if (now - link_traffic.window_start >= LINK_TRAFFIC_WINDOW_MS){
+    time_ms_t elapsed = now - link_traffic.window_start;
+    link_traffic.tx_rate = link_traffic.window_tx_bytes * 1000 / elapsed;
+    link_traffic.rx_rate = link_traffic.window_rx_bytes * 1000 / elapsed;
+    if (config.debug.linkstate && link_traffic.window_start)
+      DEBUGF("LINK STATE; sending %u, receiving %u bytes per second of routing information",
+	link_traffic.tx_rate, link_traffic.rx_rate);
+    link_traffic.window_start = now;
+    link_traffic.window_tx_bytes = 0;
+    link_traffic.window_rx_bytes = 0;
+  }
+  link_traffic.tx_bytes += tx_bytes;
+  link_traffic.rx_bytes += rx_bytes;
+  link_traffic.window_tx_bytes += tx_bytes;
+  link_traffic.window_rx_bytes += rx_bytes;
+}
+
+void link_traffic_status_html(struct strbuf *b)
+{
+  strbuf_sprintf(b, "Routing: sending %u, receiving %u bytes per second, %u changed and %u repeated routes sent<br>",
+    link_traffic.tx_rate, link_traffic.rx_rate, link_traffic.changed_records, link_traffic.refresh_records);
+}
 
 struct network_destination * new_destination(struct overlay_interface *interface, char encapsulation){
   assert(interface);
@@ -252,12 +339,41 @@ static int NumberOfSetBits(uint32_t i)
 static struct link_state *get_link_state(struct subscriber *subscriber)
 {
   if (!subscriber->link_state){
-    subscriber->link_state = emalloc_zero(sizeof(struct link_state));
-    subscriber->link_state->route_version = route_version -1;
+    struct link_state *state = subscriber->link_state = emalloc_zero(sizeof(struct link_state));
+    state->hop_count = state->candidate_hop_count = UNREACHABLE_HOP_COUNT;
+    state->path_cost = state->candidate_cost = UNREACHABLE_COST;
+    state->stale = 1;
   }
   return subscriber->link_state;
 }
 
+static struct neighbour *get_neighbour(struct subscriber *subscriber, char create);
+
+static int refresh_link(struct subscriber *subscriber, void *context)
+{
+  time_ms_t *when = context;
+  if (subscriber->link_state && subscriber->link_state->next_update > *when)
+    subscriber->link_state->next_update = *when;
+  return 0;
+}
+
+// drop our routing state for an unreachable subscriber, so that it can be forgotten
+int link_state_forget(struct subscriber *subscriber)
+{
+  struct link_state *state = subscriber->link_state;
+  if (!state)
+    return 1;
+  if (subscriber->reachable != REACHABLE_NONE
+    || state->links_from || state->first_child || state->prev_sibling || state->dirty || state->heap_pos
+    || get_neighbour(subscriber, 0))
+    return 0;
+  set_subscriber_ref(&state->next_hop, NULL);
+  set_subscriber_ref(&state->transmitter, NULL);
+  free(state);
+  subscriber->link_state = NULL;
+  return 1;
+}
+
 static struct neighbour *get_neighbour(struct subscriber *subscriber, char create)
 {
   struct neighbour *n = neighbours;
@@ -268,7 +384,7 @@ static struct neighbour *get_neighbour(struct subscriber *subscriber, char creat
   }
   if (create){
     n = emalloc_zero(sizeof(struct neighbour));
-    n->subscriber = subscriber;
+    n->subscriber = add_subscriber_ref(subscriber);
     n->_next = neighbours;
     n->last_update_seq = -1;
     n->mdp_ack_sequence = -1;
@@ -278,10 +394,60 @@ static struct neighbour *get_neighbour(struct subscriber *subscriber, char creat
     neighbours = n;
     if (config.debug.linkstate)
       DEBUGF("LINK STATE; new neighbour %s", alloca_tohex_sid_t(n->subscriber->sid));
+    // we only repeat unchanged routes occasionally, so tell our new neighbour about everything now
+    time_ms_t when = gettime_ms() + 5;
+    enum_subscribers(NULL, refresh_link, &when);
+    update_alarm(__WHENCE__, when);
   }
   return n;
 }
 
+static void grow_route_list(struct subscriber ***list, unsigned *size, unsigned count)
+{
+  if (count < *size)
+    return;
+  unsigned new_size = *size ? *size * 2 : 64;
+  struct subscriber **new_list = erealloc(*list, new_size * sizeof(struct subscriber *));
+  if (!new_list)
+    FATAL("Out of memory while calculating routes");
+  *list = new_list;
+  *size = new_size;
+}
+
+// remember that the links to this subscriber have changed, so we need to calculate its route again
+static void route_changed(struct subscriber *subscriber)
+{
+  struct link_state *state = get_link_state(subscriber);
+  if (state->dirty)
+    return;
+  grow_route_list(&route_dirty, &route_dirty_size, route_dirty_count);
+  route_dirty[route_dirty_count++] = add_subscriber_ref(subscriber);
+  state->dirty = 1;
+}
+
+static void link_set_transmitter(struct link *link, struct subscriber *transmitter)
+{
+  if (link->transmitter == transmitter)
+    return;
+  if (link->transmitter){
+    *link->_prev_from = link->_next_from;
+    if (link->_next_from)
+      link->_next_from->_prev_from = link->_prev_from;
+    link->_next_from = NULL;
+    link->_prev_from = NULL;
+  }
+  set_subscriber_ref(&link->transmitter, transmitter);
+  if (transmitter){
+    struct link_state *state = get_link_state(transmitter);
+    link->_next_from = state->links_from;
+    if (link->_next_from)
+      link->_next_from->_prev_from = &link->_next_from;
+    link->_prev_from = &state->links_from;
+    state->links_from = link;
+  }
+  route_changed(link->receiver);
+}
+
 static void free_links(struct link *link)
 {
   if (!link)
@@ -290,8 +456,16 @@ static void free_links(struct link *link)
   link->_left=NULL;
   free_links(link->_right);
   link->_right=NULL;
+  link_set_transmitter(link, NULL);
+  // our route to the receiver will be recalculated before this link is looked at again
+  struct link_state *state = link->receiver->link_state;
+  if (state && state->link == link){
+    state->link = NULL;
+    route_changed(link->receiver);
+  }
   if (link->destination)
     release_destination_ref(link->destination);
+  release_subscriber_ref(link->receiver);
   free(link);
 }
 
@@ -302,8 +476,9 @@ static struct link *find_link(struct neighbour *neighbour, struct subscriber *re
     if (link==NULL){
       if (create){
         link = *link_ptr = emalloc_zero(sizeof(struct link));
-        link->receiver = receiver;
-        link->path_version = neighbour->path_version -1;
+        link->neighbour = neighbour;
+        link->receiver = add_subscriber_ref(receiver);
+        link->hop_count = -1;
 	link->last_ack_seq = -1;
 	link->link_version = -1;
       }
@@ -317,59 +492,314 @@ static struct link *find_link(struct neighbour *neighbour, struct subscriber *re
   return link;
 }
 
-static struct link *get_parent(struct neighbour *neighbour, struct link *link)
+// is this path better than the best we have found so far?
+// Equal paths are ordered by neighbour, so the result doesn't depend on the order we find them in.
+static int route_better(int cost, int hop_count, struct link *link, struct link_state *state)
 {
-  // root of the routing table.
-  if (link->receiver == neighbour->subscriber || link->transmitter == NULL)
-    return NULL;
+  if (cost != state->candidate_cost)
+    return cost < state->candidate_cost;
+  if (hop_count != state->candidate_hop_count)
+    return hop_count < state->candidate_hop_count;
+  if (!link || !state->candidate)
+    return link && !state->candidate;
+  return cmp_sid_t(&link->neighbour->subscriber->sid, &state->candidate->neighbour->subscriber->sid) < 0;
+}
+
+// the cost of sending packets over this link
+static int link_cost(struct link *link, int hop_airtime)
+{
+  // ignore occasional dropped packets due to collisions
+  int drop_rate = link->drop_rate>2 ? link->drop_rate : 0;
+  if (route_metric == ROUTE_METRIC_AIRTIME){
+    // the expected number of transmissions (ETX) for each packet, times the airtime of each
+    if (drop_rate > 15)
+      drop_rate = 15;
+    return hop_airtime * 16 / (16 - drop_rate);
+  }
+  return drop_rate;
+}
 
-  if (!link->parent)
-    link->parent = find_link(neighbour, link->transmitter, 0);
+static void heap_swap(unsigned a, unsigned b)
+{
+  struct subscriber *s = route_heap[a];
+  route_heap[a] = route_heap[b];
+  route_heap[b] = s;
+  route_heap[a]->link_state->heap_pos = a + 1;
+  route_heap[b]->link_state->heap_pos = b + 1;
+}
 
-  return link->parent;
+static int heap_less(unsigned a, unsigned b)
+{
+  struct link_state *sa = route_heap[a]->link_state;
+  return route_better(sa->candidate_cost, sa->candidate_hop_count, sa->candidate, route_heap[b]->link_state);
 }
 
-static void update_path_score(struct neighbour *neighbour, struct link *link){
-  if (link->path_version == neighbour->path_version)
+static void heap_update(unsigned i)
+{
+  while (i > 0 && heap_less(i, (i - 1) / 2)){
+    heap_swap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  while (1){
+    unsigned c = i * 2 + 1;
+    if (c >= route_heap_count)
+      break;
+    if (c + 1 < route_heap_count && heap_less(c + 1, c))
+      c++;
+    if (!heap_less(c, i))
+      break;
+    heap_swap(i, c);
+    i = c;
+  }
+}
+
+static void heap_push(struct subscriber *subscriber)
+{
+  struct link_state *state = subscriber->link_state;
+  if (!state->heap_pos){
+    grow_route_list(&route_heap, &route_heap_size, route_heap_count);
+    route_heap[route_heap_count++] = subscriber;
+    state->heap_pos = route_heap_count;
+  }
+  heap_update(state->heap_pos - 1);
+}
+
+static void heap_remove(struct subscriber *subscriber)
+{
+  struct link_state *state = subscriber->link_state;
+  unsigned i = state->heap_pos - 1;
+  state->heap_pos = 0;
+  if (i != --route_heap_count){
+    route_heap[i] = route_heap[route_heap_count];
+    route_heap[i]->link_state->heap_pos = i + 1;
+    heap_update(i);
+  }
+}
+
+static void tree_detach(struct link_state *state)
+{
+  if (!state->prev_sibling)
     return;
-  if (link->calculating)
+  *state->prev_sibling = state->next_sibling;
+  if (state->next_sibling)
+    state->next_sibling->link_state->prev_sibling = state->prev_sibling;
+  state->next_sibling = NULL;
+  state->prev_sibling = NULL;
+}
+
+static void tree_attach(struct subscriber *subscriber, struct link_state *parent)
+{
+  struct link_state *state = subscriber->link_state;
+  state->next_sibling = parent->first_child;
+  if (state->next_sibling)
+    state->next_sibling->link_state->prev_sibling = &state->next_sibling;
+  state->prev_sibling = &parent->first_child;
+  parent->first_child = subscriber;
+}
+
+static void route_touch(struct subscriber *subscriber)
+{
+  grow_route_list(&route_touched, &route_touched_size, route_touched_count);
+  route_touched[route_touched_count++] = subscriber;
+}
+
+/* The route to this transmitter is about to change, so any better route we have found through it, 
+ * that is still waiting in the heap, may now cost more or be through the wrong neighbour. 
+ * Go back to the route we had before, and look for better routes again.
+ */
+static void route_reconsider(struct link_state *transmitter)
+{
+  struct link *l;
+  for (l = transmitter->links_from; l; l = l->_next_from){
+    struct link_state *state = l->receiver->link_state;
+    if (!state || !state->heap_pos || state->candidate != l)
+      continue;
+    heap_remove(l->receiver);
+    if (state->invalid){
+      state->candidate = NULL;
+      state->candidate_hop_count = UNREACHABLE_HOP_COUNT;
+      state->candidate_cost = UNREACHABLE_COST;
+    }else{
+      state->candidate = state->link;
+      state->candidate_hop_count = state->hop_count;
+      state->candidate_cost = state->path_cost;
+      state->candidate_airtime = state->hop_airtime;
+    }
+    route_touch(l->receiver);
+  }
+}
+
+// forget the current route to this subscriber, and everything we are routing through it
+static void route_invalidate(struct subscriber *subscriber)
+{
+  struct link_state *state = subscriber->link_state;
+  if (state->invalid)
     return;
+  if (state->heap_pos)
+    heap_remove(subscriber);
+  route_reconsider(state);
+  state->invalid = 1;
+  state->candidate = NULL;
+  state->candidate_hop_count = UNREACHABLE_HOP_COUNT;
+  state->candidate_cost = UNREACHABLE_COST;
+  tree_detach(state);
+  route_touch(subscriber);
+  while (state->first_child)
+    route_invalidate(state->first_child);
+}
 
-  link->calculating = 1;
-  int hop_count = -1;
-  int drop_rate = 0;
+// can we improve our route to the receiver of this link, by routing through its transmitter?
+static void route_relax(struct link *link)
+{
+  if (!link || !link->transmitter)
+    return;
+  struct neighbour *neighbour = link->neighbour;
+  if (neighbour->link_in_timeout < route_now)
+    return;
+  struct subscriber *receiver = link->receiver;
+  if (receiver->reachable == REACHABLE_SELF)
+    return;
 
+  int hop_count;
+  int cost = 0;
+  int hop_airtime;
   if (link->transmitter == my_subscriber){
-    if (link->receiver==neighbour->subscriber){
-      hop_count = 1;
-    }
+    if (receiver != neighbour->subscriber)
+      return;
+    hop_count = 1;
+    hop_airtime = link->destination ? overlay_interface_airtime(link->destination->interface) : DEFAULT_HOP_AIRTIME;
   }else{
-    struct link *parent = get_parent(neighbour, link);
-    if (parent && (!parent->calculating)){
-      update_path_score(neighbour, parent);
-      // TODO more interesting path cost metrics...
-      if (parent->hop_count>0){
-        hop_count = parent->hop_count+1;
-        drop_rate = parent->path_drop_rate;
-      }
+    // only if we also route to the transmitter through this neighbour, and that route is settled
+    struct link_state *parent = link->transmitter->link_state;
+    if (link->transmitter->reachable == REACHABLE_SELF
+      || parent->invalid || parent->heap_pos || parent->next_hop != neighbour->subscriber)
+      return;
+    hop_count = parent->hop_count+1;
+    cost = parent->path_cost;
+    // we can't see the interfaces that other nodes are using, assume they are like the one we share with our neighbour
+    hop_airtime = parent->hop_airtime;
+  }
+  cost += link_cost(link, hop_airtime);
+
+  link->hop_count = hop_count;
+  link->path_cost = cost;
+
+  struct link_state *state = get_link_state(receiver);
+  if (!route_better(cost, hop_count, link, state))
+    return;
+  state->candidate = link;
+  state->candidate_hop_count = hop_count;
+  state->candidate_cost = cost;
+  state->candidate_airtime = hop_airtime;
+  heap_push(receiver);
+}
+
+// look for a route to this subscriber through any of our neighbours
+static void route_seed(struct subscriber *subscriber)
+{
+  struct neighbour *neighbour = neighbours;
+  while (neighbour){
+    route_relax(find_link(neighbour, subscriber, 0));
+    neighbour = neighbour->_next;
+  }
+}
+
+static void route_set(struct subscriber *subscriber, struct link *link)
+{
+  struct link_state *state = subscriber->link_state;
+  struct subscriber *transmitter = link ? link->transmitter : NULL;
+  if (state->transmitter != transmitter || state->link != link)
+    state->changed = 1;
+  set_subscriber_ref(&state->next_hop, link ? link->neighbour->subscriber : NULL);
+  set_subscriber_ref(&state->transmitter, transmitter);
+  state->link = link;
+  state->hop_count = state->candidate_hop_count;
+  state->path_cost = state->candidate_cost;
+  state->hop_airtime = state->candidate_airtime;
+  state->invalid = 0;
+  state->stale = 1;
+}
+
+// we have found the best route to this subscriber, use it to find routes to everything beyond
+static void route_settle(struct subscriber *subscriber)
+{
+  struct link_state *state = subscriber->link_state;
+  struct link *link = state->candidate;
+  unsigned touched = route_touched_count;
+
+  if (!state->invalid){
+    route_reconsider(state);
+    // if we used to route to this subscriber through another neighbour, everything we are routing through it must change too
+    if (state->next_hop != link->neighbour->subscriber){
+      while (state->first_child)
+	route_invalidate(state->first_child);
     }
   }
+  tree_detach(state);
+  route_set(subscriber, link);
+  tree_attach(subscriber, get_link_state(link->transmitter));
 
-  // ignore occasional dropped packets due to collisions
-  if (link->drop_rate>2)
-    drop_rate += link->drop_rate;
+  struct link *l;
+  for (l = state->links_from; l; l = l->_next_from)
+    if (l->neighbour->subscriber == state->next_hop)
+      route_relax(l);
 
-  if (config.debug.verbose && config.debug.linkstate && hop_count != link->hop_count)
-    DEBUGF("LINK STATE; path score to %s via %s version %d = %d",
-	alloca_tohex_sid_t(link->receiver->sid),
-	alloca_tohex_sid_t(neighbour->subscriber->sid),
-	neighbour->path_version,
-	hop_count);
+  for (; touched < route_touched_count; touched++)
+    route_seed(route_touched[touched]);
+}
 
-  link->hop_count = hop_count;
-  link->path_version = neighbour->path_version;
-  link->path_drop_rate = drop_rate;
-  link->calculating = 0;
+/* Recalculate routes to subscribers whose links have changed since we last looked.
+ * Our routes form a tree of shortest paths from us, so we only need to forget the routes that depend on
+ * changed links, and search for new routes to them from the unchanged part of the tree (Dijkstra's algorithm).
+ */
+static int route_metric_changed(struct subscriber *subscriber, void *UNUSED(context))
+{
+  if (subscriber->link_state)
+    route_changed(subscriber);
+  return 0;
+}
+
+void link_routes_update()
+{
+  if (route_metric != config.mdp.route_metric){
+    // path costs can't be compared with the old ones, so start again
+    route_metric = config.mdp.route_metric;
+    enum_subscribers(NULL, route_metric_changed, NULL);
+  }
+  if (!route_dirty_count || !my_subscriber)
+    return;
+  IN();
+  route_now = gettime_ms();
+  unsigned i;
+  for (i = 0; i < route_dirty_count; i++){
+    struct subscriber *subscriber = route_dirty[i];
+    subscriber->link_state->dirty = 0;
+    if (subscriber != my_subscriber)
+      route_invalidate(subscriber);
+  }
+  if (config.debug.linkstate && config.debug.verbose)
+    DEBUGF("LINK STATE; recalculating routes to %u subscribers after %u changes", route_touched_count, route_dirty_count);
+  for (i = 0; i < route_dirty_count; i++)
+    release_subscriber_ref(route_dirty[i]);
+  route_dirty_count = 0;
+
+  for (i = 0; i < route_touched_count; i++)
+    route_seed(route_touched[i]);
+
+  while (route_heap_count){
+    struct subscriber *subscriber = route_heap[0];
+    heap_remove(subscriber);
+    route_settle(subscriber);
+  }
+
+  // anything left is now unreachable
+  for (i = 0; i < route_touched_count; i++){
+    struct subscriber *subscriber = route_touched[i];
+    if (subscriber->link_state->invalid)
+      route_set(subscriber, NULL);
+  }
+  route_touched_count = 0;
+  OUT();
 }
 
 // pick the best path to this network destination
@@ -378,71 +808,22 @@ static struct link * find_best_link(struct subscriber *subscriber)
   IN();
   if (subscriber->reachable==REACHABLE_SELF)
     RETURN(NULL);
-    
+
+  link_routes_update();
   struct link_state *state = get_link_state(subscriber);
-  if (state->route_version == route_version)
+  if (!state->stale)
     RETURN(state->link);
+  state->stale = 0;
 
-  if (state->calculating)
-    RETURN(NULL);
-  state->calculating = 1;
-
-  struct neighbour *neighbour = neighbours;
-  struct network_destination *destination = NULL;
-  int best_hop_count = 99;
-  int best_drop_rate = 99;
-  struct link *best_link = NULL;
-  struct subscriber *next_hop = NULL, *transmitter=NULL;
-  time_ms_t now = gettime_ms();
-
-  while (neighbour){
-    if (neighbour->link_in_timeout < now)
-      goto next;
-
-    struct link *link = find_link(neighbour, subscriber, 0);
-    if (!(link && link->transmitter))
-      goto next;
-
-    if (link->transmitter != my_subscriber){
-      struct link_state *parent_state = get_link_state(link->transmitter);
-      find_best_link(link->transmitter);
-      if (parent_state->next_hop != neighbour->subscriber)
-	goto next;
-    }
-
-    update_path_score(neighbour, link);
-
-    if (link->hop_count>0){
-      if (link->path_drop_rate < best_drop_rate ||
-         (link->path_drop_rate == best_drop_rate && link->hop_count < best_hop_count)){
-        next_hop = neighbour->subscriber;
-        best_hop_count = link->hop_count;
-	best_drop_rate = link->path_drop_rate;
-        transmitter = link->transmitter;
-        destination = link->destination;
-        best_link = link;
-      }
-    }
+  struct link *best_link = state->link;
+  struct subscriber *next_hop = state->next_hop;
+  int changed = state->changed;
+  state->changed = 0;
 
-next:
-    neighbour = neighbour->_next;
-  }
-
-  int changed =0;
-  if (state->transmitter != transmitter || state->link != best_link)
-    changed = 1;
-
-  state->next_hop = next_hop;
-  state->transmitter = transmitter;
-  state->hop_count = best_hop_count;
-  state->route_version = route_version;
-  state->calculating = 0;
-  state->link = best_link;
-  
   if (next_hop == subscriber)
     next_hop = NULL;
-  
-  if (set_reachable(subscriber, destination, next_hop))
+
+  if (set_reachable(subscriber, best_link ? best_link->destination : NULL, next_hop))
     changed = 1;
   
   if (subscriber->identity && subscriber->reachable == REACHABLE_NONE){
@@ -454,8 +835,9 @@ next:
   }
   
   if (changed){
-    monitor_announce_link(best_hop_count, transmitter, subscriber);
-    state->next_update = now+5;
+    monitor_announce_link(state->hop_count, state->transmitter, subscriber);
+    state->next_update = gettime_ms()+5;
+    state->announce = 1;
   }
 
   RETURN(best_link);
@@ -513,6 +895,17 @@ static int append_link_state(struct overlay_buffer *payload, char flags,
   return 0;
 }
 
+static void link_announced(struct link_state *state, time_ms_t now)
+{
+  if (state->announce)
+    link_traffic.changed_records++;
+  else
+    link_traffic.refresh_records++;
+  state->announce = 0;
+  // our neighbours will keep this link until we tell them otherwise, but repeat it occasionally in case they missed it
+  state->next_update = now + config.mdp.link_refresh_ms;
+}
+
 static int append_link(struct subscriber *subscriber, void *context)
 {
   if (subscriber == my_subscriber)
@@ -532,8 +925,7 @@ static int append_link(struct subscriber *subscriber, void *context)
         link_send_alarm.alarm = now+5;
         return 1;
       }
-      // include information about this link every 5s
-      state->next_update = now + 5000;
+      link_announced(state, now);
     }
   } else {
     
@@ -546,8 +938,7 @@ static int append_link(struct subscriber *subscriber, void *context)
         link_send_alarm.alarm = now+5;
         return 1;
       }
-      // include information about this link every 5s
-      state->next_update = now + 5000;
+      link_announced(state, now);
     }
   }
 
@@ -579,6 +970,8 @@ static void free_neighbour(struct neighbour **neighbour_ptr){
   
   free_links(n->root);
   n->root=NULL;
+  route_changed(n->subscriber);
+  release_subscriber_ref(n->subscriber);
   *neighbour_ptr = n->_next;
   free(n);
 }
@@ -622,9 +1015,8 @@ static void clean_neighbours(time_ms_t now)
     // when all links to a neighbour that we are routing through expire, force a routing calculation update
     struct link_state *state = get_link_state(n->subscriber);
     if (state->next_hop == n->subscriber && 
-	(n->link_in_timeout < now || !n->links || !alive) && 
-	state->route_version == route_version)
-      route_version++;
+	(n->link_in_timeout < now || !n->links || !alive))
+      route_changed(n->subscriber);
       
     if (!n->links || !alive){
       free_neighbour(n_ptr);
@@ -647,7 +1039,7 @@ static void link_status_html(struct strbuf *b, struct subscriber *n, struct link
   strbuf_sprintf(b, "%s* -%s H: %d, C: %d, via %s*<br>", 
     alloca_tohex_sid_t_trunc(link->receiver->sid, 16), 
     best?" *best*":"",
-    link->hop_count, link->path_drop_rate, 
+    link->hop_count, link->path_cost, 
     link->transmitter?alloca_tohex_sid_t_trunc(link->transmitter->sid, 16):"unreachable");
   link_status_html(b, n, link->_right);
 }
@@ -692,6 +1084,7 @@ void link_neighbour_status_html(struct strbuf *b, struct subscriber *neighbour)
 	  strbuf_sprintf(b, "Out: %s %s<br>", 
 	    link_out->destination->interface->name,
 	    link_out->destination->unicast?"unicast":"broadcast");
+	  destination_state_html(b, link_out->destination);
 	}
 	link_out = link_out->_next;
       }
@@ -706,7 +1099,7 @@ void link_neighbour_status_html(struct strbuf *b, struct subscriber *neighbour)
 
 
 static int send_legacy_self_announce_ack(struct neighbour *neighbour, struct link_in *link, time_ms_t now){
-  struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type = OF_TYPE_SELFANNOUNCE_ACK;
   frame->ttl = 6;
   frame->destination = neighbour->subscriber;
@@ -791,7 +1184,7 @@ static int send_neighbour_link(struct neighbour *n)
     send_legacy_self_announce_ack(n, n->best_link, now);
     n->last_update = now;
   } else {
-    struct overlay_frame *frame = emalloc_zero(sizeof(struct overlay_frame));
+    struct overlay_frame *frame = op_new();
     frame->type=OF_TYPE_DATA;
     frame->source=my_subscriber;
     frame->ttl=1;
@@ -833,6 +1226,7 @@ static int send_neighbour_link(struct neighbour *n)
     
     append_link_state(frame->payload, flags, n->subscriber, my_subscriber, n->best_link->neighbour_interface, 1,
 	              n->best_link->ack_sequence, n->best_link->ack_mask, -1);
+    link_traffic_add(ob_position(frame->payload), 0);
     if (overlay_payload_enqueue(frame) == -1)
       op_free(frame);
 
@@ -886,7 +1280,7 @@ static void link_send(struct sched_ent *alarm)
   // TODO use a separate alarm
   link_send_neighbours();
 
-  struct overlay_frame *frame=emalloc_zero(sizeof(struct overlay_frame));
+  struct overlay_frame *frame=op_new();
   frame->type=OF_TYPE_DATA;
   frame->source=my_subscriber;
   frame->ttl=1;
@@ -900,6 +1294,7 @@ static void link_send(struct sched_ent *alarm)
     size_t pos = ob_position(frame->payload);
     enum_subscribers(NULL, append_link, frame->payload);
     ob_rewind(frame->payload);
+    link_traffic_add(ob_position(frame->payload) - pos, 0);
     if (ob_position(frame->payload) == pos)
       op_free(frame);
     else if (overlay_payload_enqueue(frame))
@@ -935,6 +1330,8 @@ int link_stop_routing(struct subscriber *subscriber)
     my_subscriber=NULL;
   if (subscriber->link_state){
     struct link_state *state = get_link_state(subscriber);
+    route_changed(subscriber);
+    state->stale = 1;
     state->next_update = gettime_ms();
     update_alarm(__WHENCE__, state->next_update);
   }
@@ -1223,6 +1620,7 @@ int link_receive(struct internal_mdp_header *header, struct overlay_buffer *payl
   IN();
 
   struct neighbour *neighbour = get_neighbour(header->source, 1);
+  link_traffic_add(0, ob_remaining(payload));
 
   struct decode_context context;
   bzero(&context, sizeof(context));
@@ -1401,7 +1799,8 @@ int link_receive(struct internal_mdp_header *header, struct overlay_buffer *payl
 
     if (link->transmitter != transmitter || link->link_version != version){
       changed = 1;
-      link->transmitter = transmitter;
+      link_set_transmitter(link, transmitter);
+      route_changed(receiver);
       link->link_version = version & 0xFF;
       link->drop_rate = drop_rate;
       // TODO other link attributes...
@@ -1411,8 +1810,6 @@ int link_receive(struct internal_mdp_header *header, struct overlay_buffer *payl
   send_please_explain(&context, my_subscriber, header->source);
 
   if (changed){
-    route_version++;
-    neighbour->path_version ++;
     if (link_send_alarm.alarm>now+5){
       unschedule(&link_send_alarm);
       link_send_alarm.alarm=now+5;
@@ -1469,7 +1866,7 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   if (link->transmitter != my_subscriber)
     changed = 1;
 
-  link->transmitter = my_subscriber;
+  link_set_transmitter(link, my_subscriber);
   link->link_version = 1;
   link->destination = interface->destination;
 
@@ -1484,8 +1881,7 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   neighbour->link_in_timeout = now + link->destination->reachable_timeout_ms;
 
   if (changed){
-    route_version++;
-    neighbour->path_version ++;
+    route_changed(frame->source);
     if (link_send_alarm.alarm>now+5){
       unschedule(&link_send_alarm);
       link_send_alarm.alarm=now+5;
@@ -1498,3 +1894,263 @@ int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now)
   return 0;
 }
 
+
+static void route_test_recalculate_all(struct subscriber **nodes, unsigned count)
+{
+  unsigned i;
+  for (i = 0; i < count; i++)
+    route_changed(nodes[i]);
+  link_routes_update();
+}
+
+/* The best route to one node found by route_test_reference(), through one of our neighbours.
+ */
+struct route_reference{
+  struct neighbour *via;
+  unsigned via_index;
+  int cost;
+  int hop_count;
+  int airtime;
+  char settled;
+};
+
+// the same order as route_better()
+static int route_reference_better(const struct route_reference *a, const struct route_reference *b)
+{
+  if (!a->via || !b->via)
+    return a->via && !b->via;
+  if (a->cost != b->cost)
+    return a->cost < b->cost;
+  if (a->hop_count != b->hop_count)
+    return a->hop_count < b->hop_count;
+  return cmp_sid_t(&a->via->subscriber->sid, &b->via->subscriber->sid) < 0;
+}
+
+/* Find the best routes to all nodes with a plain O(n^2) Dijkstra over the links our neighbours have
+ * told us about, without using any of the state that link_routes_update() keeps.  As there, a route
+ * through a neighbour can only be extended by that neighbour's own links.
+ */
+static int route_test_reference(struct subscriber **nodes, unsigned count, struct route_reference *ref)
+{
+  time_ms_t now = gettime_ms();
+  unsigned neighbour_count = 0, i, j, k;
+  struct neighbour *n;
+  for (n = neighbours; n; n = n->_next)
+    neighbour_count++;
+  struct neighbour *hood[neighbour_count];
+  for (k = 0, n = neighbours; n; n = n->_next)
+    hood[k++] = n;
+  // the link each neighbour has told us about to each node
+  struct link **links = emalloc_zero(neighbour_count * count * sizeof(struct link *));
+  if (neighbour_count && !links)
+    return -1;
+  for (i = 0; i < count; i++)
+    ref[i] = (struct route_reference){.via = NULL};
+  for (k = 0; k < neighbour_count; k++){
+    if (hood[k]->link_in_timeout < now)
+      continue;
+    for (j = 0; j < count; j++){
+      struct link *link = links[k * count + j] = find_link(hood[k], nodes[j], 0);
+      // the only link from us is the one to the neighbour itself
+      if (!link || link->transmitter != my_subscriber || nodes[j] != hood[k]->subscriber
+	|| nodes[j]->reachable == REACHABLE_SELF)
+	continue;
+      int airtime = link->destination ? overlay_interface_airtime(link->destination->interface) : DEFAULT_HOP_AIRTIME;
+      struct route_reference r = {
+	.via = hood[k], .via_index = k, .cost = link_cost(link, airtime), .hop_count = 1, .airtime = airtime
+      };
+      if (route_reference_better(&r, &ref[j]))
+	ref[j] = r;
+    }
+  }
+  while (1){
+    unsigned best = count;
+    for (j = 0; j < count; j++)
+      if (!ref[j].settled && ref[j].via && (best == count || route_reference_better(&ref[j], &ref[best])))
+	best = j;
+    if (best == count)
+      break;
+    ref[best].settled = 1;
+    k = ref[best].via_index;
+    for (j = 0; j < count; j++){
+      struct link *link = links[k * count + j];
+      if (!link || link->transmitter != nodes[best] || ref[j].settled || nodes[j]->reachable == REACHABLE_SELF)
+	continue;
+      struct route_reference r = {
+	.via = hood[k], .via_index = k,
+	.cost = ref[best].cost + link_cost(link, ref[best].airtime),
+	.hop_count = ref[best].hop_count + 1,
+	.airtime = ref[best].airtime
+      };
+      if (route_reference_better(&r, &ref[j]))
+	ref[j] = r;
+    }
+  }
+  if (links)
+    free(links);
+  return 0;
+}
+
+// count how many of the routes we have differ from the reference calculation
+static unsigned route_test_compare(struct subscriber **nodes, unsigned count)
+{
+  struct route_reference ref[count];
+  if (route_test_reference(nodes, count, ref) == -1)
+    return count;
+  unsigned i, differences = 0;
+  for (i = 0; i < count; i++){
+    struct link_state *state = nodes[i]->link_state;
+    if (!ref[i].via){
+      if (state->link)
+	differences++;
+    }else if (!state->link
+      || state->path_cost != ref[i].cost
+      || state->hop_count != ref[i].hop_count
+      || state->next_hop != ref[i].via->subscriber)
+      differences++;
+  }
+  return differences;
+}
+
+// change one random link, as if we heard a single link state update
+static void route_test_change(struct subscriber **nodes, unsigned node_count, const char *linked, unsigned neighbour_count)
+{
+  struct neighbour *neighbour = neighbours;
+  unsigned j;
+  for (j = random() % neighbour_count; j > 0; j--)
+    neighbour = neighbour->_next;
+  unsigned r = random() % node_count;
+  struct link *link = find_link(neighbour, nodes[r], 0);
+  if (!link || link->transmitter == my_subscriber)
+    return;
+  if (random() & 1){
+    // the neighbour has found another path through a node next to the receiver
+    unsigned t = random() % node_count;
+    while (!linked[r * node_count + t])
+      t = (t + 1) % node_count;
+    link_set_transmitter(link, nodes[t]);
+  }else{
+    link->drop_rate = random() % 4 ? 0 : random() % 8;
+    route_changed(nodes[r]);
+  }
+  link_routes_update();
+}
+
+/* Build a random mesh of nodes scattered over a square, where nodes within range of each other are linked.
+ * Our neighbours are the nodes within range of us, and each of them tells us about its own shortest path
+ * tree.  Then measure how long it takes to recalculate routes as single links change.
+ */
+int app_route_test(const struct cli_parsed *parsed, struct cli_context *context)
+{
+  if (config.debug.verbose)
+    DEBUG_cli_parsed(parsed);
+  const unsigned node_count = 1000;
+  const unsigned changes = 10000;
+  const unsigned checks = 1000;
+  // on average, each node can hear about 8 others
+  const double range = sqrt(8.0 / (M_PI * node_count));
+  if (!my_subscriber) {
+    sid_t sid;
+    urandombytes(sid.binary, sizeof sid.binary);
+    if ((my_subscriber = find_subscriber(sid.binary, sizeof sid.binary, 1)) == NULL)
+      return -1;
+    my_subscriber->reachable = REACHABLE_SELF;
+  }
+  struct subscriber *nodes[node_count];
+  double x[node_count], y[node_count];
+  int parent[node_count];
+  unsigned queue[node_count];
+  unsigned i, j;
+  char *linked = emalloc_zero(node_count * node_count);
+  if (!linked)
+    return -1;
+  for (i = 0; i < node_count; i++){
+    sid_t sid;
+    urandombytes(sid.binary, sizeof sid.binary);
+    if ((nodes[i] = find_subscriber(sid.binary, sizeof sid.binary, 1)) == NULL)
+      return -1;
+    x[i] = (random() & 0xFFFF) / 65536.0;
+    y[i] = (random() & 0xFFFF) / 65536.0;
+  }
+  for (i = 0; i < node_count; i++)
+    for (j = i + 1; j < node_count; j++)
+      if (hypot(x[i] - x[j], y[i] - y[j]) < range)
+	linked[i * node_count + j] = linked[j * node_count + i] = 1;
+
+  // we are in the middle, and our neighbours send us a breadth first tree of the mesh
+  unsigned neighbour_count = 0;
+  for (i = 0; i < node_count; i++){
+    if (hypot(x[i] - 0.5, y[i] - 0.5) >= range)
+      continue;
+    neighbour_count++;
+    struct neighbour *neighbour = get_neighbour(nodes[i], 1);
+    neighbour->link_in_timeout = TIME_NEVER_WILL;
+    link_set_transmitter(find_link(neighbour, nodes[i], 1), my_subscriber);
+    for (j = 0; j < node_count; j++)
+      parent[j] = -1;
+    parent[i] = i;
+    unsigned head = 0, tail = 0;
+    queue[tail++] = i;
+    while (head < tail){
+      unsigned n = queue[head++], m;
+      for (m = 0; m < node_count; m++){
+	if (!linked[n * node_count + m] || parent[m] != -1)
+	  continue;
+	parent[m] = n;
+	queue[tail++] = m;
+	struct link *link = find_link(neighbour, nodes[m], 1);
+	link_set_transmitter(link, nodes[n]);
+	link->drop_rate = random() % 4 ? 0 : random() % 8;
+      }
+    }
+  }
+
+  time_ms_t start = gettime_ms();
+  route_test_recalculate_all(nodes, node_count);
+  time_ms_t elapsed = gettime_ms() - start;
+  unsigned reachable = 0;
+  for (i = 0; i < node_count; i++)
+    if (nodes[i]->link_state->link)
+      reachable++;
+  cli_printf(context, "Routes to %u of %u nodes through %u neighbours took %"PRId64"ms\n",
+      reachable, node_count, neighbour_count, (int64_t)elapsed);
+
+  // then change one link at a time
+  start = gettime_ms();
+  for (i = 0; neighbour_count && i < changes; i++)
+    route_test_change(nodes, node_count, linked, neighbour_count);
+  elapsed = gettime_ms() - start;
+  cli_printf(context, "%u single link changes took %"PRId64"ms, %.1fus per change\n",
+      changes, (int64_t)elapsed, elapsed * 1000.0 / changes);
+
+  // a separate, simple calculation must find exactly the same routes
+  start = gettime_ms();
+  unsigned differences = route_test_compare(nodes, node_count);
+  elapsed = gettime_ms() - start;
+  cli_printf(context, "Reference calculation took %"PRId64"ms, %u routes differ\n", (int64_t)elapsed, differences);
+
+  // and keep checking after every change for a while
+  unsigned failed_checks = 0;
+  for (i = 0; neighbour_count && i < checks; i++){
+    route_test_change(nodes, node_count, linked, neighbour_count);
+    unsigned d = route_test_compare(nodes, node_count);
+    if (d){
+      differences += d;
+      failed_checks++;
+    }
+  }
+  cli_printf(context, "%u of %u further single link changes gave different routes to the reference calculation\n",
+      failed_checks, checks);
+
+  while (neighbours)
+    free_neighbour(&neighbours);
+  link_routes_update();
+  for (i = 0; i < node_count; i++)
+    link_state_forget(nodes[i]);
+  free(my_subscriber->link_state);
+  my_subscriber->link_state = NULL;
+  free(linked);
+  if (differences)
+    return WHYF("Incremental route calculation differs from the reference calculation for %u nodes", differences);
+  return 0;
+}
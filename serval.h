@@ -261,6 +261,7 @@ int rhizome_cache_count();
 int overlayServerMode(void);
 int overlay_payload_enqueue(struct overlay_frame *p);
 int overlay_queue_remaining(int queue);
+void overlay_queue_status_html(struct strbuf *b);
 int overlay_queue_schedule_next(time_ms_t next_allowed_packet);
 int overlay_send_tick_packet(struct network_destination *destination);
 int overlay_queue_ack(struct subscriber *neighbour, struct network_destination *destination, uint32_t ack_mask, int ack_seq);
@@ -316,6 +317,9 @@ int directory_registration();
 int directory_service_init();
 
 int app_nonce_test(const struct cli_parsed *parsed, struct cli_context *context);
+int app_route_test(const struct cli_parsed *parsed, struct cli_context *context);
+int app_filter_test(const struct cli_parsed *parsed, struct cli_context *context);
+int app_mdp_ring_test(const struct cli_parsed *parsed, struct cli_context *context);
 int app_rhizome_direct_sync(const struct cli_parsed *parsed, struct cli_context *context);
 int app_monitor_cli(const struct cli_parsed *parsed, struct cli_context *context);
 int app_vomp_console(const struct cli_parsed *parsed, struct cli_context *context);
@@ -360,6 +364,8 @@ void overlay_mdp_bind_internal_services();
 int overlay_send_probe(struct subscriber *peer, struct network_destination *destination, int queue);
 int overlay_send_stun_request(struct subscriber *server, struct subscriber *request);
 void fd_periodicstats(struct sched_ent *alarm);
+#define SUBSCRIBER_CLEANUP_INTERVAL_MS 60000
+void subscriber_cleanup(struct sched_ent *alarm);
 void rhizome_check_connections(struct sched_ent *alarm);
 
 int overlay_queue_init();
@@ -392,9 +398,14 @@ int link_state_announce_links();
 int link_state_legacy_ack(struct overlay_frame *frame, time_ms_t now);
 int link_state_ack_soon(struct subscriber *sender);
 int link_state_should_forward_broadcast(struct subscriber *transmitter);
+int link_state_forget(struct subscriber *subscriber);
+void link_routes_update();
 int link_unicast_ack(struct subscriber *subscriber, struct overlay_interface *interface, struct socket_address *addr);
 int link_add_destinations(struct overlay_frame *frame);
 void link_neighbour_short_status_html(struct strbuf *b, const char *link_prefix);
+void link_traffic_status_html(struct strbuf *b);
+void overlay_broadcast_status_html(struct strbuf *b);
+void overlay_mdp_bindings_status_html(struct strbuf *b);
 void link_neighbour_status_html(struct strbuf *b, struct subscriber *neighbour);
 int link_stop_routing(struct subscriber *subscriber);
 
@@ -86,4 +86,16 @@ ssize_t _recv_message(struct __sourceloc, int fd, struct socket_address *address
 
 ssize_t recvwithttl(int sock, unsigned char *buffer, size_t bufferlen, int *ttl, struct socket_address *recvaddr);
 
+// one datagram of a batched read
+#define RECV_BATCH_MAX 64
+struct recv_slot{
+  unsigned char *buffer;
+  size_t bufferlen;
+  ssize_t len;
+  int ttl;
+  struct socket_address recvaddr;
+};
+
+int recvwithttl_batch(int sock, struct recv_slot *slots, unsigned count);
+
 #endif // __SERVAL_DNA___SOCKET_H
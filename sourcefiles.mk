@@ -51,6 +51,7 @@ SERVAL_DAEMON_SOURCES = \
 	meshms_restful.c \
 	mdp_client.c \
 	mdp_net.c \
+	mdp_ring.c \
 	msp_client.c \
 	msp_proxy.c \
 	monitor.c \
@@ -80,6 +81,7 @@ SERVAL_DAEMON_SOURCES = \
 	rhizome_direct_http.c \
 	rhizome_fetch.c \
 	rhizome_http.c \
+	rhizome_index.c \
 	rhizome_restful.c \
 	rhizome_packetformats.c \
 	rhizome_store.c \
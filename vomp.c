@@ -376,8 +376,8 @@ static struct vomp_call_state *vomp_create_call(struct subscriber *remote,
   
   /* prepare slot */
   bzero(call,sizeof(struct vomp_call_state));
-  call->local.subscriber=local;
-  call->remote.subscriber=remote;
+  call->local.subscriber=add_subscriber_ref(local);
+  call->remote.subscriber=add_subscriber_ref(remote);
   call->local.session=local_session;
   call->remote.session=remote_session;
   call->local.state=VOMP_STATE_NOCALL;
@@ -778,6 +778,8 @@ static int vomp_call_destroy(struct vomp_call_state *call)
   unschedule(&call->alarm);
   call->local.session=0;
   call->remote.session=0;
+  release_subscriber_ref(call->local.subscriber);
+  release_subscriber_ref(call->remote.subscriber);
   
   assert(vomp_call_count > 0);
   vomp_call_count--;